@@ -110,7 +110,40 @@ bool NTPClient::forceUpdate() {
   } while (cb == 0);
 
   this->_lastUpdate = millis() - (10 * (timeout + 1)); // Account for delay in reading the time
+  this->readTime();
 
+  return true;
+}
+
+bool NTPClient::updateAsync() {
+  if (!this->_requestPending) {
+    if ((millis() - this->_lastUpdate < this->_updateInterval) && this->_lastUpdate != 0) {
+      return false;
+    }
+    if (!this->_udpSetup) this->begin();                         // setup the UDP client if needed
+    this->sendNTPPacket();
+    this->_requestTime = millis();
+    this->_requestPending = true;
+    return false;
+  }
+
+  if (this->_udp->parsePacket() > 0) {
+    this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
+    if (this->isValid(this->_packetBuffer)) {
+      this->_requestPending = false;
+      this->_lastUpdate = this->_requestTime; // Account for delay in reading the time
+      this->readTime();
+      return true;
+    }
+  }
+
+  if (millis() - this->_requestTime >= NTP_RESPONSE_TIMEOUT) {
+    this->_requestPending = false;                               // Send a new request in the next call
+  }
+  return false;
+}
+
+void NTPClient::readTime() {
   unsigned long highWord = word(this->_packetBuffer[40], this->_packetBuffer[41]);
   unsigned long lowWord = word(this->_packetBuffer[42], this->_packetBuffer[43]);
   // combine the four bytes (two words) into a long integer
@@ -118,8 +151,6 @@ bool NTPClient::forceUpdate() {
   unsigned long secsSince1900 = highWord << 16 | lowWord;
 
   this->_currentEpoc = secsSince1900 - SEVENZYYEARS;
-
-  return true;
 }
 
 bool NTPClient::update() {
@@ -7,6 +7,7 @@
 #define SEVENZYYEARS 2208988800UL
 #define NTP_PACKET_SIZE 48
 #define NTP_DEFAULT_LOCAL_PORT 1337
+#define NTP_RESPONSE_TIMEOUT 1000
 #define LEAP_YEAR(Y)     ( (Y>0) && !(Y%4) && ( (Y%100) || !(Y%400) ) )
 
 
@@ -24,10 +25,14 @@ class NTPClient {
     unsigned long _currentEpoc    = 0;      // In s
     unsigned long _lastUpdate     = 0;      // In ms
 
+    bool          _requestPending = false;
+    unsigned long _requestTime    = 0;      // In ms
+
     byte          _packetBuffer[NTP_PACKET_SIZE];
 
     void          sendNTPPacket();
     bool          isValid(byte * ntpPacket);
+    void          readTime();
 
   public:
     NTPClient(UDP& udp);
@@ -61,6 +66,14 @@ class NTPClient {
      */
     bool forceUpdate();
 
+    /**
+     * Like update(), but without waiting for the NTP Server: the request is sent when an update is due,
+     * later calls take the response when it arrived, or give up after NTP_RESPONSE_TIMEOUT.
+     *
+     * @return true when a new time was received
+     */
+    bool updateAsync();
+
     int getDay();
     int getHours();
     int getMinutes();
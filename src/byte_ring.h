@@ -0,0 +1,142 @@
+#ifndef byte_ring_h
+#define byte_ring_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+// Lock-free single-producer/single-consumer byte ring. The producer (UART RX)
+// writes into contiguous free space and commits, the consumer (OI parsers)
+// reads contiguous spans in place and consumes them. SIZE must be a power of two.
+template <size_t SIZE>
+class ByteRing
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "ByteRing size must be a power of two");
+
+public:
+    // Producer: contiguous free space at the write position
+    size_t writeSpan(uint8_t *&data)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t free = SIZE - (head - _tail.load(std::memory_order_acquire));
+        size_t offset = head & (SIZE - 1);
+        data = _buff + offset;
+        return (free < SIZE - offset ? free : SIZE - offset);
+    }
+
+    void commit(size_t length)
+    {
+        size_t head = _head.load(std::memory_order_relaxed) + length;
+        _head.store(head, std::memory_order_release);
+
+        size_t used = head - _tail.load(std::memory_order_acquire);
+        if (used > _highWater)
+        {
+            _highWater = used;
+        }
+    }
+
+    // Producer: copy bytes, returns the number of bytes that didn't fit
+    size_t push(const uint8_t *data, size_t length)
+    {
+        while (length > 0)
+        {
+            uint8_t *span;
+            size_t free = writeSpan(span);
+            if (free == 0)
+            {
+                _overflows++;
+                return length;
+            }
+            size_t count = (length < free ? length : free);
+            memcpy(span, data, count);
+            commit(count);
+            data += count;
+            length -= count;
+        }
+        return 0;
+    }
+
+    // Producer: count data which had to be dropped because the ring was full
+    void overflow()
+    {
+        _overflows++;
+    }
+
+    // Consumer
+    size_t available() const
+    {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_relaxed);
+    }
+
+    // Consumer: contiguous readable bytes at the read position (+ skip)
+    size_t readSpan(const uint8_t *&data, size_t skip = 0) const
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed) + skip;
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t used = (head - tail <= SIZE ? head - tail : 0);
+        size_t offset = tail & (SIZE - 1);
+        data = _buff + offset;
+        return (used < SIZE - offset ? used : SIZE - offset);
+    }
+
+    uint8_t peek(size_t offset) const
+    {
+        return _buff[(_tail.load(std::memory_order_relaxed) + offset) & (SIZE - 1)];
+    }
+
+    void consume(size_t length)
+    {
+        _tail.store(_tail.load(std::memory_order_relaxed) + length, std::memory_order_release);
+    }
+
+    // Consumer: copy and consume up to length bytes
+    size_t read(uint8_t *data, size_t length)
+    {
+        size_t count = 0;
+        while (count < length)
+        {
+            const uint8_t *span;
+            size_t used = readSpan(span);
+            if (used == 0)
+            {
+                break;
+            }
+            size_t part = (length - count < used ? length - count : used);
+            memcpy(data + count, span, part);
+            consume(part);
+            count += part;
+        }
+        return count;
+    }
+
+    void clear()
+    {
+        consume(available());
+    }
+
+    size_t capacity() const
+    {
+        return SIZE;
+    }
+
+    size_t highWater() const
+    {
+        return _highWater;
+    }
+
+    unsigned long overflows() const
+    {
+        return _overflows;
+    }
+
+private:
+    uint8_t _buff[SIZE];
+    std::atomic<size_t> _head{0}; // free running write index
+    std::atomic<size_t> _tail{0}; // free running read index
+    size_t _highWater = 0;
+    unsigned long _overflows = 0;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "change_detector.h"
+
+ChangeDetector::ChangeDetector(const ChangeField *fields, uint8_t count) : _fields(fields), _count(count < CHANGE_FIELDS_MAX ? count : CHANGE_FIELDS_MAX)
+{
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        _values[i] = 0;
+        _published[i] = 0;
+        _averages[i] = 0;
+    }
+}
+
+void ChangeDetector::set(uint8_t field, int32_t value)
+{
+    if (field < _count && _values[field] != value)
+    {
+        _values[field] = value;
+        _sampleChanged = true;
+    }
+}
+
+bool ChangeDetector::significant()
+{
+    return !_hasPublished || trigger() >= 0;
+}
+
+int8_t ChangeDetector::trigger()
+{
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        int32_t change = compared(i) - _published[i];
+        change = change < 0 ? -change : change;
+        if (change > 0 && change >= _fields[i].deadband)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *ChangeDetector::name(uint8_t field)
+{
+    return field < _count ? _fields[field].name : "";
+}
+
+void ChangeDetector::sample(unsigned long ms)
+{
+    unsigned long elapsed = ms - _sampleTime;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (_fields[i].smoothing == 0)
+        {
+            continue;
+        }
+        int32_t value = _values[i] * CHANGE_AVERAGE_SCALE;
+        _averages[i] = _sampled ? _averages[i] + ((int64_t)value - _averages[i]) * (int64_t)elapsed / (int64_t)(elapsed + _fields[i].smoothing) : value;
+    }
+    _sampleTime = ms;
+    _sampled = true;
+
+    _samples++;
+    if (_sampleChanged && !significant())
+    {
+        _suppressed++;
+    }
+    _sampleChanged = false;
+}
+
+void ChangeDetector::published()
+{
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        _published[i] = compared(i);
+    }
+    _hasPublished = true;
+}
+
+// The value, or its average for a field with smoothing
+int32_t ChangeDetector::compared(uint8_t field)
+{
+    return _fields[field].smoothing == 0 ? _values[field] : _averages[field] / CHANGE_AVERAGE_SCALE;
+}
+
+unsigned long ChangeDetector::suppressed()
+{
+    return _suppressed;
+}
+
+unsigned long ChangeDetector::samples()
+{
+    return _samples;
+}
@@ -0,0 +1,60 @@
+#ifndef change_detector_h
+#define change_detector_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHANGE_FIELDS_MAX 16
+#define CHANGE_AVERAGE_SCALE 1000 // fixed point of the averages, values up to +/-2000000
+
+struct ChangeField
+{
+    const char *name;
+    int32_t deadband;   // smallest significant change, 0 = every change
+    uint32_t smoothing; // ms, time constant of an average compared instead of the value, 0 = the value
+};
+
+// Decides whether the fields of a message changed enough to publish it.
+//
+// Values are compared with the values of the last publish, not with the
+// previous sample: noise inside the deadband never triggers, a slow drift
+// triggers once it adds up to the deadband, and a value hovering around a
+// threshold doesn't flap, because the reference only moves on a publish.
+//
+// A field with smoothing compares an exponential average of its samples
+// instead, for values which are noisy from sample to sample (e.g. the current
+// of a cleaning Roomba in the 15ms stream): the noise averages out, a step
+// still reaches the deadband within a fraction of the time constant.
+class ChangeDetector
+{
+public:
+    ChangeDetector(const ChangeField *fields, uint8_t count);
+
+    void set(uint8_t field, int32_t value);
+    bool significant(); // a field moved by at least its deadband, or nothing was published yet
+    int8_t trigger();   // first field that moved by at least its deadband, -1 if none
+    const char *name(uint8_t field);
+
+    void sample(unsigned long ms); // a complete set of values: update the averages, suppressed when it changed, but not significantly
+    void published(); // the current values were published
+
+    unsigned long suppressed();
+    unsigned long samples();
+
+private:
+    int32_t compared(uint8_t field);
+
+    const ChangeField *_fields;
+    uint8_t _count;
+    int32_t _values[CHANGE_FIELDS_MAX];
+    int32_t _published[CHANGE_FIELDS_MAX];
+    int32_t _averages[CHANGE_FIELDS_MAX]; // of fields with smoothing, scaled by CHANGE_AVERAGE_SCALE
+    unsigned long _sampleTime = 0;
+    bool _sampled = false;
+    bool _hasPublished = false;
+    bool _sampleChanged = false; // since the last sample()
+    unsigned long _suppressed = 0;
+    unsigned long _samples = 0;
+};
+
+#endif
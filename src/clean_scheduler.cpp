@@ -0,0 +1,422 @@
+#include "clean_scheduler.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SLOT_HOURS 60 // first hour slot, after the minute slots
+#define SLOT_DAYS 84  // first day slot, after the hour slots
+#define SLOT_END 0xFF // end of a slot's list
+
+static const char *ACTION_NAMES[] = {"none", "clean", "dock"};
+
+static uint8_t weekday(uint32_t day)
+{
+    return (day + 4) % 7; // 1970-01-01 was a Thursday
+}
+
+static const char *skipSpaces(const char *text)
+{
+    while (*text == ' ' || *text == '\t')
+    {
+        text++;
+    }
+    return text;
+}
+
+// A number of a cron field, advances the text
+static bool parseNumber(const char *&text, uint8_t max, uint8_t &value)
+{
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+    uint16_t number = 0;
+    while (*text >= '0' && *text <= '9' && number <= max)
+    {
+        number = number * 10 + (*text++ - '0');
+    }
+    value = number;
+    return number <= max;
+}
+
+// End of a field: a space or the end of the text
+static bool fieldEnd(const char *text)
+{
+    return *text == ' ' || *text == '\t' || *text == '\0';
+}
+
+void CleanScheduler::onFire(FireCallback callback)
+{
+    _fireCallback = callback;
+}
+
+void CleanScheduler::setRules(const ScheduleRule *rules, uint8_t count)
+{
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES; rule++)
+    {
+        _rules[rule] = rule < count ? rules[rule] : ScheduleRule();
+    }
+    if (_running)
+    {
+        start(_minute);
+    }
+}
+
+void CleanScheduler::setCatchUp(uint16_t minutes)
+{
+    _catchUp = minutes;
+}
+
+void CleanScheduler::loop(uint32_t epoch)
+{
+    if (epoch < SCHEDULE_MIN_EPOCH)
+    {
+        return;
+    }
+    uint32_t minute = epoch / 60;
+    if (_running && minute == _minute)
+    {
+        return;
+    }
+    if (_running && minute > _minute && minute - _minute <= SCHEDULE_MAX_TICKS)
+    {
+        while (_minute < minute)
+        {
+            tick();
+        }
+        return;
+    }
+
+    // Boot or jump: run the latest missed slot within the catch-up window
+    if (_running)
+    {
+        _jumps++;
+    }
+    uint8_t missed = SLOT_END;
+    uint32_t missedSlot = 0;
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES && _catchUp > 0; rule++)
+    {
+        uint32_t slot = used(rule) ? previousSlot(rule, minute) : 0;
+        if (slot != 0 && slot + _catchUp > minute && slot > _lastSlot && (!_running || slot > _minute) && slot > missedSlot)
+        {
+            missed = rule;
+            missedSlot = slot;
+        }
+    }
+    if (missed != SLOT_END)
+    {
+        fire(missed, missedSlot, missedSlot != minute);
+    }
+    start(minute);
+}
+
+bool CleanScheduler::running()
+{
+    return _running;
+}
+
+uint8_t CleanScheduler::rules()
+{
+    uint8_t count = 0;
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES; rule++)
+    {
+        count += used(rule) ? 1 : 0;
+    }
+    return count;
+}
+
+uint32_t CleanScheduler::next()
+{
+    uint32_t next = 0;
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES && _running; rule++)
+    {
+        if (used(rule) && (next == 0 || _expiry[rule] < next))
+        {
+            next = _expiry[rule];
+        }
+    }
+    return next * 60;
+}
+
+CleanScheduler::Action CleanScheduler::nextAction()
+{
+    uint32_t minute = next() / 60;
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES && minute != 0; rule++)
+    {
+        if (used(rule) && _expiry[rule] == minute)
+        {
+            return (Action)_rules[rule].action;
+        }
+    }
+    return Action::NONE;
+}
+
+unsigned long CleanScheduler::fired()
+{
+    return _fired;
+}
+
+unsigned long CleanScheduler::late()
+{
+    return _late;
+}
+
+unsigned long CleanScheduler::jumps()
+{
+    return _jumps;
+}
+
+// "m h * * dow action", dow as *, list and ranges of 0..7 (0 and 7 = Sunday)
+bool CleanScheduler::parse(const char *text, ScheduleRule &rule)
+{
+    ScheduleRule parsed = {};
+    text = skipSpaces(text);
+    if (*text == '\0')
+    {
+        rule = parsed;
+        return true;
+    }
+
+    if (!parseNumber(text, 59, parsed.minute) || !fieldEnd(text))
+    {
+        return false;
+    }
+    text = skipSpaces(text);
+    if (!parseNumber(text, 23, parsed.hour) || !fieldEnd(text))
+    {
+        return false;
+    }
+    for (uint8_t field = 0; field < 2; field++) // day of month and month
+    {
+        text = skipSpaces(text);
+        if (*text++ != '*' || !fieldEnd(text))
+        {
+            return false;
+        }
+    }
+
+    text = skipSpaces(text);
+    if (*text == '*')
+    {
+        parsed.days = 0x7F;
+        text++;
+    }
+    else
+    {
+        while (true)
+        {
+            uint8_t first;
+            uint8_t last;
+            if (!parseNumber(text, 7, first))
+            {
+                return false;
+            }
+            last = first;
+            if (*text == '-')
+            {
+                text++;
+                if (!parseNumber(text, 7, last) || last < first)
+                {
+                    return false;
+                }
+            }
+            for (uint8_t day = first; day <= last; day++)
+            {
+                parsed.days |= 1 << (day % 7);
+            }
+            if (*text != ',')
+            {
+                break;
+            }
+            text++;
+        }
+    }
+    if (!fieldEnd(text))
+    {
+        return false;
+    }
+
+    text = skipSpaces(text);
+    for (uint8_t action = (uint8_t)Action::CLEAN; action <= (uint8_t)Action::DOCK; action++)
+    {
+        size_t length = strlen(ACTION_NAMES[action]);
+        if (strncmp(text, ACTION_NAMES[action], length) == 0 && *skipSpaces(text + length) == '\0')
+        {
+            parsed.action = action;
+            rule = parsed;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t CleanScheduler::format(const ScheduleRule &rule, char *out, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    out[0] = '\0';
+    if ((rule.days & 0x7F) == 0 || rule.action > (uint8_t)Action::DOCK)
+    {
+        return 0;
+    }
+
+    // Weekdays as runs, e.g. 1-5 or 0,6
+    char days[16] = "*";
+    size_t length = 0;
+    for (uint8_t day = 0; day < 7 && (rule.days & 0x7F) != 0x7F; day++)
+    {
+        if (!(rule.days & (1 << day)))
+        {
+            continue;
+        }
+        uint8_t last = day;
+        while (last < 6 && (rule.days & (1 << (last + 1))))
+        {
+            last++;
+        }
+        if (last > day)
+        {
+            length += snprintf(days + length, sizeof(days) - length, "%s%u-%u", length > 0 ? "," : "", day, last);
+        }
+        else
+        {
+            length += snprintf(days + length, sizeof(days) - length, "%s%u", length > 0 ? "," : "", day);
+        }
+        day = last;
+    }
+
+    int written = snprintf(out, size, "%u %u * * %s %s", rule.minute, rule.hour, days, ACTION_NAMES[rule.action]);
+    return written < 0 ? 0 : ((size_t)written < size ? written : size - 1);
+}
+
+const char *CleanScheduler::actionName(Action action)
+{
+    return (uint8_t)action <= (uint8_t)Action::DOCK ? ACTION_NAMES[(uint8_t)action] : "";
+}
+
+// Wheel from the minute on, every rule at its next slot
+void CleanScheduler::start(uint32_t minute)
+{
+    memset(_slots, SLOT_END, sizeof(_slots));
+    _minute = minute;
+    _running = true;
+    for (uint8_t rule = 0; rule < SCHEDULE_RULES; rule++)
+    {
+        if (used(rule))
+        {
+            _expiry[rule] = nextSlot(rule, minute);
+            insert(rule);
+        }
+    }
+}
+
+void CleanScheduler::tick()
+{
+    _minute++;
+    if (_minute % 1440 == 0)
+    {
+        cascade(SLOT_DAYS + (_minute / 1440) % 8);
+    }
+    if (_minute % 60 == 0)
+    {
+        cascade(SLOT_HOURS + (_minute / 60) % 24);
+    }
+
+    uint8_t rule = _slots[_minute % 60];
+    _slots[_minute % 60] = SLOT_END;
+    while (rule != SLOT_END)
+    {
+        uint8_t next = _nextRule[rule];
+        if (_expiry[rule] == _minute && _minute > _lastSlot)
+        {
+            fire(rule, _minute, false);
+        }
+        _expiry[rule] = nextSlot(rule, _minute);
+        insert(rule);
+        rule = next;
+    }
+}
+
+// The rules of an hour or day which begins into the finer slots
+void CleanScheduler::cascade(uint8_t slot)
+{
+    uint8_t rule = _slots[slot];
+    _slots[slot] = SLOT_END;
+    while (rule != SLOT_END)
+    {
+        uint8_t next = _nextRule[rule];
+        insert(rule);
+        rule = next;
+    }
+}
+
+void CleanScheduler::insert(uint8_t rule)
+{
+    uint32_t expiry = _expiry[rule];
+    uint8_t slot;
+    if (expiry / 60 == _minute / 60)
+    {
+        slot = expiry % 60;
+    }
+    else if (expiry / 1440 == _minute / 1440)
+    {
+        slot = SLOT_HOURS + (expiry / 60) % 24;
+    }
+    else
+    {
+        slot = SLOT_DAYS + (expiry / 1440) % 8; // up to 7 days ahead, never the current day's slot
+    }
+    _nextRule[rule] = _slots[slot];
+    _slots[slot] = rule;
+}
+
+void CleanScheduler::fire(uint8_t rule, uint32_t minute, bool late)
+{
+    _lastSlot = minute;
+    _fired++;
+    if (late)
+    {
+        _late++;
+    }
+    if (_fireCallback)
+    {
+        _fireCallback(rule, (Action)_rules[rule].action, minute * 60, late);
+    }
+}
+
+bool CleanScheduler::used(uint8_t rule)
+{
+    const ScheduleRule &r = _rules[rule];
+    return (r.days & 0x7F) != 0 && r.action != (uint8_t)Action::NONE && r.action <= (uint8_t)Action::DOCK && r.hour < 24 && r.minute < 60;
+}
+
+uint32_t CleanScheduler::nextSlot(uint8_t rule, uint32_t minute)
+{
+    const ScheduleRule &r = _rules[rule];
+    uint32_t day = minute / 1440;
+    for (uint32_t d = day; d <= day + 7; d++)
+    {
+        uint32_t slot = d * 1440 + r.hour * 60 + r.minute;
+        if ((r.days & (1 << weekday(d))) && slot > minute)
+        {
+            return slot;
+        }
+    }
+    return 0;
+}
+
+uint32_t CleanScheduler::previousSlot(uint8_t rule, uint32_t minute)
+{
+    const ScheduleRule &r = _rules[rule];
+    uint32_t day = minute / 1440;
+    for (uint32_t d = day + 1; d-- > day - 7;)
+    {
+        uint32_t slot = d * 1440 + r.hour * 60 + r.minute;
+        if ((r.days & (1 << weekday(d))) && slot <= minute)
+        {
+            return slot;
+        }
+    }
+    return 0;
+}
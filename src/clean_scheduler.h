@@ -0,0 +1,94 @@
+#ifndef clean_scheduler_h
+#define clean_scheduler_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+#define SCHEDULE_RULES 8                // rules in the config
+#define SCHEDULE_MIN_EPOCH 1577836800UL // 2020-01-01, earlier times are not synced yet
+#define SCHEDULE_MAX_TICKS 5            // minutes ticked through at once, a longer gap is a jump
+#define SCHEDULE_CATCH_UP 60            // default minutes a missed slot is run late
+#define SCHEDULE_TEXT_SIZE 40           // buffer for a rule as text
+
+// A weekly rule as stored in the config, a cron line "m h * * dow action"
+struct ScheduleRule
+{
+    uint8_t days;   // bit n = weekday n, 0 = Sunday. 0 = rule not used
+    uint8_t hour;   // 0..23
+    uint8_t minute; // 0..59
+    uint8_t action; // CleanScheduler::Action
+};
+
+// Runs the weekly rules at local epoch time (as from NTPClient, with the
+// time offset), without the broker or a server.
+//
+// Every rule is a timer for its next slot in a hierarchical wheel: 60
+// minute slots for the current hour, 24 hour slots for the current day and
+// 8 day slots for the week ahead. A new minute cascades the timers of the
+// hour (and the day) which begins into the finer slots and fires the timers
+// of the minute slot, so loop() costs a compare per call and a tick per
+// minute, no matter how many rules there are.
+//
+// The time may jump: on the first synced time after a boot, when NTP
+// corrects it by more than SCHEDULE_MAX_TICKS or when it goes back. Then
+// the wheel is built again from the new time, and the latest slot missed
+// within the catch-up window is run once, marked as late. A slot never runs
+// twice, also not when the time goes back.
+class CleanScheduler
+{
+public:
+    enum class Action : uint8_t
+    {
+        NONE,
+        CLEAN,
+        DOCK
+    };
+
+    typedef std::function<void(uint8_t rule, Action action, uint32_t slot, bool late)> FireCallback; // slot in epoch seconds
+
+    void onFire(FireCallback callback);
+    void setRules(const ScheduleRule *rules, uint8_t count);
+    void setCatchUp(uint16_t minutes);
+    void loop(uint32_t epoch);
+
+    bool running();   // synced time arrived
+    uint8_t rules();  // rules in use
+    uint32_t next();  // epoch of the next slot, 0 = none
+    Action nextAction();
+    unsigned long fired();
+    unsigned long late();
+    unsigned long jumps();
+
+    static bool parse(const char *text, ScheduleRule &rule); // an empty text is a rule not used
+    static size_t format(const ScheduleRule &rule, char *out, size_t size);
+    static const char *actionName(Action action);
+
+private:
+    void start(uint32_t minute);
+    void tick();
+    void cascade(uint8_t slot);
+    void insert(uint8_t rule);
+    void fire(uint8_t rule, uint32_t minute, bool late);
+    bool used(uint8_t rule);
+    uint32_t nextSlot(uint8_t rule, uint32_t minute);     // first slot after the minute
+    uint32_t previousSlot(uint8_t rule, uint32_t minute); // last slot up to the minute, 0 = none
+
+    FireCallback _fireCallback;
+    ScheduleRule _rules[SCHEDULE_RULES] = {};
+    uint16_t _catchUp = SCHEDULE_CATCH_UP;
+
+    // Wheel: 60 minutes, 24 hours, 8 days, each a list of rules
+    uint8_t _slots[60 + 24 + 8];
+    uint8_t _nextRule[SCHEDULE_RULES];
+    uint32_t _expiry[SCHEDULE_RULES]; // minute of the next slot
+
+    bool _running = false;
+    uint32_t _minute = 0;   // epoch minutes of the last tick
+    uint32_t _lastSlot = 0; // latest slot run
+    unsigned long _fired = 0;
+    unsigned long _late = 0;
+    unsigned long _jumps = 0;
+};
+
+#endif
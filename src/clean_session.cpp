@@ -0,0 +1,201 @@
+#include "clean_session.h"
+
+void SessionDetector::onStart(SessionCallback callback)
+{
+    _startCallback = callback;
+}
+
+// Called with every ended session
+void SessionDetector::onEnd(SessionCallback callback)
+{
+    _endCallback = callback;
+}
+
+void SessionDetector::update(unsigned long ms, uint32_t time, const SensorSnapshot &sensors, bool docked, OIMode mode, uint16_t level)
+{
+    if (!sensors.valid)
+    {
+        return;
+    }
+
+    unsigned long elapsed = ms - _lastSample;
+    elapsed = elapsed < SESSION_LOST_TIME ? elapsed : 0;
+    _lastSample = ms;
+    _lastLevel = level;
+    int64_t drawn = sensors.current < 0 ? -(int64_t)sensors.current * elapsed : 0;
+
+    // Debounce the cleaning current, the time it started is the start of a change
+    bool cleaning = sensors.cleaning && !docked;
+    if (cleaning != _rawCleaning)
+    {
+        _rawCleaning = cleaning;
+        _rawSince = ms;
+        _rawSinceTime = time;
+        _rawUsed = 0;
+    }
+    _rawUsed += drawn;
+    bool changed = cleaning != _cleaning && ms - _rawSince >= SESSION_DEBOUNCE;
+    if (changed)
+    {
+        _cleaning = cleaning;
+    }
+
+    if (_state != State::IDLE)
+    {
+        _used += drawn;
+        if (sensors.current < 0 && (uint16_t)-sensors.current > _current.peakCurrent)
+        {
+            _current.peakCurrent = -sensors.current;
+        }
+        if (mode == OIMode::OFF || docked)
+        {
+            end(docked ? SessionEnd::DOCKED : SessionEnd::OFF, ms);
+            return;
+        }
+    }
+
+    switch (_state)
+    {
+    case State::IDLE:
+        if (changed && _cleaning && mode != OIMode::SAFE && mode != OIMode::FULL)
+        {
+            _state = State::CLEANING;
+            _current = CleanSession();
+            _current.start = _rawSinceTime;
+            _current.startLevel = level;
+            _current.peakCurrent = sensors.current < 0 ? -sensors.current : 0;
+            _startMs = _rawSince;
+            _paused = 0;
+            _used = _rawUsed;
+            if (_startCallback)
+            {
+                _startCallback(_current);
+            }
+        }
+        break;
+
+    case State::CLEANING:
+        if (changed && !_cleaning)
+        {
+            _state = State::PAUSED;
+            _pauseStart = _rawSince;
+            _current.pauses++;
+        }
+        break;
+
+    case State::PAUSED:
+        if (changed && _cleaning)
+        {
+            _state = State::CLEANING;
+            _paused += _rawSince - _pauseStart;
+        }
+        else if (ms - _pauseStart >= SESSION_PAUSE_MAX)
+        {
+            // The session ended when the pause started
+            end(level < SESSION_LOW_LEVEL ? SessionEnd::BATTERY : SessionEnd::STOPPED, _pauseStart);
+        }
+        break;
+    }
+}
+
+void SessionDetector::loop(unsigned long ms)
+{
+    if (_state != State::IDLE && ms - _lastSample >= SESSION_LOST_TIME)
+    {
+        end(SessionEnd::LOST, _lastSample);
+    }
+}
+
+SessionDetector::State SessionDetector::state()
+{
+    return _state;
+}
+
+const CleanSession &SessionDetector::current()
+{
+    return _current;
+}
+
+bool SessionDetector::session(uint8_t age, CleanSession &session)
+{
+    if (age >= _count)
+    {
+        return false;
+    }
+    session = _sessions[(_head + SESSION_RECORDS - 1 - age) % SESSION_RECORDS];
+    return true;
+}
+
+uint8_t SessionDetector::count()
+{
+    return _count;
+}
+
+unsigned long SessionDetector::sessions()
+{
+    return _ended;
+}
+
+const char *SessionDetector::stateName(State state)
+{
+    switch (state)
+    {
+    case State::CLEANING:
+        return "cleaning";
+    case State::PAUSED:
+        return "paused";
+    default:
+        return "idle";
+    }
+}
+
+const char *SessionDetector::endName(SessionEnd reason)
+{
+    switch (reason)
+    {
+    case SessionEnd::DOCKED:
+        return "docked";
+    case SessionEnd::STOPPED:
+        return "stopped";
+    case SessionEnd::BATTERY:
+        return "battery";
+    case SessionEnd::OFF:
+        return "off";
+    default:
+        return "lost";
+    }
+}
+
+void SessionDetector::end(SessionEnd reason, unsigned long ms)
+{
+    if (_state == State::PAUSED)
+    {
+        _paused += ms - _pauseStart;
+    }
+
+    unsigned long duration = (ms - _startMs) / 1000;
+    int64_t used = _used / 3600000;
+    _current.duration = duration < 0xFFFF ? duration : 0xFFFF;
+    _current.paused = _paused / 1000 < 0xFFFF ? _paused / 1000 : 0xFFFF;
+    _current.used = used < 0xFFFF ? used : 0xFFFF;
+    _current.endLevel = _lastLevel;
+    _current.reason = reason;
+
+    _sessions[_head] = _current;
+    _head = (_head + 1) % SESSION_RECORDS;
+    if (_count < SESSION_RECORDS)
+    {
+        _count++;
+    }
+    _ended++;
+
+    // A Roomba that keeps cleaning after a lost stream starts a new session
+    _state = State::IDLE;
+    _cleaning = false;
+    _rawCleaning = false;
+
+    if (_endCallback)
+    {
+        _endCallback(_current);
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef clean_session_h
+#define clean_session_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "sensor_snapshot.h"
+#include "roomba_oi.h"
+
+#define SESSION_RECORDS 8         // ended sessions kept in RAM
+#define SESSION_DEBOUNCE 10000    // ms a cleaning or idle current must last to start or pause a session
+#define SESSION_PAUSE_MAX 600000  // ms, a longer pause ends the session
+#define SESSION_LOST_TIME 60000   // ms without sensor values end the session
+#define SESSION_LOW_LEVEL 100     // permille, a session that stops below this level ran out of battery
+
+enum class SessionEnd : uint8_t
+{
+    DOCKED,  // reached the home base
+    STOPPED, // paused too long, e.g. stopped by the button or stuck
+    BATTERY, // stopped with an empty battery
+    OFF,     // OI mode changed to off
+    LOST     // no sensor values, e.g. the Roomba was switched off
+};
+
+struct CleanSession
+{
+    uint32_t start = 0;        // epoch s
+    uint16_t duration = 0;     // s from start to end
+    uint16_t paused = 0;       // s of the duration in pauses
+    uint8_t pauses = 0;
+    uint16_t used = 0;         // mAh
+    uint16_t peakCurrent = 0;  // mA of discharge
+    uint16_t startLevel = 0;   // state of charge in permille
+    uint16_t endLevel = 0;
+    SessionEnd reason = SessionEnd::LOST;
+};
+
+// Cleaning sessions from the sensor stream, whoever started them: MQTT, the
+// button or the Roomba's own schedule.
+//
+// A session starts when the Roomba draws a cleaning current off the home
+// base for SESSION_DEBOUNCE, it pauses when the current stays low as long
+// and ends on the home base, after a long pause, when the OI is switched
+// off or when no sensor values arrive. In SAFE and FULL mode the current
+// comes from drive commands, so no session starts.
+class SessionDetector
+{
+public:
+    enum class State : uint8_t
+    {
+        IDLE,
+        CLEANING,
+        PAUSED
+    };
+
+    typedef std::function<void(const CleanSession &session)> SessionCallback;
+
+    void onStart(SessionCallback callback);
+    void onEnd(SessionCallback callback);
+
+    // One sensor sample. docked: a charging source is present, level: state
+    // of charge in permille.
+    void update(unsigned long ms, uint32_t time, const SensorSnapshot &sensors, bool docked, OIMode mode, uint16_t level);
+    void loop(unsigned long ms); // ends a session without sensor values
+
+    State state();
+    const CleanSession &current(); // the running session
+    bool session(uint8_t age, CleanSession &session); // ended sessions, 0 = newest
+    uint8_t count();
+    unsigned long sessions(); // ended since the start
+
+    static const char *stateName(State state);
+    static const char *endName(SessionEnd reason);
+
+private:
+    void end(SessionEnd reason, unsigned long ms);
+
+    SessionCallback _startCallback;
+    SessionCallback _endCallback;
+    State _state = State::IDLE;
+    CleanSession _current;
+
+    bool _cleaning = false;       // debounced
+    bool _rawCleaning = false;    // of the last sample
+    unsigned long _rawSince = 0;  // ms
+    uint32_t _rawSinceTime = 0;   // epoch s
+    int64_t _rawUsed = 0;         // mA*ms since _rawSince
+    unsigned long _lastSample = 0;
+    uint16_t _lastLevel = 0;
+
+    unsigned long _startMs = 0;
+    unsigned long _pauseStart = 0;
+    unsigned long _paused = 0; // ms
+    int64_t _used = 0;         // mA*ms
+
+    CleanSession _sessions[SESSION_RECORDS];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+    unsigned long _ended = 0;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "command_queue.h"
+#include <Arduino.h>
+
+CommandQueue::CommandQueue(unsigned long coalesceWindow, unsigned long conditionTimeout)
+{
+    _coalesceWindow = coalesceWindow;
+    _conditionTimeout = conditionTimeout;
+}
+
+void CommandQueue::onExecute(ExecuteCallback callback)
+{
+    _executeCallback = callback;
+}
+
+void CommandQueue::onCondition(ConditionCallback callback)
+{
+    _conditionCallback = callback;
+}
+
+void CommandQueue::onStatus(StatusCallback callback)
+{
+    _statusCallback = callback;
+}
+
+// Queue a command. With statusDelay > 0 a status update is requested that long
+// after the command was executed.
+bool CommandQueue::push(uint8_t command, uint8_t trigger, unsigned long statusDelay, Condition condition /* = Condition::NONE */)
+{
+    if (_hasLastPush && command == _lastPushCommand && condition == _lastPushCondition && (millis() - _lastPushTime) < _coalesceWindow)
+    {
+        _coalesced++;
+        return true;
+    }
+
+    if (_count >= CMD_QUEUE_SIZE)
+    {
+        _dropped++;
+        return false;
+    }
+
+    Command &entry = _queue[(_head + _count) % CMD_QUEUE_SIZE];
+    entry.command = command;
+    entry.trigger = trigger;
+    entry.condition = condition;
+    entry.statusDelay = statusDelay;
+    entry.pushed = millis();
+    _count++;
+
+    _hasLastPush = true;
+    _lastPushCommand = command;
+    _lastPushCondition = condition;
+    _lastPushTime = entry.pushed;
+
+    return true;
+}
+
+void CommandQueue::loop()
+{
+    // Status update requested by an executed command
+    if (_statusPending && (millis() - _statusTime) >= _statusDelay)
+    {
+        _statusPending = false;
+        if (_statusCallback)
+        {
+            _statusCallback(_statusTrigger);
+        }
+    }
+
+    if (_count == 0)
+    {
+        return;
+    }
+
+    Command &entry = _queue[_head];
+    if (entry.condition != Condition::NONE && _conditionCallback && !_conditionCallback(entry.condition) && (millis() - entry.pushed) < _conditionTimeout)
+    {
+        return; // wait for the condition, but not forever
+    }
+
+    Command command = entry;
+    _head = (_head + 1) % CMD_QUEUE_SIZE;
+    _count--;
+
+    _lastLatency = millis() - command.pushed;
+    if (_lastLatency > _maxLatency)
+    {
+        _maxLatency = _lastLatency;
+    }
+    _executed++;
+
+    if (_executeCallback)
+    {
+        _executeCallback(command.command);
+    }
+
+    if (command.statusDelay > 0)
+    {
+        // A newer status request replaces a pending one
+        _statusPending = true;
+        _statusTrigger = command.trigger;
+        _statusTime = millis();
+        _statusDelay = command.statusDelay;
+    }
+}
+
+uint8_t CommandQueue::depth()
+{
+    return _count;
+}
+
+unsigned long CommandQueue::lastLatency()
+{
+    return _lastLatency;
+}
+
+unsigned long CommandQueue::maxLatency()
+{
+    return _maxLatency;
+}
+
+unsigned long CommandQueue::executed()
+{
+    return _executed;
+}
+
+unsigned long CommandQueue::coalesced()
+{
+    return _coalesced;
+}
+
+unsigned long CommandQueue::dropped()
+{
+    return _dropped;
+}
@@ -0,0 +1,80 @@
+#ifndef command_queue_h
+#define command_queue_h
+
+#include <Arduino.h>
+#include <functional>
+
+#define CMD_QUEUE_SIZE 8
+
+// Bounded queue for Roomba commands, executed from loop() without blocking.
+// A command can wait for a condition before it is executed (e.g. "cleaning
+// stopped") and can request a status update some time after execution.
+// The same command pushed again within the coalesce window is dropped, so
+// e.g. three "clean" toggles within a second end up as one.
+class CommandQueue
+{
+public:
+    enum class Condition : uint8_t
+    {
+        NONE,
+        NOT_CLEANING
+    };
+
+    typedef std::function<void(uint8_t command)> ExecuteCallback;
+    typedef std::function<bool(Condition condition)> ConditionCallback;
+    typedef std::function<void(uint8_t trigger)> StatusCallback;
+
+    CommandQueue(unsigned long coalesceWindow, unsigned long conditionTimeout);
+
+    void onExecute(ExecuteCallback callback);
+    void onCondition(ConditionCallback callback);
+    void onStatus(StatusCallback callback);
+
+    bool push(uint8_t command, uint8_t trigger, unsigned long statusDelay, Condition condition = Condition::NONE);
+    void loop();
+
+    uint8_t depth();
+    unsigned long lastLatency();
+    unsigned long maxLatency();
+    unsigned long executed();
+    unsigned long coalesced();
+    unsigned long dropped();
+
+private:
+    struct Command
+    {
+        uint8_t command;
+        uint8_t trigger;
+        Condition condition;
+        unsigned long statusDelay;
+        unsigned long pushed;
+    };
+
+    ExecuteCallback _executeCallback;
+    ConditionCallback _conditionCallback;
+    StatusCallback _statusCallback;
+
+    Command _queue[CMD_QUEUE_SIZE];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+
+    unsigned long _coalesceWindow;
+    unsigned long _conditionTimeout;
+    bool _hasLastPush = false;
+    uint8_t _lastPushCommand = 0;
+    Condition _lastPushCondition = Condition::NONE;
+    unsigned long _lastPushTime = 0;
+
+    bool _statusPending = false;
+    uint8_t _statusTrigger = 0;
+    unsigned long _statusTime = 0;
+    unsigned long _statusDelay = 0;
+
+    unsigned long _lastLatency = 0;
+    unsigned long _maxLatency = 0;
+    unsigned long _executed = 0;
+    unsigned long _coalesced = 0;
+    unsigned long _dropped = 0;
+};
+
+#endif
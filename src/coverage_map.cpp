@@ -0,0 +1,422 @@
+#include "coverage_map.h"
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t PNG_SIGNATURE[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+static const uint8_t PNG_PALETTE[] = {255, 255, 255, // free
+                                      120, 200, 120, // cleaned
+                                      255, 150, 0,   // bumped
+                                      200, 0, 0};    // cliff
+static const uint16_t DEFLATE_BLOCK_MAX = 65535;     // bytes of a stored block
+
+static int32_t floorDiv(int32_t value, int32_t divisor)
+{
+    return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+static uint32_t isqrt(uint32_t value)
+{
+    uint32_t root = 0;
+    for (uint32_t bit = 1UL << 30; bit > 0; bit >>= 2)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+// Bit order of a byte reversed, the bitsets have the leftmost column in bit 0
+static uint8_t reverse(uint8_t value)
+{
+    value = (value & 0xF0) >> 4 | (value & 0x0F) << 4;
+    value = (value & 0xCC) >> 2 | (value & 0x33) << 2;
+    return (value & 0xAA) >> 1 | (value & 0x55) << 1;
+}
+
+void CoverageMap::reset()
+{
+    _count = 0;
+    _last = 0;
+    _swept = false;
+    _sweeps = 0;
+    _dropped = 0;
+}
+
+void CoverageMap::sweep(int32_t x, int32_t y)
+{
+    if (!_swept)
+    {
+        footprint(x, y);
+        _swept = true;
+        _sweepX = x;
+        _sweepY = y;
+        _sweeps++;
+        return;
+    }
+
+    int32_t dx = x - _sweepX;
+    int32_t dy = y - _sweepY;
+    const int64_t jump = COVERAGE_SWEEP_STEPS * COVERAGE_CELL / 2;
+    int64_t squared = (int64_t)dx * dx + (int64_t)dy * dy;
+    if (squared < (COVERAGE_CELL / 2) * (COVERAGE_CELL / 2))
+    {
+        return;
+    }
+
+    // A footprint every half cell, a jump only at its end
+    int32_t steps = 1;
+    if (squared <= jump * jump)
+    {
+        steps = (isqrt(squared) + COVERAGE_CELL / 2 - 1) / (COVERAGE_CELL / 2);
+    }
+    for (int32_t step = 1; step <= steps; step++)
+    {
+        footprint(_sweepX + dx * step / steps, _sweepY + dy * step / steps);
+    }
+    _sweepX = x;
+    _sweepY = y;
+    _sweeps++;
+}
+
+void CoverageMap::mark(Layer layer, int32_t x, int32_t y)
+{
+    int32_t cellX = floorDiv(x, COVERAGE_CELL);
+    setSpan(layer, floorDiv(y, COVERAGE_CELL), cellX, cellX);
+}
+
+bool CoverageMap::get(Layer layer, int32_t cellX, int32_t cellY)
+{
+    int32_t tileX = floorDiv(cellX, COVERAGE_TILE);
+    return row(layer, tileX, cellY) & (1UL << (cellX - tileX * COVERAGE_TILE));
+}
+
+void CoverageMap::bounds(int32_t &cellX, int32_t &cellY, uint16_t &width, uint16_t &height)
+{
+    int32_t minX = 0;
+    int32_t minY = 0;
+    int32_t maxX = 0;
+    int32_t maxY = 0;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        const Tile &tile = _tiles[i];
+        minX = i == 0 || tile.x < minX ? tile.x : minX;
+        minY = i == 0 || tile.y < minY ? tile.y : minY;
+        maxX = i == 0 || tile.x > maxX ? tile.x : maxX;
+        maxY = i == 0 || tile.y > maxY ? tile.y : maxY;
+    }
+    cellX = minX * COVERAGE_TILE;
+    cellY = minY * COVERAGE_TILE;
+    width = (maxX - minX + 1) * COVERAGE_TILE;
+    height = (maxY - minY + 1) * COVERAGE_TILE;
+}
+
+uint8_t CoverageMap::tiles()
+{
+    return _count;
+}
+
+size_t CoverageMap::bytes()
+{
+    return _count * sizeof(Tile);
+}
+
+unsigned long CoverageMap::cells(Layer layer)
+{
+    unsigned long count = 0;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        for (uint8_t row = 0; row < COVERAGE_TILE; row++)
+        {
+            count += __builtin_popcount(_tiles[i].rows[(uint8_t)layer][row]);
+        }
+    }
+    return count;
+}
+
+unsigned long CoverageMap::sweeps()
+{
+    return _sweeps;
+}
+
+unsigned long CoverageMap::dropped()
+{
+    return _dropped;
+}
+
+size_t CoverageMap::encode(Format format, Layer layer, Output output)
+{
+    _output = output;
+    _length = 0;
+    _written = 0;
+    if (format == Format::PNG)
+    {
+        encodePng();
+    }
+    else
+    {
+        encodePbm(layer);
+    }
+    flush();
+    return _written;
+}
+
+bool CoverageMap::parseLayer(const char *name, Layer &layer)
+{
+    for (uint8_t i = 0; i < COVERAGE_LAYERS; i++)
+    {
+        if (strcmp(name, layerName((Layer)i)) == 0)
+        {
+            layer = (Layer)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *CoverageMap::layerName(Layer layer)
+{
+    switch (layer)
+    {
+    case Layer::BUMPED:
+        return "bumped";
+    case Layer::CLIFF:
+        return "cliff";
+    default:
+        return "cleaned";
+    }
+}
+
+const char *CoverageMap::contentType(Format format)
+{
+    return format == Format::PNG ? "image/png" : "image/x-portable-bitmap";
+}
+
+CoverageMap::Tile *CoverageMap::tile(int32_t tileX, int32_t tileY, bool create)
+{
+    if (_last < _count && _tiles[_last].x == tileX && _tiles[_last].y == tileY)
+    {
+        return &_tiles[_last];
+    }
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (_tiles[i].x == tileX && _tiles[i].y == tileY)
+        {
+            _last = i;
+            return &_tiles[i];
+        }
+    }
+    if (!create || _count == COVERAGE_TILES || tileX < INT8_MIN || tileX > INT8_MAX || tileY < INT8_MIN || tileY > INT8_MAX)
+    {
+        return nullptr;
+    }
+
+    Tile &tile = _tiles[_count];
+    tile.x = tileX;
+    tile.y = tileY;
+    memset(tile.rows, 0, sizeof(tile.rows));
+    _last = _count++;
+    return &tile;
+}
+
+void CoverageMap::setSpan(Layer layer, int32_t cellY, int32_t cellX0, int32_t cellX1)
+{
+    int32_t tileY = floorDiv(cellY, COVERAGE_TILE);
+    int32_t row = cellY - tileY * COVERAGE_TILE;
+    for (int32_t tileX = floorDiv(cellX0, COVERAGE_TILE); tileX <= floorDiv(cellX1, COVERAGE_TILE); tileX++)
+    {
+        int32_t first = (cellX0 > tileX * COVERAGE_TILE ? cellX0 : tileX * COVERAGE_TILE) - tileX * COVERAGE_TILE;
+        int32_t last = (cellX1 < tileX * COVERAGE_TILE + COVERAGE_TILE - 1 ? cellX1 : tileX * COVERAGE_TILE + COVERAGE_TILE - 1) - tileX * COVERAGE_TILE;
+        Tile *tile = this->tile(tileX, tileY, true);
+        if (tile == nullptr)
+        {
+            _dropped += last - first + 1;
+            continue;
+        }
+        uint32_t mask = (last == COVERAGE_TILE - 1 ? 0xFFFFFFFFUL : (1UL << (last + 1)) - 1) & ~((1UL << first) - 1);
+        tile->rows[(uint8_t)layer][row] |= mask;
+    }
+}
+
+// All cells the disc of the Roomba touches, a span per row
+void CoverageMap::footprint(int32_t x, int32_t y)
+{
+    const int32_t radius = COVERAGE_FOOTPRINT;
+    for (int32_t cellY = floorDiv(y - radius, COVERAGE_CELL); cellY <= floorDiv(y + radius, COVERAGE_CELL); cellY++)
+    {
+        // Distance of the centre to the nearest point of the row
+        int32_t low = cellY * COVERAGE_CELL;
+        int32_t dy = y < low ? low - y : (y >= low + COVERAGE_CELL ? y - (low + COVERAGE_CELL - 1) : 0);
+        int32_t chord = isqrt(radius * radius - dy * dy);
+        setSpan(Layer::CLEANED, cellY, floorDiv(x - chord, COVERAGE_CELL), floorDiv(x + chord, COVERAGE_CELL));
+    }
+}
+
+uint32_t CoverageMap::row(Layer layer, int32_t tileX, int32_t cellY)
+{
+    int32_t tileY = floorDiv(cellY, COVERAGE_TILE);
+    Tile *tile = this->tile(tileX, tileY, false);
+    return tile != nullptr ? tile->rows[(uint8_t)layer][cellY - tileY * COVERAGE_TILE] : 0;
+}
+
+void CoverageMap::encodePbm(Layer layer)
+{
+    int32_t cellX;
+    int32_t cellY;
+    uint16_t width;
+    uint16_t height;
+    bounds(cellX, cellY, width, height);
+
+    char header[48];
+    int length = snprintf(header, sizeof(header), "P4\n# %s, %u mm per cell\n%u %u\n", layerName(layer), COVERAGE_CELL, width, height);
+    put((const uint8_t *)header, length);
+
+    for (int32_t y = cellY + height - 1; y >= cellY; y--)
+    {
+        for (int32_t tileX = cellX / COVERAGE_TILE; tileX < (cellX + width) / COVERAGE_TILE; tileX++)
+        {
+            uint32_t bits = row(layer, tileX, y);
+            uint8_t bytes[4] = {reverse(bits), reverse(bits >> 8), reverse(bits >> 16), reverse(bits >> 24)};
+            put(bytes, sizeof(bytes));
+        }
+    }
+}
+
+void CoverageMap::encodePng()
+{
+    int32_t cellX;
+    int32_t cellY;
+    uint16_t width;
+    uint16_t height;
+    bounds(cellX, cellY, width, height);
+
+    // Filter byte and 4 pixels per byte, a zlib stream of stored blocks
+    uint32_t dataSize = (uint32_t)height * (1 + width / 4);
+    uint32_t blocks = (dataSize + DEFLATE_BLOCK_MAX - 1) / DEFLATE_BLOCK_MAX;
+
+    put(PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    chunk("IHDR", 13);
+    put32(width);
+    put32(height);
+    const uint8_t header[] = {2, 3, 0, 0, 0}; // bit depth, palette, deflate, filter, no interlace
+    put(header, sizeof(header));
+    chunkEnd();
+    chunk("PLTE", sizeof(PNG_PALETTE));
+    put(PNG_PALETTE, sizeof(PNG_PALETTE));
+    chunkEnd();
+
+    chunk("IDAT", 2 + dataSize + 5 * blocks + 4);
+    const uint8_t zlib[] = {0x78, 0x01};
+    put(zlib, sizeof(zlib));
+    _adler = 1;
+    _dataLeft = dataSize;
+    _blockLeft = 0;
+    for (int32_t y = cellY + height - 1; y >= cellY; y--)
+    {
+        const uint8_t filter = 0;
+        putData(&filter, 1);
+        for (int32_t tileX = cellX / COVERAGE_TILE; tileX < (cellX + width) / COVERAGE_TILE; tileX++)
+        {
+            uint32_t cleaned = row(Layer::CLEANED, tileX, y);
+            uint32_t bumped = row(Layer::BUMPED, tileX, y);
+            uint32_t cliff = row(Layer::CLIFF, tileX, y);
+            uint8_t pixels[COVERAGE_TILE / 4] = {};
+            for (uint8_t column = 0; column < COVERAGE_TILE; column++)
+            {
+                uint32_t bit = 1UL << column;
+                uint8_t pixel = (cliff & bit) ? 3 : (bumped & bit) ? 2 : (cleaned & bit) ? 1 : 0;
+                pixels[column / 4] |= pixel << (6 - 2 * (column % 4));
+            }
+            putData(pixels, sizeof(pixels));
+        }
+    }
+    put32(_adler);
+    chunkEnd();
+
+    chunk("IEND", 0);
+    chunkEnd();
+}
+
+void CoverageMap::chunk(const char *type, uint32_t length)
+{
+    put32(length);
+    _crc = 0xFFFFFFFF;
+    put((const uint8_t *)type, 4);
+}
+
+void CoverageMap::chunkEnd()
+{
+    put32(~_crc);
+}
+
+void CoverageMap::put(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        _crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            _crc = (_crc >> 1) ^ (0xEDB88320UL & -(_crc & 1));
+        }
+
+        _buffer[_length++] = data[i];
+        if (_length == sizeof(_buffer))
+        {
+            flush();
+        }
+    }
+}
+
+// Starts a stored deflate block where the last one ended
+void CoverageMap::putData(const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (_blockLeft == 0)
+        {
+            _blockLeft = _dataLeft < DEFLATE_BLOCK_MAX ? _dataLeft : DEFLATE_BLOCK_MAX;
+            const uint8_t header[] = {(uint8_t)(_blockLeft == _dataLeft ? 1 : 0), (uint8_t)_blockLeft, (uint8_t)(_blockLeft >> 8),
+                                      (uint8_t)~_blockLeft, (uint8_t)(~_blockLeft >> 8)};
+            put(header, sizeof(header));
+        }
+
+        size_t part = length < _blockLeft ? length : _blockLeft;
+        uint32_t a = _adler & 0xFFFF;
+        uint32_t b = _adler >> 16;
+        for (size_t i = 0; i < part; i++)
+        {
+            a = (a + data[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        _adler = b << 16 | a;
+        put(data, part);
+
+        data += part;
+        length -= part;
+        _blockLeft -= part;
+        _dataLeft -= part;
+    }
+}
+
+// Big endian
+void CoverageMap::put32(uint32_t value)
+{
+    const uint8_t bytes[] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+    put(bytes, sizeof(bytes));
+}
+
+void CoverageMap::flush()
+{
+    if (_length > 0 && _output)
+    {
+        _output(_buffer, _length);
+    }
+    _written += _length;
+    _length = 0;
+}
@@ -0,0 +1,109 @@
+#ifndef coverage_map_h
+#define coverage_map_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+#define COVERAGE_CELL 100         // mm per cell side
+#define COVERAGE_TILE 32          // cells per tile side, a row is one uint32_t
+#define COVERAGE_TILES 12         // tiles in RAM, 388 bytes each
+#define COVERAGE_LAYERS 3         // cleaned, bumped, cliff
+#define COVERAGE_FOOTPRINT 170    // mm, radius of the Roomba
+#define COVERAGE_SWEEP_STEPS 8    // max. footprints between two poses, a longer move is a jump
+#define COVERAGE_OUTPUT_SIZE 128  // bytes collected before they are passed to the output
+
+// Which cells of the floor a run covered, relative to the odometry origin.
+//
+// The grid grows by tiles of 32x32 cells (3.2 x 3.2 m) where the Roomba
+// goes. A tile holds a packed bitset per layer, one uint32_t per row, so a
+// footprint sets a few row spans with one OR each: the cost per pose is
+// constant. A move of more than half a cell is filled with footprints in
+// between. When all tiles are in use, cells outside of them are dropped.
+//
+// The map is encoded on the fly, row by row from the bitsets, as the
+// bounding box of the tiles with +y up:
+// PBM: P4, one layer, 1 = set
+// PNG: 2 bit palette of all layers (free, cleaned, bumped, cliff), the
+//      image data in stored deflate blocks, so nothing is buffered
+class CoverageMap
+{
+public:
+    enum class Layer : uint8_t
+    {
+        CLEANED,
+        BUMPED,
+        CLIFF
+    };
+
+    enum class Format : uint8_t
+    {
+        PBM,
+        PNG
+    };
+
+    typedef std::function<void(const uint8_t *data, size_t length)> Output;
+
+    void reset();
+    void sweep(int32_t x, int32_t y);             // footprint at a pose (mm) into the cleaned layer
+    void mark(Layer layer, int32_t x, int32_t y); // the cell at a point (mm)
+    bool get(Layer layer, int32_t cellX, int32_t cellY);
+
+    // Bounding box of the tiles in cells
+    void bounds(int32_t &cellX, int32_t &cellY, uint16_t &width, uint16_t &height);
+
+    uint8_t tiles();
+    size_t bytes(); // RAM of the tiles in use
+    unsigned long cells(Layer layer);
+    unsigned long sweeps();
+    unsigned long dropped(); // cells outside of the tiles
+
+    size_t encode(Format format, Layer layer, Output output); // returns the bytes written
+
+    static bool parseLayer(const char *name, Layer &layer);
+    static const char *layerName(Layer layer);
+    static const char *contentType(Format format);
+
+private:
+    struct Tile
+    {
+        int8_t x;
+        int8_t y;
+        uint32_t rows[COVERAGE_LAYERS][COVERAGE_TILE]; // bit n = column n
+    };
+
+    Tile *tile(int32_t tileX, int32_t tileY, bool create);
+    void setSpan(Layer layer, int32_t cellY, int32_t cellX0, int32_t cellX1);
+    void footprint(int32_t x, int32_t y);
+    uint32_t row(Layer layer, int32_t tileX, int32_t cellY); // tile row, 0 without a tile
+
+    void encodePbm(Layer layer);
+    void encodePng();
+    void chunk(const char *type, uint32_t length);
+    void chunkEnd();
+    void put(const uint8_t *data, size_t length);
+    void putData(const uint8_t *data, size_t length); // image data inside the IDAT chunk
+    void put32(uint32_t value);
+    void flush();
+
+    Tile _tiles[COVERAGE_TILES];
+    uint8_t _count = 0;
+    uint8_t _last = 0; // tile of the last access
+
+    bool _swept = false;
+    int32_t _sweepX = 0; // mm of the last footprint
+    int32_t _sweepY = 0;
+    unsigned long _sweeps = 0;
+    unsigned long _dropped = 0;
+
+    Output _output;
+    uint8_t _buffer[COVERAGE_OUTPUT_SIZE];
+    size_t _length = 0;
+    size_t _written = 0;
+    uint32_t _crc = 0;       // of the PNG chunk
+    uint32_t _adler = 0;     // of the image data
+    uint32_t _dataLeft = 0;  // bytes of image data to come
+    uint16_t _blockLeft = 0; // bytes of the current deflate block
+};
+
+#endif
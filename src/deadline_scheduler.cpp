@@ -0,0 +1,157 @@
+#include "deadline_scheduler.h"
+
+// now is at or after the deadline
+static bool due(uint32_t deadline, uint32_t now)
+{
+    return (int32_t)(now - deadline) >= 0;
+}
+
+uint8_t DeadlineScheduler::add(const char *name, Callback callback, unsigned long period /* = 0 */)
+{
+    if (_count >= DEADLINE_TASKS)
+    {
+        return DEADLINE_NONE;
+    }
+    Task &task = _tasks[_count];
+    task.name = name;
+    task.callback = callback;
+    task.period = period;
+    task.deadline = 0;
+    task.armed = false;
+    task.runs = 0;
+    task.overruns = 0;
+    task.maxLate = 0;
+    return _count++;
+}
+
+void DeadlineScheduler::after(uint8_t task, unsigned long delay, unsigned long now)
+{
+    if (task >= _count)
+    {
+        return;
+    }
+    _tasks[task].deadline = now + delay;
+    _tasks[task].armed = true;
+    if (!_hasNext || (int32_t)(_tasks[task].deadline - _next) < 0)
+    {
+        _next = _tasks[task].deadline;
+        _hasNext = true;
+    }
+}
+
+void DeadlineScheduler::setPeriod(uint8_t task, unsigned long period)
+{
+    if (task < _count)
+    {
+        _tasks[task].period = period;
+    }
+}
+
+// The earliest deadline is left as it is, loop() finds nothing due then
+void DeadlineScheduler::cancel(uint8_t task)
+{
+    if (task < _count)
+    {
+        _tasks[task].armed = false;
+    }
+}
+
+bool DeadlineScheduler::armed(uint8_t task)
+{
+    return task < _count && _tasks[task].armed;
+}
+
+void DeadlineScheduler::loop(unsigned long now)
+{
+    if (!_hasNext || !due(_next, now))
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        Task &task = _tasks[i];
+        if (!task.armed || !due(task.deadline, now))
+        {
+            continue;
+        }
+
+        uint32_t late = now - task.deadline;
+        task.maxLate = late > task.maxLate ? late : task.maxLate;
+        if (task.period > 0)
+        {
+            if (late >= task.period)
+            {
+                task.overruns++;
+                task.deadline = now + task.period;
+            }
+            else
+            {
+                task.deadline += task.period;
+            }
+        }
+        else
+        {
+            task.armed = false;
+        }
+
+        task.runs++;
+        if (task.callback)
+        {
+            task.callback(); // may arm or cancel tasks
+        }
+    }
+    updateNext();
+}
+
+unsigned long DeadlineScheduler::nextWake(unsigned long now)
+{
+    if (!_hasNext)
+    {
+        return DEADLINE_IDLE;
+    }
+    return due(_next, now) ? 0 : _next - (uint32_t)now;
+}
+
+uint8_t DeadlineScheduler::count()
+{
+    return _count;
+}
+
+const char *DeadlineScheduler::name(uint8_t task)
+{
+    return task < _count ? _tasks[task].name : "";
+}
+
+unsigned long DeadlineScheduler::period(uint8_t task)
+{
+    return task < _count ? _tasks[task].period : 0;
+}
+
+unsigned long DeadlineScheduler::runs(uint8_t task)
+{
+    return task < _count ? _tasks[task].runs : 0;
+}
+
+unsigned long DeadlineScheduler::overruns(uint8_t task)
+{
+    return task < _count ? _tasks[task].overruns : 0;
+}
+
+unsigned long DeadlineScheduler::maxLate(uint8_t task)
+{
+    return task < _count ? _tasks[task].maxLate : 0;
+}
+
+void DeadlineScheduler::updateNext()
+{
+    _hasNext = false;
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        if (_tasks[i].armed && (!_hasNext || (int32_t)(_tasks[i].deadline - _next) < 0))
+        {
+            _next = _tasks[i].deadline;
+            _hasNext = true;
+        }
+    }
+}
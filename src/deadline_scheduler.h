@@ -0,0 +1,71 @@
+#ifndef deadline_scheduler_h
+#define deadline_scheduler_h
+
+#include <stdint.h>
+#include <functional>
+
+#define DEADLINE_TASKS 16        // tasks which can be added
+#define DEADLINE_NONE 0xFF       // no task, e.g. when all are in use
+#define DEADLINE_IDLE 0xFFFFFFFF // nextWake() without an armed task
+
+// Deadlines of the periodic and delayed work of loop(), instead of a
+// "last time" variable per task.
+//
+// A task is added once with its callback and period. after() arms it to
+// run that many ms from now; a task with a period runs again one period
+// after its last deadline, a task without one (period 0) runs once. Arming
+// an armed task moves its deadline, e.g. to restart a timeout.
+//
+// All times are compared as the signed 32 bit difference to now, which
+// stays right over the millis() rollover for deadlines up to 24 days ahead.
+// Deadlines are 32 bit like millis() on the ESP, also where unsigned long
+// is wider, so a host build wraps the same way. The
+// earliest deadline is kept, so loop() costs a compare until a task is due
+// and nextWake() tells how long the loop could sleep.
+//
+// A run is late when it starts after its deadline. When a periodic task is
+// a whole period late, the runs it missed are skipped and counted as an
+// overrun, so a blocked loop never causes a burst of runs.
+class DeadlineScheduler
+{
+public:
+    typedef std::function<void()> Callback;
+
+    uint8_t add(const char *name, Callback callback, unsigned long period = 0); // returns DEADLINE_NONE when full
+    void after(uint8_t task, unsigned long delay, unsigned long now);
+    void setPeriod(uint8_t task, unsigned long period);
+    void cancel(uint8_t task);
+    bool armed(uint8_t task);
+
+    void loop(unsigned long now);
+    unsigned long nextWake(unsigned long now); // ms until the next deadline, 0 = due
+
+    uint8_t count();
+    const char *name(uint8_t task);
+    unsigned long period(uint8_t task);
+    unsigned long runs(uint8_t task);
+    unsigned long overruns(uint8_t task);
+    unsigned long maxLate(uint8_t task); // ms
+
+private:
+    struct Task
+    {
+        const char *name;
+        Callback callback;
+        unsigned long period;
+        uint32_t deadline;
+        bool armed;
+        unsigned long runs;
+        unsigned long overruns;
+        unsigned long maxLate;
+    };
+
+    void updateNext();
+
+    Task _tasks[DEADLINE_TASKS];
+    uint8_t _count = 0;
+    bool _hasNext = false;
+    uint32_t _next = 0; // earliest deadline
+};
+
+#endif
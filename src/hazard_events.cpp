@@ -0,0 +1,201 @@
+#include "hazard_events.h"
+
+struct HazardInfo
+{
+    const char *name;
+    uint16_t rise; // ms the "on" state must hold
+    uint16_t fall; // ms the "off" state must hold
+};
+
+// Order of enum Hazard
+static const HazardInfo HAZARDS[HAZARD_COUNT] = {
+    {"bump_right", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"bump_left", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"drop_right", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"drop_left", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"wall", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"cliff_left", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"cliff_front_left", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"cliff_front_right", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"cliff_right", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"virtual_wall", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"overcurrent", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE},
+    {"dirt", 0, HAZARD_DIRT_HOLD},
+    {"light_bump", HAZARD_DEBOUNCE, HAZARD_DEBOUNCE}};
+
+void HazardDetector::onBatch(BatchCallback callback)
+{
+    _batchCallback = callback;
+}
+
+void HazardDetector::setPacket(uint8_t id, int32_t value)
+{
+    uint16_t mask;
+    uint16_t bits;
+
+    switch (id)
+    {
+    case 7: // bumps and wheel drops, same bit order as the hazards
+        mask = 0x0F << HAZARD_BUMP_RIGHT;
+        bits = (value & 0x0F) << HAZARD_BUMP_RIGHT;
+        break;
+    case 8:
+        mask = 1 << HAZARD_WALL;
+        bits = value != 0 ? mask : 0;
+        break;
+    case 9:
+    case 10:
+    case 11:
+    case 12:
+        mask = 1 << (HAZARD_CLIFF_LEFT + id - 9);
+        bits = value != 0 ? mask : 0;
+        break;
+    case 13:
+        mask = 1 << HAZARD_VIRTUAL_WALL;
+        bits = value != 0 ? mask : 0;
+        break;
+    case 14: // wheels, main and side brush
+        mask = 1 << HAZARD_OVERCURRENT;
+        bits = value != 0 ? mask : 0;
+        break;
+    case 15:
+        mask = 1 << HAZARD_DIRT;
+        bits = value > 0 ? mask : 0;
+        break;
+    case 45: // any of the six light bumper sensors
+        mask = 1 << HAZARD_LIGHT_BUMP;
+        bits = value != 0 ? mask : 0;
+        break;
+    default:
+        return;
+    }
+    _raw = (_raw & ~mask) | bits;
+}
+
+void HazardDetector::update(unsigned long ms)
+{
+    uint16_t changed = _raw ^ _sampled;
+    for (uint8_t hazard = 0; hazard < HAZARD_COUNT; hazard++)
+    {
+        uint16_t bit = 1 << hazard;
+        if (changed & bit)
+        {
+            // Back to the debounced state before the new one held
+            if ((_raw & bit) == (_active & bit) && hazard != HAZARD_DIRT)
+            {
+                _bounces++;
+            }
+            _since[hazard] = ms;
+        }
+    }
+    _sampled = _raw;
+
+    uint16_t transitions = _sampled ^ _active;
+    for (uint8_t hazard = 0; transitions != 0 && hazard < HAZARD_COUNT; hazard++)
+    {
+        uint16_t bit = 1 << hazard;
+        if (!(transitions & bit))
+        {
+            continue;
+        }
+        bool on = _sampled & bit;
+        if (ms - _since[hazard] >= (on ? HAZARDS[hazard].rise : HAZARDS[hazard].fall))
+        {
+            _active ^= bit;
+            queue(hazard, on, _since[hazard]);
+        }
+    }
+}
+
+void HazardDetector::loop(unsigned long ms)
+{
+    if (_count == 0 || !_batchCallback || (_retry && ms - _lastAttempt < HAZARD_BATCH_DELAY))
+    {
+        return;
+    }
+    if (_count < HAZARD_BATCH_MAX && ms - _queue[_head].ms < HAZARD_BATCH_DELAY)
+    {
+        return;
+    }
+
+    HazardEvent batch[HAZARD_BATCH_MAX];
+    uint8_t count = _count < HAZARD_BATCH_MAX ? _count : HAZARD_BATCH_MAX;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        batch[i] = _queue[(_head + i) % HAZARD_QUEUE_SIZE];
+    }
+
+    uint8_t taken = _batchCallback(batch, count);
+    if (taken == 0)
+    {
+        _retry = true;
+        _lastAttempt = ms;
+        return;
+    }
+    taken = taken < count ? taken : count;
+    _head = (_head + taken) % HAZARD_QUEUE_SIZE;
+    _count -= taken;
+    _retry = false;
+    _batches++;
+}
+
+uint16_t HazardDetector::active()
+{
+    return _active;
+}
+
+uint8_t HazardDetector::pending()
+{
+    return _count;
+}
+
+unsigned long HazardDetector::events()
+{
+    return _events;
+}
+
+unsigned long HazardDetector::count(uint8_t hazard)
+{
+    return hazard < HAZARD_COUNT ? _counts[hazard] : 0;
+}
+
+unsigned long HazardDetector::bounces()
+{
+    return _bounces;
+}
+
+unsigned long HazardDetector::dropped()
+{
+    return _dropped;
+}
+
+unsigned long HazardDetector::batches()
+{
+    return _batches;
+}
+
+const char *HazardDetector::name(uint8_t hazard)
+{
+    return hazard < HAZARD_COUNT ? HAZARDS[hazard].name : "";
+}
+
+void HazardDetector::queue(uint8_t hazard, bool on, unsigned long ms)
+{
+    if (_count == HAZARD_QUEUE_SIZE)
+    {
+        _head = (_head + 1) % HAZARD_QUEUE_SIZE;
+        _count--;
+        _dropped++;
+    }
+    HazardEvent &event = _queue[(_head + _count) % HAZARD_QUEUE_SIZE];
+    event.ms = ms;
+    event.hazard = hazard;
+    event.on = on;
+    _count++;
+
+    _events++;
+    if (on)
+    {
+        _counts[hazard]++;
+    }
+}
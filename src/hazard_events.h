@@ -0,0 +1,100 @@
+#ifndef hazard_events_h
+#define hazard_events_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+#define HAZARD_QUEUE_SIZE 32     // events waiting for a batch, the oldest is dropped when full
+#define HAZARD_BATCH_MAX 16      // events handed to one batch callback
+#define HAZARD_BATCH_DELAY 200   // ms a batch waits for more events after its first one
+#define HAZARD_DEBOUNCE 30       // ms a switch must keep its new state, two stream frames
+#define HAZARD_DIRT_HOLD 1000    // ms without dirt until a dirt episode ends
+
+enum Hazard : uint8_t
+{
+    HAZARD_BUMP_RIGHT,
+    HAZARD_BUMP_LEFT,
+    HAZARD_DROP_RIGHT,
+    HAZARD_DROP_LEFT,
+    HAZARD_WALL,
+    HAZARD_CLIFF_LEFT,
+    HAZARD_CLIFF_FRONT_LEFT,
+    HAZARD_CLIFF_FRONT_RIGHT,
+    HAZARD_CLIFF_RIGHT,
+    HAZARD_VIRTUAL_WALL,
+    HAZARD_OVERCURRENT,
+    HAZARD_DIRT,
+    HAZARD_LIGHT_BUMP,
+    HAZARD_COUNT
+};
+
+// A debounced transition, 8 bytes
+struct HazardEvent
+{
+    uint32_t ms = 0; // millis() of the first sample with the new state
+    uint8_t hazard = 0;
+    bool on = false;
+};
+
+// Edge-triggered hazard events from the sensor stream: bumpers and wheel
+// drops (packet 7), wall (8), cliffs (9-12), virtual wall (13), wheel
+// overcurrents (14), dirt detect (15) and the light bumper (45).
+//
+// Packets are collected with setPacket() and judged once per stream frame
+// with update(), so the resolution is the stream interval of 15 ms. A
+// transition is accepted when the new state holds for the debounce time of
+// the hazard. It is timestamped with the sample that first showed it, so
+// the debounce delays the event, but doesn't move it. Dirt comes in single
+// samples and is accepted at once, an episode ends HAZARD_DIRT_HOLD after
+// the last one.
+//
+// Accepted events are queued and handed out in batches by loop(), when the
+// first queued event is HAZARD_BATCH_DELAY old or HAZARD_BATCH_MAX events
+// are waiting.
+class HazardDetector
+{
+public:
+    // Returns the number of events it took, 0 to retry the batch later
+    typedef std::function<uint8_t(const HazardEvent *events, uint8_t count)> BatchCallback;
+
+    void onBatch(BatchCallback callback);
+
+    void setPacket(uint8_t id, int32_t value); // a hazard packet of the current frame
+    void update(unsigned long ms);             // end of a frame
+    void loop(unsigned long ms);               // hands out a due batch
+
+    uint16_t active();                   // debounced state, bit per Hazard
+    uint8_t pending();                   // queued events
+    unsigned long events();              // accepted since the start
+    unsigned long count(uint8_t hazard); // accepted "on" events of a hazard
+    unsigned long bounces();             // transitions which didn't hold for the debounce time
+    unsigned long dropped();             // events lost to a full queue
+    unsigned long batches();
+
+    static const char *name(uint8_t hazard);
+
+private:
+    void queue(uint8_t hazard, bool on, unsigned long ms);
+
+    BatchCallback _batchCallback;
+
+    uint16_t _raw = 0;                       // of the current frame
+    uint16_t _sampled = 0;                   // of the last frame
+    uint16_t _active = 0;                    // debounced
+    unsigned long _since[HAZARD_COUNT] = {}; // ms the sampled state of a hazard started
+
+    HazardEvent _queue[HAZARD_QUEUE_SIZE];
+    uint8_t _head = 0; // oldest event
+    uint8_t _count = 0;
+    unsigned long _lastAttempt = 0; // ms of a batch nobody took
+    bool _retry = false;
+
+    unsigned long _events = 0;
+    unsigned long _counts[HAZARD_COUNT] = {};
+    unsigned long _bounces = 0;
+    unsigned long _dropped = 0;
+    unsigned long _batches = 0;
+};
+
+#endif
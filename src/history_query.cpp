@@ -0,0 +1,267 @@
+#include "history_query.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *METRIC_NAMES[] = {"voltage", "current", "temperature", "charge"};
+
+static int16_t sampleValue(const TelemetrySample &sample, RollupMetric metric)
+{
+    switch (metric)
+    {
+    case RollupMetric::VOLTAGE:
+        return sample.voltage;
+    case RollupMetric::CURRENT:
+        return sample.current;
+    case RollupMetric::TEMPERATURE:
+        return sample.temperature;
+    default:
+        return sample.charge;
+    }
+}
+
+static void put16(uint8_t *out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+static void put32(uint8_t *out, uint32_t value)
+{
+    put16(out, value >> 16);
+    put16(out + 2, value);
+}
+
+HistoryQuery::HistoryQuery(TelemetryHistory &history, TelemetryRollup &rollup, TelemetryLog &log) : _history(history), _rollup(rollup), _log(log)
+{
+}
+
+unsigned long HistoryQuery::run(RollupMetric metric, uint32_t from, uint32_t to, uint32_t resolution, Format format, Output output)
+{
+    uint32_t source = resolution < 60 ? 1 : resolution < 900 ? 60 : resolution < 3600 ? 900 : 3600;
+    _output = output;
+    _format = format;
+    _from = from;
+    _to = to;
+    _resolution = resolution - resolution % source;
+    _resolution = _resolution > source ? _resolution : source;
+    _point = Point();
+    _points = 0;
+    _length = 0;
+
+    if (format == Format::CSV)
+    {
+        write("time,samples,min,max,mean,last\n");
+    }
+    else if (format == Format::JSON)
+    {
+        write("{\"metric\":\"%s\",\"resolution\":%lu,\"points\":[", metricName(metric), (unsigned long)_resolution);
+    }
+    else
+    {
+        uint8_t header[HISTORY_BINARY_HEADER_SIZE] = {'R', 'H', 'S', 'T', HISTORY_BINARY_VERSION, (uint8_t)metric};
+        put32(header + 6, _resolution);
+        writeBytes(header, sizeof(header));
+    }
+
+    if (source == 1)
+    {
+        TelemetryHistory::Iterator samples = _history.samples();
+        TelemetrySample sample;
+        while (samples.next(sample))
+        {
+            int16_t value = sampleValue(sample, metric);
+            add(sample.time, 1, {value, value, value, value});
+        }
+    }
+    else if (source == 60)
+    {
+        RollupLevel &level = _rollup.level(TelemetryRollup::MINUTE);
+        RollupPoint point;
+        for (uint16_t age = level.count(); age-- > 0 && level.point(age, point);)
+        {
+            add(point.time, point.samples, point.values[(uint8_t)metric]);
+        }
+    }
+    else
+    {
+        // Closed buckets from the log, the open one from RAM
+        TelemetryRollup::Resolution level = source == 900 ? TelemetryRollup::QUARTER : TelemetryRollup::HOUR;
+        TelemetryLog::Reader records = _log.records(from);
+        LogRecord record;
+        uint32_t last = 0;
+        while (records.next(record))
+        {
+            uint8_t recordLevel;
+            RollupBucket bucket;
+            if (record.type == LOG_ROLLUP && rollupDecode(record.data, record.length, recordLevel, bucket) && recordLevel == level)
+            {
+                add(record.time, bucket.samples, bucket.values[(uint8_t)metric]);
+                last = record.time;
+            }
+        }
+
+        RollupPoint point;
+        if (_rollup.level(level).point(0, point) && point.time > last)
+        {
+            add(point.time, point.samples, point.values[(uint8_t)metric]);
+        }
+    }
+
+    if (_point.samples > 0)
+    {
+        emit();
+    }
+    if (format == Format::JSON)
+    {
+        write("]}");
+    }
+    flush();
+    return _points;
+}
+
+bool HistoryQuery::parseMetric(const char *name, RollupMetric &metric)
+{
+    for (uint8_t i = 0; i < (uint8_t)RollupMetric::COUNT; i++)
+    {
+        if (strcmp(name, METRIC_NAMES[i]) == 0)
+        {
+            metric = (RollupMetric)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HistoryQuery::parseFormat(const char *name, Format &format)
+{
+    if (strcmp(name, "csv") == 0)
+    {
+        format = Format::CSV;
+    }
+    else if (strcmp(name, "json") == 0)
+    {
+        format = Format::JSON;
+    }
+    else if (strcmp(name, "bin") == 0)
+    {
+        format = Format::BINARY;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char *HistoryQuery::metricName(RollupMetric metric)
+{
+    return metric < RollupMetric::COUNT ? METRIC_NAMES[(uint8_t)metric] : "";
+}
+
+const char *HistoryQuery::contentType(Format format)
+{
+    switch (format)
+    {
+    case Format::CSV:
+        return "text/csv";
+    case Format::JSON:
+        return "application/json";
+    default:
+        return "application/octet-stream";
+    }
+}
+
+// Add a source point to the output point of its time
+void HistoryQuery::add(uint32_t time, uint16_t samples, const RollupValue &value)
+{
+    if (samples == 0 || time < _from || time >= _to)
+    {
+        return;
+    }
+
+    uint32_t bucket = time - time % _resolution;
+    if (_point.samples > 0 && bucket != _point.time)
+    {
+        emit();
+    }
+
+    if (_point.samples == 0)
+    {
+        _point.time = bucket;
+        _point.min = value.min;
+        _point.max = value.max;
+    }
+    else
+    {
+        _point.min = value.min < _point.min ? value.min : _point.min;
+        _point.max = value.max > _point.max ? value.max : _point.max;
+    }
+    _point.sum += (int32_t)value.mean * samples;
+    _point.samples += samples;
+    _point.last = value.last;
+}
+
+void HistoryQuery::emit()
+{
+    int32_t half = (_point.sum < 0 ? -(int32_t)_point.samples : (int32_t)_point.samples) / 2;
+    int16_t mean = (_point.sum + half) / (int32_t)_point.samples;
+
+    if (_format == Format::CSV)
+    {
+        write("%lu,%lu,%d,%d,%d,%d\n", (unsigned long)_point.time, (unsigned long)_point.samples, _point.min, _point.max, mean, _point.last);
+    }
+    else if (_format == Format::JSON)
+    {
+        write("%s[%lu,%lu,%d,%d,%d,%d]", _points > 0 ? "," : "", (unsigned long)_point.time, (unsigned long)_point.samples, _point.min, _point.max, mean, _point.last);
+    }
+    else
+    {
+        uint8_t data[HISTORY_BINARY_POINT_SIZE];
+        put32(data, _point.time);
+        put16(data + 4, _point.samples < 0xFFFF ? _point.samples : 0xFFFF);
+        put16(data + 6, _point.min);
+        put16(data + 8, _point.max);
+        put16(data + 10, mean);
+        put16(data + 12, _point.last);
+        writeBytes(data, sizeof(data));
+    }
+    _points++;
+    _point = Point();
+}
+
+// Text of at most 64 bytes
+void HistoryQuery::write(const char *format, ...)
+{
+    if (_length + 64 > sizeof(_buffer))
+    {
+        flush();
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf((char *)_buffer + _length, sizeof(_buffer) - _length, format, arguments);
+    va_end(arguments);
+    if (length > 0)
+    {
+        _length += (size_t)length < sizeof(_buffer) - _length ? length : sizeof(_buffer) - _length - 1;
+    }
+}
+
+void HistoryQuery::writeBytes(const uint8_t *data, size_t length)
+{
+    if (_length + length > sizeof(_buffer))
+    {
+        flush();
+    }
+    memcpy(_buffer + _length, data, length);
+    _length += length;
+}
+
+void HistoryQuery::flush()
+{
+    if (_length > 0)
+    {
+        _output(_buffer, _length);
+        _length = 0;
+    }
+}
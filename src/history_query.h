@@ -0,0 +1,84 @@
+#ifndef history_query_h
+#define history_query_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "telemetry_history.h"
+#include "telemetry_rollup.h"
+#include "telemetry_log.h"
+
+#define HISTORY_OUTPUT_SIZE 256 // bytes collected before they are passed to the output
+#define HISTORY_BINARY_VERSION 1
+#define HISTORY_BINARY_HEADER_SIZE 10 // "RHST", version, metric, resolution (uint32)
+#define HISTORY_BINARY_POINT_SIZE 14  // time (uint32), samples (uint16), min, max, mean, last (int16)
+
+// Points of one metric in a time range, streamed in small pieces.
+//
+// The source follows from the resolution: the per-second history below
+// 1 min, the 1 min rollups below 15 min (both in RAM, the last hour), else
+// the 15 min or 1 hour rollups from the telemetry log plus the open bucket.
+// Resolutions that are a multiple of the source are aggregated, others are
+// rounded down to one. Each point has the bucket start, the number of
+// samples and min/max/mean/last; buckets without samples are left out.
+//
+// CSV:    time,samples,min,max,mean,last lines after a header line
+// JSON:   {"metric":..,"resolution":..,"points":[[time,samples,min,max,mean,last],..]}
+// Binary: "RHST", version, metric, resolution (uint32), then points of
+//         time (uint32), samples (uint16), min, max, mean, last (int16),
+//         all big endian
+class HistoryQuery
+{
+public:
+    enum class Format : uint8_t
+    {
+        CSV,
+        JSON,
+        BINARY
+    };
+
+    typedef std::function<void(const uint8_t *data, size_t length)> Output;
+
+    HistoryQuery(TelemetryHistory &history, TelemetryRollup &rollup, TelemetryLog &log);
+
+    // Points with from <= time < to, returns the number of points
+    unsigned long run(RollupMetric metric, uint32_t from, uint32_t to, uint32_t resolution, Format format, Output output);
+
+    static bool parseMetric(const char *name, RollupMetric &metric);
+    static bool parseFormat(const char *name, Format &format);
+    static const char *metricName(RollupMetric metric);
+    static const char *contentType(Format format);
+
+private:
+    struct Point
+    {
+        uint32_t time = 0;
+        uint32_t samples = 0;
+        int16_t min = 0;
+        int16_t max = 0;
+        int32_t sum = 0; // mean * samples
+        int16_t last = 0;
+    };
+
+    void add(uint32_t time, uint16_t samples, const RollupValue &value);
+    void emit();
+    void write(const char *format, ...);
+    void writeBytes(const uint8_t *data, size_t length);
+    void flush();
+
+    TelemetryHistory &_history;
+    TelemetryRollup &_rollup;
+    TelemetryLog &_log;
+
+    Output _output;
+    Format _format;
+    uint32_t _from;
+    uint32_t _to;
+    uint32_t _resolution;
+    Point _point; // being aggregated
+    unsigned long _points;
+    uint8_t _buffer[HISTORY_OUTPUT_SIZE];
+    size_t _length;
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "latency_histogram.h"
+
+#define SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+
+void LatencyHistogram::record(uint32_t value)
+{
+    uint8_t index = bucket(value);
+    if (_buckets[index] == 0xFFFF)
+    {
+        _bucketTotal = 0;
+        for (uint8_t i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            _buckets[i] >>= 1;
+            _bucketTotal += _buckets[i];
+        }
+    }
+    _buckets[index]++;
+    _bucketTotal++;
+
+    _count++;
+    _sum += value;
+    _max = value > _max ? value : _max;
+}
+
+void LatencyHistogram::reset()
+{
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        _buckets[i] = 0;
+    }
+    _bucketTotal = 0;
+    _count = 0;
+    _sum = 0;
+    _max = 0;
+}
+
+uint32_t LatencyHistogram::percentile(uint16_t permille)
+{
+    if (_bucketTotal == 0)
+    {
+        return 0;
+    }
+    uint32_t rank = ((uint64_t)_bucketTotal * permille + 999) / 1000; // values at or below the percentile
+    rank = rank > 0 ? rank : 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += _buckets[i];
+        if (seen >= rank)
+        {
+            uint32_t upper = bucketUpper(i);
+            return upper < _max ? upper : _max;
+        }
+    }
+    return _max;
+}
+
+uint32_t LatencyHistogram::max()
+{
+    return _max;
+}
+
+unsigned long LatencyHistogram::count()
+{
+    return _count;
+}
+
+uint64_t LatencyHistogram::sum()
+{
+    return _sum;
+}
+
+uint32_t LatencyHistogram::mean()
+{
+    return _count > 0 ? _sum / _count : 0;
+}
+
+// The linear range, then per power of two its top bits below the leading one
+uint8_t LatencyHistogram::bucket(uint32_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return value;
+    }
+    if (value > LATENCY_MAX_VALUE)
+    {
+        return LATENCY_BUCKETS - 1;
+    }
+    uint8_t magnitude = 31 - __builtin_clz(value); // >= LATENCY_SUB_BITS
+    uint8_t shift = magnitude - LATENCY_SUB_BITS;
+    return SUB_BUCKETS * (shift + 1) + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint32_t LatencyHistogram::bucketUpper(uint8_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    uint8_t shift = bucket / SUB_BUCKETS - 1;
+    uint32_t lower = (uint32_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + (1UL << shift) - 1;
+}
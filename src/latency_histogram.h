@@ -0,0 +1,42 @@
+#ifndef latency_histogram_h
+#define latency_histogram_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LATENCY_SUB_BITS 2                                                     // 4 buckets per power of two
+#define LATENCY_MAGNITUDES 20                                                  // powers of two above the linear range
+#define LATENCY_BUCKETS ((1 << LATENCY_SUB_BITS) * (LATENCY_MAGNITUDES + 1))   // 84 buckets, 168 bytes
+#define LATENCY_MAX_VALUE ((1UL << (LATENCY_SUB_BITS + LATENCY_MAGNITUDES)) - 1) // µs, larger values go to the last bucket
+
+// Durations in µs, log-linear as in HdrHistogram: values below 4 have a
+// bucket each, above that every power of two is split into 4 buckets, so a
+// bucket is at most 25% wide from 4 µs to 4.2 s. The memory is fixed.
+//
+// Percentiles are the upper bound of their bucket. When a bucket reaches
+// 65535, all buckets are halved, so the percentiles follow the recent
+// values. count(), sum() and max() are kept exactly and never decay.
+class LatencyHistogram
+{
+public:
+    void record(uint32_t value);
+    void reset();
+
+    uint32_t percentile(uint16_t permille); // e.g. 990 for p99, 0 without values
+    uint32_t max();
+    unsigned long count();
+    uint64_t sum();
+    uint32_t mean();
+
+    static uint8_t bucket(uint32_t value);
+    static uint32_t bucketUpper(uint8_t bucket);
+
+private:
+    uint16_t _buckets[LATENCY_BUCKETS] = {};
+    uint32_t _bucketTotal = 0; // of the (halved) buckets
+    unsigned long _count = 0;
+    uint64_t _sum = 0;
+    uint32_t _max = 0;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "littlefs_storage.h"
+
+LittleFSStorage::LittleFSStorage(const char *prefix) : _prefix(prefix)
+{
+}
+
+size_t LittleFSStorage::size(uint8_t segment)
+{
+    char name[32];
+    path(segment, name, sizeof(name));
+    File file = LittleFS.open(name, "r");
+    if (!file)
+    {
+        return 0;
+    }
+    size_t size = file.size();
+    file.close();
+    return size;
+}
+
+size_t LittleFSStorage::read(uint8_t segment, size_t offset, uint8_t *data, size_t length)
+{
+    if (segment != _readerSegment)
+    {
+        char name[32];
+        closeReader();
+        path(segment, name, sizeof(name));
+        _reader = LittleFS.open(name, "r");
+        if (!_reader)
+        {
+            return 0;
+        }
+        _readerSegment = segment;
+    }
+
+    if (!_reader.seek(offset))
+    {
+        return 0;
+    }
+    return _reader.read(data, length);
+}
+
+bool LittleFSStorage::append(uint8_t segment, const uint8_t *data, size_t length)
+{
+    char name[32];
+    if (segment == _readerSegment)
+    {
+        closeReader();
+    }
+    path(segment, name, sizeof(name));
+    File file = LittleFS.open(name, "a");
+    if (!file)
+    {
+        return false;
+    }
+    size_t written = file.write(data, length);
+    file.close();
+    return written == length;
+}
+
+bool LittleFSStorage::erase(uint8_t segment)
+{
+    char name[32];
+    if (segment == _readerSegment)
+    {
+        closeReader();
+    }
+    path(segment, name, sizeof(name));
+    return !LittleFS.exists(name) || LittleFS.remove(name);
+}
+
+void LittleFSStorage::path(uint8_t segment, char *out, size_t size)
+{
+    snprintf(out, size, "%s%u", _prefix, segment);
+}
+
+void LittleFSStorage::closeReader()
+{
+    if (_readerSegment != 0xFF)
+    {
+        _reader.close();
+        _readerSegment = 0xFF;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef littlefs_storage_h
+#define littlefs_storage_h
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "telemetry_log.h"
+
+// Log segments as files <prefix><segment> on LittleFS. LittleFS makes each
+// append atomic (copy on write), a reset never leaves half a page behind.
+class LittleFSStorage : public LogStorage
+{
+public:
+    LittleFSStorage(const char *prefix);
+
+    size_t size(uint8_t segment) override;
+    size_t read(uint8_t segment, size_t offset, uint8_t *data, size_t length) override;
+    bool append(uint8_t segment, const uint8_t *data, size_t length) override;
+    bool erase(uint8_t segment) override;
+
+private:
+    void path(uint8_t segment, char *out, size_t size);
+    void closeReader();
+
+    const char *_prefix;
+    File _reader; // kept open between reads of the same segment
+    uint8_t _readerSegment = 0xFF;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#include "loop_timing.h"
+
+// Order of enum TimingProbe
+static const char *PROBE_NAMES[TIMING_PROBES] = {"button", "web", "display", "debug", "ntp", "mqtt", "publish"};
+
+LoopTiming::LoopTiming(Clock clock, uint32_t ticksPerUs)
+{
+    _clock = clock;
+    _ticksPerUs = ticksPerUs > 0 ? ticksPerUs : 1;
+}
+
+unsigned long LoopTiming::start()
+{
+    return _clock();
+}
+
+void LoopTiming::stop(uint8_t probe, unsigned long start)
+{
+    if (probe < TIMING_PROBES)
+    {
+        _histograms[probe].record((uint32_t)((uint32_t)_clock() - (uint32_t)start) / _ticksPerUs);
+    }
+}
+
+LatencyHistogram &LoopTiming::histogram(uint8_t probe)
+{
+    return _histograms[probe < TIMING_PROBES ? probe : 0];
+}
+
+const char *LoopTiming::name(uint8_t probe)
+{
+    return probe < TIMING_PROBES ? PROBE_NAMES[probe] : "";
+}
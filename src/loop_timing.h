@@ -0,0 +1,63 @@
+#ifndef loop_timing_h
+#define loop_timing_h
+
+#include <stdint.h>
+#include "latency_histogram.h"
+
+// Calls in loop() whose durations are recorded
+enum TimingProbe : uint8_t
+{
+    TIMING_BUTTON,  // handleButton()
+    TIMING_WEB,     // server.handleClient()
+    TIMING_DISPLAY, // handleDisplay()
+    TIMING_DEBUG,   // Debug.handle()
+    TIMING_NTP,     // timeClient.updateAsync()
+    TIMING_MQTT,    // client.loop()
+    TIMING_PUBLISH, // MQTT publish of status, pose, hazards and sessions
+    TIMING_PROBES
+};
+
+// A histogram of durations per probe. The clock is a free running counter
+// (the CPU cycle counter on the device), durations are converted to µs on
+// stop, so the counter may wrap between start and stop.
+class LoopTiming
+{
+public:
+    typedef unsigned long (*Clock)();
+
+    LoopTiming(Clock clock, uint32_t ticksPerUs);
+
+    unsigned long start();
+    void stop(uint8_t probe, unsigned long start);
+
+    LatencyHistogram &histogram(uint8_t probe);
+    static const char *name(uint8_t probe);
+
+private:
+    Clock _clock;
+    uint32_t _ticksPerUs;
+    LatencyHistogram _histograms[TIMING_PROBES];
+};
+
+// Records the time until the end of the scope
+class TimingScope
+{
+public:
+    TimingScope(LoopTiming &timing, uint8_t probe) : _timing(timing), _probe(probe), _start(timing.start()) {}
+    ~TimingScope() { _timing.stop(_probe, _start); }
+
+private:
+    LoopTiming &_timing;
+    uint8_t _probe;
+    unsigned long _start;
+};
+
+// Probes only exist with the build flag LOOP_TIMING, without it they are
+// compiled out completely
+#ifdef LOOP_TIMING
+#define TIMING_SCOPE(timing, probe) TimingScope timingScope(timing, probe)
+#else
+#define TIMING_SCOPE(timing, probe)
+#endif
+
+#endif
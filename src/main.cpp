@@ -13,8 +13,31 @@
 #include <Wire.h>
 #include <jled.h>
 #include <Ticker.h>
+#include <LittleFS.h>
 #include <settings.h> // Include my type definitions (must be in a separate file!)
 #include "screens.h"
+#include "roomba_oi.h"
+#include "oi_stream.h"
+#include "oi_packets.h"
+#include "command_queue.h"
+#include "oi_trace.h"
+#include "sensor_snapshot.h"
+#include "telemetry_history.h"
+#include "telemetry_rollup.h"
+#include "telemetry_log.h"
+#include "littlefs_storage.h"
+#include "history_query.h"
+#include "soc_estimator.h"
+#include "clean_session.h"
+#include "change_detector.h"
+#include "hazard_events.h"
+#include "odometry.h"
+#include "coverage_map.h"
+#include "clean_scheduler.h"
+#include "deadline_scheduler.h"
+#include "task_runtime.h"
+#include "loop_timing.h"
+#include "metrics_writer.h"
 
 // ++++++++++++++++++++++++++++++++++++++++
 //
@@ -48,31 +71,172 @@ const char COMPILE_DATE[] = __DATE__ " " __TIME__;
 const int PWMRANGE = 1023;
 
 // Constants - Sensor
-#define SENSORBYTES_LENGHT 10
+#define SENSORBYTES_LENGHT oiPacketSize(3) // sensor group 3
 unsigned long lastSensorStatusTime = 0;
-char sensorbytes[SENSORBYTES_LENGHT];
-boolean sensorbytesvalid = false;
-#define CHARGE_STATE (int)(sensorbytes[0])
-#define VOLTAGE (int)((sensorbytes[1] << 8) + sensorbytes[2])
-#define CURRENT (signed short int)((sensorbytes[3] << 8) + sensorbytes[4])
-#define TEMP (int)(sensorbytes[5])
-#define CHARGE (int)((sensorbytes[6] << 8) + sensorbytes[7])
-#define CAPACITY (int)((sensorbytes[8] << 8) + sensorbytes[9])
+unsigned long lastSensorStatusRequest = 0;
+boolean sensorStatusPending = false;
+uint8_t sensorbytes[SENSORBYTES_LENGHT];
+SensorSnapshot sensors; // decoded from sensorbytes when a status or stream frame arrived
+
+// Sensor query of the status page, see getWebSensorPackets()
+struct WebSensorQuery
+{
+  uint8_t packets[OI_QUERY_LIST_MAX];
+  uint8_t count = 0;
+  bool pending = false;
+  bool done = false;
+  bool success = false;
+  uint8_t data[OI_RX_MAX];
+  uint8_t length = 0;
+  unsigned long time = 0; // of the response
+};
+WebSensorQuery webQuery;
+
+// Constants - Telemetry history
+const long INTERVAL_HISTORY_SAMPLE = 1000;
+unsigned long lastHistorySampleTime = 0;
+unsigned long lastHistorySensorTime = 0;
+
+// Constants - OI Stream
+const uint8_t OI_STREAM_PACKETS[] = {7, 8, 9, 10, 11, 12, 13, 14, 15, 19, 20, 21, 22, 23, 24, 25, 26, 34, 35, 43, 44, 45}; // packets in stream mode (hazards, distance/angle, sensor group 3, charging sources, OI mode, encoders and light bumper)
+const int OI_STREAM_TIMEOUT = 1000;                                    // stream is lost if no valid frame arrived
+const int OI_STREAM_RESTART_INTERVAL = 5000;                           // interval to restart a lost stream
+const uint8_t OI_CHARGING_SOURCE_HOME_BASE = 0x02;                     // bit of packet 34
+uint8_t chargingSources = 0; // packet 34, only known with the stream
+unsigned long lastStreamFrameTime = 0;
+unsigned long lastStreamFrames = 0;
+unsigned long lastStreamErrors = 0;
+unsigned int streamFramesPerSecond = 0;
+unsigned int streamErrorsPerSecond = 0;
 
 // Constants - Intervals (all in ms)
 const int LED_FANCY_DURATION = 50; // interval at which to blink (milliseconds)
 const int LED_WEB_MIN_TIME = 300;  // interval at which to blink (milliseconds)
 const int TIME_BUTTON_LONGPRESS = 10000;
+const int TIME_BUTTON_DEBOUNCE = 50; // state changes within this time after a change are bouncing
 const long INTERVAL_SENSOR_STATUS = 1000;
 const int STATE_PUBLISH_INTERVAL = 5000;
 const int MQTT_RECONNECT_INTERVAL = 2000;
 const int DISPLAY_UPDATE_INTERVAL = 200;
 const int DISPLAY_TIMEOUT = 4000; // time after display will go offs
+const int CMD_STATUS_DELAY = 2000; // delay status message after a command
+const int WEB_QUERY_REFRESH = 1;    // s between reloads of a page waiting for a Roomba response
+const int WEB_QUERY_MAX_AGE = 5000; // a stored response answers the reloads of its page for this long
+const int CMD_COALESCE_WINDOW = 1000;    // same command again within this time is dropped
+const int CMD_CONDITION_TIMEOUT = 10000; // max. time a command waits for its condition
+const int HEAP_SAMPLE_INTERVAL = 1000;   // free heap between the loop tasks, no request being handled
+
+// Constants - Soft time budgets of the loop tasks (µs)
+const unsigned long TASK_BUDGET_TIMERS = 2000;
+const unsigned long TASK_BUDGET_OI = 3000;
+const unsigned long TASK_BUDGET_LED = 500;
+const unsigned long TASK_BUDGET_BUTTON = 500;
+const unsigned long TASK_BUDGET_WEB = 20000;     // a page is built in one slice
+const unsigned long TASK_BUDGET_DISPLAY = 30000; // a full frame over I2C
+const unsigned long TASK_BUDGET_DEBUG = 2000;
+const unsigned long TASK_BUDGET_NTP = 2000;
+const unsigned long TASK_BUDGET_MQTT = 5000;
 
 // Constants - MQTT
 const char MQTT_SUBSCRIBE_CMD_TOPIC1[] = "%s/cmd";               // Subscribe patter without hostname
 const char MQTT_SUBSCRIBE_CMD_TOPIC2[] = "%s%s/cmd";             // Subscribe patter with hostname
 const char MQTT_PUBLISH_STATUS_TOPIC[] = "%s%s/status";          // Public pattern for status (normal and LWT) with hostname
+const char MQTT_PUBLISH_PACKETS_TOPIC[] = "%s%s/packets";        // Public pattern for sensor packets requested by a command
+const char MQTT_PUBLISH_SESSION_TOPIC[] = "%s%s/session";        // Public pattern for ended cleaning sessions
+const char MQTT_PUBLISH_EVENTS_TOPIC[] = "%s%s/events";          // Public pattern for batches of hazard events
+const char MQTT_PUBLISH_POSE_TOPIC[] = "%s%s/pose";              // Public pattern for the odometry pose while the Roomba moves
+const int MQTT_POSE_INTERVAL = 1000;                            // min. time between pose messages
+const int MQTT_CHANGE_MIN_INTERVAL = 1000;                      // min. time between status messages sent for a change
+#ifdef LOOP_TIMING
+const char MQTT_PUBLISH_TIMING_TOPIC[] = "%s%s/timing";          // Public pattern for the loop timing percentiles
+const unsigned long MQTT_TIMING_INTERVAL = 60000;               // time between timing messages
+#endif
+
+const uint16_t MQTT_BUFFER_SIZE = 768;                          // PubSubClient buffer for a whole message, set in setup()
+const size_t MQTT_TOPIC_MAX = 2 * (sizeof(configData_t::mqtt_prefix) - 1) + 16; // both prefixes and the longest topic name
+const size_t MQTT_HEADER_MAX = 5 + 2;                           // fixed header and topic length
+
+// Members of the status message with the max. length of their serialized
+// value. The JSON document and the MQTT buffer are sized from this list, a
+// new member of the status message has to be added here.
+struct JsonMember
+{
+  const char *key;
+  uint8_t valueMax;
+};
+constexpr JsonMember STATUS_MEMBERS[] = {
+    {"cleaning", 5},
+    {"charging", 5},
+    {"trigger", 10},
+    {"note", 2 * (sizeof(configData_t::note) - 1) + 2}, // every character escaped
+    {"firmware", sizeof(FIRMWARE_VERSION) + 1},
+    {"wifi_rssi", 4},
+    {"cmd_queue", 3},
+    {"cmd_latency", 10},
+    {"cmd_latency_max", 10},
+    {"battery_mv", 5},
+    {"battery_ma", 6},
+    {"battery_mah", 5},
+    {"battery_capacity", 5},
+    {"battery_level", 5},
+    {"temperature", 4},
+    {"session", 10},
+    {"battery_mv_min_1h", 6},
+    {"battery_mv_max_1h", 6},
+    {"soc", 5},
+    {"soc_confidence", 3},
+    {"soc_capacity", 5},
+    {"changed", 16},
+    {"mqtt_sent", 10},
+    {"mqtt_suppressed", 10},
+};
+const size_t STATUS_MEMBER_COUNT = sizeof(STATUS_MEMBERS) / sizeof(*STATUS_MEMBERS);
+
+// Longest serialized object of the members: "key":value, each within braces
+constexpr size_t jsonObjectLength(const JsonMember *members, size_t count)
+{
+  size_t length = 1;
+  for (size_t i = 0; i < count; i++)
+  {
+    const char *key = members[i].key;
+    while (*key++)
+    {
+      length++;
+    }
+    length += 4 + members[i].valueMax;
+  }
+  return length;
+}
+const size_t STATUS_PAYLOAD_MAX = jsonObjectLength(STATUS_MEMBERS, STATUS_MEMBER_COUNT);
+const size_t STATUS_JSON_SIZE = JSON_OBJECT_SIZE(STATUS_MEMBER_COUNT) + sizeof(configData_t::note) + 16; // copies of the note and the trigger
+static_assert(MQTT_HEADER_MAX + MQTT_TOPIC_MAX + STATUS_PAYLOAD_MAX <= MQTT_BUFFER_SIZE, "The status message doesn't fit into the MQTT buffer");
+
+// Status fields that trigger a status message when they change by at least the deadband
+enum StatusField : uint8_t
+{
+  STATUS_VALID,
+  STATUS_CLEANING,
+  STATUS_CHARGING,
+  STATUS_CHARGING_STATE,
+  STATUS_SESSION,
+  STATUS_VOLTAGE,
+  STATUS_CURRENT,
+  STATUS_TEMPERATURE,
+  STATUS_CHARGE,
+  STATUS_SOC
+};
+const ChangeField STATUS_FIELDS[] = {
+    {"valid", 0},
+    {"cleaning", 0},
+    {"charging", 0},
+    {"charging_state", 0},
+    {"session", 0},
+    {"battery_mv", 50, 10000},  // averaged like the current, the voltage sags with it
+    {"battery_ma", 100, 10000}, // averaged, single stream samples are +/-100 mA apart while cleaning
+    {"temperature", 1},
+    {"battery_mah", 20},
+    {"soc", 10}, // permille
+};
 const char MQTT_LWT_MESSAGE[] = "{\"device\":\"disconnected\"}"; // LWT message
 const char MQTT_DEFAULT_PREFIX[] = "roombaesp";                  // Default MQTT topic prefix
 
@@ -102,8 +266,10 @@ enum class RoombaCMDs
 enum class StatusTrigger
 {
   PERIODIC,
+  CHANGE,
   WEB,
   MQTT,
+  SCHEDULE,
   NONE // Triggers no update
 };
 
@@ -121,8 +287,40 @@ NTPClient timeClient(ntpUDP, "europe.pool.ntp.org", 3600, 60000);
 WiFiClient espClient;
 PubSubClient client(espClient);
 U8G2_SSD1306_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/U8X8_PIN_NONE, /* clock=*/D6, /* data=*/D5); // pin remapping with ESP8266 HW I2C
-Screens screen(u8g2, SCREEN_COUNT, DISPLAY_UPDATE_INTERVAL, DISPLAY_TIMEOUT);
+DeadlineScheduler scheduler;
+TaskRuntime runtime(micros);
+#ifdef LOOP_TIMING
+LoopTiming loopTiming([]() -> unsigned long
+                      { return ESP.getCycleCount(); },
+                      F_CPU / 1000000);
+#endif
+Screens screen(u8g2, scheduler, SCREEN_COUNT, DISPLAY_UPDATE_INTERVAL, DISPLAY_TIMEOUT);
 Ticker ledTicker;
+RoombaOI oi(Serial, PIN_BRC);
+OIStreamParser oiStream;
+OITrace oiTrace;
+TelemetryHistory telemetryHistory;
+TelemetryRollup telemetryRollup;
+LittleFSStorage logStorage("/tlog");
+TelemetryLog telemetryLog(logStorage);
+HistoryQuery historyQuery(telemetryHistory, telemetryRollup, telemetryLog);
+SocEstimator socEstimator;
+SessionDetector sessionDetector;
+HazardDetector hazardDetector;
+Odometry odometry;
+unsigned long lastPosePublishTime = 0;
+uint32_t lastPoseTravel = 0; // mm
+CoverageMap coverageMap;
+CleanScheduler cleanScheduler;
+unsigned long scheduleSkipped = 0; // scheduled cleans not started
+ChangeDetector statusChanges(STATUS_FIELDS, sizeof(STATUS_FIELDS) / sizeof(*STATUS_FIELDS));
+unsigned long lastStatusPublishTime = 0;
+unsigned long statusPublishes[(int)StatusTrigger::NONE] = {}; // successful, by trigger
+unsigned long mqttConnects = 0;          // successful connects to the broker
+unsigned long mqttConnectFailures = 0;   // failed attempts
+unsigned long metricsScrapes = 0;        // requests of /metrics
+unsigned long lastMetricsScrapeTime = 0; // µs the last request took
+CommandQueue commandQueue(CMD_COALESCE_WINDOW, CMD_CONDITION_TIMEOUT);
 auto led = JLed(PIN_LED_WIFI);
 
 // ++++++++++++++++++++++++++++++++++++++++
@@ -135,14 +333,12 @@ auto led = JLed(PIN_LED_WIFI);
 uint8_t cfgStart = 0;         // Start address in EEPROM for structure 'cfg'
 configData_t cfg;             // Instance 'cfg' is a global variable with 'configData_t' structure now
 bool configIsDefault = false; // true if no valid config found in eeprom and defaults settings loaded
-const int CURRENT_CONFIG_VERSION = 2;
+const int CURRENT_CONFIG_VERSION = 4;
 
 // Variables will change
 int wifiledState = HIGH;
-unsigned long lastLEDTime = 0;              // will store last time LED was updated
 unsigned long lastButtonTimer = 0;          // will store how long button was pressed
-unsigned long mqttLastReconnectAttempt = 0; // will store last time reconnect to mqtt broker
-unsigned long nextPublishTime = 0;          // will store last publish time
+unsigned long lastButtonChange = 0;         // will store last time the button state changed
 unsigned long lastDisplayUpdate = 0;        // will store last display update
 char mqtt_prefix[50];                       // prefix fpr mqtt topic
 bool previousButtonState = 1;               // will store last Button state. 1 = unpressed, 0 = pressed
@@ -153,6 +349,19 @@ bool displayPowerSaving = true;
 bool stopLEDupdate = false;
 int ledBrightness = PWMRANGE;
 
+// Tasks of the scheduler
+uint8_t ledOffTask = DEADLINE_NONE;
+uint8_t streamRestartTask = DEADLINE_NONE;
+uint8_t streamRateTask = DEADLINE_NONE;
+uint8_t mqttReconnectTask = DEADLINE_NONE;
+uint8_t heartbeatTask = DEADLINE_NONE;
+uint8_t heapTask = DEADLINE_NONE;
+uint32_t idleFreeHeap = 0;
+uint32_t idleFreeHeapMin = 0;
+#ifdef LOOP_TIMING
+uint8_t timingTask = DEADLINE_NONE;
+#endif
+
 // buffers
 String html;
 char buff[255];
@@ -161,7 +370,8 @@ char lastClean[50] = "---"; // will store last Clean
 // function prototype
 void HTMLHeader(const char *section, unsigned int refresh = 0, const char *url = "/");
 void MQTTpublishStatus(StatusTrigger statusTrigger);
-unsigned int getSensorStatus(bool force = false);
+bool getSensorStatus(bool force = false, StatusTrigger statusTrigger = StatusTrigger::NONE);
+void onSensors(unsigned long ms);
 
 // ++++++++++++++++++++++++++++++++++++++++
 //
@@ -178,14 +388,6 @@ WiFiEventHandler mDisConnectHandler;
 //
 // ++++++++++++++++++++++++++++++++++++++++
 
-void clearSerialBuffer()
-{
-  while (Serial.available())
-  {
-    Serial.read();
-  }
-}
-
 void saveConfig()
 {
   EEPROM.begin(512);
@@ -209,7 +411,12 @@ void eraseConfig()
 
 void handleButton()
 {
+  TIMING_SCOPE(loopTiming, TIMING_BUTTON);
   bool inp = digitalRead(PIN_BUTTON);
+  if (inp != previousButtonState && (millis() - lastButtonChange) < TIME_BUTTON_DEBOUNCE)
+  {
+    return; // bouncing, ignore it without blocking the loop
+  }
   if (inp == 0)
   {
     if (inp != previousButtonState)
@@ -223,161 +430,506 @@ void handleButton()
     {
       debugA("Button pressed long\n");
       eraseConfig();
+      telemetryLog.flush();
       ESP.reset();
     }
-
-    // Delay a little bit to avoid bouncing
-    delay(50);
+  }
+  if (inp != previousButtonState)
+  {
+    lastButtonChange = millis();
   }
   previousButtonState = inp;
 }
 
-void roombaCmd(RoombaCMDs cmd, StatusTrigger statusTrigger = StatusTrigger::NONE)
+String oiModeString()
+{
+  switch (oi.mode())
+  {
+  case OIMode::OFF:
+    return "Off";
+  case OIMode::PASSIVE:
+    return "Passive";
+  case OIMode::SAFE:
+    return "Safe";
+  case OIMode::FULL:
+    return "Full";
+  default:
+    return "Unknown";
+  }
+}
+
+// Queue a command, it is executed by commandQueue.loop(). With a statusTrigger
+// a status message is published a while after the command was executed.
+void roombaCmd(RoombaCMDs cmd, StatusTrigger statusTrigger = StatusTrigger::NONE, CommandQueue::Condition condition = CommandQueue::Condition::NONE)
+{
+  if (!commandQueue.push((uint8_t)cmd, (uint8_t)statusTrigger, (statusTrigger != StatusTrigger::NONE ? CMD_STATUS_DELAY : 0), condition))
+  {
+    rdebugA("Command queue full\n");
+  }
+}
+
+void executeRoombaCmd(RoombaCMDs cmd)
 {
 
   switch (cmd)
   {
   case RoombaCMDs::RMB_WAKE:
     rdebugA("%s\n", "Send RMB_WAKE to RMB");
-    digitalWrite(PIN_BRC, HIGH);
-    delay(50);
-    digitalWrite(PIN_BRC, LOW);
-    delay(50);
-    digitalWrite(PIN_BRC, HIGH);
-    delay(50);
-    digitalWrite(PIN_BRC, LOW);
-    delay(50);
+    oi.wake();
     break;
 
   case RoombaCMDs::RMB_START:
     rdebugA("%s\n", "Send RMB_START to RMB");
-    Serial.write(128); // Start
-    delay(50);
+    oi.start();
     break;
 
   case RoombaCMDs::RMB_STOP:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
     rdebugA("%s\n", "Send RMB_STOP to RMB");
-    Serial.write(173); // Stop
+    oi.command(173, true, false); // Stop
     break;
 
   case RoombaCMDs::RMB_CLEAN:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_CLEAN to RMB");
-    Serial.write(135); // Clean
+    oi.command(135); // Clean
     break;
 
   case RoombaCMDs::RMB_MAX:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_MAX to RMB");
-    Serial.write(136); // Max
+    oi.command(136); // Max
     break;
 
   case RoombaCMDs::RMB_SPOT:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_SPOT to RMB");
-    Serial.write(134); // Spot
+    oi.command(134); // Spot
     break;
 
   case RoombaCMDs::RMB_DOCK:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_DOCK to RMB");
-    Serial.write(143); // Seek Dock
+    oi.command(143); // Seek Dock
     break;
 
   case RoombaCMDs::RMB_POWER:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_POWER to RMB");
-    Serial.write(133); // powers down Roomba
+    oi.command(133); // powers down Roomba
     break;
 
   case RoombaCMDs::RMB_RESET:
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
     rdebugA("%s\n", "Send RMB_POWER to RMB");
-    Serial.write(7); // resets down Roomba
+    oi.command(7); // resets down Roomba
     break;
   }
+}
+
+void onSensorStatus(bool success, const uint8_t *data, uint8_t length, StatusTrigger statusTrigger)
+{
+  rdebugA("Bytes to read: %i\n", length);
+
+  if (success)
+  {
+    memcpy(sensorbytes, data, SENSORBYTES_LENGHT);
+    lastSensorStatusTime = millis();
+    rdebugA("Successful read sensor status\n");
+    sensors = SensorSnapshot::fromGroup3(sensorbytes);
+    onSensors(lastSensorStatusTime);
+  }
+  else
+  {
+    rdebugA("Error read sensor status. To less or many bytes. Expecting %d\n", SENSORBYTES_LENGHT);
+    oiTrace.mark(micros(), "sensor status failed");
+    sensors = SensorSnapshot();
+  }
+
+  /*
+  rdebugA("CHARGE_STATE: %i\n", sensors.chargingState);
+  rdebugA("VOLTAGE: %i\n", sensors.voltage);
+  rdebugA("CURRENT: %i\n", sensors.current);
+  rdebugA("TEMP: %i\n", sensors.temperature);
+  rdebugA("CHARGE: %i\n", sensors.charge);
+  rdebugA("CAPACITY: %i\n", sensors.capacity);*/
 
   if (statusTrigger != StatusTrigger::NONE)
   {
-    delay(2000); // delay status message directly after command
-    getSensorStatus(true);
     MQTTpublishStatus(statusTrigger);
   }
 }
 
-unsigned int getSensorStatus(bool force)
+bool isStreamActive()
 {
-  unsigned long lastSensorStatusDiff = (millis() - lastSensorStatusTime);
+  return cfg.oi_stream == 1 && lastStreamFrameTime != 0 && (millis() - lastStreamFrameTime) < OI_STREAM_TIMEOUT;
+}
 
-  if (force || lastSensorStatusDiff >= INTERVAL_SENSOR_STATUS || lastSensorStatusTime == 0)
+void onStreamPacket(uint8_t id, const uint8_t *data, uint8_t length)
+{
+  // Store the packet at its position in the sensor group 3 bytes
+  const OIGroupInfo &group = *oiGroup(3);
+  if (oiGroupContains(group, id))
   {
-    rdebugA("Get new sensor values\n");
-    uint8_t i = 0;
-    int8_t availabled = 0;
+    memcpy(sensorbytes + oiGroupOffset(group, id), data, length);
+  }
+  else if (id == OI_PACKET_OI_MODE)
+  {
+    oi.setMode((OIMode)data[0]);
+  }
+  else if (id == OI_PACKET_CHARGING_SOURCES)
+  {
+    chargingSources = data[0];
+  }
+  else
+  {
+    hazardDetector.setPacket(id, oiPacketValue(id, data));
+    odometry.setPacket(id, oiPacketValue(id, data));
+  }
+}
 
-    clearSerialBuffer();
+// Mark a hazard at the edge of the Roomba, angle relative to the heading in degrees
+void markHazard(CoverageMap::Layer layer, const Pose &pose, int16_t angle)
+{
+  uint32_t direction = pose.theta + (uint32_t)(int32_t)(angle * (int64_t)0x100000000 / 360);
+  coverageMap.mark(layer, pose.x + COVERAGE_FOOTPRINT * Odometry::cosQ15(direction) / 32768,
+                   pose.y + COVERAGE_FOOTPRINT * Odometry::sinQ15(direction) / 32768);
+}
 
-    yield();
+// Footprint while cleaning, bumps and cliffs at the pose of the odometry
+void updateCoverage()
+{
+  if (!odometry.valid())
+  {
+    return;
+  }
+  Pose pose = odometry.pose();
+  if (sensors.valid && sensors.cleaning)
+  {
+    coverageMap.sweep(pose.x, pose.y);
+  }
+
+  uint16_t hazards = hazardDetector.active();
+  const uint16_t bumps = 1 << HAZARD_BUMP_RIGHT | 1 << HAZARD_BUMP_LEFT;
+  if ((hazards & bumps) == bumps)
+  {
+    markHazard(CoverageMap::Layer::BUMPED, pose, 0);
+  }
+  else if (hazards & bumps)
+  {
+    markHazard(CoverageMap::Layer::BUMPED, pose, (hazards & 1 << HAZARD_BUMP_LEFT) ? 40 : -40);
+  }
+  const int16_t CLIFF_ANGLES[] = {60, 20, -20, -60}; // left, front left, front right, right
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    if (hazards & 1 << (HAZARD_CLIFF_LEFT + i))
+    {
+      markHazard(CoverageMap::Layer::CLIFF, pose, CLIFF_ANGLES[i]);
+    }
+  }
+}
 
-    roombaCmd(RoombaCMDs::RMB_WAKE);
-    roombaCmd(RoombaCMDs::RMB_START);
+void onStreamFrame()
+{
+  lastStreamFrameTime = millis();
+  lastSensorStatusTime = lastStreamFrameTime;
+  sensors = SensorSnapshot::fromGroup3(sensorbytes);
+  hazardDetector.update(lastStreamFrameTime);
+  odometry.update(lastStreamFrameTime);
+  updateCoverage();
+  onSensors(lastStreamFrameTime);
+}
 
-    Serial.write(142);
-    Serial.write(3);
-    delay(50);
+// Store the sensor values in the history at most once per second. Only values
+// which arrived since the last sample are stored, no request is sent for the
+// history: with the OI stream there is a sample every second, when polling
+// there are samples while something requests the status.
+void recordTelemetry()
+{
+  if (millis() - lastHistorySampleTime < INTERVAL_HISTORY_SAMPLE || !sensors.valid || lastSensorStatusTime == lastHistorySensorTime)
+  {
+    return;
+  }
+  lastHistorySampleTime = millis();
+  lastHistorySensorTime = lastSensorStatusTime;
+
+  TelemetrySample sample;
+  sample.time = timeClient.getEpochTime();
+  sample.voltage = sensors.voltage;
+  sample.current = sensors.current;
+  sample.temperature = sensors.temperature;
+  sample.charge = sensors.charge;
+  sample.chargingState = sensors.chargingState;
+  telemetryHistory.append(sample);
+  telemetryRollup.add(sample);
+}
 
-    availabled = Serial.available();
-    rdebugA("Bytes to read: %i\n", availabled);
+// Store closed rollup buckets in the telemetry log
+void logRollup(TelemetryRollup::Resolution resolution, const RollupPoint &point)
+{
+  uint8_t record[ROLLUP_RECORD_SIZE];
+  telemetryLog.append(LOG_ROLLUP, point.time, record, rollupEncode(resolution, point, record));
+}
 
-    yield();
+void setLastClean()
+{
+  unsigned long now = timeClient.getEpochTime();
+  timeClient.getFormattedDate(now).toCharArray(lastClean, sizeof(lastClean) / sizeof(*lastClean));
+  telemetryLog.event(LOG_EVENT_CLEAN, now);
+  telemetryLog.flush(); // keep it over a reboot
+}
 
-    if (availabled == SENSORBYTES_LENGHT)
+// Range of a metric over the last count rollup points (including the open one)
+bool telemetryRange(TelemetryRollup::Resolution resolution, uint16_t count, RollupMetric metric, int16_t &min, int16_t &max)
+{
+  RollupLevel &level = telemetryRollup.level(resolution);
+  RollupPoint point;
+  bool found = false;
+  for (uint16_t age = 0; age < count && level.point(age, point); age++)
+  {
+    if (point.samples == 0)
     {
-      while (Serial.available())
-      {
-        int c = Serial.read();
+      continue;
+    }
+    const RollupValue &value = point.values[(uint8_t)metric];
+    if (!found || value.min < min)
+    {
+      min = value.min;
+    }
+    if (!found || value.max > max)
+    {
+      max = value.max;
+    }
+    found = true;
+  }
+  return found;
+}
 
-        if (i < SENSORBYTES_LENGHT)
-        {
-          sensorbytes[i++] = c;
-        }
-      }
+void updateStatusChanges()
+{
+  statusChanges.set(STATUS_VALID, sensors.valid);
+  statusChanges.set(STATUS_CLEANING, sensors.valid && sensors.cleaning);
+  statusChanges.set(STATUS_CHARGING, sensors.valid && sensors.charging);
+  statusChanges.set(STATUS_CHARGING_STATE, sensors.chargingState);
+  statusChanges.set(STATUS_SESSION, (int32_t)sessionDetector.state());
+  statusChanges.set(STATUS_VOLTAGE, sensors.voltage);
+  statusChanges.set(STATUS_CURRENT, sensors.current);
+  statusChanges.set(STATUS_TEMPERATURE, sensors.temperature);
+  statusChanges.set(STATUS_CHARGE, sensors.charge);
+  statusChanges.set(STATUS_SOC, socEstimator.valid() ? socEstimator.level() : sensors.level);
+}
 
-      lastSensorStatusTime = millis();
-      rdebugA("Successful read sensor status\n");
-      sensorbytesvalid = true;
+// Everything that follows new sensor values
+void onSensors(unsigned long ms)
+{
+  socEstimator.update(ms, sensors);
+  bool homeBase = isStreamActive() && (chargingSources & OI_CHARGING_SOURCE_HOME_BASE);
+  sessionDetector.update(ms, timeClient.getEpochTime(), sensors, sensors.docked || homeBase, oi.mode(),
+                         socEstimator.valid() ? socEstimator.level() : sensors.level);
+  oi.setCharging(sensors.charging);
+  updateStatusChanges();
+  statusChanges.sample(ms);
+}
+
+// Session as JSON, levels in percent with one decimal
+size_t formatSession(char *out, size_t size, const CleanSession &session)
+{
+  char startLevel[8];
+  char endLevel[8];
+  formatDecimal(startLevel, sizeof(startLevel), session.startLevel, 1);
+  formatDecimal(endLevel, sizeof(endLevel), session.endLevel, 1);
+  return snprintf(out, size, "{\"start\":%lu,\"duration\":%u,\"paused\":%u,\"pauses\":%u,\"used_mah\":%u,\"peak_ma\":%u,\"start_level\":%s,\"end_level\":%s,\"end\":\"%s\"}",
+                  (unsigned long)session.start, session.duration, session.paused, session.pauses, session.used, session.peakCurrent, startLevel, endLevel,
+                  SessionDetector::endName(session.reason));
+}
+
+void publishSession(const CleanSession &session)
+{
+  TIMING_SCOPE(loopTiming, TIMING_PUBLISH);
+  if (!client.connected())
+  {
+    return;
+  }
+  char payload[256];
+  size_t payloadSize = formatSession(payload, sizeof(payload), session);
+  snprintf(buff, sizeof(buff), MQTT_PUBLISH_SESSION_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
+  if (payloadSize >= sizeof(payload) || !client.publish(buff, (uint8_t *)payload, (unsigned int)payloadSize, false))
+  {
+    rdebugAln("Failed to publish session!");
+  }
+}
+
+// Hazard events as {"time":1700000000,"events":[[120,"bump_left",1],...]}, each
+// event with its age in ms at the time of the message. Publishes as many
+// events as fit into the MQTT buffer, the detector hands out the rest later.
+uint8_t publishHazards(const HazardEvent *events, uint8_t count)
+{
+  TIMING_SCOPE(loopTiming, TIMING_PUBLISH);
+  if (!client.connected())
+  {
+    return 0;
+  }
+  snprintf(buff, sizeof(buff), MQTT_PUBLISH_EVENTS_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
+  size_t payloadSize = client.getBufferSize() - strlen(buff) - 7; // MQTT fixed header and topic length
+  char payload[payloadSize];
+  unsigned long now = millis();
+  size_t length = snprintf(payload, payloadSize, "{\"time\":%lu,\"events\":[", (unsigned long)timeClient.getEpochTime());
+  uint8_t taken = 0;
+  while (taken < count)
+  {
+    const HazardEvent &event = events[taken];
+    size_t eventLength = snprintf(payload + length, payloadSize - length, "%s[%lu,\"%s\",%u]", taken > 0 ? "," : "", now - event.ms,
+                                  HazardDetector::name(event.hazard), event.on ? 1 : 0);
+    if (length + eventLength + 2 >= payloadSize)
+    {
+      break;
     }
-    else
+    length += eventLength;
+    taken++;
+  }
+  length += snprintf(payload + length, payloadSize - length, "]}");
+  if (taken == 0 || !client.publish(buff, (uint8_t *)payload, (unsigned int)length, false))
+  {
+    rdebugAln("Failed to publish hazard events!");
+    return 0;
+  }
+  return taken;
+}
+
+void publishPose()
+{
+  TIMING_SCOPE(loopTiming, TIMING_PUBLISH);
+  Pose pose = odometry.pose();
+  char heading[8];
+  char payload[128];
+  formatDecimal(heading, sizeof(heading), odometry.headingDecidegrees(), 1);
+  size_t payloadSize = snprintf(payload, sizeof(payload), "{\"x\":%ld,\"y\":%ld,\"theta\":%s,\"travel\":%lu}", (long)pose.x, (long)pose.y, heading,
+                                (unsigned long)odometry.travel());
+  snprintf(buff, sizeof(buff), MQTT_PUBLISH_POSE_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
+  if (!client.publish(buff, (uint8_t *)payload, (unsigned int)payloadSize, false))
+  {
+    rdebugAln("Failed to publish pose!");
+  }
+  lastPosePublishTime = millis();
+  lastPoseTravel = odometry.travel();
+}
+
+#ifdef LOOP_TIMING
+// Percentiles of the probes and the whole loop as [p50,p99,max] in µs
+void publishTiming()
+{
+  TIMING_SCOPE(loopTiming, TIMING_PUBLISH);
+  char payload[384];
+  LatencyHistogram &loops = runtime.loops();
+  size_t length = snprintf(payload, sizeof(payload), "{\"loop\":[%lu,%lu,%lu]", (unsigned long)loops.percentile(500), (unsigned long)loops.percentile(990),
+                           (unsigned long)loops.max());
+  for (uint8_t probe = 0; probe < TIMING_PROBES && length < sizeof(payload); probe++)
+  {
+    LatencyHistogram &histogram = loopTiming.histogram(probe);
+    length += snprintf(payload + length, sizeof(payload) - length, ",\"%s\":[%lu,%lu,%lu]", LoopTiming::name(probe),
+                       (unsigned long)histogram.percentile(500), (unsigned long)histogram.percentile(990), (unsigned long)histogram.max());
+  }
+  if (length < sizeof(payload) - 1)
+  {
+    payload[length++] = '}';
+  }
+  else
+  {
+    rdebugAln("Timing message too long!");
+    return;
+  }
+
+  snprintf(buff, sizeof(buff), MQTT_PUBLISH_TIMING_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
+  if (!client.beginPublish(buff, length, false) || client.write((const uint8_t *)payload, length) != length || !client.endPublish())
+  {
+    rdebugAln("Failed to publish timing!");
+  }
+}
+#endif
+
+// Estimated charging level ("74.2%"), with its error ("74.2% +/-3.1%"), the
+// Roomba's own level until the estimator has a sample
+void formatSoc(char *out, size_t size, const char *errorPrefix)
+{
+  if (!socEstimator.valid())
+  {
+    sensors.formatLevel(out, size);
+    return;
+  }
+  size_t length = formatDecimal(out, size, socEstimator.level(), 1, "%");
+  if (errorPrefix != nullptr && length < size)
+  {
+    length += snprintf(out + length, size - length, "%s", errorPrefix);
+    if (length < size)
     {
-      clearSerialBuffer();
-      rdebugA("Error read sensor status. To less or many bytes. Expecting %d\n", SENSORBYTES_LENGHT);
-      sensorbytesvalid = false;
+      formatDecimal(out + length, size - length, socEstimator.error(), 1, "%");
     }
+  }
+}
 
-    yield();
+// Start the stream at boot and restart it when it is lost
+void restartStream()
+{
+  if (cfg.oi_stream == 1 && !isStreamActive())
+  {
+    rdebugA("Start OI stream\n");
+    oiStream.reset();
+    oi.startStream(OI_STREAM_PACKETS, sizeof(OI_STREAM_PACKETS));
+  }
+}
+
+void updateStreamRate()
+{
+  unsigned long errors = oiStream.checksumErrors() + oiStream.frameErrors();
+  streamFramesPerSecond = oiStream.frames() - lastStreamFrames;
+  streamErrorsPerSecond = errors - lastStreamErrors;
+  lastStreamFrames = oiStream.frames();
+  lastStreamErrors = errors;
+}
 
-    /*
-    rdebugA("CHARGE_STATE: %i\n", CHARGE_STATE);
-    rdebugA("VOLTAGE: %i\n", VOLTAGE);
-    rdebugA("CURRENT: %i\n", CURRENT);
-    rdebugA("TEMP: %i\n", TEMP);
-    rdebugA("CHARGE: %i\n", CHARGE);
-    rdebugA("CAPACITY: %i\n", CAPACITY);*/
-    return availabled;
+// Request new sensor values from the Roomba. Returns immediately, the values
+// are updated when the response arrives. If statusTrigger is set, a status
+// message is published as soon as the values are updated.
+bool getSensorStatus(bool force, StatusTrigger statusTrigger)
+{
+  unsigned long lastSensorStatusDiff = (millis() - lastSensorStatusRequest);
+
+  if (isStreamActive())
+  {
+    // Sensor values are never older than one stream frame
+    if (statusTrigger != StatusTrigger::NONE)
+    {
+      MQTTpublishStatus(statusTrigger);
+    }
+    return false;
+  }
+
+  if (sensorStatusPending && statusTrigger == StatusTrigger::NONE)
+  {
+    return false;
+  }
+
+  if (force || lastSensorStatusDiff >= INTERVAL_SENSOR_STATUS || lastSensorStatusRequest == 0)
+  {
+    rdebugA("Get new sensor values\n");
+    const uint8_t request[] = {142, 3}; // Sensors, group 3
+
+    // Periodic updates never wake up the Roomba, so it can go to sleep
+    if (oi.query(request, sizeof(request), SENSORBYTES_LENGHT, [statusTrigger](bool success, const uint8_t *data, uint8_t length)
+                 {
+                   sensorStatusPending = false;
+                   onSensorStatus(success, data, length, statusTrigger); },
+                 force))
+    {
+      lastSensorStatusRequest = millis();
+      sensorStatusPending = true;
+      return true;
+    }
+    rdebugA("Roomba request queue full\n");
   }
   else
   {
     rdebugA("Use cached sensor values (next refresh in %lums)\n", ((INTERVAL_SENSOR_STATUS - lastSensorStatusDiff)));
+    if (statusTrigger != StatusTrigger::NONE)
+    {
+      MQTTpublishStatus(statusTrigger);
+    }
   }
 
-  return 0;
+  return false;
 }
 
 void showWEBMQTTAction(bool isWebAction = true)
@@ -397,7 +949,7 @@ void showWEBMQTTAction(bool isWebAction = true)
   else
   {
     analogWrite(PIN_LED_WIFI, ledBrightness);
-    lastLEDTime = millis();
+    scheduler.after(ledOffTask, LED_WEB_MIN_TIME, millis());
   }
 
   // Log Access to telnet
@@ -413,103 +965,112 @@ void showWEBMQTTAction(bool isWebAction = true)
   }
 }
 
-bool getRoombaSensorPacket(int PacketID, int &result)
+// Parse a comma separated list of sensor packet IDs, e.g. "7,21,22".
+// Returns the number of IDs, 0 if the list is empty or invalid.
+uint8_t parsePacketList(String list, uint8_t *packets, uint8_t maxCount)
 {
+  uint8_t count = 0;
+  int start = 0;
 
-  int low = 0;
-  int high = 0;
-
-  clearSerialBuffer();
-
-  yield();
-
-  roombaCmd(RoombaCMDs::RMB_WAKE);
-  roombaCmd(RoombaCMDs::RMB_START);
-
-  Serial.write(142);
-  Serial.write(PacketID);
-  delay(50);
-
-  yield();
-
-  if (Serial.available() > 0)
+  list.trim();
+  if (list.length() == 0)
+  {
+    return 0;
+  }
+  while (true)
   {
-    rdebugA("Bytes to read: %i\n", Serial.available());
-    if (Serial.available() == 1)
+    int end = list.indexOf(',', start);
+    if (end < 0)
     {
-      sint8_t value = Serial.read();
-      rdebugA("Serial.read: %i\n", value);
-      rdebugA("Serial.read: %i\n", (signed int)value);
-      rdebugA("Serial.read: %i\n", (unsigned int)value);
-      rdebugA("Serial.read: %x\n", value);
-      rdebugA("Serial.read: %i\n", value);
-      rdebugA("Serial.read: %u\n", value);
-      rdebugA("Serial.read: %i\n", (signed int)value);
-      rdebugA("Serial.read: %u\n", (unsigned int)value);
-      rdebugA("Serial.read: %u\n", (signed int)value);
-      rdebugA("Serial.read: %u\n", (unsigned int)value);
-      result = value;
-      return true;
+      end = list.length();
     }
-    else if (Serial.available() == 2)
+
+    // Only digits, toInt() would take anything else as packet 0
+    String item = list.substring(start, end);
+    item.trim();
+    if (item.length() == 0 || item.length() > 3)
     {
-      high = Serial.read();
-      low = Serial.read();
-      rdebugA("Serial.read: %i (%i, %i)\n", (high * 256 + low), high, low);
-      rdebugA("Serial.read: %i, %i\n", lowByte(high * 256 + low), highByte(high * 256 + low));
-      rdebugA("Serial.read: %i\n", (signed int)(low + (high << 8)));
-      rdebugA("Serial.read: %i\n", (unsigned int)(low + (high << 8)));
-      result = (high * 256 + low);
-      return true;
+      return 0;
     }
-    else
+    for (unsigned int i = 0; i < item.length(); i++)
     {
-      while (Serial.available())
+      if (!isDigit(item[i]))
       {
-        rdebugA("%i\n", Serial.read());
+        return 0;
       }
     }
+    long packetID = item.toInt();
+    if (count >= maxCount || packetID > 255 || !oiIsPacket(packetID))
+    {
+      return 0;
+    }
+
+    packets[count++] = packetID;
+    if (end >= (int)list.length())
+    {
+      break;
+    }
+    start = end + 1;
   }
-  else
+
+  return count;
+}
+
+void decodePacketList(const uint8_t *packets, uint8_t count, const uint8_t *data, int32_t *values)
+{
+  for (uint8_t i = 0; i < count; i++)
   {
-    rdebugA("Es gibt nichts zu lesen! %s\n", "");
-    return false;
+    values[i] = oiPacketValue(packets[i], data);
+    data += oiPacketSize(packets[i]);
   }
-
-  return false;
 }
 
-bool isRoombaCleaning()
+// Read a list of sensor packets with one Query List request for the status
+// page. Nothing waits for the response: the page reloads until the stored
+// response of the same packets is there (like /wifiscan). Returns PENDING
+// until then, DONE or FAILED for a response of the last WEB_QUERY_MAX_AGE ms.
+OIFuture::State getWebSensorPackets(const uint8_t *packets, uint8_t count)
 {
-  getSensorStatus();
-  if (CHARGE_STATE == 1 || CHARGE_STATE == 2 || CHARGE_STATE == 3 || CHARGE_STATE == 5 || !sensorbytesvalid)
+  bool same = webQuery.count == count && memcmp(webQuery.packets, packets, count) == 0;
+  if (webQuery.pending)
   {
-    return false;
+    return OIFuture::State::PENDING; // a page with other packets queues its request after this one
   }
-  else
+  if (same && webQuery.done && (millis() - webQuery.time) < WEB_QUERY_MAX_AGE)
   {
-    if (CURRENT < -400)
-    {
-      return true;
-    }
-    else
-    {
-      return false;
-    }
+    return webQuery.success ? OIFuture::State::DONE : OIFuture::State::FAILED;
   }
+
+  memcpy(webQuery.packets, packets, count);
+  webQuery.count = count;
+  webQuery.done = false;
+  webQuery.pending = oi.queryList(packets, count, [](bool success, const uint8_t *data, uint8_t length)
+                                  {
+                                    rdebugA("Bytes to read: %i\n", length);
+                                    memcpy(webQuery.data, data, length);
+                                    webQuery.length = length;
+                                    webQuery.success = success;
+                                    webQuery.done = true;
+                                    webQuery.pending = false;
+                                    webQuery.time = millis(); });
+  if (!webQuery.pending)
+  {
+    rdebugA("Roomba request queue full\n");
+    return OIFuture::State::FAILED;
+  }
+  return OIFuture::State::PENDING;
+}
+
+bool isRoombaCleaning()
+{
+  getSensorStatus();
+  return sensors.valid && sensors.cleaning;
 }
 
 bool isRoombaCharging()
 {
   getSensorStatus();
-  if (sensorbytesvalid && (CHARGE_STATE == 1 || CHARGE_STATE == 2 || CHARGE_STATE == 3 || CHARGE_STATE == 5))
-  {
-    return true;
-  }
-  else
-  {
-    return false;
-  }
+  return sensors.valid && sensors.charging;
 }
 
 String getStatusTriggerString(StatusTrigger statusTrigger)
@@ -519,12 +1080,18 @@ String getStatusTriggerString(StatusTrigger statusTrigger)
   case StatusTrigger::PERIODIC:
     return "periodic";
     break;
+  case StatusTrigger::CHANGE:
+    return "change";
+    break;
   case StatusTrigger::WEB:
     return "web";
     break;
   case StatusTrigger::MQTT:
     return "mqtt";
     break;
+  case StatusTrigger::SCHEDULE:
+    return "schedule";
+    break;
   case StatusTrigger::NONE:
     return "none";
     break;
@@ -536,36 +1103,137 @@ String getStatusTriggerString(StatusTrigger statusTrigger)
 
 void MQTTpublishStatus(StatusTrigger statusTrigger)
 {
-  char jsonpretty[255];
+  TIMING_SCOPE(loopTiming, TIMING_PUBLISH);
   showWEBMQTTAction(false);
   rdebugA("Publish MQTT status message\n");
-  uint16_t mqtt_buffersize = client.getBufferSize();
 
-  char payload[mqtt_buffersize];
-  DynamicJsonDocument jsondoc(mqtt_buffersize);
+  char payload[STATUS_PAYLOAD_MAX + 1];
+  DynamicJsonDocument jsondoc(STATUS_JSON_SIZE);
 
-  // getSensorStatus(true);
-  jsondoc["cleaning"] = isRoombaCleaning();
-  jsondoc["charging"] = isRoombaCharging();
+  // Values of the last read, the callers publish when new values arrived
+  jsondoc["cleaning"] = sensors.valid && sensors.cleaning;
+  jsondoc["charging"] = sensors.valid && sensors.charging;
   jsondoc["trigger"] = getStatusTriggerString(statusTrigger);
+  int8_t changed = statusChanges.trigger();
+  if (statusTrigger == StatusTrigger::CHANGE && changed >= 0)
+  {
+    jsondoc["changed"] = statusChanges.name(changed);
+  }
   jsondoc["note"] = cfg.note;
   jsondoc["firmware"] = FIRMWARE_VERSION;
   jsondoc["wifi_rssi"] = WiFi.RSSI();
+  jsondoc["cmd_queue"] = commandQueue.depth();
+  jsondoc["cmd_latency"] = commandQueue.lastLatency();
+  jsondoc["cmd_latency_max"] = commandQueue.maxLatency();
+  char level[8]; // percent with one decimal, serialized as a JSON number without float
+  if (sensors.valid)
+  {
+    jsondoc["battery_mv"] = sensors.voltage;
+    jsondoc["battery_ma"] = sensors.current;
+    jsondoc["battery_mah"] = sensors.charge;
+    jsondoc["battery_capacity"] = sensors.capacity;
+    if (sensors.capacity > 0)
+    {
+      formatDecimal(level, sizeof(level), sensors.level, 1);
+      jsondoc["battery_level"] = serialized((const char *)level);
+    }
+    jsondoc["temperature"] = sensors.temperature;
+  }
+  jsondoc["session"] = SessionDetector::stateName(sessionDetector.state());
+  char soc[8];
+  if (socEstimator.valid())
+  {
+    formatDecimal(soc, sizeof(soc), socEstimator.level(), 1);
+    jsondoc["soc"] = serialized((const char *)soc);
+    jsondoc["soc_confidence"] = (socEstimator.confidence() + 5) / 10;
+    jsondoc["soc_capacity"] = socEstimator.capacity();
+  }
+  int16_t voltageMin;
+  int16_t voltageMax;
+  if (telemetryRange(TelemetryRollup::MINUTE, 60, RollupMetric::VOLTAGE, voltageMin, voltageMax))
+  {
+    jsondoc["battery_mv_min_1h"] = voltageMin;
+    jsondoc["battery_mv_max_1h"] = voltageMax;
+  }
+  unsigned long sent = 0;
+  for (unsigned long count : statusPublishes)
+  {
+    sent += count;
+  }
+  jsondoc["mqtt_sent"] = sent + 1; // including this message
+  jsondoc["mqtt_suppressed"] = statusChanges.suppressed();
 
+  if (jsondoc.overflowed())
+  {
+    rdebugAln("Status members missing, add them to STATUS_MEMBERS!");
+  }
   size_t payloadSize = serializeJson(jsondoc, payload, sizeof(payload));
-  serializeJsonPretty(jsondoc, jsonpretty, sizeof(jsonpretty));
 
   snprintf(buff, sizeof(buff), MQTT_PUBLISH_STATUS_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
 
-  rdebugA("Payload-/Buffersize: %i/%i bytes (%i%%)\n", payloadSize, mqtt_buffersize, (int)((100.00 / (double)mqtt_buffersize) * payloadSize));
-  rdebugA("Topic: %s\nMessage: %s\n", buff, jsonpretty);
+  rdebugA("Payload-/Buffersize: %i/%i bytes (%i%%)\n", payloadSize, (int)STATUS_PAYLOAD_MAX, (int)((100.00 / (double)STATUS_PAYLOAD_MAX) * payloadSize));
+  rdebugA("Topic: %s\nMessage: %s\n", buff, payload);
 
   if (!client.publish(buff, (uint8_t *)payload, (unsigned int)payloadSize, true))
   {
     rdebugAln("Failed to publish message!");
   }
+  else if (statusTrigger < StatusTrigger::NONE)
+  {
+    statusPublishes[(int)statusTrigger]++;
+  }
+
+  updateStatusChanges();
+  statusChanges.published();
+  lastStatusPublishTime = millis();
+  if (cfg.mqtt_periodic_update_interval > 0)
+  {
+    scheduler.after(heartbeatTask, cfg.mqtt_periodic_update_interval * 1000UL, millis()); // next heartbeat one interval after any status
+  }
+}
+
+// Read the sensor packets with one Query List request and publish the values when they arrive
+void MQTTpublishPackets(String list)
+{
+  struct PacketList
+  {
+    uint8_t packets[OI_QUERY_LIST_MAX];
+    uint8_t count;
+  } packetList;
 
-  nextPublishTime = millis() + (cfg.mqtt_periodic_update_interval * 1000);
+  packetList.count = parsePacketList(list, packetList.packets, OI_QUERY_LIST_MAX);
+  if (packetList.count == 0)
+  {
+    rdebugA("Invalid packet list: %s\n", list.c_str());
+    return;
+  }
+
+  oi.queryList(packetList.packets, packetList.count, [packetList](bool success, const uint8_t *data, uint8_t length)
+               {
+                 uint16_t mqtt_buffersize = client.getBufferSize();
+                 char payload[mqtt_buffersize];
+                 DynamicJsonDocument jsondoc(mqtt_buffersize);
+
+                 if (success)
+                 {
+                   int32_t values[OI_QUERY_LIST_MAX];
+                   decodePacketList(packetList.packets, packetList.count, data, values);
+                   for (uint8_t i = 0; i < packetList.count; i++)
+                   {
+                     jsondoc[oiPacket(packetList.packets[i]).name] = values[i];
+                   }
+                 }
+                 else
+                 {
+                   jsondoc["error"] = "no data";
+                 }
+
+                 size_t payloadSize = serializeJson(jsondoc, payload, sizeof(payload));
+                 snprintf(buff, sizeof(buff), MQTT_PUBLISH_PACKETS_TOPIC, mqtt_prefix, cfg.mqtt_prefix);
+                 if (!client.publish(buff, (uint8_t *)payload, (unsigned int)payloadSize, false))
+                 {
+                   rdebugAln("Failed to publish message!");
+                 } });
 }
 
 long RSSI2Quality(long dBm)
@@ -607,10 +1275,31 @@ void loadDefaults()
   cfg.mqtt_port = 1883;
   memcpy(cfg.mqtt_password, "", sizeof(cfg.mqtt_password) / sizeof(*cfg.mqtt_password));
   memcpy(cfg.mqtt_prefix, MQTT_DEFAULT_PREFIX, sizeof(cfg.mqtt_prefix) / sizeof(*cfg.mqtt_prefix));
-  cfg.mqtt_periodic_update_interval = 10;
+  cfg.mqtt_periodic_update_interval = 60;
 
   cfg.fancyled = 0;
   cfg.led_brightness = 50;
+
+  cfg.oi_stream = 0;
+
+  memset(cfg.schedule, 0, sizeof(cfg.schedule));
+  cfg.schedule_catchup = SCHEDULE_CATCH_UP;
+}
+
+// Keep settings of an older config version and load defaults for the settings added since then
+void migrateConfig()
+{
+  if (cfg.configisvalid < 3)
+  {
+    cfg.oi_stream = 0;
+  }
+  if (cfg.configisvalid < 4)
+  {
+    memset(cfg.schedule, 0, sizeof(cfg.schedule));
+    cfg.schedule_catchup = SCHEDULE_CATCH_UP;
+  }
+
+  cfg.configisvalid = CURRENT_CONFIG_VERSION;
 }
 
 void loadConfig()
@@ -619,7 +1308,12 @@ void loadConfig()
   EEPROM.get(cfgStart, cfg);
   EEPROM.end();
 
-  if (cfg.configisvalid != CURRENT_CONFIG_VERSION)
+  if (cfg.configisvalid >= 2 && cfg.configisvalid < CURRENT_CONFIG_VERSION)
+  {
+    migrateConfig();
+    configIsDefault = false; // Config from EEPROM
+  }
+  else if (cfg.configisvalid != CURRENT_CONFIG_VERSION)
   {
     loadDefaults();
   }
@@ -629,36 +1323,6 @@ void loadConfig()
   }
 }
 
-String chargeStateString()
-{
-  if (sensorbytesvalid)
-  {
-    switch (CHARGE_STATE)
-    {
-    case 0:
-      return "Not charging";
-      break;
-    case 1:
-      return "Reconditioning";
-      break;
-    case 2:
-      return "Full";
-      break;
-    case 3:
-      return "Trickle";
-      break;
-    case 4:
-      return "Waiting";
-      break;
-    case 5:
-      return "Fault Condition";
-      break;
-    }
-  }
-
-  return "Charging Unknown";
-}
-
 void HTMLHeader(const char *section, unsigned int refresh, const char *url)
 {
 
@@ -850,7 +1514,7 @@ void handleRoot()
   }
   html += "</td>\n</tr>\n";
   html += "<tr>\n<td>Cleaning State</td>\n<td>";
-  html += (sensorbytesvalid ? (isRoombaCleaning() ? "ON" : "OFF") : "---");
+  html += (sensors.valid ? (isRoombaCleaning() ? "ON" : "OFF") : "---");
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Last clean</td>\n<td>";
@@ -858,52 +1522,41 @@ void handleRoot()
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Dock</td>\n<td>";
-  html += (sensorbytesvalid ? (isRoombaCharging() ? "YES" : "NO") : "---");
+  html += (sensors.valid ? (sensors.docked ? "YES" : "NO") : "---");
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Charging State</td>\n<td>";
-  html += (sensorbytesvalid ? chargeStateString() : "---");
+  html += (sensors.valid ? sensors.chargingStateName() : "---");
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Voltage</td>\n<td>";
-  snprintf(buff, sizeof(buff), "%.2f V", ((float)VOLTAGE / 1000));
-  html += (sensorbytesvalid ? buff : "---");
+  sensors.formatVoltage(buff, sizeof(buff));
+  html += buff;
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Current</td>\n<td>";
-  snprintf(buff, sizeof(buff), "%d mA", CURRENT);
-  html += (sensorbytesvalid ? buff : "---");
+  sensors.formatCurrent(buff, sizeof(buff));
+  html += buff;
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Temperature</td>\n<td>";
-  snprintf(buff, sizeof(buff), "%d&deg;C", TEMP);
-  html += (sensorbytesvalid ? buff : "---");
+  sensors.formatTemperature(buff, sizeof(buff), "&deg;C");
+  html += buff;
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Charging level</td>\n<td>";
-  if (sensorbytesvalid && CAPACITY > 0 && CHARGE > 0)
-  {
-    snprintf(buff, sizeof(buff), "%.2f%%", (100 / (float)CAPACITY) * CHARGE);
-    html += buff;
-  }
-  else
-  {
-    html += "---";
-  }
+  formatSoc(buff, sizeof(buff), " &plusmn;");
+  html += buff;
+  html += "</td>\n</tr>\n";
+
+  html += "<tr>\n<td>Charging level (Roomba)</td>\n<td>";
+  sensors.formatLevel(buff, sizeof(buff));
+  html += buff;
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Battery capacity</td>\n<td>";
-  if (sensorbytesvalid)
-  {
-    html += CHARGE;
-    html += "/";
-    html += CAPACITY;
-    html += " mA";
-  }
-  else
-  {
-    html += "---";
-  }
+  sensors.formatCharge(buff, sizeof(buff));
+  html += buff;
   html += "</td>\n</tr>\n";
 
   html += "<tr>\n<td>Note</td>\n<td>";
@@ -977,6 +1630,7 @@ void handleSettings()
       // Disable Checkboxes first and update only when on is in form data because its a checkbox
       cfg.telnet = 0;
       cfg.fancyled = 0;
+      cfg.oi_stream = 0;
 
       for (uint8_t i = 0; i < server.args(); i++)
       {
@@ -1047,6 +1701,23 @@ void handleSettings()
         else if (server.argName(i) == "led_brightness")
         {
           cfg.led_brightness = value.toInt();
+        } // OI Stream
+        else if (server.argName(i) == "oi_stream")
+        {
+          cfg.oi_stream = 1;
+        } // Schedule
+        else if (server.argName(i) == "schedule_catchup")
+        {
+          cfg.schedule_catchup = value.toInt();
+        }
+        else if (server.argName(i).startsWith("schedule_"))
+        {
+          int rule = server.argName(i).substring(9).toInt();
+          if (rule >= 0 && rule < SCHEDULE_RULES && !CleanScheduler::parse(value.c_str(), cfg.schedule[rule]))
+          {
+            rdebugA("Invalid schedule rule %i: %s\n", rule, value.c_str());
+            memset(&cfg.schedule[rule], 0, sizeof(cfg.schedule[rule]));
+          }
         }
         saveandreboot = true;
       }
@@ -1138,10 +1809,10 @@ void handleSettings()
       html += cfg.mqtt_prefix;
       html += "'></td>\n</tr>\n";
 
-      html += "<tr>\n<td>\nMQTT periodic update interval:</td>\n";
+      html += "<tr>\n<td>\nMQTT heartbeat interval:</td>\n";
       html += "<td><input name='mqtt_periodic_update_interval' type='text' maxlength='5' autocapitalize='none' value='";
       html += cfg.mqtt_periodic_update_interval;
-      html += "'> (in sec. 0 to disable)</td>\n</tr>\n";
+      html += "'> (in sec. changes are sent at once, 0 to disable)</td>\n</tr>\n";
 
       html += "<tr>\n<td>\nEnable Telnet:</td>\n";
       html += "<td><input type='checkbox' name='telnet' ";
@@ -1153,6 +1824,27 @@ void handleSettings()
       html += (cfg.fancyled == 1 ? "checked" : "");
       html += "></td>\n</tr>\n";
 
+      html += "<tr>\n<td>\nEnable OI stream mode:</td>\n";
+      html += "<td><input type='checkbox' name='oi_stream' ";
+      html += (cfg.oi_stream == 1 ? "checked" : "");
+      html += "> (sensor values every 15ms)</td>\n</tr>\n";
+
+      char rule[SCHEDULE_TEXT_SIZE];
+      for (uint8_t i = 0; i < SCHEDULE_RULES; i++)
+      {
+        CleanScheduler::format(cfg.schedule[i], rule, sizeof(rule));
+        snprintf(buff, sizeof(buff), "<tr>\n<td>\nSchedule %u:</td>\n<td><input name='schedule_%u' type='text' maxlength='%u' autocapitalize='none' placeholder='%s' value='%s'>",
+                 i + 1, i, SCHEDULE_TEXT_SIZE - 1, (i == 0 ? "30 9 * * 1-5 clean" : ""), rule);
+        html += buff;
+        html += (i == 0 ? " (min hour * * weekdays clean|dock, 0 = Sunday)" : "");
+        html += "</td>\n</tr>\n";
+      }
+
+      html += "<tr>\n<td>\nSchedule catch-up:</td>\n";
+      html += "<td><input name='schedule_catchup' type='text' maxlength='5' autocapitalize='none' value='";
+      html += cfg.schedule_catchup;
+      html += "'> (in min. a slot missed by a reboot is run late, 0 to disable)</td>\n</tr>\n";
+
       html += "<tr>\n<td>LED brightness:</td>\n";
       html += "<td><select name='led_brightness'>";
       html += "<option value='5'";
@@ -1191,6 +1883,7 @@ void handleSettings()
     if (saveandreboot)
     {
       saveConfig();
+      telemetryLog.flush();
       ESP.reset();
     }
   }
@@ -1253,114 +1946,639 @@ void handleActions()
       }
     }
 
-    HTMLHeader("Switch Socket");
-    html += "<form method='POST' action='/actions'>";
-    html += "<input type='submit' name='action' value='Wake'>";
-    html += "<input type='submit' name='action' value='Start (OI)'>";
-    html += "<input type='submit' name='action' value='Stop (OI)'>";
-    html += "<br /><br />";
-    html += "<input type='submit' name='action' value='Toggle Clean'>";
-    html += "<input type='submit' name='action' value='Max'>";
-    html += "<input type='submit' name='action' value='Spot'>";
-    html += "<input type='submit' name='action' value='Dock'>";
-    html += "<br /><br />";
-    html += "<input type='submit' name='action' value='Power off'>";
-    html += "<input type='submit' name='action' value='Reset Roomba'>";
-    html += "</form>";
+    HTMLHeader("Switch Socket");
+    html += "<form method='POST' action='/actions'>";
+    html += "<input type='submit' name='action' value='Wake'>";
+    html += "<input type='submit' name='action' value='Start (OI)'>";
+    html += "<input type='submit' name='action' value='Stop (OI)'>";
+    html += "<br /><br />";
+    html += "<input type='submit' name='action' value='Toggle Clean'>";
+    html += "<input type='submit' name='action' value='Max'>";
+    html += "<input type='submit' name='action' value='Spot'>";
+    html += "<input type='submit' name='action' value='Dock'>";
+    html += "<br /><br />";
+    html += "<input type='submit' name='action' value='Power off'>";
+    html += "<input type='submit' name='action' value='Reset Roomba'>";
+    html += "</form>";
+
+    HTMLFooter();
+    server.send(200, "text/html", html);
+  }
+}
+
+void handleStatus()
+{
+  showWEBMQTTAction();
+
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
+  else
+  {
+
+    // The form shows the parsed packet list, never the raw argument
+    uint8_t packets[OI_QUERY_LIST_MAX];
+    uint8_t packetCount = parsePacketList(server.arg("packets"), packets, OI_QUERY_LIST_MAX);
+
+    // Sensor query of the page: a packet list, a single packet or sensor group 3
+    // (its packets have the layout of the group). The page reloads as GET
+    // request with the parsed query until the response is there.
+    const OIGroupInfo &group = *oiGroup(3);
+    uint8_t groupPackets[OI_QUERY_LIST_MAX];
+    uint8_t singlePacket[1];
+    const uint8_t *query = nullptr;
+    uint8_t queryCount = 0;
+    String reload = "/status?";
+    if (server.arg("packets") != "")
+    {
+      query = packets;
+      queryCount = packetCount;
+      reload += "packets=";
+      for (uint8_t i = 0; i < packetCount; i++)
+      {
+        reload += (i > 0 ? "," : "");
+        reload += packets[i];
+      }
+    }
+    else if (server.hasArg("sensorgroup"))
+    {
+      for (uint8_t id = group.first; id <= group.last; id++)
+      {
+        groupPackets[queryCount++] = id;
+      }
+      query = groupPackets;
+      reload += "sensorgroup=1";
+    }
+    else if (server.arg("singlesensorid") != "")
+    {
+      rdebugA("PackedID: %s\n", server.arg("singlesensorid").c_str());
+      query = singlePacket;
+      queryCount = parsePacketList(server.arg("singlesensorid"), singlePacket, 1);
+      reload += "singlesensorid=";
+      reload += queryCount > 0 ? singlePacket[0] : 0;
+    }
+    OIFuture::State queryState = queryCount > 0 ? getWebSensorPackets(query, queryCount) : OIFuture::State::IDLE;
+    if (queryState == OIFuture::State::PENDING)
+    {
+      HTMLHeader("Status", WEB_QUERY_REFRESH, reload.c_str());
+      html += "Reading sensors...\n";
+      HTMLFooter();
+      server.send(200, "text/html", html);
+      return;
+    }
+
+    HTMLHeader("Status");
+    html += "<form method='POST' action='/status'><br />";
+    html += "<input type='text' name='singlesensorid' value=''>";
+    html += "<input type='submit' name='singlesensor' value='Single Sensor'>";
+    html += "<input type='submit' name='sensorgroup' value='Sensor Group 3'>";
+    html += "<br /><input type='text' name='packets' value='";
+    for (uint8_t i = 0; i < packetCount; i++)
+    {
+      snprintf(buff, sizeof(buff), "%s%u", i > 0 ? "," : "", packets[i]);
+      html += buff;
+    }
+    html += "' placeholder='7,21,22,23,25,26'>";
+    html += "<input type='submit' name='querylist' value='Query List'>";
+
+    html += "<br /><br /><b>OI mode:</b> ";
+    html += oiModeString();
+    html += (oi.asleep() ? " (asleep)" : " (awake)");
+    snprintf(buff, sizeof(buff), "<br />Requests: %lu<br />Timeouts: %lu<br />Wakeups: %lu<br />", oi.requests(), oi.timeouts(), oi.wakeups());
+    html += buff;
+    snprintf(buff, sizeof(buff), "Receive ring: max. %u of %u bytes, %lu overflows<br />", (unsigned int)oi.rxHighWater(), OI_RX_RING_SIZE, oi.rxOverflows());
+    html += buff;
+
+    snprintf(buff, sizeof(buff), "<br /><b>Command queue:</b> %u<br />Executed: %lu<br />Coalesced: %lu<br />Dropped: %lu<br />Latency: %lums (max. %lums)<br />",
+             commandQueue.depth(), commandQueue.executed(), commandQueue.coalesced(), commandQueue.dropped(), commandQueue.lastLatency(), commandQueue.maxLatency());
+    html += buff;
+
+    html += "<br /><b>OI stream:</b> ";
+    html += (isStreamActive() ? "active" : (cfg.oi_stream == 1 ? "lost" : "disabled"));
+    snprintf(buff, sizeof(buff), "<br />Frames: %lu (%u/s)<br />Checksum errors: %lu<br />Frame errors: %lu<br />Errors: %u/s<br />Dropped bytes: %lu<br />",
+             oiStream.frames(), streamFramesPerSecond, oiStream.checksumErrors(), oiStream.frameErrors(), streamErrorsPerSecond, oiStream.droppedBytes());
+    html += buff;
+
+    snprintf(buff, sizeof(buff), "<br /><b>OI trace:</b> <a href='/trace.bin'>%u bytes</a> (%lu records, %lu dropped) <a href='/trace.bin?clear=1'>clear</a><br />",
+             (unsigned int)oiTrace.size(), oiTrace.records(), oiTrace.droppedRecords());
+    html += buff;
+
+    snprintf(buff, sizeof(buff), "<br /><b>Telemetry history:</b> %lu samples (%lus), %u of %u bytes, %lu dropped<br />",
+             telemetryHistory.count(), (unsigned long)(telemetryHistory.lastTime() - telemetryHistory.firstTime()), (unsigned int)telemetryHistory.bytes(), TELEMETRY_HISTORY_SIZE, telemetryHistory.droppedSamples());
+    html += buff;
+    snprintf(buff, sizeof(buff), "Rollups: %u/%u min, 15 min and 1 hour in the log (%u bytes in RAM)<br />",
+             telemetryRollup.level(TelemetryRollup::MINUTE).count(), ROLLUP_MINUTES, (unsigned int)sizeof(telemetryRollup));
+    html += buff;
+    snprintf(buff, sizeof(buff), "Log: %u bytes, %lu flushes (%lu bytes), %lu rotations, %lu CRC errors, %lu write errors<br />",
+             (unsigned int)telemetryLog.size(), telemetryLog.flushes(), telemetryLog.bytesWritten(), telemetryLog.rotations(), telemetryLog.crcErrors(), telemetryLog.writeErrors());
+    html += buff;
+
+    snprintf(buff, sizeof(buff), "<br /><b>MQTT status:</b> %lu heartbeats, %lu on change, %lu requested, %lu of %lu samples suppressed<br />",
+             statusPublishes[(int)StatusTrigger::PERIODIC], statusPublishes[(int)StatusTrigger::CHANGE],
+             statusPublishes[(int)StatusTrigger::WEB] + statusPublishes[(int)StatusTrigger::MQTT] + statusPublishes[(int)StatusTrigger::SCHEDULE],
+             statusChanges.suppressed(), statusChanges.samples());
+    html += buff;
+
+    snprintf(buff, sizeof(buff), "<br /><b>Memory:</b> %lu bytes free heap when idle, min. %lu<br />", (unsigned long)idleFreeHeap, (unsigned long)idleFreeHeapMin);
+    html += buff;
+
+    LatencyHistogram &loops = runtime.loops();
+    snprintf(buff, sizeof(buff), "<br /><b>Loop tasks:</b> loop p50 %luus, p99 %luus, max. %luus in %lu loops<br />",
+             (unsigned long)loops.percentile(500), (unsigned long)loops.percentile(990), (unsigned long)loops.max(), loops.count());
+    html += buff;
+    for (uint8_t task = 0; task < runtime.count(); task++)
+    {
+      LatencyHistogram &slices = runtime.slices(task);
+      snprintf(buff, sizeof(buff), "%s: p99 %luus, max. %luus, %lu of %lu slices over the budget of %luus<br />", runtime.name(task),
+               (unsigned long)slices.percentile(990), (unsigned long)slices.max(), runtime.overBudget(task), slices.count(), runtime.budget(task));
+      html += buff;
+    }
+
+#ifdef LOOP_TIMING
+    html += "<br /><b>Timing:</b> <a href='/api/timing'>JSON</a><br />";
+    for (uint8_t probe = 0; probe < TIMING_PROBES; probe++)
+    {
+      LatencyHistogram &histogram = loopTiming.histogram(probe);
+      snprintf(buff, sizeof(buff), "%s: p50 %luus, p99 %luus, max. %luus in %lu calls<br />", LoopTiming::name(probe), (unsigned long)histogram.percentile(500),
+               (unsigned long)histogram.percentile(990), (unsigned long)histogram.max(), histogram.count());
+      html += buff;
+    }
+
+#endif
+    unsigned long wake = scheduler.nextWake(millis());
+    snprintf(buff, sizeof(buff), wake == DEADLINE_IDLE ? "<br /><b>Deadlines:</b> none armed<br />" : "<br /><b>Deadlines:</b> next in %lums<br />", wake);
+    html += buff;
+    for (uint8_t task = 0; task < scheduler.count(); task++)
+    {
+      char period[16] = "once";
+      if (scheduler.period(task) > 0)
+      {
+        snprintf(period, sizeof(period), "every %lums", scheduler.period(task));
+      }
+      snprintf(buff, sizeof(buff), "%s: %s, %lu runs, %lu overruns, max. %lums late<br />", scheduler.name(task), period,
+               scheduler.runs(task), scheduler.overruns(task), scheduler.maxLate(task));
+      html += buff;
+    }
+
+    snprintf(buff, sizeof(buff), "<br /><b>Hazard events:</b> %lu events%s in %lu batches, %u pending, %lu dropped, %lu bounces<br />",
+             hazardDetector.events(), cfg.oi_stream == 1 ? "" : " (OI stream only)", hazardDetector.batches(), hazardDetector.pending(),
+             hazardDetector.dropped(), hazardDetector.bounces());
+    html += buff;
+    for (uint8_t hazard = 0; hazard < HAZARD_COUNT; hazard++)
+    {
+      if (hazardDetector.count(hazard) > 0)
+      {
+        snprintf(buff, sizeof(buff), "%s: %lu%s<br />", HazardDetector::name(hazard), hazardDetector.count(hazard),
+                 (hazardDetector.active() & (1 << hazard)) ? " (active)" : "");
+        html += buff;
+      }
+    }
+
+    if (odometry.valid())
+    {
+      Pose pose = odometry.pose();
+      const OdometryDrift &drift = odometry.drift();
+      char heading[12];
+      formatDecimal(heading, sizeof(heading), odometry.headingDecidegrees(), 1);
+      snprintf(buff, sizeof(buff), "<br /><b>Odometry:</b> x %ld mm, y %ld mm, heading %s&deg;, travel %lu m, %lu gaps<br />",
+               (long)pose.x, (long)pose.y, heading, (unsigned long)(odometry.travel() / 1000), odometry.gaps());
+      html += buff;
+      char headingMean[8];
+      char headingMax[8];
+      formatDecimal(heading, sizeof(heading), odometry.headingDifference(), 1);
+      formatDecimal(headingMean, sizeof(headingMean), drift.headingMean, 1);
+      formatDecimal(headingMax, sizeof(headingMax), drift.headingMax, 1);
+      snprintf(buff, sizeof(buff), "Drift to distance/angle: %ld mm, %s&deg;, per m: %lu mm (max. %lu), %s&deg; (max. %s) in %lu windows<br />",
+               (long)odometry.distanceDifference(), heading, (unsigned long)drift.distanceMean, (unsigned long)drift.distanceMax, headingMean, headingMax,
+               drift.windows);
+      html += buff;
+      snprintf(buff, sizeof(buff), "Path: <a href='/api/path'>%u points</a> of %lu, tolerance %u mm<br />",
+               odometry.pathCount(), odometry.rawPoints(), odometry.pathTolerance());
+      html += buff;
+      char area[12];
+      formatDecimal(area, sizeof(area), coverageMap.cells(CoverageMap::Layer::CLEANED) * (COVERAGE_CELL * COVERAGE_CELL) / 100000, 1, " m&sup2;");
+      snprintf(buff, sizeof(buff), "Coverage: %s cleaned, %lu bump and %lu cliff cells, %u tiles (%u bytes), <a href='/map.png'>PNG</a> <a href='/map.pbm'>PBM</a><br />",
+               area, coverageMap.cells(CoverageMap::Layer::BUMPED), coverageMap.cells(CoverageMap::Layer::CLIFF), coverageMap.tiles(), (unsigned int)coverageMap.bytes());
+      html += buff;
+    }
+
+    snprintf(buff, sizeof(buff), "<br /><b>Schedule:</b> %u rules%s, %lu run (%lu late), %lu cleans skipped, %lu time jumps<br />",
+             cleanScheduler.rules(), cleanScheduler.running() ? "" : " (waiting for NTP)", cleanScheduler.fired(), cleanScheduler.late(), scheduleSkipped,
+             cleanScheduler.jumps());
+    html += buff;
+    if (cleanScheduler.next() != 0)
+    {
+      html += "Next: ";
+      html += timeClient.getFormattedDate(cleanScheduler.next());
+      html += " ";
+      html += CleanScheduler::actionName(cleanScheduler.nextAction());
+      html += "<br />";
+    }
+
+    snprintf(buff, sizeof(buff), "<br /><b>Cleaning sessions:</b> %s, <a href='/api/sessions'>%lu ended</a><br />",
+             SessionDetector::stateName(sessionDetector.state()), sessionDetector.sessions());
+    html += buff;
+
+    formatSoc(buff, sizeof(buff), " +/-");
+    html += "<br /><b>Charging level estimate:</b> ";
+    html += buff;
+    snprintf(buff, sizeof(buff), ", capacity %u mAh, %lu corrections<br />", socEstimator.capacity(), socEstimator.corrections());
+    html += buff;
+
+    if (server.arg("packets") != "")
+    {
+      // GET /status?packets=7,21,22 or POST
+      int32_t values[OI_QUERY_LIST_MAX];
+
+      html += "<br /><br /><b>Packets:</b><br />";
+      if (packetCount == 0)
+      {
+        html += "Invalid packet list";
+      }
+      else if (queryState == OIFuture::State::DONE)
+      {
+        decodePacketList(packets, packetCount, webQuery.data, values);
+        html += "<table>\n";
+        for (uint8_t i = 0; i < packetCount; i++)
+        {
+          const OIPacketInfo &packet = oiPacket(packets[i]);
+          snprintf(buff, sizeof(buff), "<tr><td>%u</td><td>%s</td><td>%ld %s</td></tr>\n", packets[i], packet.name, (long)values[i], oiUnitName(packet.unit));
+          html += buff;
+        }
+        html += "</table>\n";
+      }
+      else
+      {
+        html += "No data";
+      }
+    }
+
+    if (query == groupPackets || query == singlePacket)
+    {
+      html += "<br /><br /><b>Result:</b>";
+      if (query == groupPackets)
+      {
+        snprintf(buff, sizeof(buff), "<br />Packets: %u<br />", queryState == OIFuture::State::DONE ? webQuery.length : 0);
+        html += buff;
+
+        if (queryState == OIFuture::State::DONE)
+        {
+          int32_t values[OI_PACKET_COUNT];
+          oiDecodeGroup(group, webQuery.data, values);
+          for (uint8_t id = group.first; id <= group.last; id++)
+          {
+            snprintf(buff, sizeof(buff), "%s: %ld %s<br />", oiPacket(id).name, (long)values[id - group.first], oiUnitName(oiPacket(id).unit));
+            html += buff;
+          }
+        }
+        else
+        {
+          html += "No data";
+        }
+      }
+      else if (queryState == OIFuture::State::DONE)
+      {
+        int32_t value;
+        decodePacketList(singlePacket, 1, webQuery.data, &value);
+        html += (long)value;
+      }
+      else
+      {
+        html += "No data";
+      }
+    }
+
+    html += "</form>";
+
+    HTMLFooter();
+    server.send(200, "text/html", html);
+  }
+}
+
+// Coverage map of the current or last session, /map.pbm?layer=cleaned|bumped|cliff
+void handleMap(CoverageMap::Format format)
+{
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
+
+  CoverageMap::Layer layer = CoverageMap::Layer::CLEANED;
+  if (server.hasArg("layer") && !CoverageMap::parseLayer(server.arg("layer").c_str(), layer))
+  {
+    server.send(400, "text/plain", "layer: cleaned, bumped or cliff\n");
+    return;
+  }
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, CoverageMap::contentType(format), "");
+  coverageMap.encode(format, layer, [](const uint8_t *data, size_t length)
+                     { server.sendContent((const char *)data, length); });
+  server.sendContent(""); // last chunk
+}
+
+// Download the OI trace (see oi_trace.h and tools/oitrace)
+void handleTrace()
+{
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
+
+  if (server.hasArg("clear"))
+  {
+    oiTrace.clear();
+    server.sendHeader("Location", "/status", true);
+    server.send(302, "text/plain", "");
+    return;
+  }
 
-    HTMLFooter();
-    server.send(200, "text/html", html);
+  server.sendHeader("Content-Disposition", "attachment; filename=trace.bin");
+  server.setContentLength(oiTrace.size());
+  server.send(200, "application/octet-stream", "");
+  oiTrace.dump([](const uint8_t *data, size_t length)
+               { server.sendContent((const char *)data, length); });
+}
+
+// Time argument of /api/history, negative values are seconds before now
+uint32_t historyTime(const char *name, uint32_t now, uint32_t fallback)
+{
+  if (!server.hasArg(name))
+  {
+    return fallback;
   }
+  long value = strtol(server.arg(name).c_str(), nullptr, 10);
+  return value < 0 ? now + value : value;
 }
 
-void handleStatus()
+// /api/history?metric=voltage&from=-86400&to=&res=300&format=csv
+// Streamed in chunks, the response is never held in RAM as a whole
+void handleHistory()
 {
-  showWEBMQTTAction();
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
 
+  RollupMetric metric = RollupMetric::VOLTAGE;
+  HistoryQuery::Format format = HistoryQuery::Format::CSV;
+  if ((server.hasArg("metric") && !HistoryQuery::parseMetric(server.arg("metric").c_str(), metric)) ||
+      (server.hasArg("format") && !HistoryQuery::parseFormat(server.arg("format").c_str(), format)))
+  {
+    server.send(400, "text/plain", "metric: voltage, current, temperature or charge; format: csv, json or bin\n");
+    return;
+  }
+
+  uint32_t now = timeClient.getEpochTime();
+  uint32_t to = historyTime("to", now, now + 1);
+  uint32_t from = historyTime("from", now, to - 86400);
+  uint32_t resolution = server.hasArg("res") ? strtoul(server.arg("res").c_str(), nullptr, 10) : 900;
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, HistoryQuery::contentType(format), "");
+  historyQuery.run(metric, from, to, resolution, format, [](const uint8_t *data, size_t length)
+                   { server.sendContent((const char *)data, length); });
+  server.sendContent(""); // last chunk
+}
+
+// Ended cleaning sessions, newest first
+void handleSessions()
+{
   if (!server.authenticate(cfg.admin_username, cfg.admin_password))
   {
     return server.requestAuthentication();
   }
-  else
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  snprintf(buff, sizeof(buff), "{\"state\":\"%s\",\"ended\":%lu,\"sessions\":[", SessionDetector::stateName(sessionDetector.state()),
+           sessionDetector.sessions());
+  server.sendContent(buff);
+  CleanSession session;
+  for (uint8_t age = 0; sessionDetector.session(age, session); age++)
   {
+    size_t length = age > 0 ? snprintf(buff, sizeof(buff), ",") : 0;
+    formatSession(buff + length, sizeof(buff) - length, session);
+    server.sendContent(buff);
+  }
+  server.sendContent("]}");
+  server.sendContent(""); // last chunk
+}
 
-    HTMLHeader("Status");
-    html += "<form method='POST' action='/status'><br />";
-    html += "<input type='text' name='singlesensorid' value=''>";
-    html += "<input type='submit' name='singlesensor' value='Single Sensor'>";
-    html += "<input type='submit' name='sensorgroup' value='Sensor Group 3'>";
-    html += "<input type='submit' name='readbuffer' value='Read Serial Buffer'>";
+// Odometry pose, drift against packets 19/20 and the simplified path of the
+// current or last session (points in cm)
+void handlePath()
+{
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
 
-    if (server.method() == HTTP_POST)
+  Pose pose = odometry.pose();
+  const OdometryDrift &drift = odometry.drift();
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  snprintf(buff, sizeof(buff), "{\"x\":%ld,\"y\":%ld,\"theta\":%ld,\"travel\":%lu,\"tolerance\":%u,\"raw\":%lu,",
+           (long)pose.x, (long)pose.y, (long)odometry.headingDecidegrees(), (unsigned long)odometry.travel(), odometry.pathTolerance(), odometry.rawPoints());
+  server.sendContent(buff);
+  snprintf(buff, sizeof(buff), "\"drift\":{\"distance\":%ld,\"heading\":%ld,\"windows\":%lu,\"distance_mean\":%lu,\"distance_max\":%lu,\"heading_mean\":%lu,\"heading_max\":%lu},\"points\":[",
+           (long)odometry.distanceDifference(), (long)odometry.headingDifference(), drift.windows, (unsigned long)drift.distanceMean, (unsigned long)drift.distanceMax,
+           (unsigned long)drift.headingMean, (unsigned long)drift.headingMax);
+  server.sendContent(buff);
+
+  // Several points per chunk
+  size_t length = 0;
+  uint16_t count = odometry.pathCount();
+  for (uint16_t i = 0; i < count; i++)
+  {
+    PathPoint point = odometry.pathPoint(i);
+    length += snprintf(buff + length, sizeof(buff) - length, "%s[%d,%d]", i > 0 ? "," : "", point.x, point.y);
+    if (length > sizeof(buff) - 32)
     {
-      html += "<br /><br /><b>Result:</b>";
-      for (uint8_t i = 0; i < server.args(); i++)
-      {
-        if (server.argName(i) == "sensorgroup")
-        {
-          unsigned int sensorPackets = getSensorStatus(true);
+      server.sendContent(buff);
+      length = 0;
+    }
+  }
+  length += snprintf(buff + length, sizeof(buff) - length, "]}");
+  server.sendContent(buff);
+  server.sendContent(""); // last chunk
+}
 
-          snprintf(buff, sizeof(buff), "<br />Packets: %i<br />", sensorPackets);
-          html += buff;
+#ifdef LOOP_TIMING
+// "name":{...} with the percentiles of a histogram in µs
+size_t formatTiming(char *out, size_t size, const char *separator, const char *name, LatencyHistogram &histogram)
+{
+  return snprintf(out, size, "%s\"%s\":{\"count\":%lu,\"mean\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}", separator, name,
+                  histogram.count(), (unsigned long)histogram.mean(), (unsigned long)histogram.percentile(500), (unsigned long)histogram.percentile(900),
+                  (unsigned long)histogram.percentile(990), (unsigned long)histogram.percentile(999), (unsigned long)histogram.max());
+}
 
-          if (sensorPackets > 0)
-          {
-            snprintf(buff, sizeof(buff), "CHARGE_STATE: %i<br />", CHARGE_STATE);
-            html += buff;
-            snprintf(buff, sizeof(buff), "VOLTAGE: %i<br />", VOLTAGE);
-            html += buff;
-            snprintf(buff, sizeof(buff), "CURRENT: %i<br />", CURRENT);
-            html += buff;
-            snprintf(buff, sizeof(buff), "TEMP: %i<br />", TEMP);
-            html += buff;
-            snprintf(buff, sizeof(buff), "CHARGE: %i<br />", CHARGE);
-            html += buff;
-            snprintf(buff, sizeof(buff), "CAPACITY: %i<br />", CAPACITY);
-            html += buff;
-          }
-          else
-          {
-            html += "No data";
-          }
-        }
-        else if (server.argName(i) == "singlesensorid")
-        {
-          String packetID;
-          packetID = server.arg(i);
-          packetID.trim();
-          if (packetID != "")
-          {
-            rdebugA("PackedID: %s (%i)\n", packetID.c_str(), (int)packetID.toInt());
-            int result;
-            if (getRoombaSensorPacket(packetID.toInt(), result))
-            {
-              html += result;
-            }
-            else
-            {
-              html += "No data";
-            }
-          }
-        }
-        else if (server.argName(i) == "readbuffer")
-        {
-          html += "available: ";
-          html += Serial.available();
-          html += " <br /><pre>";
-          while (Serial.available())
-          {
-            html += Serial.read();
-          }
-          html += "</pre>";
-        }
-      }
-    }
+// Durations of the probes, the loop tasks and the whole loop
+void handleTiming()
+{
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
 
-    html += "</form>";
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  server.sendContent("{\"unit\":\"us\",\"probes\":{");
+  for (uint8_t probe = 0; probe < TIMING_PROBES; probe++)
+  {
+    formatTiming(buff, sizeof(buff), probe > 0 ? "," : "", LoopTiming::name(probe), loopTiming.histogram(probe));
+    server.sendContent(buff);
+  }
+  server.sendContent("},\"tasks\":{");
+  for (uint8_t task = 0; task < runtime.count(); task++)
+  {
+    formatTiming(buff, sizeof(buff), task > 0 ? "," : "", runtime.name(task), runtime.slices(task));
+    server.sendContent(buff);
+  }
+  server.sendContent("},");
+  formatTiming(buff, sizeof(buff), "", "loop", runtime.loops());
+  server.sendContent(buff);
+  server.sendContent("}");
+  server.sendContent(""); // last chunk
+}
+#endif
 
-    HTMLFooter();
-    server.send(200, "text/html", html);
+// Prometheus text format, see metrics_writer.h. The lines go out in chunks
+// of the writer's buffer on the stack, no String is built on the heap.
+void handleMetrics()
+{
+  if (!server.authenticate(cfg.admin_username, cfg.admin_password))
+  {
+    return server.requestAuthentication();
+  }
+
+  // Order of enum StatusTrigger
+  static const char *TRIGGER_LABELS[] = {"trigger=\"periodic\"", "trigger=\"change\"", "trigger=\"web\"", "trigger=\"mqtt\"", "trigger=\"schedule\""};
+  unsigned long start = micros();
+  char labels[48];
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
+  MetricsWriter metrics([](const char *data, size_t length)
+                        { server.sendContent(data, length); });
+
+  // System
+  metrics.family("roomba_uptime_seconds", "counter", "Time since the start");
+  metrics.sample("roomba_uptime_seconds", nullptr, (unsigned long)(micros64() / 1000000));
+  metrics.family("roomba_free_heap_bytes", "gauge", "Free heap");
+  metrics.sample("roomba_free_heap_bytes", nullptr, (unsigned long)ESP.getFreeHeap());
+  metrics.family("roomba_idle_free_heap_bytes", "gauge", "Free heap between the loop tasks, sampled every second");
+  metrics.sample("roomba_idle_free_heap_bytes", nullptr, (unsigned long)idleFreeHeap);
+  metrics.family("roomba_max_free_block_bytes", "gauge", "Largest free block of the heap");
+  metrics.sample("roomba_max_free_block_bytes", nullptr, (unsigned long)ESP.getMaxFreeBlockSize());
+  metrics.family("roomba_heap_fragmentation_percent", "gauge", "Fragmentation of the heap");
+  metrics.sample("roomba_heap_fragmentation_percent", nullptr, (unsigned long)ESP.getHeapFragmentation());
+  if (WiFi.isConnected())
+  {
+    metrics.family("roomba_wifi_rssi_dbm", "gauge", "Signal strength of the WiFi");
+    metrics.sample("roomba_wifi_rssi_dbm", nullptr, (long)WiFi.RSSI());
+  }
+
+  // Sensors, only from a valid snapshot
+  metrics.family("roomba_sensors_valid", "gauge", "1 if the sensor values below are current");
+  metrics.sample("roomba_sensors_valid", nullptr, (unsigned long)sensors.valid);
+  if (sensors.valid)
+  {
+    metrics.family("roomba_battery_voltage_volts", "gauge", "Battery voltage");
+    metrics.decimal("roomba_battery_voltage_volts", nullptr, sensors.voltage, 3);
+    metrics.family("roomba_battery_current_amperes", "gauge", "Battery current, negative while discharging");
+    metrics.decimal("roomba_battery_current_amperes", nullptr, sensors.current, 3);
+    metrics.family("roomba_battery_temperature_celsius", "gauge", "Battery temperature");
+    metrics.sample("roomba_battery_temperature_celsius", nullptr, (long)sensors.temperature);
+    metrics.family("roomba_battery_charge_mah", "gauge", "Battery charge");
+    metrics.sample("roomba_battery_charge_mah", nullptr, (unsigned long)sensors.charge);
+    metrics.family("roomba_battery_capacity_mah", "gauge", "Battery capacity as reported");
+    metrics.sample("roomba_battery_capacity_mah", nullptr, (unsigned long)sensors.capacity);
+    metrics.family("roomba_charging_state", "gauge", "OI charging state (packet 21)");
+    metrics.sample("roomba_charging_state", nullptr, (unsigned long)sensors.chargingState);
+    metrics.family("roomba_docked", "gauge", "1 if a charging source is present");
+    metrics.sample("roomba_docked", nullptr, (unsigned long)sensors.docked);
+    metrics.family("roomba_cleaning", "gauge", "1 while cleaning");
+    metrics.sample("roomba_cleaning", nullptr, (unsigned long)sensors.cleaning);
+  }
+  if (socEstimator.valid())
+  {
+    metrics.family("roomba_battery_level_ratio", "gauge", "Estimated state of charge");
+    metrics.decimal("roomba_battery_level_ratio", nullptr, socEstimator.level(), 3);
+  }
+
+  // OI link
+  metrics.family("roomba_oi_requests_total", "counter", "OI transport requests");
+  metrics.sample("roomba_oi_requests_total", nullptr, oi.requests());
+  metrics.family("roomba_oi_timeouts_total", "counter", "OI requests without a complete response");
+  metrics.sample("roomba_oi_timeouts_total", nullptr, oi.timeouts());
+  metrics.family("roomba_oi_wakeups_total", "counter", "Wakeups of the OI");
+  metrics.sample("roomba_oi_wakeups_total", nullptr, oi.wakeups());
+  metrics.family("roomba_oi_rx_overflows_total", "counter", "Bytes lost to a full receive ring");
+  metrics.sample("roomba_oi_rx_overflows_total", nullptr, oi.rxOverflows());
+  metrics.family("roomba_oi_stream_frames_total", "counter", "Frames of the OI stream");
+  metrics.sample("roomba_oi_stream_frames_total", nullptr, oiStream.frames());
+  metrics.family("roomba_oi_stream_errors_total", "counter", "Broken frames of the OI stream");
+  metrics.sample("roomba_oi_stream_errors_total", "error=\"checksum\"", oiStream.checksumErrors());
+  metrics.sample("roomba_oi_stream_errors_total", "error=\"frame\"", oiStream.frameErrors());
+  metrics.family("roomba_oi_stream_dropped_bytes_total", "counter", "Bytes skipped to find the next frame");
+  metrics.sample("roomba_oi_stream_dropped_bytes_total", nullptr, oiStream.droppedBytes());
+  metrics.family("roomba_commands_total", "counter", "OI commands of the queue");
+  metrics.sample("roomba_commands_total", "result=\"executed\"", commandQueue.executed());
+  metrics.sample("roomba_commands_total", "result=\"coalesced\"", commandQueue.coalesced());
+  metrics.sample("roomba_commands_total", "result=\"dropped\"", commandQueue.dropped());
+  metrics.family("roomba_hazard_events_total", "counter", "Debounced hazard events");
+  metrics.sample("roomba_hazard_events_total", nullptr, hazardDetector.events());
+  metrics.family("roomba_sessions_total", "counter", "Ended cleaning sessions");
+  metrics.sample("roomba_sessions_total", nullptr, sessionDetector.sessions());
+
+  // MQTT
+  metrics.family("roomba_mqtt_connected", "gauge", "1 while connected to the broker");
+  metrics.sample("roomba_mqtt_connected", nullptr, (unsigned long)client.connected());
+  metrics.family("roomba_mqtt_connects_total", "counter", "Connects to the broker");
+  metrics.sample("roomba_mqtt_connects_total", "result=\"ok\"", mqttConnects);
+  metrics.sample("roomba_mqtt_connects_total", "result=\"failed\"", mqttConnectFailures);
+  metrics.family("roomba_mqtt_status_publishes_total", "counter", "Status messages published");
+  for (uint8_t trigger = 0; trigger < (uint8_t)StatusTrigger::NONE; trigger++)
+  {
+    metrics.sample("roomba_mqtt_status_publishes_total", TRIGGER_LABELS[trigger], statusPublishes[trigger]);
+  }
+  metrics.family("roomba_mqtt_hazard_publishes_total", "counter", "Hazard batches published");
+  metrics.sample("roomba_mqtt_hazard_publishes_total", nullptr, hazardDetector.batches());
+
+  // Loop latency
+  metrics.family("roomba_loop_duration_seconds", "summary", "Duration of loop()");
+  metrics.summary("roomba_loop_duration_seconds", nullptr, runtime.loops());
+  metrics.family("roomba_task_slice_seconds", "summary", "Duration of the slices of the loop tasks");
+  for (uint8_t task = 0; task < runtime.count(); task++)
+  {
+    snprintf(labels, sizeof(labels), "task=\"%s\"", runtime.name(task));
+    metrics.summary("roomba_task_slice_seconds", labels, runtime.slices(task));
+  }
+  metrics.family("roomba_task_over_budget_total", "counter", "Slices longer than the budget of the task");
+  for (uint8_t task = 0; task < runtime.count(); task++)
+  {
+    snprintf(labels, sizeof(labels), "task=\"%s\"", runtime.name(task));
+    metrics.sample("roomba_task_over_budget_total", labels, runtime.overBudget(task));
+  }
+#ifdef LOOP_TIMING
+  metrics.family("roomba_call_duration_seconds", "summary", "Duration of the calls in loop()");
+  for (uint8_t probe = 0; probe < TIMING_PROBES; probe++)
+  {
+    snprintf(labels, sizeof(labels), "probe=\"%s\"", LoopTiming::name(probe));
+    metrics.summary("roomba_call_duration_seconds", labels, loopTiming.histogram(probe));
   }
+#endif
+
+  // The scrape itself, the duration of this one is reported by the next
+  metrics.family("roomba_metrics_scrapes_total", "counter", "Requests of /metrics");
+  metrics.sample("roomba_metrics_scrapes_total", nullptr, ++metricsScrapes);
+  metrics.family("roomba_metrics_scrape_seconds", "gauge", "Duration of the previous request of /metrics");
+  metrics.decimal("roomba_metrics_scrape_seconds", nullptr, lastMetricsScrapeTime / 100, 4);
+  metrics.end();
+  server.sendContent(""); // last chunk
+  lastMetricsScrapeTime = micros() - start;
 }
 
 void handleWiFiScan()
@@ -1373,9 +2591,24 @@ void handleWiFiScan()
   else
   {
 
+    // Scan in the background, the page reloads until the result is there
+    int n = WiFi.scanComplete();
+    if (n == WIFI_SCAN_FAILED)
+    {
+      WiFi.scanNetworks(true);
+      n = WIFI_SCAN_RUNNING;
+    }
+    if (n == WIFI_SCAN_RUNNING)
+    {
+      HTMLHeader("WiFi Scan", 2, "/wifiscan");
+      html += "Scanning...\n";
+      HTMLFooter();
+      server.send(200, "text/html", html);
+      return;
+    }
+
     HTMLHeader("WiFi Scan");
 
-    int n = WiFi.scanNetworks();
     if (n == 0)
     {
       html += "No networks found.\n";
@@ -1442,6 +2675,7 @@ void handleWiFiScan()
       }
       html += "</table>";
     }
+    WiFi.scanDelete(); // the next visit scans again
 
     HTMLFooter();
 
@@ -1479,6 +2713,7 @@ void handleReboot()
     if (reboot)
     {
       delay(200);
+      telemetryLog.flush();
       ESP.reset();
     }
   }
@@ -1553,6 +2788,51 @@ void onDisconnected(const WiFiEventStationModeDisconnected &evt)
   }
 }
 
+// Commands of MQTT and the schedule
+void commandClean(bool start, StatusTrigger statusTrigger)
+{
+  if (start)
+  {
+    screen.displayMsgForce("Start cleaning!");
+    roombaCmd(RoombaCMDs::RMB_CLEAN, statusTrigger);
+  }
+  else if (isRoombaCleaning())
+  {
+    screen.displayMsgForce("Cleaning stopped!");
+    roombaCmd(RoombaCMDs::RMB_CLEAN); // Stop cleaning
+  }
+}
+
+void commandDock(StatusTrigger statusTrigger)
+{
+  screen.displayMsgForce("Searching dock!");
+  if (isRoombaCleaning())
+  {
+    roombaCmd(RoombaCMDs::RMB_CLEAN); // Stop cleaning
+  }
+  roombaCmd(RoombaCMDs::RMB_DOCK, statusTrigger, CommandQueue::Condition::NOT_CLEANING);
+}
+
+// A slot of the schedule is due. A late clean is skipped when a cleaning
+// session started since the slot, e.g. before a reboot.
+void onSchedule(uint8_t rule, CleanScheduler::Action action, uint32_t slot, bool late)
+{
+  rdebugA("Schedule rule %u: %s%s\n", rule, CleanScheduler::actionName(action), late ? " (late)" : "");
+  if (action == CleanScheduler::Action::CLEAN)
+  {
+    if ((late && telemetryLog.state().lastClean >= slot) || isRoombaCleaning())
+    {
+      scheduleSkipped++;
+      return;
+    }
+    commandClean(true, StatusTrigger::SCHEDULE);
+  }
+  else if (action == CleanScheduler::Action::DOCK)
+  {
+    commandDock(StatusTrigger::SCHEDULE);
+  }
+}
+
 void MQTTprocessCommand(JsonObject &json)
 {
   rdebugA("incomming MQTT command\n");
@@ -1560,33 +2840,14 @@ void MQTTprocessCommand(JsonObject &json)
   // Power on/off
   if (json.containsKey("clean"))
   {
-    if (json["clean"].as<boolean>())
-    {
-      screen.displayMsgForce("Start cleaning!");
-      roombaCmd(RoombaCMDs::RMB_CLEAN, StatusTrigger::MQTT);
-      timeClient.getFormattedDate().toCharArray(lastClean, sizeof(lastClean) / sizeof(*lastClean));
-    }
-    else if (!json["clean"].as<boolean>())
-    {
-      if (isRoombaCleaning())
-      {
-        screen.displayMsgForce("Cleaning stopped!");
-        roombaCmd(RoombaCMDs::RMB_CLEAN); // Stop cleaning
-      }
-    }
+    commandClean(json["clean"].as<boolean>(), StatusTrigger::MQTT);
   }
 
   if (json.containsKey("dock"))
   {
     if (json["dock"].as<boolean>())
     {
-      screen.displayMsgForce("Searching dock!");
-      if (isRoombaCleaning())
-      {
-        roombaCmd(RoombaCMDs::RMB_CLEAN); // Stop cleaning
-      }
-      delay(2000);
-      roombaCmd(RoombaCMDs::RMB_DOCK, StatusTrigger::MQTT);
+      commandDock(StatusTrigger::MQTT);
     }
     else if (!json["dock"].as<boolean>())
     {
@@ -1594,11 +2855,16 @@ void MQTTprocessCommand(JsonObject &json)
     }
   }
 
+  // Read sensor packets, e.g. {"packets":"7,21,22"}
+  if (json.containsKey("packets"))
+  {
+    MQTTpublishPackets(json["packets"].as<String>());
+  }
+
   // Trigger status update
   if (json.containsKey("status"))
   {
-    getSensorStatus(true); // force status update
-    MQTTpublishStatus(StatusTrigger::MQTT);
+    getSensorStatus(true, StatusTrigger::MQTT); // force status update, publish when values arrived
   }
 }
 
@@ -1649,6 +2915,7 @@ boolean MQTTreconnect()
     if (client.connect(WiFi.hostname().c_str(), cfg.mqtt_user, cfg.mqtt_password, buff, 0, 1, MQTT_LWT_MESSAGE))
     {
       rdebugA("connected!\n");
+      mqttConnects++;
 
       snprintf(buff, sizeof(buff), MQTT_SUBSCRIBE_CMD_TOPIC1, cfg.mqtt_prefix);
       client.subscribe(buff);
@@ -1662,13 +2929,24 @@ boolean MQTTreconnect()
     else
     {
       rdebugA("failed with state: %i\n", client.state());
+      mqttConnectFailures++;
       return false;
     }
   }
 }
 
+// Connect while WiFi is up, the heartbeat sends a status at once after connecting
+void MQTTreconnectTask()
+{
+  if (WiFi.status() == WL_CONNECTED && !configIsDefault && !client.connected() && MQTTreconnect() && cfg.mqtt_periodic_update_interval > 0)
+  {
+    scheduler.after(heartbeatTask, 0, millis());
+  }
+}
+
 void handleDisplay()
 {
+  TIMING_SCOPE(loopTiming, TIMING_DISPLAY);
   if (screen.needRefresh())
   {
 
@@ -1689,29 +2967,41 @@ void handleDisplay()
       break;
 
     case 2:
-      snprintf(buff1, sizeof(buff1), "Charging: %s", (sensorbytesvalid ? chargeStateString().c_str() : "---"));
+      snprintf(buff1, sizeof(buff1), "Charging: %s", (sensors.valid ? sensors.chargingStateName() : "---"));
 
-      snprintf(buff, sizeof(buff), "%.2f V", ((float)VOLTAGE / 1000));
-      snprintf(buff2, sizeof(buff2), "Voltage: %s ", (sensorbytesvalid ? buff : "---"));
+      sensors.formatVoltage(buff, sizeof(buff));
+      snprintf(buff2, sizeof(buff2), "Voltage: %s ", buff);
 
-      snprintf(buff, sizeof(buff), "%d mA", CURRENT);
-      snprintf(buff3, sizeof(buff3), "Current: %s", (sensorbytesvalid ? buff : "---"));
+      sensors.formatCurrent(buff, sizeof(buff));
+      snprintf(buff3, sizeof(buff3), "Current: %s", buff);
 
-      snprintf(buff, sizeof(buff), "%d C", TEMP);
-      snprintf(buff4, sizeof(buff4), "Temperature: %s", (sensorbytesvalid ? buff : "---"));
+      sensors.formatTemperature(buff, sizeof(buff), " C");
+      snprintf(buff4, sizeof(buff4), "Temperature: %s", buff);
       screen.displayMsg(buff1, buff2, buff3, buff4);
       break;
 
     case 3:
-      snprintf(buff, sizeof(buff), "%.2f%%", (100 / (float)CAPACITY) * CHARGE);
-      snprintf(buff1, sizeof(buff1), "Charging level: %s", (sensorbytesvalid ? buff : "---"));
+      formatSoc(buff, sizeof(buff), nullptr);
+      snprintf(buff1, sizeof(buff1), "Charging level: %s", buff);
 
-      snprintf(buff2, sizeof(buff2), "Battery capacity: %s ", (sensorbytesvalid ? buff : "---"));
+      sensors.formatCharge(buff, sizeof(buff));
+      snprintf(buff3, sizeof(buff3), "  %s", buff);
 
-      snprintf(buff, sizeof(buff), "%d/%d mA", CHARGE, CAPACITY);
-      snprintf(buff3, sizeof(buff3), "  %s", (sensorbytesvalid ? buff : "---"));
+      int16_t voltageMin;
+      int16_t voltageMax;
+      if (telemetryRange(TelemetryRollup::MINUTE, 60, RollupMetric::VOLTAGE, voltageMin, voltageMax))
+      {
+        char minText[12];
+        formatDecimal(minText, sizeof(minText), (voltageMin + 5) / 10, 2);
+        formatDecimal(buff, sizeof(buff), (voltageMax + 5) / 10, 2, " V");
+        snprintf(buff4, sizeof(buff4), "1h: %s-%s", minText, buff);
+      }
+      else
+      {
+        snprintf(buff4, sizeof(buff4), "1h: ---");
+      }
 
-      screen.displayMsg(buff1, "Battery capacity:", buff3);
+      screen.displayMsg(buff1, "Battery capacity:", buff3, buff4);
       break;
 
     case 4:
@@ -1730,6 +3020,89 @@ void handleDisplay()
   }
 }
 
+// Loop tasks, each runs one slice per loop() and yields when its budget is used up
+
+// Roomba Open Interface, telemetry and commands
+void oiTask()
+{
+  static uint16_t resume = 0;
+  TASK_BEGIN(resume);
+  oi.loop();
+  recordTelemetry();
+  TASK_YIELD_IF(resume, runtime.expired());
+  sessionDetector.loop(millis());
+  hazardDetector.loop(millis());
+  TASK_YIELD_IF(resume, runtime.expired());
+  telemetryLog.loop();
+  TASK_YIELD_IF(resume, runtime.expired());
+  cleanScheduler.loop(timeClient.getEpochTime()); // runs on the last synced time without WiFi
+  commandQueue.loop();
+  TASK_END(resume);
+}
+
+void ledTask()
+{
+  if (cfg.fancyled == 1 && !stopLEDupdate)
+  {
+    led.Update();
+  }
+}
+
+void debugTask()
+{
+  if (WiFi.status() == WL_CONNECTED && cfg.telnet)
+  {
+    TIMING_SCOPE(loopTiming, TIMING_DEBUG);
+    Debug.handle();
+  }
+}
+
+void ntpTask()
+{
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    TIMING_SCOPE(loopTiming, TIMING_NTP);
+    timeClient.updateAsync();
+  }
+}
+
+// MQTT - if config valid, connected by mqttReconnectTask
+void mqttTask()
+{
+  static uint16_t resume = 0;
+  if (WiFi.status() != WL_CONNECTED || configIsDefault || !client.connected())
+  {
+    resume = 0;
+    return;
+  }
+
+  TASK_BEGIN(resume);
+  // Handle MQTT msgs
+  {
+    TIMING_SCOPE(loopTiming, TIMING_MQTT);
+    client.loop();
+  }
+  TASK_YIELD_IF(resume, runtime.expired());
+
+  // send a status on significant changes, the heartbeat is heartbeatTask
+  if (cfg.mqtt_periodic_update_interval > 0)
+  {
+    updateStatusChanges();
+    if (statusChanges.significant() && (millis() - lastStatusPublishTime) >= MQTT_CHANGE_MIN_INTERVAL)
+    {
+      MQTTpublishStatus(StatusTrigger::CHANGE);
+    }
+  }
+  TASK_YIELD_IF(resume, runtime.expired());
+
+  // pose stream while the Roomba moves
+  if (odometry.valid() && odometry.travel() != lastPoseTravel && (millis() - lastPosePublishTime) >= MQTT_POSE_INTERVAL)
+  {
+    publishPose();
+  }
+  TASK_END(resume);
+}
+
 void setup(void)
 {
 
@@ -1758,6 +3131,113 @@ void setup(void)
   // Load Config
   loadConfig();
 
+  // OI Stream
+  oiStream.onPacket(onStreamPacket);
+  oiStream.onFrame(onStreamFrame);
+  oiStream.expect(OI_STREAM_PACKETS, sizeof(OI_STREAM_PACKETS)); // as requested by restartStream()
+  oi.onStream([](const uint8_t *data, size_t length)
+              { oiStream.feed(data, length); });
+  oi.setTrace(&oiTrace);
+  if (cfg.oi_stream != 1)
+  {
+    oi.stopStream(); // Roomba may still stream from before the last reboot
+  }
+
+  // Command queue
+  commandQueue.onExecute([](uint8_t command)
+                         { executeRoombaCmd((RoombaCMDs)command); });
+  commandQueue.onCondition([](CommandQueue::Condition condition)
+                           { return condition != CommandQueue::Condition::NOT_CLEANING || !isRoombaCleaning(); });
+  commandQueue.onStatus([](uint8_t trigger)
+                        { getSensorStatus(true, (StatusTrigger)trigger); });
+
+  // Telemetry log
+  if (!LittleFS.begin())
+  {
+    LittleFS.format();
+    LittleFS.begin();
+  }
+  telemetryLog.begin();
+  if (telemetryLog.state().lastClean != 0)
+  {
+    timeClient.getFormattedDate(telemetryLog.state().lastClean).toCharArray(lastClean, sizeof(lastClean) / sizeof(*lastClean));
+  }
+  telemetryRollup.level(TelemetryRollup::QUARTER).onClose([](const RollupPoint &point)
+                                                          { logRollup(TelemetryRollup::QUARTER, point); });
+  telemetryRollup.level(TelemetryRollup::HOUR).onClose([](const RollupPoint &point)
+                                                       { logRollup(TelemetryRollup::HOUR, point); });
+  sessionDetector.onStart([](const CleanSession &session)
+                          { setLastClean();
+                            odometry.reset();
+                            coverageMap.reset(); });
+  sessionDetector.onEnd(publishSession);
+  hazardDetector.onBatch(publishHazards);
+  odometry.reset();
+
+  // Deadlines of loop()
+  ledOffTask = scheduler.add("LED off", []()
+                             {
+                               if (cfg.fancyled != 1)
+                               {
+                                 analogWrite(PIN_LED_WIFI, 0);
+                               } });
+  scheduler.after(ledOffTask, LED_WEB_MIN_TIME, millis());
+  streamRestartTask = scheduler.add("OI stream restart", restartStream, OI_STREAM_RESTART_INTERVAL);
+  scheduler.after(streamRestartTask, 0, millis());
+  streamRateTask = scheduler.add("OI stream rate", updateStreamRate, 1000);
+  scheduler.after(streamRateTask, 1000, millis());
+  heapTask = scheduler.add("heap", []()
+                           {
+                             idleFreeHeap = ESP.getFreeHeap();
+                             idleFreeHeapMin = (idleFreeHeapMin == 0 || idleFreeHeap < idleFreeHeapMin) ? idleFreeHeap : idleFreeHeapMin; },
+                           HEAP_SAMPLE_INTERVAL);
+  scheduler.after(heapTask, 0, millis());
+  if (!client.setBufferSize(MQTT_BUFFER_SIZE))
+  {
+    rdebugAln("MQTT buffer not allocated!");
+  }
+  mqttReconnectTask = scheduler.add("MQTT reconnect", MQTTreconnectTask, MQTT_RECONNECT_INTERVAL);
+  scheduler.after(mqttReconnectTask, 0, millis());
+  heartbeatTask = scheduler.add("MQTT heartbeat", []()
+                                {
+                                  if (client.connected())
+                                  {
+                                    getSensorStatus(false, StatusTrigger::PERIODIC); // publishes when the values arrived
+                                  } },
+                                cfg.mqtt_periodic_update_interval * 1000UL);
+#ifdef LOOP_TIMING
+  timingTask = scheduler.add("MQTT timing", []()
+                             {
+                               if (client.connected())
+                               {
+                                 publishTiming();
+                               } },
+                             MQTT_TIMING_INTERVAL);
+  scheduler.after(timingTask, MQTT_TIMING_INTERVAL, millis());
+#endif
+
+  // Schedule
+  cleanScheduler.setRules(cfg.schedule, SCHEDULE_RULES);
+  cleanScheduler.setCatchUp(cfg.schedule_catchup);
+  cleanScheduler.onFire(onSchedule);
+
+  // Loop tasks
+  runtime.add("timers", []()
+              { scheduler.loop(millis()); },
+              TASK_BUDGET_TIMERS);
+  runtime.add("OI", oiTask, TASK_BUDGET_OI);
+  runtime.add("LED", ledTask, TASK_BUDGET_LED);
+  runtime.add("button", handleButton, TASK_BUDGET_BUTTON);
+  runtime.add("web", []()
+              {
+                TIMING_SCOPE(loopTiming, TIMING_WEB);
+                server.handleClient(); },
+              TASK_BUDGET_WEB);
+  runtime.add("display", handleDisplay, TASK_BUDGET_DISPLAY);
+  runtime.add("debug", debugTask, TASK_BUDGET_DEBUG);
+  runtime.add("NTP", ntpTask, TASK_BUDGET_NTP);
+  runtime.add("MQTT", mqttTask, TASK_BUDGET_MQTT);
+
   // Begin Wifi
   WiFi.mode(WIFI_OFF);
 
@@ -1849,6 +3329,18 @@ void setup(void)
   server.on("/reboot", handleReboot);
   server.on("/actions", handleActions);
   server.on("/status", handleStatus);
+  server.on("/trace.bin", handleTrace);
+  server.on("/map.png", []()
+            { handleMap(CoverageMap::Format::PNG); });
+  server.on("/map.pbm", []()
+            { handleMap(CoverageMap::Format::PBM); });
+  server.on("/api/history", handleHistory);
+  server.on("/api/sessions", handleSessions);
+  server.on("/api/path", handlePath);
+#ifdef LOOP_TIMING
+  server.on("/api/timing", handleTiming);
+#endif
+  server.on("/metrics", handleMetrics);
   server.on("/fwupdate", handleFWUpdate);
   server.on("/wifiscan", handleWiFiScan);
   server.begin();
@@ -1864,78 +3356,5 @@ void setup(void)
 
 void loop(void)
 {
-  // Update LEDs
-  if (cfg.fancyled == 1)
-  {
-    // LED
-    if (!stopLEDupdate)
-    {
-      led.Update();
-    }
-  }
-  else
-  {
-    // showWEBMQTTAction
-    if (millis() - lastLEDTime >= LED_WEB_MIN_TIME)
-    {
-      analogWrite(PIN_LED_WIFI, 0);
-    }
-  }
-
-  // Button
-  handleButton();
-
-  // Webserver
-  server.handleClient();
-
-  // Display
-  screen.loop();
-  handleDisplay();
-
-  // handle if we have a wifi connection (to wifi station)
-  if (WiFi.status() == WL_CONNECTED)
-  {
-    // Remote Debug
-    if (cfg.telnet)
-    {
-      Debug.handle();
-    }
-
-    // NTPClient Update
-    timeClient.update();
-
-    // MQTT - if config valid
-    if (!configIsDefault)
-    {
-
-      if (!client.connected())
-      {
-        // MQTT connect
-        if (mqttLastReconnectAttempt == 0 || (millis() - mqttLastReconnectAttempt) >= MQTT_RECONNECT_INTERVAL)
-        {
-          mqttLastReconnectAttempt = millis();
-
-          // try to reconnect
-          if (MQTTreconnect())
-          {
-            mqttLastReconnectAttempt = 0;
-          }
-        }
-      }
-      else
-      {
-        // Handle MQTT msgs
-        client.loop();
-
-        // send periodic update if enabled
-        if (cfg.mqtt_periodic_update_interval > 0)
-        {
-          if (millis() >= nextPublishTime)
-          {
-            MQTTpublishStatus(StatusTrigger::PERIODIC);
-          }
-        }
-      }
-    }
-  }
-}
\ No newline at end of file
+  runtime.loop();
+}
@@ -0,0 +1,135 @@
+#include "metrics_writer.h"
+#include "sensor_snapshot.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+// Quantiles of a summary in permille and as label value
+static const uint16_t QUANTILES[] = {500, 900, 990, 999};
+static const char *QUANTILE_NAMES[] = {"0.5", "0.9", "0.99", "0.999"};
+
+MetricsWriter::MetricsWriter(Output output)
+{
+    _output = output;
+}
+
+void MetricsWriter::family(const char *name, const char *type, const char *help)
+{
+    line("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void MetricsWriter::sample(const char *name, const char *labels, unsigned long value)
+{
+    if (labels)
+    {
+        line("%s{%s} %lu\n", name, labels, value);
+    }
+    else
+    {
+        line("%s %lu\n", name, value);
+    }
+}
+
+void MetricsWriter::sample(const char *name, const char *labels, long value)
+{
+    if (labels)
+    {
+        line("%s{%s} %ld\n", name, labels, value);
+    }
+    else
+    {
+        line("%s %ld\n", name, value);
+    }
+}
+
+void MetricsWriter::decimal(const char *name, const char *labels, int32_t value, uint8_t decimals)
+{
+    char number[16];
+    formatDecimal(number, sizeof(number), value, decimals);
+    if (labels)
+    {
+        line("%s{%s} %s\n", name, labels, number);
+    }
+    else
+    {
+        line("%s %s\n", name, number);
+    }
+}
+
+void MetricsWriter::summary(const char *name, const char *labels, LatencyHistogram &histogram)
+{
+    for (uint8_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++)
+    {
+        seconds(name, "", labels, QUANTILE_NAMES[i], histogram.percentile(QUANTILES[i]));
+    }
+    seconds(name, "_sum", labels, nullptr, histogram.sum());
+    if (labels)
+    {
+        line("%s_count{%s} %lu\n", name, labels, histogram.count());
+    }
+    else
+    {
+        line("%s_count %lu\n", name, histogram.count());
+    }
+}
+
+void MetricsWriter::end()
+{
+    flush();
+}
+
+size_t MetricsWriter::bytes()
+{
+    return _bytes + _length;
+}
+
+// Seconds with µs resolution, without float and 64 bit printf
+void MetricsWriter::seconds(const char *name, const char *suffix, const char *labels, const char *quantile, uint64_t us)
+{
+    unsigned long whole = us / 1000000;
+    unsigned long fraction = us % 1000000;
+    if (labels && quantile)
+    {
+        line("%s%s{%s,quantile=\"%s\"} %lu.%06lu\n", name, suffix, labels, quantile, whole, fraction);
+    }
+    else if (labels || quantile)
+    {
+        line(labels ? "%s%s{%s} %lu.%06lu\n" : "%s%s{quantile=\"%s\"} %lu.%06lu\n", name, suffix, labels ? labels : quantile, whole, fraction);
+    }
+    else
+    {
+        line("%s%s %lu.%06lu\n", name, suffix, whole, fraction);
+    }
+}
+
+void MetricsWriter::line(const char *format, ...)
+{
+    if (_length + METRICS_LINE_SIZE > METRICS_BUFFER_SIZE)
+    {
+        flush();
+    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(_buffer + _length, METRICS_LINE_SIZE, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+    if (length >= METRICS_LINE_SIZE)
+    {
+        // Truncated, but still a line of its own
+        length = METRICS_LINE_SIZE - 1;
+        _buffer[_length + length - 1] = '\n';
+    }
+    _length += length;
+}
+
+void MetricsWriter::flush()
+{
+    if (_length > 0 && _output)
+    {
+        _output(_buffer, _length);
+    }
+    _bytes += _length;
+    _length = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef metrics_writer_h
+#define metrics_writer_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "latency_histogram.h"
+
+#define METRICS_BUFFER_SIZE 512 // bytes collected before they are passed to the output
+#define METRICS_LINE_SIZE 160   // longest sample line, a longer one is truncated
+
+// Prometheus text exposition format (version 0.0.4), written line by line
+// into a fixed buffer which is passed to the output when the next line
+// might not fit. Nothing is allocated, the buffer lives with the writer,
+// usually on the stack of the handler.
+//
+// Names, types, help texts and label sets are expected to be literals:
+// they are written as they are, without escaping.
+//
+//   MetricsWriter metrics(output);
+//   metrics.family("roomba_free_heap_bytes", "gauge", "Free heap");
+//   metrics.sample("roomba_free_heap_bytes", nullptr, ESP.getFreeHeap());
+//   metrics.end();
+class MetricsWriter
+{
+public:
+    typedef std::function<void(const char *data, size_t length)> Output;
+
+    MetricsWriter(Output output);
+
+    // # HELP and # TYPE lines, once before the samples of a metric
+    void family(const char *name, const char *type, const char *help);
+
+    // name{labels} value, labels without braces (e.g. "task=\"oi\"") or nullptr
+    void sample(const char *name, const char *labels, unsigned long value);
+    void sample(const char *name, const char *labels, long value);
+    void decimal(const char *name, const char *labels, int32_t value, uint8_t decimals); // value / 10^decimals
+
+    // Percentiles and totals of a histogram in µs as a summary in seconds:
+    // name{quantile="..."}, name_sum and name_count
+    void summary(const char *name, const char *labels, LatencyHistogram &histogram);
+
+    void end(); // passes the rest of the buffer to the output
+    size_t bytes(); // written so far, including the buffer
+
+private:
+    void line(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    void seconds(const char *name, const char *suffix, const char *labels, const char *quantile, uint64_t us);
+    void flush();
+
+    Output _output;
+    char _buffer[METRICS_BUFFER_SIZE];
+    size_t _length = 0;
+    size_t _bytes = 0;
+};
+
+#endif
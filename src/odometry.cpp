@@ -0,0 +1,389 @@
+#include "odometry.h"
+
+// Wheel travel per encoder count in nm, heading change per count of
+// difference between the wheels as binary angle
+static const int64_t NM_PER_COUNT = (int64_t)(ODOMETRY_WHEEL_DIAMETER * 3.14159265358979 / ODOMETRY_COUNTS_PER_REV * 1e6 + 0.5);
+static const int64_t ANGLE_PER_COUNT = (int64_t)(ODOMETRY_WHEEL_DIAMETER / (2 * ODOMETRY_COUNTS_PER_REV * ODOMETRY_WHEELBASE) * 4294967296.0 + 0.5);
+
+// Quarter wave sin(z * pi/2) ~ z * (A - z^2 * (B - z^2 * C)), coefficients in Q15
+static const int64_t SIN_A = 51437;
+static const int64_t SIN_B = 20953;
+static const int64_t SIN_C = 2285;
+
+static uint32_t isqrt(uint64_t value)
+{
+    uint64_t root = 0;
+    for (uint64_t bit = 1ULL << 62; bit > 0; bit >>= 2)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+    }
+    return (uint32_t)root;
+}
+
+void Odometry::setPacket(uint8_t id, int32_t value)
+{
+    switch (id)
+    {
+    case 19:
+        _reported += value;
+        break;
+    case 20:
+        _reportedAngle += value;
+        break;
+    case 43:
+        _leftCounts = value;
+        _encoders |= 1;
+        break;
+    case 44:
+        _rightCounts = value;
+        _encoders |= 2;
+        break;
+    }
+}
+
+void Odometry::update(unsigned long ms)
+{
+    if (_encoders == 3)
+    {
+        unsigned long elapsed = ms - _lastTime;
+        int16_t left = (int16_t)(_leftCounts - _lastLeft);
+        int16_t right = (int16_t)(_rightCounts - _lastRight);
+
+        if (!_valid || elapsed > ODOMETRY_MAX_GAP ||
+            (!plausible(left, right, elapsed) && _skipped && plausible(_leftCounts - _skippedLeft, _rightCounts - _skippedRight, ms - _skippedTime)))
+        {
+            // Start over from these counts, the motion in between is unknown.
+            // Also when the counts continue from a skipped frame: they jumped
+            // for real, e.g. after a restart of the Roomba.
+            if (_valid)
+            {
+                _gaps++;
+            }
+            _valid = true;
+            _skipped = false;
+            _lastTime = ms;
+            _lastLeft = _leftCounts;
+            _lastRight = _rightCounts;
+        }
+        else if (!plausible(left, right, elapsed))
+        {
+            // Corrupted counts which passed the frame check. The frame is
+            // skipped, the counts of the next one cover its motion.
+            _skipped = true;
+            _skippedTime = ms;
+            _skippedLeft = _leftCounts;
+            _skippedRight = _rightCounts;
+            _rejected++;
+        }
+        else
+        {
+            integrate(left, right);
+            _reportedDistance += _reported;
+            _reportedHeading += _reportedAngle;
+            _windowReported += _reported;
+            _windowReportedAngle += _reportedAngle;
+            check();
+            addRawPoint();
+            _skipped = false;
+            _lastTime = ms;
+            _lastLeft = _leftCounts;
+            _lastRight = _rightCounts;
+        }
+    }
+
+    _encoders = 0;
+    _reported = 0;
+    _reportedAngle = 0;
+}
+
+// Wheels not faster than ODOMETRY_MAX_SPEED, with some jitter of the frames
+bool Odometry::plausible(int16_t left, int16_t right, unsigned long elapsed)
+{
+    int32_t limit = (int64_t)ODOMETRY_MAX_SPEED * elapsed * 1000 / NM_PER_COUNT + 10;
+    return left <= limit && left >= -limit && right <= limit && right >= -limit;
+}
+
+void Odometry::reset()
+{
+    _x = 0;
+    _y = 0;
+    _theta = 0;
+    _travel = 0;
+
+    _encoderDistance = 0;
+    _encoderAngle = 0;
+    _reportedDistance = 0;
+    _reportedHeading = 0;
+    _windowStart = 0;
+    _windowDistance = 0;
+    _windowAngle = 0;
+    _windowReported = 0;
+    _windowReportedAngle = 0;
+    _distanceSum = 0;
+    _headingSum = 0;
+    _drift = OdometryDrift();
+
+    _path[0] = PathPoint{0, 0};
+    _pathCount = 1;
+    _buffer[0] = _path[0];
+    _bufferCount = 1;
+    _tolerance = ODOMETRY_PATH_TOLERANCE;
+    _rawPoints = 1;
+}
+
+bool Odometry::valid()
+{
+    return _valid;
+}
+
+Pose Odometry::pose()
+{
+    Pose pose;
+    pose.x = _x / 1000;
+    pose.y = _y / 1000;
+    pose.theta = _theta;
+    return pose;
+}
+
+int32_t Odometry::headingDecidegrees()
+{
+    return ((int64_t)(int32_t)_theta * 3600) >> 32;
+}
+
+uint32_t Odometry::travel()
+{
+    return _travel / 1000;
+}
+
+// The stored path and the buffered points which are not simplified yet
+uint16_t Odometry::pathCount()
+{
+    return _pathCount == 0 ? 0 : _pathCount + _bufferCount - 1;
+}
+
+PathPoint Odometry::pathPoint(uint16_t index)
+{
+    if (index < _pathCount)
+    {
+        return _path[index];
+    }
+    index -= _pathCount - 1;
+    return index < _bufferCount ? _buffer[index] : PathPoint{0, 0};
+}
+
+uint16_t Odometry::pathTolerance()
+{
+    return _tolerance;
+}
+
+unsigned long Odometry::rawPoints()
+{
+    return _rawPoints;
+}
+
+const OdometryDrift &Odometry::drift()
+{
+    return _drift;
+}
+
+int32_t Odometry::distanceDifference()
+{
+    return _encoderDistance / 1000 - _reportedDistance;
+}
+
+int32_t Odometry::headingDifference()
+{
+    return (_encoderAngle * 3600 >> 32) - _reportedHeading * 10;
+}
+
+unsigned long Odometry::gaps()
+{
+    return _gaps;
+}
+
+unsigned long Odometry::rejected()
+{
+    return _rejected;
+}
+
+int32_t Odometry::sinQ15(uint32_t angle)
+{
+    uint32_t quadrant = angle >> 30;
+    uint32_t position = angle & 0x3FFFFFFF; // 2^30 = 90 degrees
+    if (quadrant & 1)
+    {
+        position = 0x40000000 - position;
+    }
+    int64_t z = position >> 15;
+    int64_t z2 = z * z >> 15;
+    int32_t value = z * (SIN_A - (z2 * (SIN_B - (z2 * SIN_C >> 15)) >> 15)) >> 15;
+    return quadrant >= 2 ? -value : value;
+}
+
+int32_t Odometry::cosQ15(uint32_t angle)
+{
+    return sinQ15(angle + 0x40000000);
+}
+
+// Move along the heading in the middle of the frame
+void Odometry::integrate(int32_t left, int32_t right)
+{
+    int64_t distance = (int64_t)(left + right) * NM_PER_COUNT / 2000; // µm
+    int64_t turn = (int64_t)(right - left) * ANGLE_PER_COUNT;
+    uint32_t heading = _theta + (uint32_t)(turn / 2);
+
+    _x += distance * cosQ15(heading) / 32768;
+    _y += distance * sinQ15(heading) / 32768;
+    _theta += (uint32_t)turn;
+    _travel += (int64_t)((left < 0 ? -left : left) + (right < 0 ? -right : right)) * NM_PER_COUNT / 2000;
+
+    _encoderDistance += distance;
+    _encoderAngle += turn;
+    _windowDistance += distance;
+    _windowAngle += turn;
+}
+
+// Compare a finished window of travel with the distance and angle packets
+void Odometry::check()
+{
+    uint32_t travel = (_travel - _windowStart) / 1000;
+    if (travel < ODOMETRY_CHECK_TRAVEL)
+    {
+        return;
+    }
+
+    int32_t distance = _windowDistance / 1000 - _windowReported;
+    int32_t heading = (_windowAngle * 3600 >> 32) - _windowReportedAngle * 10;
+    uint32_t distanceError = (uint32_t)(distance < 0 ? -distance : distance) * 1000UL / travel;
+    uint32_t headingError = (uint32_t)(heading < 0 ? -heading : heading) * 1000UL / travel;
+
+    _drift.windows++;
+    _distanceSum += distanceError;
+    _headingSum += headingError;
+    _drift.distanceMean = _distanceSum / _drift.windows;
+    _drift.headingMean = _headingSum / _drift.windows;
+    _drift.distanceMax = distanceError > _drift.distanceMax ? distanceError : _drift.distanceMax;
+    _drift.headingMax = headingError > _drift.headingMax ? headingError : _drift.headingMax;
+
+    _windowStart = _travel;
+    _windowDistance = 0;
+    _windowAngle = 0;
+    _windowReported = 0;
+    _windowReportedAngle = 0;
+}
+
+void Odometry::addRawPoint()
+{
+    if (_bufferCount == 0)
+    {
+        return; // no path before the first reset
+    }
+
+    PathPoint point = {(int16_t)(_x / 10000), (int16_t)(_y / 10000)};
+    const PathPoint &last = _buffer[_bufferCount - 1];
+    int32_t dx = point.x - last.x;
+    int32_t dy = point.y - last.y;
+    if (dx * dx + dy * dy < (ODOMETRY_PATH_STEP / 10) * (ODOMETRY_PATH_STEP / 10))
+    {
+        return;
+    }
+
+    _buffer[_bufferCount++] = point;
+    _rawPoints++;
+    if (_bufferCount == ODOMETRY_PATH_BUFFER)
+    {
+        flushPath();
+    }
+}
+
+// Append the simplified buffer to the path, the last point starts the next buffer
+void Odometry::flushPath()
+{
+    _bufferCount = simplify(_buffer, _bufferCount, _tolerance);
+    while (_pathCount + _bufferCount - 1 > ODOMETRY_PATH_POINTS && _tolerance < 0x4000)
+    {
+        _tolerance *= 2;
+        _pathCount = simplify(_path, _pathCount, _tolerance);
+        _bufferCount = simplify(_buffer, _bufferCount, _tolerance);
+    }
+
+    for (uint16_t i = 1; i < _bufferCount && _pathCount < ODOMETRY_PATH_POINTS; i++)
+    {
+        _path[_pathCount++] = _buffer[i];
+    }
+    _buffer[0] = _buffer[_bufferCount - 1];
+    _bufferCount = 1;
+}
+
+// Douglas-Peucker without recursion: the segment from a kept point to the
+// next one is split at its farthest point until no point is farther than
+// the tolerance (mm), then the next segment follows. Compacts the points in
+// place and returns their new count.
+uint16_t Odometry::simplify(PathPoint *points, uint16_t count, int32_t tolerance)
+{
+    if (count <= 2)
+    {
+        return count;
+    }
+
+    uint8_t keep[(ODOMETRY_PATH_POINTS + 7) / 8] = {};
+    keep[0] |= 1;
+    keep[(count - 1) / 8] |= 1 << ((count - 1) % 8);
+
+    uint16_t start = 0;
+    while (start < count - 1)
+    {
+        uint16_t end = start + 1;
+        while (!(keep[end / 8] & (1 << (end % 8))))
+        {
+            end++;
+        }
+
+        // Distance to the segment's line: |cross| / length, in cm
+        int64_t dx = points[end].x - points[start].x;
+        int64_t dy = points[end].y - points[start].y;
+        int64_t length = isqrt(dx * dx + dy * dy);
+        int64_t farthest = 0;
+        uint16_t index = 0;
+        for (uint16_t i = start + 1; i < end; i++)
+        {
+            int64_t px = points[i].x - points[start].x;
+            int64_t py = points[i].y - points[start].y;
+            int64_t distance = length > 0 ? (dx * py - dy * px) : isqrt(px * px + py * py);
+            distance = distance < 0 ? -distance : distance;
+            if (distance > farthest)
+            {
+                farthest = distance;
+                index = i;
+            }
+        }
+
+        // farthest * 10 / length > tolerance in mm
+        if (index != 0 && farthest * 10 > tolerance * (length > 0 ? length : 1))
+        {
+            keep[index / 8] |= 1 << (index % 8);
+        }
+        else
+        {
+            start = end;
+        }
+    }
+
+    uint16_t kept = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (keep[i / 8] & (1 << (i % 8)))
+        {
+            points[kept++] = points[i];
+        }
+    }
+    return kept;
+}
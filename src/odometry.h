@@ -0,0 +1,145 @@
+#ifndef odometry_h
+#define odometry_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ODOMETRY_WHEEL_DIAMETER 72.0   // mm (Roomba 600 OI spec)
+#define ODOMETRY_COUNTS_PER_REV 508.8  // encoder counts per wheel revolution
+#define ODOMETRY_WHEELBASE 235.0       // mm between the wheels
+#define ODOMETRY_MAX_GAP 20000         // ms without encoder counts after which the counts can't be unwrapped
+#define ODOMETRY_MAX_SPEED 1000        // mm/s, faster wheels are corrupted counts
+#define ODOMETRY_CHECK_TRAVEL 1000     // mm of travel per drift window
+#define ODOMETRY_PATH_POINTS 256       // simplified path points of a session
+#define ODOMETRY_PATH_BUFFER 32        // raw points simplified at once
+#define ODOMETRY_PATH_STEP 50          // mm of movement per raw point
+#define ODOMETRY_PATH_TOLERANCE 20     // mm, initial Douglas-Peucker tolerance
+
+// Position in mm and heading as binary angle (2^32 = 360 degrees, wraps on its own)
+struct Pose
+{
+    int32_t x = 0;
+    int32_t y = 0;
+    uint32_t theta = 0; // counter-clockwise, 0 = direction at the reset
+};
+
+struct PathPoint
+{
+    int16_t x; // cm
+    int16_t y;
+};
+
+// Encoder against distance/angle (packets 19/20), per window of
+// ODOMETRY_CHECK_TRAVEL mm
+struct OdometryDrift
+{
+    unsigned long windows = 0;
+    uint32_t distanceMean = 0; // mean absolute difference, mm per m of travel
+    uint32_t distanceMax = 0;
+    uint32_t headingMean = 0;  // mean absolute difference, 1/10 degree per m of travel
+    uint32_t headingMax = 0;
+};
+
+// Dead reckoning from the wheel encoders (packets 43/44) at the stream rate.
+//
+// The 16 bit counters are unwrapped by their difference to the last frame,
+// which is unambiguous up to ODOMETRY_MAX_GAP: 32768 counts are 14.5 m, 29 s
+// at full speed. Distance and heading change of a frame move the pose along
+// the heading in the middle of the frame, all in integers: the pose in µm
+// and a binary angle, sine and cosine from a polynomial in Q15.
+//
+// A frame with counts faster than ODOMETRY_MAX_SPEED is skipped: corrupted
+// bytes can pass the 8 bit checksum of the stream. The next frame is
+// measured from the last good counts, so the motion of the skipped frame
+// isn't lost. Only when the next frame continues from the skipped counts,
+// they jumped for real and the counts start over.
+//
+// The distance and angle packets (19/20) integrate the same motion inside
+// the Roomba. They are not used for the pose, but compared with it per
+// window of travel, which gives the drift between the two.
+//
+// The path of a session is kept as a polyline: a raw point per
+// ODOMETRY_PATH_STEP of movement, simplified with Douglas-Peucker in
+// batches of ODOMETRY_PATH_BUFFER. When the path is full, the tolerance
+// doubles and the whole path is simplified again, so it always fits into
+// ODOMETRY_PATH_POINTS.
+class Odometry
+{
+public:
+    void setPacket(uint8_t id, int32_t value); // a packet of the current frame
+    void update(unsigned long ms);             // end of a frame
+
+    void reset();     // pose to the origin, new path
+    bool valid();     // encoder counts arrived
+    Pose pose();
+    int32_t headingDecidegrees(); // -1800..1799
+    uint32_t travel();            // mm driven since the reset, both directions
+
+    uint16_t pathCount();
+    PathPoint pathPoint(uint16_t index);
+    uint16_t pathTolerance();  // mm
+    unsigned long rawPoints(); // since the reset
+
+    const OdometryDrift &drift();
+    int32_t distanceDifference(); // mm, encoders minus packet 19 since the reset
+    int32_t headingDifference();  // 1/10 degree, encoders minus packet 20 since the reset
+    unsigned long gaps();         // restarts of the encoder counts after a gap or a jump of the counts
+    unsigned long rejected();     // frames skipped for implausible counts
+
+    static int32_t sinQ15(uint32_t angle);
+    static int32_t cosQ15(uint32_t angle);
+
+private:
+    bool plausible(int16_t left, int16_t right, unsigned long elapsed);
+    void integrate(int32_t left, int32_t right);
+    void check();
+    void addRawPoint();
+    void flushPath();
+    uint16_t simplify(PathPoint *points, uint16_t count, int32_t tolerance); // tolerance in mm
+
+    // Frame
+    uint16_t _leftCounts = 0;
+    uint16_t _rightCounts = 0;
+    uint8_t _encoders = 0; // bits of the encoders which arrived in the frame
+    int32_t _reported = 0; // mm of packet 19 in the frame
+    int32_t _reportedAngle = 0;
+
+    bool _valid = false;
+    unsigned long _lastTime = 0;
+    uint16_t _lastLeft = 0;
+    uint16_t _lastRight = 0;
+
+    int64_t _x = 0; // µm
+    int64_t _y = 0;
+    uint32_t _theta = 0;
+    uint64_t _travel = 0; // µm
+    unsigned long _gaps = 0;
+    unsigned long _rejected = 0;
+    bool _skipped = false; // the last frame had implausible counts
+    unsigned long _skippedTime = 0;
+    uint16_t _skippedLeft = 0;
+    uint16_t _skippedRight = 0;
+
+    // Totals and window of the drift check
+    int64_t _encoderDistance = 0;  // µm, since the reset
+    int64_t _encoderAngle = 0;     // binary angle, unwrapped
+    int32_t _reportedDistance = 0; // mm
+    int32_t _reportedHeading = 0;  // degrees
+    uint64_t _windowStart = 0;     // µm of travel
+    int64_t _windowDistance = 0;   // µm
+    int64_t _windowAngle = 0;
+    int32_t _windowReported = 0;
+    int32_t _windowReportedAngle = 0;
+    uint64_t _distanceSum = 0;
+    uint64_t _headingSum = 0;
+    OdometryDrift _drift;
+
+    PathPoint _path[ODOMETRY_PATH_POINTS];
+    uint16_t _pathCount = 0;
+    PathPoint _buffer[ODOMETRY_PATH_BUFFER];
+    uint16_t _bufferCount = 0;
+    uint16_t _tolerance = ODOMETRY_PATH_TOLERANCE;
+    unsigned long _rawPoints = 0;
+};
+
+#endif
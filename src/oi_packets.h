@@ -0,0 +1,334 @@
+#ifndef oi_packets_h
+#define oi_packets_h
+
+#include <stdint.h>
+
+// Roomba 600 Open Interface sensor packets (see _docu/iRobot_Roomba_600_Open_Interface_Spec-1.pdf)
+//
+// Everything is derived from the OI_PACKETS table at compile time: sizes,
+// signedness, group layouts, decoders and JSON keys. Adding a sensor is a
+// new row in the table.
+
+#define OI_PACKET_FIRST 7
+#define OI_PACKET_LAST 58
+#define OI_PACKET_COUNT (OI_PACKET_LAST - OI_PACKET_FIRST + 1)
+
+enum OIPacketID : uint8_t
+{
+    OI_PACKET_BUMPS_WHEELDROPS = 7,
+    OI_PACKET_WALL = 8,
+    OI_PACKET_CLIFF_LEFT = 9,
+    OI_PACKET_CLIFF_FRONT_LEFT = 10,
+    OI_PACKET_CLIFF_FRONT_RIGHT = 11,
+    OI_PACKET_CLIFF_RIGHT = 12,
+    OI_PACKET_VIRTUAL_WALL = 13,
+    OI_PACKET_WHEEL_OVERCURRENTS = 14,
+    OI_PACKET_DIRT_DETECT = 15,
+    OI_PACKET_IR_OMNI = 17,
+    OI_PACKET_BUTTONS = 18,
+    OI_PACKET_DISTANCE = 19,
+    OI_PACKET_ANGLE = 20,
+    OI_PACKET_CHARGING_STATE = 21,
+    OI_PACKET_VOLTAGE = 22,
+    OI_PACKET_CURRENT = 23,
+    OI_PACKET_TEMPERATURE = 24,
+    OI_PACKET_BATTERY_CHARGE = 25,
+    OI_PACKET_BATTERY_CAPACITY = 26,
+    OI_PACKET_WALL_SIGNAL = 27,
+    OI_PACKET_CHARGING_SOURCES = 34,
+    OI_PACKET_OI_MODE = 35,
+    OI_PACKET_SONG_NUMBER = 36,
+    OI_PACKET_SONG_PLAYING = 37,
+    OI_PACKET_STREAM_PACKETS = 38,
+    OI_PACKET_REQUESTED_VELOCITY = 39,
+    OI_PACKET_REQUESTED_RADIUS = 40,
+    OI_PACKET_LEFT_ENCODER = 43,
+    OI_PACKET_RIGHT_ENCODER = 44,
+    OI_PACKET_LIGHT_BUMPER = 45,
+    OI_PACKET_LEFT_MOTOR_CURRENT = 54,
+    OI_PACKET_RIGHT_MOTOR_CURRENT = 55,
+    OI_PACKET_MAIN_BRUSH_CURRENT = 56,
+    OI_PACKET_SIDE_BRUSH_CURRENT = 57,
+    OI_PACKET_STASIS = 58
+};
+
+enum class OIUnit : uint8_t
+{
+    NONE,
+    MM,
+    DEGREE,
+    MV,
+    MA,
+    CELSIUS,
+    MAH,
+    MM_PER_SEC,
+    COUNTS
+};
+
+struct OIPacketInfo
+{
+    uint8_t id;
+    uint8_t size;
+    bool isSigned;
+    OIUnit unit;
+    const char *name; // JSON key
+};
+
+constexpr OIPacketInfo OI_PACKETS[] = {
+    {7, 1, false, OIUnit::NONE, "bumps_wheeldrops"},
+    {8, 1, false, OIUnit::NONE, "wall"},
+    {9, 1, false, OIUnit::NONE, "cliff_left"},
+    {10, 1, false, OIUnit::NONE, "cliff_front_left"},
+    {11, 1, false, OIUnit::NONE, "cliff_front_right"},
+    {12, 1, false, OIUnit::NONE, "cliff_right"},
+    {13, 1, false, OIUnit::NONE, "virtual_wall"},
+    {14, 1, false, OIUnit::NONE, "wheel_overcurrents"},
+    {15, 1, false, OIUnit::NONE, "dirt_detect"},
+    {16, 1, false, OIUnit::NONE, "unused_16"},
+    {17, 1, false, OIUnit::NONE, "ir_omni"},
+    {18, 1, false, OIUnit::NONE, "buttons"},
+    {19, 2, true, OIUnit::MM, "distance"},
+    {20, 2, true, OIUnit::DEGREE, "angle"},
+    {21, 1, false, OIUnit::NONE, "charging_state"},
+    {22, 2, false, OIUnit::MV, "voltage"},
+    {23, 2, true, OIUnit::MA, "current"},
+    {24, 1, true, OIUnit::CELSIUS, "temperature"},
+    {25, 2, false, OIUnit::MAH, "battery_charge"},
+    {26, 2, false, OIUnit::MAH, "battery_capacity"},
+    {27, 2, false, OIUnit::NONE, "wall_signal"},
+    {28, 2, false, OIUnit::NONE, "cliff_left_signal"},
+    {29, 2, false, OIUnit::NONE, "cliff_front_left_signal"},
+    {30, 2, false, OIUnit::NONE, "cliff_front_right_signal"},
+    {31, 2, false, OIUnit::NONE, "cliff_right_signal"},
+    {32, 1, false, OIUnit::NONE, "unused_32"},
+    {33, 2, false, OIUnit::NONE, "unused_33"},
+    {34, 1, false, OIUnit::NONE, "charging_sources"},
+    {35, 1, false, OIUnit::NONE, "oi_mode"},
+    {36, 1, false, OIUnit::NONE, "song_number"},
+    {37, 1, false, OIUnit::NONE, "song_playing"},
+    {38, 1, false, OIUnit::NONE, "stream_packets"},
+    {39, 2, true, OIUnit::MM_PER_SEC, "requested_velocity"},
+    {40, 2, true, OIUnit::MM, "requested_radius"},
+    {41, 2, true, OIUnit::MM_PER_SEC, "requested_right_velocity"},
+    {42, 2, true, OIUnit::MM_PER_SEC, "requested_left_velocity"},
+    {43, 2, false, OIUnit::COUNTS, "left_encoder"},
+    {44, 2, false, OIUnit::COUNTS, "right_encoder"},
+    {45, 1, false, OIUnit::NONE, "light_bumper"},
+    {46, 2, false, OIUnit::NONE, "light_bump_left"},
+    {47, 2, false, OIUnit::NONE, "light_bump_front_left"},
+    {48, 2, false, OIUnit::NONE, "light_bump_center_left"},
+    {49, 2, false, OIUnit::NONE, "light_bump_center_right"},
+    {50, 2, false, OIUnit::NONE, "light_bump_front_right"},
+    {51, 2, false, OIUnit::NONE, "light_bump_right"},
+    {52, 1, false, OIUnit::NONE, "ir_left"},
+    {53, 1, false, OIUnit::NONE, "ir_right"},
+    {54, 2, true, OIUnit::MA, "left_motor_current"},
+    {55, 2, true, OIUnit::MA, "right_motor_current"},
+    {56, 2, true, OIUnit::MA, "main_brush_current"},
+    {57, 2, true, OIUnit::MA, "side_brush_current"},
+    {58, 1, false, OIUnit::NONE, "stasis"},
+};
+
+// Packet groups are ranges of consecutive packets
+struct OIGroupInfo
+{
+    uint8_t id;
+    uint8_t first;
+    uint8_t last;
+};
+
+constexpr OIGroupInfo OI_GROUPS[] = {
+    {0, 7, 26},
+    {1, 7, 16},
+    {2, 17, 20},
+    {3, 21, 26},
+    {4, 27, 34},
+    {5, 35, 42},
+    {6, 7, 42},
+    {100, 7, 58},
+    {101, 43, 58},
+    {106, 46, 51},
+    {107, 54, 58},
+};
+
+// Offset of every packet in the complete packet list (= group 100)
+struct OIPacketOffsets
+{
+    uint8_t offset[OI_PACKET_COUNT + 1];
+
+    constexpr OIPacketOffsets() : offset()
+    {
+        uint8_t position = 0;
+        for (uint8_t i = 0; i < OI_PACKET_COUNT; i++)
+        {
+            offset[i] = position;
+            position += OI_PACKETS[i].size;
+        }
+        offset[OI_PACKET_COUNT] = position;
+    }
+};
+
+constexpr OIPacketOffsets OI_PACKET_OFFSETS;
+
+constexpr bool oiIsPacket(uint8_t id)
+{
+    return id >= OI_PACKET_FIRST && id <= OI_PACKET_LAST;
+}
+
+constexpr const OIPacketInfo &oiPacket(uint8_t id)
+{
+    return OI_PACKETS[id - OI_PACKET_FIRST];
+}
+
+// Group info, nullptr if the ID is no group
+constexpr const OIGroupInfo *oiGroup(uint8_t id)
+{
+    for (const OIGroupInfo &group : OI_GROUPS)
+    {
+        if (group.id == id)
+        {
+            return &group;
+        }
+    }
+    return nullptr;
+}
+
+constexpr uint8_t oiGroupSize(const OIGroupInfo &group)
+{
+    return OI_PACKET_OFFSETS.offset[group.last - OI_PACKET_FIRST + 1] - OI_PACKET_OFFSETS.offset[group.first - OI_PACKET_FIRST];
+}
+
+constexpr bool oiGroupContains(const OIGroupInfo &group, uint8_t id)
+{
+    return id >= group.first && id <= group.last;
+}
+
+constexpr uint8_t oiGroupOffset(const OIGroupInfo &group, uint8_t id)
+{
+    return OI_PACKET_OFFSETS.offset[id - OI_PACKET_FIRST] - OI_PACKET_OFFSETS.offset[group.first - OI_PACKET_FIRST];
+}
+
+// Size of a sensor packet or packet group in bytes, 0 if unknown
+constexpr uint8_t oiPacketSize(uint8_t id)
+{
+    return oiIsPacket(id) ? oiPacket(id).size : (oiGroup(id) != nullptr ? oiGroupSize(*oiGroup(id)) : 0);
+}
+
+// Value of a single sensor packet, data in OI byte order (high byte first)
+constexpr int32_t oiPacketValue(uint8_t id, const uint8_t *data)
+{
+    return oiPacket(id).size == 1
+               ? (oiPacket(id).isSigned ? (int32_t)(int8_t)data[0] : (int32_t)data[0])
+               : (oiPacket(id).isSigned ? (int32_t)(int16_t)((data[0] << 8) | data[1]) : (int32_t)(uint16_t)((data[0] << 8) | data[1]));
+}
+
+// Decode all packets of a group, values must have room for every packet of the group
+inline uint8_t oiDecodeGroup(const OIGroupInfo &group, const uint8_t *data, int32_t *values)
+{
+    uint8_t count = 0;
+    for (uint8_t id = group.first; id <= group.last; id++)
+    {
+        values[count++] = oiPacketValue(id, data);
+        data += oiPacket(id).size;
+    }
+    return count;
+}
+
+constexpr const char *oiUnitName(OIUnit unit)
+{
+    switch (unit)
+    {
+    case OIUnit::MM:
+        return "mm";
+    case OIUnit::DEGREE:
+        return "deg";
+    case OIUnit::MV:
+        return "mV";
+    case OIUnit::MA:
+        return "mA";
+    case OIUnit::CELSIUS:
+        return "C";
+    case OIUnit::MAH:
+        return "mAh";
+    case OIUnit::MM_PER_SEC:
+        return "mm/s";
+    case OIUnit::COUNTS:
+        return "counts";
+    case OIUnit::NONE:
+        break;
+    }
+    return "";
+}
+
+// Typed decoders, e.g. oiDecode<OI_PACKET_VOLTAGE>(data) returns uint16_t
+template <uint8_t Size, bool Signed>
+struct OIValueType;
+template <>
+struct OIValueType<1, false>
+{
+    typedef uint8_t type;
+};
+template <>
+struct OIValueType<1, true>
+{
+    typedef int8_t type;
+};
+template <>
+struct OIValueType<2, false>
+{
+    typedef uint16_t type;
+};
+template <>
+struct OIValueType<2, true>
+{
+    typedef int16_t type;
+};
+
+template <uint8_t ID>
+using OIValue = typename OIValueType<oiPacket(ID).size, oiPacket(ID).isSigned>::type;
+
+template <uint8_t ID>
+constexpr OIValue<ID> oiDecode(const uint8_t *data)
+{
+    static_assert(oiIsPacket(ID), "unknown sensor packet");
+    return (OIValue<ID>)oiPacketValue(ID, data);
+}
+
+// Decode a packet inside the response of a packet group, e.g. oiDecode<3, OI_PACKET_VOLTAGE>(sensorbytes)
+template <uint8_t GROUP, uint8_t ID>
+constexpr OIValue<ID> oiDecode(const uint8_t *groupData)
+{
+    static_assert(oiGroup(GROUP) != nullptr, "unknown sensor packet group");
+    static_assert(oiGroupContains(*oiGroup(GROUP), ID), "sensor packet not part of the group");
+    return oiDecode<ID>(groupData + oiGroupOffset(*oiGroup(GROUP), ID));
+}
+
+// Check the table against the group sizes of the OI spec
+constexpr bool oiPacketTableValid()
+{
+    for (uint8_t i = 0; i < OI_PACKET_COUNT; i++)
+    {
+        if (OI_PACKETS[i].id != OI_PACKET_FIRST + i || OI_PACKETS[i].size < 1 || OI_PACKETS[i].size > 2)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(sizeof(OI_PACKETS) / sizeof(OI_PACKETS[0]) == OI_PACKET_COUNT, "OI_PACKETS must contain every packet");
+static_assert(oiPacketTableValid(), "OI_PACKETS must be ordered by ID");
+static_assert(oiPacketSize(0) == 26, "group 0 size");
+static_assert(oiPacketSize(1) == 10, "group 1 size");
+static_assert(oiPacketSize(2) == 6, "group 2 size");
+static_assert(oiPacketSize(3) == 10, "group 3 size");
+static_assert(oiPacketSize(4) == 14, "group 4 size");
+static_assert(oiPacketSize(5) == 12, "group 5 size");
+static_assert(oiPacketSize(6) == 52, "group 6 size");
+static_assert(oiPacketSize(100) == 80, "group 100 size");
+static_assert(oiPacketSize(101) == 28, "group 101 size");
+static_assert(oiPacketSize(106) == 12, "group 106 size");
+static_assert(oiPacketSize(107) == 9, "group 107 size");
+static_assert(oiGroupOffset(*oiGroup(3), OI_PACKET_BATTERY_CAPACITY) == 8, "group 3 layout");
+
+#endif
@@ -0,0 +1,189 @@
+#include "oi_stream.h"
+#include "oi_packets.h"
+#include <string.h>
+
+void OIStreamParser::onPacket(PacketCallback callback)
+{
+    _packetCallback = callback;
+}
+
+void OIStreamParser::onFrame(FrameCallback callback)
+{
+    _frameCallback = callback;
+}
+
+// Accept only frames with exactly these packets in this order, a count of 0
+// accepts any single packets again
+bool OIStreamParser::expect(const uint8_t *packets, uint8_t count)
+{
+    if (count > OI_STREAM_PACKETS_MAX)
+    {
+        return false;
+    }
+    memcpy(_expected, packets, count);
+    _expectedCount = count;
+    return true;
+}
+
+void OIStreamParser::feed(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        feed(data[i]);
+    }
+}
+
+void OIStreamParser::feed(uint8_t data)
+{
+    if (_length == 0 && data != OI_STREAM_HEADER)
+    {
+        _droppedBytes++;
+        return;
+    }
+
+    _buff[_length++] = data;
+    parse();
+}
+
+void OIStreamParser::reset()
+{
+    _length = 0;
+}
+
+unsigned long OIStreamParser::frames()
+{
+    return _frames;
+}
+
+unsigned long OIStreamParser::checksumErrors()
+{
+    return _checksumErrors;
+}
+
+unsigned long OIStreamParser::frameErrors()
+{
+    return _frameErrors;
+}
+
+unsigned long OIStreamParser::droppedBytes()
+{
+    return _droppedBytes;
+}
+
+// Check the buffered bytes. Normally the buffer holds exactly one (partial)
+// frame, after a resync it may hold more than one.
+void OIStreamParser::parse()
+{
+    while (_length > 0)
+    {
+        if (_buff[0] != OI_STREAM_HEADER)
+        {
+            resync();
+            continue;
+        }
+
+        if (_length < 2)
+        {
+            return;
+        }
+
+        if (_buff[1] == 0 || _buff[1] + 3 > OI_STREAM_FRAME_MAX)
+        {
+            _frameErrors++;
+            resync();
+            continue;
+        }
+
+        uint8_t frameLength = _buff[1] + 3;
+
+        if (_length < frameLength)
+        {
+            return;
+        }
+
+        uint8_t checksum = 0;
+        for (uint8_t i = 0; i < frameLength; i++)
+        {
+            checksum += _buff[i];
+        }
+
+        if (checksum != 0)
+        {
+            _checksumErrors++;
+            resync();
+            continue;
+        }
+
+        if (dispatch())
+        {
+            _frames++;
+        }
+        else
+        {
+            _frameErrors++;
+        }
+
+        _length -= frameLength;
+        memmove(_buff, _buff + frameLength, _length);
+    }
+}
+
+// Drop the first byte and everything up to the next possible header
+void OIStreamParser::resync()
+{
+    uint8_t i = 1;
+    while (i < _length && _buff[i] != OI_STREAM_HEADER)
+    {
+        i++;
+    }
+    _droppedBytes += i;
+    _length -= i;
+    memmove(_buff, _buff + i, _length);
+}
+
+bool OIStreamParser::dispatch()
+{
+    uint8_t end = _buff[1] + 2;
+
+    // Validate the packet layout first, so a bad frame never updates anything.
+    // Groups are valid in a stream request, but the receivers decode single
+    // packets only (oiPacketValue()).
+    uint8_t i = 2;
+    uint8_t count = 0;
+    while (i < end)
+    {
+        uint8_t id = _buff[i];
+        if (!oiIsPacket(id) || i + 1 + oiPacketSize(id) > end)
+        {
+            return false;
+        }
+        if (_expectedCount > 0 && (count >= _expectedCount || _expected[count] != id))
+        {
+            return false;
+        }
+        i += 1 + oiPacketSize(id);
+        count++;
+    }
+    if (_expectedCount > 0 && count != _expectedCount)
+    {
+        return false;
+    }
+
+    if (_packetCallback)
+    {
+        i = 2;
+        while (i < end)
+        {
+            uint8_t size = oiPacketSize(_buff[i]);
+            _packetCallback(_buff[i], _buff + i + 1, size);
+            i += 1 + size;
+        }
+    }
+
+    if (_frameCallback)
+    {
+        _frameCallback();
+    }
+
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef oi_stream_h
+#define oi_stream_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+#define OI_STREAM_HEADER 19
+#define OI_STREAM_FRAME_MAX 128 // header + length + payload + checksum
+#define OI_STREAM_PACKETS_MAX 30 // max. packets of one stream request (OI_TX_MAX - 2)
+
+// Incremental parser for Open Interface stream frames (opcode 148):
+// [19][n][id][data]...[id][data][checksum]
+// Bytes can be fed in any chunk size. After a corrupted frame the parser
+// resynchronises on the next header byte inside the already received data.
+//
+// A frame is only accepted if it carries single sensor packets (no groups).
+// With expect(), it must carry exactly the packets of the stream request in
+// their order, which also rejects most corrupted frames that happen to pass
+// the 8 bit checksum.
+class OIStreamParser
+{
+public:
+    typedef std::function<void(uint8_t id, const uint8_t *data, uint8_t length)> PacketCallback;
+    typedef std::function<void()> FrameCallback;
+
+    void onPacket(PacketCallback callback);
+    void onFrame(FrameCallback callback);
+    bool expect(const uint8_t *packets, uint8_t count); // the packets passed to RoombaOI::startStream()
+
+    void feed(uint8_t data);
+    void feed(const uint8_t *data, size_t length);
+    void reset();
+
+    unsigned long frames();
+    unsigned long checksumErrors();
+    unsigned long frameErrors();
+    unsigned long droppedBytes();
+
+private:
+    void parse();
+    void resync();
+    bool dispatch();
+
+    uint8_t _buff[OI_STREAM_FRAME_MAX];
+    uint8_t _length = 0;
+
+    uint8_t _expected[OI_STREAM_PACKETS_MAX];
+    uint8_t _expectedCount = 0;
+
+    PacketCallback _packetCallback;
+    FrameCallback _frameCallback;
+
+    unsigned long _frames = 0;
+    unsigned long _checksumErrors = 0;
+    unsigned long _frameErrors = 0;
+    unsigned long _droppedBytes = 0;
+};
+
+#endif
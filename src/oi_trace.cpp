@@ -0,0 +1,259 @@
+#include "oi_trace.h"
+#include <string.h>
+
+static const uint8_t OI_TRACE_MAGIC[] = {'O', 'I', 'T', 'R'};
+
+static size_t writeVarint(uint8_t *out, uint64_t value)
+{
+    size_t length = 0;
+    do
+    {
+        uint8_t data = value & 0x7F;
+        value >>= 7;
+        out[length++] = data | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+    return length;
+}
+
+void OITrace::rx(uint32_t time, const uint8_t *data, size_t length)
+{
+    record(time, RX, length, nullptr, 0, data, length);
+}
+
+void OITrace::tx(uint32_t time, const uint8_t *data, size_t length)
+{
+    record(time, TX, length, nullptr, 0, data, length);
+}
+
+void OITrace::brc(uint32_t time, bool level)
+{
+    record(time, BRC, level ? 1 : 0, nullptr, 0, nullptr, 0);
+}
+
+void OITrace::event(uint32_t time, Event event, const uint8_t *data, size_t length)
+{
+    uint8_t code = event;
+    record(time, EVENT, length + 1, &code, 1, data, length);
+}
+
+void OITrace::mark(uint32_t time, const char *text)
+{
+    event(time, MARK, (const uint8_t *)text, strlen(text));
+}
+
+void OITrace::clear()
+{
+    _ring.clear();
+    _started = false;
+    _contextLength = 0;
+}
+
+bool OITrace::empty()
+{
+    return _ring.available() == 0;
+}
+
+// Size of the dump (header and records)
+size_t OITrace::size()
+{
+    return OI_TRACE_HEADER_SIZE + contextLength() + _ring.available();
+}
+
+void OITrace::dump(Output output)
+{
+    uint8_t header[OI_TRACE_HEADER_SIZE];
+    memcpy(header, OI_TRACE_MAGIC, sizeof(OI_TRACE_MAGIC));
+    header[4] = OI_TRACE_VERSION;
+    header[5] = _startTime >> 24;
+    header[6] = _startTime >> 16;
+    header[7] = _startTime >> 8;
+    header[8] = _startTime;
+    output(header, sizeof(header));
+
+    if (_contextLength > 0)
+    {
+        uint8_t context[2 + sizeof(_context)];
+        context[0] = EVENT; // delta 0
+        context[1] = _contextLength;
+        memcpy(context + 2, _context, _contextLength);
+        output(context, 2 + _contextLength);
+    }
+
+    const uint8_t *span;
+    size_t offset = 0;
+    size_t length;
+    while ((length = _ring.readSpan(span, offset)) > 0)
+    {
+        output(span, length);
+        offset += length;
+    }
+}
+
+unsigned long OITrace::records()
+{
+    return _records;
+}
+
+unsigned long OITrace::droppedRecords()
+{
+    return _droppedRecords;
+}
+
+void OITrace::record(uint32_t time, Type type, uint32_t value, const uint8_t *prefix, size_t prefixLength, const uint8_t *data, size_t length)
+{
+    uint8_t header[16];
+
+    if (!_started)
+    {
+        _started = true;
+        _startTime = time;
+        _lastTime = time;
+    }
+
+    size_t headerLength = writeVarint(header, ((uint64_t)(uint32_t)(time - _lastTime) << 2) | type);
+    headerLength += writeVarint(header + headerLength, value);
+
+    size_t recordLength = headerLength + prefixLength + length;
+    if (recordLength > OI_TRACE_SIZE)
+    {
+        return;
+    }
+
+    while (OI_TRACE_SIZE - _ring.available() < recordLength)
+    {
+        dropRecord();
+    }
+
+    _ring.push(header, headerLength);
+    _ring.push(prefix, prefixLength);
+    _ring.push(data, length);
+    _lastTime = time;
+    _records++;
+}
+
+// Drop the oldest record, its time becomes the start time of the trace
+void OITrace::dropRecord()
+{
+    uint64_t header;
+    uint64_t value;
+    size_t length = readVarint(0, header);
+    length += readVarint(length, value);
+
+    if ((header & 3) == EVENT && value <= sizeof(_context) && _ring.peek(length) == STATE)
+    {
+        for (uint8_t i = 0; i < value; i++)
+        {
+            _context[i] = _ring.peek(length + i);
+        }
+        _contextLength = value;
+    }
+
+    if ((header & 3) != BRC)
+    {
+        length += value;
+    }
+
+    _ring.consume(length);
+    _droppedRecords++;
+
+    // The delta of the new oldest record now counts from the dropped one
+    _startTime += (uint32_t)(header >> 2);
+}
+
+size_t OITrace::contextLength()
+{
+    return _contextLength > 0 ? 2 + _contextLength : 0;
+}
+
+size_t OITrace::readVarint(size_t offset, uint64_t &value)
+{
+    size_t length = 0;
+    uint8_t data;
+    value = 0;
+    do
+    {
+        data = _ring.peek(offset + length);
+        value |= (uint64_t)(data & 0x7F) << (7 * length);
+        length++;
+    } while ((data & 0x80) != 0 && length < 10);
+    return length;
+}
+
+OITraceReader::OITraceReader(const uint8_t *data, size_t length) : _data(data), _length(length)
+{
+    _valid = length >= OI_TRACE_HEADER_SIZE && memcmp(data, OI_TRACE_MAGIC, sizeof(OI_TRACE_MAGIC)) == 0 && data[4] == OI_TRACE_VERSION;
+    _position = OI_TRACE_HEADER_SIZE;
+}
+
+bool OITraceReader::valid()
+{
+    return _valid;
+}
+
+// micros() of the recording device at the start of the trace
+uint32_t OITraceReader::startTime()
+{
+    return _valid ? ((uint32_t)_data[5] << 24) | ((uint32_t)_data[6] << 16) | ((uint32_t)_data[7] << 8) | _data[8] : 0;
+}
+
+// Returns false at the end of the trace or on a truncated record (see error())
+bool OITraceReader::next(OITraceRecord &record)
+{
+    uint64_t header;
+    uint64_t value;
+
+    if (!_valid || _error || _position >= _length)
+    {
+        return false;
+    }
+
+    if (!readVarint(header) || !readVarint(value))
+    {
+        _error = true;
+        return false;
+    }
+
+    _time += header >> 2;
+    record.type = (OITrace::Type)(header & 3);
+    record.time = _time;
+    record.data = nullptr;
+    record.length = 0;
+    record.level = 0;
+
+    if (record.type == OITrace::BRC)
+    {
+        record.level = (uint8_t)value;
+        return true;
+    }
+
+    if (value > _length - _position)
+    {
+        _error = true;
+        return false;
+    }
+
+    record.data = _data + _position;
+    record.length = (size_t)value;
+    _position += record.length;
+    return true;
+}
+
+bool OITraceReader::error()
+{
+    return _error;
+}
+
+bool OITraceReader::readVarint(uint64_t &value)
+{
+    value = 0;
+    for (uint8_t shift = 0; shift < 64 && _position < _length; shift += 7)
+    {
+        uint8_t data = _data[_position++];
+        value |= (uint64_t)(data & 0x7F) << shift;
+        if ((data & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
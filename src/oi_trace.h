@@ -0,0 +1,105 @@
+#ifndef oi_trace_h
+#define oi_trace_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "byte_ring.h"
+
+#define OI_TRACE_SIZE 4096 // RAM for records, the oldest records are dropped when full
+#define OI_TRACE_VERSION 1
+#define OI_TRACE_HEADER_SIZE 9 // "OITR", version, start time (uint32, big endian)
+
+// Binary trace of the OI serial link: every byte in and out, BRC pin edges
+// and transport events, with microsecond timestamps.
+//
+// Record: varint(delta << 2 | type) followed by
+//   RX/TX:  varint(length) bytes
+//   BRC:    varint(level)
+//   EVENT:  varint(length) event code, data
+// delta is the time since the previous record in us. Varints are LEB128.
+// The last STATE event dropped from the ring is kept and dumped as the first
+// record, so a replay knows the state at the start of the trace.
+class OITrace
+{
+public:
+    enum Type : uint8_t
+    {
+        RX = 0,
+        TX = 1,
+        BRC = 2,
+        EVENT = 3
+    };
+
+    enum Event : uint8_t
+    {
+        REQUEST = 1, // flags (1 = wake, 2 = start, 4 = force), response length, holdoff (uint32, big endian), request bytes
+        RESULT = 2,  // of a query: success, response length
+        MARK = 3,    // text, e.g. an error of the firmware
+        STATE = 4    // OI mode, flags (1 = awake, 2 = streaming, 4 = charging)
+    };
+
+    typedef std::function<void(const uint8_t *data, size_t length)> Output;
+
+    void rx(uint32_t time, const uint8_t *data, size_t length);
+    void tx(uint32_t time, const uint8_t *data, size_t length);
+    void brc(uint32_t time, bool level);
+    void event(uint32_t time, Event event, const uint8_t *data, size_t length);
+    void mark(uint32_t time, const char *text);
+    void clear();
+
+    bool empty();
+    size_t size();
+    void dump(Output output);
+
+    unsigned long records();
+    unsigned long droppedRecords();
+
+private:
+    void record(uint32_t time, Type type, uint32_t value, const uint8_t *prefix, size_t prefixLength, const uint8_t *data, size_t length);
+    void dropRecord();
+    size_t readVarint(size_t offset, uint64_t &value);
+    size_t contextLength();
+
+    ByteRing<OI_TRACE_SIZE> _ring;
+    bool _started = false;
+    uint32_t _startTime = 0; // time of the oldest record in the ring
+    uint32_t _lastTime = 0;
+    uint8_t _context[8]; // STATE event
+    uint8_t _contextLength = 0;
+    unsigned long _records = 0;
+    unsigned long _droppedRecords = 0;
+};
+
+// Decoder for a dumped trace, e.g. for the host replay tool
+struct OITraceRecord
+{
+    OITrace::Type type;
+    uint64_t time; // us since the start of the trace
+    const uint8_t *data;
+    size_t length;
+    uint8_t level; // BRC level
+};
+
+class OITraceReader
+{
+public:
+    OITraceReader(const uint8_t *data, size_t length);
+
+    bool valid();
+    uint32_t startTime();
+    bool next(OITraceRecord &record);
+    bool error();
+
+private:
+    bool readVarint(uint64_t &value);
+
+    const uint8_t *_data;
+    size_t _length;
+    size_t _position = 0;
+    uint64_t _time = 0;
+    bool _valid = false;
+    bool _error = false;
+};
+
+#endif
@@ -0,0 +1,686 @@
+#include "roomba_oi.h"
+#include "oi_packets.h"
+#include <Arduino.h>
+
+#define OI_OPCODE_RESET 7
+#define OI_OPCODE_START 128
+#define OI_OPCODE_SAFE 131
+#define OI_OPCODE_FULL 132
+#define OI_OPCODE_POWER 133
+#define OI_OPCODE_SPOT 134
+#define OI_OPCODE_CLEAN 135
+#define OI_OPCODE_MAX 136
+#define OI_OPCODE_SENSORS 142
+#define OI_OPCODE_SEEK_DOCK 143
+#define OI_OPCODE_STREAM 148
+#define OI_OPCODE_QUERY_LIST 149
+#define OI_OPCODE_PAUSE_RESUME_STREAM 150
+#define OI_OPCODE_STOP 173
+
+const unsigned long OI_WAKE_PULSE = 50;        // duration of one BRC level while waking up the Roomba
+const unsigned long OI_START_DELAY = 50;       // time the Roomba needs after the START opcode
+const unsigned long OI_RESPONSE_TIMEOUT = 100; // max. time to wait for a response with known length
+const unsigned long OI_RESPONSE_WINDOW = 50;   // time to collect a response with unknown length
+const unsigned long OI_STREAM_PAUSE_DELAY = 20; // time for the last stream bytes to arrive after pausing the stream
+const unsigned long OI_SLEEP_TIMEOUT = 240000;  // Roomba sleeps after 5 minutes without activity in Passive mode (if not charging), assume it sleeps after 4 to be safe
+
+RoombaOI::RoombaOI(Stream &serial, uint8_t brcPin) : _serial(serial), _brcPin(brcPin)
+{
+}
+
+bool RoombaOI::command(uint8_t opcode, bool wake /* = true */, bool start /* = true */)
+{
+    return send(&opcode, 1, wake, start);
+}
+
+bool RoombaOI::send(const uint8_t *data, uint8_t length, bool wake /* = true */, bool start /* = true */)
+{
+    return enqueue(data, length, 0, wake, start, false, 0, nullptr, nullptr);
+}
+
+bool RoombaOI::query(const uint8_t *data, uint8_t length, uint8_t responseLength, Callback callback, bool wake /* = true */, bool start /* = true */)
+{
+    return enqueue(data, length, responseLength, wake, start, false, 0, callback, nullptr);
+}
+
+bool RoombaOI::query(const uint8_t *data, uint8_t length, uint8_t responseLength, OIFuture &future, bool wake /* = true */, bool start /* = true */)
+{
+    return enqueue(data, length, responseLength, wake, start, false, 0, nullptr, &future);
+}
+
+// Read several sensor packets with one request (Query List). The response is
+// the concatenated packet data in the requested order.
+bool RoombaOI::queryList(const uint8_t *packets, uint8_t count, Callback callback)
+{
+    uint8_t request[OI_TX_MAX];
+    uint8_t responseLength;
+    uint8_t length = buildQueryList(request, packets, count, responseLength);
+    return length > 0 && query(request, length, responseLength, callback);
+}
+
+bool RoombaOI::queryList(const uint8_t *packets, uint8_t count, OIFuture &future)
+{
+    uint8_t request[OI_TX_MAX];
+    uint8_t responseLength;
+    uint8_t length = buildQueryList(request, packets, count, responseLength);
+    return length > 0 && query(request, length, responseLength, future);
+}
+
+// Returns the request length, 0 if the list is empty, too long or contains unknown packets
+uint8_t RoombaOI::buildQueryList(uint8_t *request, const uint8_t *packets, uint8_t count, uint8_t &responseLength)
+{
+    unsigned int length = 0;
+
+    if (count == 0 || count + 2 > OI_TX_MAX)
+    {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t size = oiPacketSize(packets[i]);
+        if (size == 0)
+        {
+            return 0;
+        }
+        length += size;
+    }
+
+    if (length > OI_RX_MAX)
+    {
+        return 0;
+    }
+
+    request[0] = OI_OPCODE_QUERY_LIST;
+    request[1] = count;
+    memcpy(request + 2, packets, count);
+    responseLength = length;
+    return count + 2;
+}
+
+// Queue an idle gap, e.g. to give the Roomba time to execute the previous command
+bool RoombaOI::pause(unsigned long duration)
+{
+    return enqueue(nullptr, 0, 0, false, false, false, duration, nullptr, nullptr);
+}
+
+// Always pulse BRC, regardless of the estimated state
+bool RoombaOI::wake()
+{
+    return enqueue(nullptr, 0, 0, true, false, true, 0, nullptr, nullptr);
+}
+
+// Always send START, regardless of the tracked OI mode
+bool RoombaOI::start()
+{
+    return enqueue(nullptr, 0, 0, false, true, true, 0, nullptr, nullptr);
+}
+
+// Start the Open Interface stream. The Roomba sends the given packets every
+// 15ms, the bytes are passed to the stream callback whenever no request waits
+// for a response.
+bool RoombaOI::startStream(const uint8_t *packets, uint8_t count)
+{
+    uint8_t request[OI_TX_MAX];
+    if (count + 2 > OI_TX_MAX)
+    {
+        return false;
+    }
+
+    request[0] = OI_OPCODE_STREAM;
+    request[1] = count;
+    memcpy(request + 2, packets, count);
+    _streaming = send(request, count + 2);
+    return _streaming;
+}
+
+bool RoombaOI::stopStream()
+{
+    const uint8_t request[] = {OI_OPCODE_PAUSE_RESUME_STREAM, 0};
+    _streaming = false;
+    return send(request, sizeof(request), false, false);
+}
+
+void RoombaOI::onStream(StreamCallback callback)
+{
+    _streamCallback = callback;
+}
+
+bool RoombaOI::streaming()
+{
+    return _streaming;
+}
+
+OIMode RoombaOI::mode()
+{
+    return _mode;
+}
+
+// Set the OI mode reported by the Roomba, e.g. from a stream packet
+void RoombaOI::setMode(OIMode mode)
+{
+    _mode = mode;
+}
+
+// The Roomba doesn't sleep while charging
+void RoombaOI::setCharging(bool charging)
+{
+    _charging = charging;
+}
+
+// Continue from a known state without talking to the Roomba, e.g. to replay a trace
+void RoombaOI::restoreState(OIMode mode, bool awake, bool streaming)
+{
+    _mode = mode;
+    _awake = awake;
+    _streaming = streaming;
+    _lastTraffic = millis();
+}
+
+// Estimate whether the Roomba sleeps: it didn't answer the last request or
+// there was no traffic for a long time
+bool RoombaOI::asleep()
+{
+    return !_awake || (!_charging && (millis() - _lastTraffic) >= OI_SLEEP_TIMEOUT);
+}
+
+unsigned long RoombaOI::lastTraffic()
+{
+    return _lastTraffic;
+}
+
+bool RoombaOI::busy()
+{
+    return _state != State::IDLE || _queueCount > 0;
+}
+
+uint8_t RoombaOI::queued()
+{
+    return _queueCount;
+}
+
+unsigned long RoombaOI::requests()
+{
+    return _requests;
+}
+
+unsigned long RoombaOI::timeouts()
+{
+    return _timeouts;
+}
+
+unsigned long RoombaOI::wakeups()
+{
+    return _wakeups;
+}
+
+// Record all traffic of the serial link, nullptr to stop recording
+void RoombaOI::setTrace(OITrace *trace)
+{
+    _trace = trace;
+}
+
+// Max. fill level of the receive ring
+size_t RoombaOI::rxHighWater()
+{
+    return _rxRing.highWater();
+}
+
+// Number of times the receive ring was full while the UART had more bytes
+unsigned long RoombaOI::rxOverflows()
+{
+    return _rxRing.overflows();
+}
+
+bool RoombaOI::enqueue(const uint8_t *data, uint8_t length, uint8_t responseLength, bool wake, bool start, bool force, unsigned long holdoff, Callback callback, OIFuture *future)
+{
+    if (_queueCount >= OI_QUEUE_SIZE || length > OI_TX_MAX || (responseLength > OI_RX_MAX && responseLength != OI_RX_UNKNOWN))
+    {
+        return false;
+    }
+
+    Request &request = _queue[(_queueHead + _queueCount) % OI_QUEUE_SIZE];
+    if (length > 0)
+    {
+        memcpy(request.tx, data, length);
+    }
+    request.txLength = length;
+    request.rxLength = responseLength;
+    request.wake = wake;
+    request.start = start;
+    request.force = force;
+    request.holdoff = holdoff;
+    request.callback = callback;
+    request.future = future;
+    _queueCount++;
+
+    if (future != nullptr)
+    {
+        future->state = OIFuture::State::PENDING;
+        future->length = 0;
+    }
+
+    return true;
+}
+
+void RoombaOI::enterState(State state, unsigned long duration)
+{
+    _state = state;
+    _stateSince = millis();
+    _stateDuration = duration;
+}
+
+bool RoombaOI::stateElapsed()
+{
+    return (millis() - _stateSince) >= _stateDuration;
+}
+
+void RoombaOI::loop()
+{
+    traceState();
+    receive();
+
+    if (_state == State::IDLE || _state == State::HOLDOFF)
+    {
+        forwardStream();
+    }
+
+    if (_state == State::IDLE)
+    {
+        if (_queueCount == 0)
+        {
+            return;
+        }
+
+        _current = _queue[_queueHead];
+        _queue[_queueHead].callback = nullptr;
+        _queueHead = (_queueHead + 1) % OI_QUEUE_SIZE;
+        _queueCount--;
+        _requests++;
+        _woken = false;
+        traceRequest();
+
+        if (_current.wake && (_current.force || asleep()))
+        {
+            enterWake();
+        }
+        else
+        {
+            enterStartOrSend();
+        }
+    }
+
+    switch (_state)
+    {
+    case State::WAKE:
+        if (stateElapsed())
+        {
+            _wakeStep++;
+            if (_wakeStep < 4)
+            {
+                setBrc((_wakeStep % 2 == 0) ? HIGH : LOW);
+                enterState(State::WAKE, OI_WAKE_PULSE);
+            }
+            else
+            {
+                // A woken up Roomba is in Off mode, assume it is awake until the mode is confirmed
+                _woken = true;
+                _awake = true;
+                _lastTraffic = millis();
+                _mode = OIMode::OFF;
+                enterStartOrSend();
+            }
+        }
+        break;
+
+    case State::START:
+        if (stateElapsed())
+        {
+            if (_streaming)
+            {
+                // The stream reports the mode (packet 35)
+                enterState(State::SEND, 0);
+            }
+            else
+            {
+                // Confirm the mode by reading packet 35
+                const uint8_t request[] = {OI_OPCODE_SENSORS, OI_PACKET_OI_MODE};
+                drain();
+                write(request, sizeof(request));
+                enterState(State::CONFIRM, OI_RESPONSE_TIMEOUT);
+            }
+        }
+        break;
+
+    case State::CONFIRM:
+        if (_rxRing.available())
+        {
+            uint8_t mode = _rxRing.peek(0);
+            _rxRing.consume(1);
+            received();
+            _mode = (mode <= (uint8_t)OIMode::FULL ? (OIMode)mode : OIMode::UNKNOWN);
+            enterState(State::SEND, 0);
+        }
+        else if (stateElapsed())
+        {
+            _timeouts++;
+            _awake = false;
+            _mode = OIMode::UNKNOWN;
+            if (_current.wake && !_woken)
+            {
+                enterWake(); // No answer, Roomba seems to sleep
+            }
+            else
+            {
+                enterState(State::SEND, 0);
+            }
+        }
+        break;
+
+    case State::SEND:
+        if (_current.rxLength > 0 && pauseStream())
+        {
+            enterState(State::SEND, OI_STREAM_PAUSE_DELAY);
+            break;
+        }
+
+        if (!stateElapsed())
+        {
+            break;
+        }
+
+        // Throw away everything which is not part of the response
+        drain();
+
+        if (_current.txLength > 0)
+        {
+            write(_current.tx, _current.txLength);
+            trackMode(_current.tx[0]);
+        }
+
+        _rxLength = 0;
+        if (_current.rxLength == 0)
+        {
+            finish(true);
+        }
+        else
+        {
+            enterState(State::RECEIVE, (_current.rxLength == OI_RX_UNKNOWN ? OI_RESPONSE_WINDOW : OI_RESPONSE_TIMEOUT));
+        }
+        break;
+
+    case State::RECEIVE:
+        if (_rxRing.available())
+        {
+            uint8_t expected = (_current.rxLength == OI_RX_UNKNOWN ? OI_RX_MAX : _current.rxLength);
+            received();
+            _rxLength += _rxRing.read(_rx + _rxLength, expected - _rxLength);
+            if (_rxLength == _current.rxLength)
+            {
+                finish(true);
+                return;
+            }
+        }
+
+        if (stateElapsed())
+        {
+            if (_current.rxLength == OI_RX_UNKNOWN)
+            {
+                finish(_rxLength > 0);
+            }
+            else
+            {
+                _timeouts++;
+                if (_rxLength == 0)
+                {
+                    _awake = false; // No answer at all, Roomba seems to sleep
+                }
+                finish(false);
+            }
+        }
+        break;
+
+    case State::HOLDOFF:
+        if (stateElapsed())
+        {
+            _state = State::IDLE;
+        }
+        break;
+
+    case State::IDLE:
+        break;
+    }
+}
+
+// Wake up Roomba: pulse BRC high, low, high, low
+void RoombaOI::enterWake()
+{
+    _wakeups++;
+    _wakeStep = 0;
+    setBrc(HIGH);
+    enterState(State::WAKE, OI_WAKE_PULSE);
+}
+
+// Send START if the request needs the OI and it isn't started yet, otherwise go on with sending
+void RoombaOI::enterStartOrSend()
+{
+    if (_current.start && (_current.force || _mode == OIMode::OFF || _mode == OIMode::UNKNOWN))
+    {
+        const uint8_t start = OI_OPCODE_START;
+        write(&start, 1);
+        trackMode(OI_OPCODE_START);
+        enterState(State::START, OI_START_DELAY);
+    }
+    else
+    {
+        enterState(State::SEND, 0);
+    }
+}
+
+// Returns true if the stream was paused now, otherwise stream frames and response get mixed up
+bool RoombaOI::pauseStream()
+{
+    if (!_streaming || _streamPaused)
+    {
+        return false;
+    }
+
+    const uint8_t pause[] = {OI_OPCODE_PAUSE_RESUME_STREAM, 0};
+    write(pause, sizeof(pause));
+    _streamPaused = true;
+    return true;
+}
+
+void RoombaOI::write(const uint8_t *data, size_t length)
+{
+    _serial.write(data, length);
+    if (_trace != nullptr)
+    {
+        _trace->tx(micros(), data, length);
+    }
+}
+
+void RoombaOI::setBrc(uint8_t level)
+{
+    digitalWrite(_brcPin, level);
+    if (_trace != nullptr)
+    {
+        _trace->brc(micros(), level == HIGH);
+    }
+}
+
+// Record the request, so a replay can issue the same requests
+void RoombaOI::traceRequest()
+{
+    uint8_t data[6 + OI_TX_MAX];
+
+    if (_trace == nullptr)
+    {
+        return;
+    }
+
+    data[0] = (_current.wake ? 1 : 0) | (_current.start ? 2 : 0) | (_current.force ? 4 : 0);
+    data[1] = _current.rxLength;
+    data[2] = _current.holdoff >> 24;
+    data[3] = _current.holdoff >> 16;
+    data[4] = _current.holdoff >> 8;
+    data[5] = _current.holdoff;
+    memcpy(data + 6, _current.tx, _current.txLength);
+    _trace->event(micros(), OITrace::REQUEST, data, 6 + _current.txLength);
+}
+
+// Record changes of the tracked state
+void RoombaOI::traceState()
+{
+    if (_trace == nullptr)
+    {
+        return;
+    }
+
+    uint8_t state[] = {(uint8_t)_mode, (uint8_t)((_awake ? 1 : 0) | (_streaming ? 2 : 0) | (_charging ? 4 : 0))};
+    if (memcmp(state, _tracedState, sizeof(state)) != 0 || _trace->empty())
+    {
+        memcpy(_tracedState, state, sizeof(state));
+        _trace->event(micros(), OITrace::STATE, state, sizeof(state));
+    }
+}
+
+void RoombaOI::received()
+{
+    _awake = true;
+    _lastTraffic = millis();
+}
+
+// Follow the OI mode changes caused by a command
+void RoombaOI::trackMode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OI_OPCODE_START:
+    case OI_OPCODE_SPOT:
+    case OI_OPCODE_CLEAN:
+    case OI_OPCODE_MAX:
+    case OI_OPCODE_SEEK_DOCK:
+        _mode = OIMode::PASSIVE;
+        _lastTraffic = millis();
+        break;
+    case OI_OPCODE_SAFE:
+        _mode = OIMode::SAFE;
+        _lastTraffic = millis();
+        break;
+    case OI_OPCODE_FULL:
+        _mode = OIMode::FULL;
+        _lastTraffic = millis();
+        break;
+    case OI_OPCODE_STOP:
+        _mode = OIMode::OFF;
+        break;
+    case OI_OPCODE_POWER:
+    case OI_OPCODE_RESET:
+        _mode = OIMode::OFF;
+        _awake = false;
+        break;
+    }
+}
+
+void RoombaOI::finish(bool success)
+{
+    // Switch state first, the callback may already queue the next request
+    if (_current.holdoff > 0)
+    {
+        enterState(State::HOLDOFF, _current.holdoff);
+    }
+    else
+    {
+        _state = State::IDLE;
+    }
+
+    if (_streaming)
+    {
+        // Resume the stream, also after commands which may have changed the OI mode
+        const uint8_t resume[] = {OI_OPCODE_PAUSE_RESUME_STREAM, 1};
+        write(resume, sizeof(resume));
+        _streamPaused = false;
+    }
+
+    if (_trace != nullptr && _current.rxLength > 0)
+    {
+        const uint8_t result[] = {success, _rxLength};
+        _trace->event(micros(), OITrace::RESULT, result, sizeof(result));
+    }
+
+    Callback callback = _current.callback;
+    OIFuture *future = _current.future;
+    _current.callback = nullptr;
+    _current.future = nullptr;
+
+    if (future != nullptr)
+    {
+        future->length = _rxLength;
+        memcpy(future->data, _rx, _rxLength);
+        future->state = (success ? OIFuture::State::DONE : OIFuture::State::FAILED);
+    }
+
+    if (callback)
+    {
+        callback(success, _rx, _rxLength);
+    }
+}
+
+// Move everything the UART has received into the receive ring
+void RoombaOI::receive()
+{
+    for (uint8_t part = 0; part < 2; part++) // the free space may wrap around once
+    {
+        size_t available = _serial.available();
+        if (available == 0)
+        {
+            return;
+        }
+
+        uint8_t *span;
+        size_t free = _rxRing.writeSpan(span);
+        if (free == 0)
+        {
+            _rxRing.overflow(); // left in the UART buffer until there is space again
+            return;
+        }
+
+        size_t length = _serial.readBytes((char *)span, (available < free ? available : free));
+        _rxRing.commit(length);
+        if (_trace != nullptr)
+        {
+            _trace->rx(micros(), span, length);
+        }
+    }
+}
+
+void RoombaOI::drain()
+{
+    receive();
+    _rxRing.clear();
+    while (_serial.available())
+    {
+        _serial.read();
+    }
+}
+
+// Pass received bytes to the stream callback in place. Without a stream,
+// there is nobody waiting for unsolicited bytes.
+void RoombaOI::forwardStream()
+{
+    if (!_streaming || !_streamCallback)
+    {
+        _rxRing.clear();
+        return;
+    }
+
+    const uint8_t *span;
+    size_t length;
+    while ((length = _rxRing.readSpan(span)) > 0)
+    {
+        received();
+        _streamCallback(span, length);
+        _rxRing.consume(length);
+    }
+}
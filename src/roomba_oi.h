@@ -0,0 +1,177 @@
+#ifndef roomba_oi_h
+#define roomba_oi_h
+
+#include <Arduino.h>
+#include <functional>
+#include "byte_ring.h"
+#include "oi_trace.h"
+
+#define OI_TX_MAX 32       // max. bytes of one request (opcode + data)
+#define OI_RX_MAX 128      // max. bytes of one response
+#define OI_QUEUE_SIZE 8    // max. queued requests
+#define OI_RX_UNKNOWN 0xFF // response length unknown, collect everything arriving within the response window
+#define OI_QUERY_LIST_MAX (OI_TX_MAX - 2) // max. packets in one Query List request
+#define OI_RX_RING_SIZE 256 // receive ring, holds ~8 stream frames of the default packet set
+
+// Result of a query, owned by the caller and filled by the transport. It must
+// live until it is ready, nothing waits for it: the caller checks ready().
+class OIFuture
+{
+public:
+    enum class State
+    {
+        IDLE,
+        PENDING,
+        DONE,
+        FAILED
+    };
+
+    State state = State::IDLE;
+    uint8_t data[OI_RX_MAX];
+    uint8_t length = 0;
+
+    bool ready() const { return state == State::DONE || state == State::FAILED; }
+    bool ok() const { return state == State::DONE; }
+};
+
+// Open Interface mode as reported by sensor packet 35
+enum class OIMode : uint8_t
+{
+    OFF = 0,
+    PASSIVE = 1,
+    SAFE = 2,
+    FULL = 3,
+    UNKNOWN = 0xFF
+};
+
+// Non-blocking Roomba Open Interface transport. Requests are queued and
+// processed by loop(): the BRC pin is toggled and response bytes are
+// collected across loop() iterations instead of using delay().
+//
+// The wake/start flags of a request mean "the Roomba must be awake" and
+// "the OI must be started". The transport tracks the OI mode and estimates
+// whether the Roomba sleeps, so BRC pulses and the START opcode are only
+// sent when needed.
+//
+// Received bytes are moved from the UART in bulk into a receive ring once
+// per loop(); responses are copied out of it and stream bytes are handed to
+// the stream callback as spans of the ring, without another copy.
+class RoombaOI
+{
+public:
+    typedef std::function<void(bool success, const uint8_t *data, uint8_t length)> Callback;
+    typedef std::function<void(const uint8_t *data, size_t length)> StreamCallback;
+
+    RoombaOI(Stream &serial, uint8_t brcPin);
+
+    bool command(uint8_t opcode, bool wake = true, bool start = true);
+    bool send(const uint8_t *data, uint8_t length, bool wake = true, bool start = true);
+    bool query(const uint8_t *data, uint8_t length, uint8_t responseLength, Callback callback, bool wake = true, bool start = true);
+    bool query(const uint8_t *data, uint8_t length, uint8_t responseLength, OIFuture &future, bool wake = true, bool start = true);
+    bool queryList(const uint8_t *packets, uint8_t count, Callback callback);
+    bool queryList(const uint8_t *packets, uint8_t count, OIFuture &future);
+    bool pause(unsigned long duration);
+    bool wake();
+    bool start();
+    void loop();
+
+    bool startStream(const uint8_t *packets, uint8_t count);
+    bool stopStream();
+    void onStream(StreamCallback callback);
+    bool streaming();
+
+    OIMode mode();
+    void setMode(OIMode mode);
+    void setCharging(bool charging);
+    void restoreState(OIMode mode, bool awake, bool streaming);
+    bool asleep();
+    unsigned long lastTraffic();
+
+    bool busy();
+    uint8_t queued();
+    unsigned long requests();
+    unsigned long timeouts();
+    unsigned long wakeups();
+    void setTrace(OITrace *trace);
+    size_t rxHighWater();
+    unsigned long rxOverflows();
+
+private:
+    enum class State
+    {
+        IDLE,
+        WAKE,
+        START,
+        CONFIRM,
+        SEND,
+        RECEIVE,
+        HOLDOFF
+    };
+
+    struct Request
+    {
+        uint8_t tx[OI_TX_MAX];
+        uint8_t txLength;
+        uint8_t rxLength;
+        bool wake;
+        bool start;
+        bool force;
+        unsigned long holdoff;
+        Callback callback;
+        OIFuture *future;
+    };
+
+    uint8_t buildQueryList(uint8_t *request, const uint8_t *packets, uint8_t count, uint8_t &responseLength);
+    bool enqueue(const uint8_t *data, uint8_t length, uint8_t responseLength, bool wake, bool start, bool force, unsigned long holdoff, Callback callback, OIFuture *future);
+    void enterState(State state, unsigned long duration);
+    bool stateElapsed();
+    void finish(bool success);
+    void receive();
+    void drain();
+    void forwardStream();
+    void write(const uint8_t *data, size_t length);
+    void setBrc(uint8_t level);
+    void traceRequest();
+    void traceState();
+    void received();
+    void trackMode(uint8_t opcode);
+    void enterWake();
+    void enterStartOrSend();
+    bool pauseStream();
+
+    Stream &_serial;
+    uint8_t _brcPin;
+
+    Request _queue[OI_QUEUE_SIZE];
+    uint8_t _queueHead = 0;
+    uint8_t _queueCount = 0;
+
+    Request _current;
+    State _state = State::IDLE;
+    uint8_t _wakeStep = 0;
+    bool _woken = false;
+    unsigned long _stateSince = 0;
+    unsigned long _stateDuration = 0;
+
+    ByteRing<OI_RX_RING_SIZE> _rxRing;
+    uint8_t _rx[OI_RX_MAX];
+    uint8_t _rxLength = 0;
+
+    OITrace *_trace = nullptr;
+    uint8_t _tracedState[2] = {0, 0};
+
+    StreamCallback _streamCallback;
+    bool _streaming = false;
+    bool _streamPaused = false;
+
+    OIMode _mode = OIMode::UNKNOWN;
+    bool _awake = false;
+    bool _charging = false;
+    unsigned long _lastTraffic = 0;
+
+    unsigned long _requests = 0;
+    unsigned long _timeouts = 0;
+    unsigned long _wakeups = 0;
+};
+
+#endif
@@ -2,7 +2,8 @@
 #include <Arduino.h>
 #include <U8g2lib.h>
 
-Screens::Screens(U8G2 &u8g2, int numofscreens, unsigned long updateInterval, unsigned long screenTimeout)
+Screens::Screens(U8G2 &u8g2, DeadlineScheduler &scheduler, int numofscreens, unsigned long updateInterval, unsigned long screenTimeout)
+    : _scheduler(scheduler)
 {
     _u8g2 = u8g2;
     _currentScreen = 0;
@@ -28,6 +29,12 @@ void Screens::setup()
     //
     _u8g2.setContrast(255);
 
+    _refreshTask = _scheduler.add("display refresh", [this]()
+                                  { _needRefresh = true; },
+                                  _updateInterval);
+    _timeoutTask = _scheduler.add("display timeout", [this]()
+                                  { powerSave(true); });
+
     reset();
 }
 
@@ -41,22 +48,6 @@ int Screens::count()
     return _numofscreens;
 }
 
-void Screens::loop()
-{
-    if ((millis() - _lastScreenActivation) >= _screenTimeout)
-    {
-        powerSave(true);
-    }
-    else
-    {
-        if ((millis() - _lastScreenUpdate) >= _updateInterval)
-        {
-            _needRefresh = true;
-            _lastScreenUpdate = millis();
-        }
-    }
-}
-
 bool Screens::needRefresh()
 {
     if (_modalMessageActive) // prevent update in loop if model Message is active
@@ -85,7 +76,7 @@ void Screens::nextScreen()
     _modalMessageActive = false;
     _needRefresh = true;
     powerSave(false);
-    _lastScreenActivation = millis();
+    activate();
 }
 
 void Screens::showScreen(int screenNumber)
@@ -96,7 +87,7 @@ void Screens::showScreen(int screenNumber)
         _needRefresh = true;
         _modalMessageActive = false;
         powerSave(false);
-        _lastScreenActivation = millis();
+        activate();
     }
 }
 
@@ -108,11 +99,13 @@ void Screens::powerSave(bool activatePowerSave, bool force /* = false */)
         _u8g2.setPowerSave(1);
         _displayPowerSaving = true;
         _modalMessageActive = false;
+        _scheduler.cancel(_refreshTask);
     }
     else if (!activatePowerSave && (_displayPowerSaving || force)) // request to deactivate power save and display is power saving mode
     {
         _u8g2.setPowerSave(0);
         _displayPowerSaving = false;
+        _scheduler.after(_refreshTask, _updateInterval, millis());
     }
 }
 
@@ -152,6 +145,11 @@ void Screens::displayMsgForce(const char *text, const char *text2 /* = "" */, co
 {
     _modalMessageActive = true;
     powerSave(false);
-    _lastScreenActivation = millis();
+    activate();
     displayMsg(text, text2, text3, text4, text5);
-}
\ No newline at end of file
+}
+
+void Screens::activate()
+{
+    _scheduler.after(_timeoutTask, _screenTimeout, millis());
+}
@@ -2,11 +2,13 @@
 #define screens_h
 
 #include <U8g2lib.h>
+#include "deadline_scheduler.h"
 
+// Screen refresh and timeout are tasks of the scheduler, added by setup()
 class Screens
 {
 public:
-    Screens(U8G2 &, int, unsigned long, unsigned long);
+    Screens(U8G2 &, DeadlineScheduler &, int, unsigned long, unsigned long);
 
     void displayMsgForce(const char *text, const char *text2 = "", const char *text3 = "", const char *text4 = "", const char *text5 = "");
     void displayMsg(const char *text, const char *text2 = "", const char *text3 = "", const char *text4 = "", const char *text5 = "");
@@ -14,7 +16,6 @@ public:
     void powerSave(bool activatePowerSave, bool force = false);
     void showScreen(int screenNumber);
     void reset();
-    void loop();
     void setup();
 
     uint8_t currentScreen();
@@ -22,7 +23,10 @@ public:
     int count();
 
 private:
+    void activate(); // restart the screen timeout
+
     U8G2 _u8g2;
+    DeadlineScheduler &_scheduler;
     uint8_t _numofscreens;
     uint8_t _currentScreen;
 
@@ -31,8 +35,8 @@ private:
     bool _needRefresh;
     bool _modalMessageActive = false;
 
-    unsigned long _lastScreenUpdate;
-    unsigned long _lastScreenActivation;
+    uint8_t _refreshTask = DEADLINE_NONE;
+    uint8_t _timeoutTask = DEADLINE_NONE;
     unsigned long _updateInterval;
     unsigned long _screenTimeout;
 };
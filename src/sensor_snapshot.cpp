@@ -0,0 +1,198 @@
+#include "sensor_snapshot.h"
+#include "oi_packets.h"
+
+static const char INVALID[] = "---";
+
+// Appends to a fixed buffer, counts the characters that didn't fit
+class TextWriter
+{
+public:
+    TextWriter(char *out, size_t size) : _out(out), _size(size)
+    {
+        if (_size > 0)
+        {
+            _out[0] = '\0';
+        }
+    }
+
+    void put(char c)
+    {
+        if (_length + 1 < _size)
+        {
+            _out[_length] = c;
+            _out[_length + 1] = '\0';
+        }
+        _length++;
+    }
+
+    void put(const char *text)
+    {
+        while (*text != '\0')
+        {
+            put(*text++);
+        }
+    }
+
+    void put(uint32_t value, uint8_t minDigits)
+    {
+        char digits[10];
+        uint8_t count = 0;
+        do
+        {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value != 0 || count < minDigits);
+        while (count > 0)
+        {
+            put(digits[--count]);
+        }
+    }
+
+    size_t length()
+    {
+        return _length;
+    }
+
+private:
+    char *_out;
+    size_t _size;
+    size_t _length = 0;
+};
+
+size_t formatDecimal(char *out, size_t size, int32_t value, uint8_t decimals, const char *suffix)
+{
+    static const uint32_t POW10[] = {1, 10, 100, 1000, 10000};
+    if (decimals >= sizeof(POW10) / sizeof(POW10[0]))
+    {
+        decimals = sizeof(POW10) / sizeof(POW10[0]) - 1;
+    }
+
+    TextWriter writer(out, size);
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+    if (value < 0)
+    {
+        writer.put('-');
+    }
+    writer.put(magnitude / POW10[decimals], 1);
+    if (decimals > 0)
+    {
+        writer.put('.');
+        writer.put(magnitude % POW10[decimals], decimals);
+    }
+    writer.put(suffix);
+    return writer.length();
+}
+
+static size_t formatInvalid(char *out, size_t size)
+{
+    TextWriter writer(out, size);
+    writer.put(INVALID);
+    return writer.length();
+}
+
+SensorSnapshot SensorSnapshot::fromGroup3(const uint8_t *data)
+{
+    SensorSnapshot snapshot;
+    snapshot.valid = true;
+    snapshot.chargingState = oiDecode<3, OI_PACKET_CHARGING_STATE>(data);
+    snapshot.voltage = oiDecode<3, OI_PACKET_VOLTAGE>(data);
+    snapshot.current = oiDecode<3, OI_PACKET_CURRENT>(data);
+    snapshot.temperature = oiDecode<3, OI_PACKET_TEMPERATURE>(data);
+    snapshot.charge = oiDecode<3, OI_PACKET_BATTERY_CHARGE>(data);
+    snapshot.capacity = oiDecode<3, OI_PACKET_BATTERY_CAPACITY>(data);
+
+    if (snapshot.capacity > 0)
+    {
+        uint32_t level = ((uint32_t)snapshot.charge * 1000 + snapshot.capacity / 2) / snapshot.capacity;
+        snapshot.level = level > 1000 ? 1000 : level;
+    }
+
+    switch (snapshot.chargingState)
+    {
+    case 1: // Reconditioning
+    case 2: // Full
+    case 3: // Trickle
+    case 5: // Fault condition
+        snapshot.charging = true;
+        break;
+    }
+    snapshot.docked = snapshot.chargingState != 0;
+    snapshot.cleaning = !snapshot.charging && snapshot.current < SNAPSHOT_CLEANING_CURRENT;
+    return snapshot;
+}
+
+size_t SensorSnapshot::formatVoltage(char *out, size_t size)
+{
+    if (!valid)
+    {
+        return formatInvalid(out, size);
+    }
+    return formatDecimal(out, size, (voltage + 5) / 10, 2, " V");
+}
+
+size_t SensorSnapshot::formatCurrent(char *out, size_t size)
+{
+    if (!valid)
+    {
+        return formatInvalid(out, size);
+    }
+    return formatDecimal(out, size, current, 0, " mA");
+}
+
+size_t SensorSnapshot::formatTemperature(char *out, size_t size, const char *unit)
+{
+    if (!valid)
+    {
+        return formatInvalid(out, size);
+    }
+    return formatDecimal(out, size, temperature, 0, unit);
+}
+
+size_t SensorSnapshot::formatLevel(char *out, size_t size)
+{
+    if (!valid || capacity == 0)
+    {
+        return formatInvalid(out, size);
+    }
+    return formatDecimal(out, size, level, 1, "%");
+}
+
+size_t SensorSnapshot::formatCharge(char *out, size_t size)
+{
+    if (!valid)
+    {
+        return formatInvalid(out, size);
+    }
+    TextWriter writer(out, size);
+    writer.put(charge, 1);
+    writer.put('/');
+    writer.put(capacity, 1);
+    writer.put(" mAh");
+    return writer.length();
+}
+
+const char *SensorSnapshot::chargingStateName()
+{
+    if (!valid)
+    {
+        return "Charging Unknown";
+    }
+
+    switch (chargingState)
+    {
+    case 0:
+        return "Not charging";
+    case 1:
+        return "Reconditioning";
+    case 2:
+        return "Full";
+    case 3:
+        return "Trickle";
+    case 4:
+        return "Waiting";
+    case 5:
+        return "Fault Condition";
+    default:
+        return "Charging Unknown";
+    }
+}
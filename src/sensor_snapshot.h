@@ -0,0 +1,47 @@
+#ifndef sensor_snapshot_h
+#define sensor_snapshot_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAPSHOT_CLEANING_CURRENT -400 // mA, a discharge above this means the Roomba is cleaning
+
+// Battery and charging values of sensor group 3, decoded once when a frame
+// or a Sensors response arrived. All values are integers in the units of the
+// OI (mV, mA, mAh), the state of charge is in permille, so nothing on the
+// way to the web page, MQTT or the display needs float math.
+//
+// A snapshot is replaced as a whole, it is never modified in place.
+struct SensorSnapshot
+{
+    bool valid = false;
+    uint8_t chargingState = 0;
+    uint16_t voltage = 0;    // mV
+    int16_t current = 0;     // mA, < 0 = discharging
+    int8_t temperature = 0;  // degree Celsius
+    uint16_t charge = 0;     // mAh
+    uint16_t capacity = 0;   // mAh
+    uint16_t level = 0;      // state of charge in permille, 0 if the capacity is unknown
+
+    bool charging = false; // charging states reconditioning, full, trickle and fault
+    bool docked = false;   // any charging state except "not charging", i.e. a charging source is present
+    bool cleaning = false; // not charging and discharging with more than SNAPSHOT_CLEANING_CURRENT
+
+    static SensorSnapshot fromGroup3(const uint8_t *data);
+
+    // Formatters write a null terminated string and return its length like
+    // snprintf (without truncation). An invalid snapshot is written as "---".
+    size_t formatVoltage(char *out, size_t size);                        // "14.23 V"
+    size_t formatCurrent(char *out, size_t size);                        // "-512 mA"
+    size_t formatTemperature(char *out, size_t size, const char *unit);  // "25" unit
+    size_t formatLevel(char *out, size_t size);                          // "85.4%"
+    size_t formatCharge(char *out, size_t size);                         // "2000/2696 mAh"
+    const char *chargingStateName();
+};
+
+// Writes value / 10^decimals with a fixed number of decimals followed by the
+// suffix, e.g. formatDecimal(out, size, 1423, 2, " V") -> "14.23 V".
+// Returns the length of the complete string, the output is truncated to size.
+size_t formatDecimal(char *out, size_t size, int32_t value, uint8_t decimals, const char *suffix = "");
+
+#endif
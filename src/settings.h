@@ -1,6 +1,8 @@
 #ifndef settings_h
 #define settings_h
 
+#include "clean_scheduler.h"
+
 // 'byte' und 'word' doesn't work!
 //  int valid;
 //  char singleChar;
@@ -29,6 +31,9 @@ typedef struct
   uint16_t mqtt_periodic_update_interval;
   uint8_t fancyled;
   uint8_t led_brightness; // in percent
+  uint8_t oi_stream;      // since config version 3
+  ScheduleRule schedule[SCHEDULE_RULES]; // since config version 4
+  uint16_t schedule_catchup;             // minutes a missed slot is run late, 0 = never
 } configData_t;
 
 #endif
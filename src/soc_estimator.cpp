@@ -0,0 +1,210 @@
+#include "soc_estimator.h"
+
+// Rest voltage of a 12 cell NiMH pack and its state of charge
+static const uint16_t REST_VOLTAGES[] = {13800, 14400, 14880, 15120, 15360, 15720, 16320, 16800}; // mV
+static const uint16_t REST_LEVELS[] = {0, 100, 200, 400, 600, 800, 950, 1000};                     // permille
+
+static uint32_t isqrt(uint32_t value)
+{
+    uint32_t root = 0;
+    for (uint32_t bit = 1UL << 30; bit > 0; bit >>= 2)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+void SocEstimator::update(unsigned long ms, const SensorSnapshot &sensors)
+{
+    if (!sensors.valid)
+    {
+        return;
+    }
+
+    uint16_t nominal = sensors.capacity > 0 ? sensors.capacity : SOC_DEFAULT_CAPACITY;
+    if (!_valid || nominal != _nominal)
+    {
+        // Start from the Roomba's level, or from the voltage without a capacity
+        reset();
+        _valid = true;
+        _lastTime = ms;
+        _nominal = nominal;
+        _capacity = nominal;
+        setLevel((sensors.capacity > 0 ? sensors.level : restLevel(sensors.voltage)) * 1000UL);
+        _baseError = (sensors.capacity > 0 ? SOC_INITIAL_ERROR : 2 * SOC_OCV_ERROR) * 1000UL;
+        _published = estimate();
+        return;
+    }
+
+    unsigned long elapsed = ms - _lastTime;
+    _lastTime = ms;
+    bool gap = elapsed > SOC_MAX_GAP;
+    if (gap)
+    {
+        _baseError += SOC_GAP_ERROR * 1000UL;
+        _resting = false;
+    }
+    else
+    {
+        int64_t delta = (int64_t)sensors.current * elapsed;
+        int64_t full = (int64_t)_capacity * 3600000;
+        _charge += delta;
+        _charge = _charge < 0 ? 0 : (_charge > full ? full : _charge);
+        _throughput += delta < 0 ? -delta : delta;
+        _drift += (int64_t)SOC_CURRENT_OFFSET * elapsed;
+        _sinceFull += delta;
+    }
+
+    // Rest voltage after SOC_REST_TIME of rest and then every SOC_REST_REPEAT
+    bool charging = sensors.chargingState != 0 && sensors.chargingState != 4;
+    int16_t current = sensors.current < 0 ? -sensors.current : sensors.current;
+    if (charging || current >= (_resting ? 2 * SOC_REST_CURRENT : SOC_REST_CURRENT))
+    {
+        _resting = false;
+    }
+    else if (!_resting)
+    {
+        _resting = true;
+        _restSince = ms;
+        _restWait = SOC_REST_TIME;
+    }
+    else if (ms - _restSince >= _restWait)
+    {
+        _restSince = ms;
+        _restWait = SOC_REST_REPEAT;
+        uint16_t level = restLevel(sensors.voltage);
+        if (_fullSeen && level <= SOC_LEARN_LEVEL && _sinceFull < 0)
+        {
+            // The charge used since the last full charge is 1000 - level permille of the capacity
+            int32_t measured = (int32_t)(-_sinceFull / (3600 * (int64_t)(1000 - level)));
+            measured = measured < _nominal / 2 ? _nominal / 2 : (measured > _nominal * 6 / 5 ? _nominal * 6 / 5 : measured);
+            uint32_t estimated = estimate();
+            _capacity += (measured - (int32_t)_capacity) / 2;
+            _capacityError = _capacityError / 2 > SOC_LEARNED_ERROR ? _capacityError / 2 : SOC_LEARNED_ERROR;
+            setLevel(estimated);
+            _fullSeen = false; // one measurement per discharge
+        }
+        correct(level * 1000UL, SOC_OCV_ERROR * 1000UL);
+    }
+
+    // Full at the start of trickle charging, the discharge is counted from its end
+    if (sensors.chargingState == 3)
+    {
+        if (!_fullCorrected)
+        {
+            _fullCorrected = true;
+            correct(1000000, SOC_FULL_ERROR * 1000UL);
+        }
+        _fullSeen = true;
+        _sinceFull = 0;
+    }
+    else
+    {
+        _fullCorrected = false;
+    }
+
+    int64_t target = estimate();
+    _published = gap ? target : _published + (target - _published) * (int64_t)elapsed / (int64_t)(elapsed + SOC_SMOOTHING_TIME);
+}
+
+void SocEstimator::reset()
+{
+    *this = SocEstimator();
+}
+
+bool SocEstimator::valid()
+{
+    return _valid;
+}
+
+uint16_t SocEstimator::level()
+{
+    return (_published + 500) / 1000;
+}
+
+uint16_t SocEstimator::error()
+{
+    uint32_t error = (errorPpm() + 500) / 1000;
+    return error < 1000 ? error : 1000;
+}
+
+uint16_t SocEstimator::confidence()
+{
+    return 1000 - error();
+}
+
+uint16_t SocEstimator::capacity()
+{
+    return _capacity;
+}
+
+unsigned long SocEstimator::corrections()
+{
+    return _corrections;
+}
+
+uint16_t SocEstimator::restLevel(uint16_t voltage)
+{
+    const size_t points = sizeof(REST_VOLTAGES) / sizeof(*REST_VOLTAGES);
+    if (voltage <= REST_VOLTAGES[0])
+    {
+        return REST_LEVELS[0];
+    }
+    for (size_t i = 1; i < points; i++)
+    {
+        if (voltage < REST_VOLTAGES[i])
+        {
+            return REST_LEVELS[i - 1] + (uint32_t)(REST_LEVELS[i] - REST_LEVELS[i - 1]) * (voltage - REST_VOLTAGES[i - 1]) /
+                                            (REST_VOLTAGES[i] - REST_VOLTAGES[i - 1]);
+        }
+    }
+    return REST_LEVELS[points - 1];
+}
+
+// Move the estimate towards a measured level (both ppm), weighted by the variances
+void SocEstimator::correct(uint32_t level, uint32_t error)
+{
+    uint32_t estimated = (errorPpm() + 500) / 1000;
+    uint32_t measured = (error + 500) / 1000;
+    estimated = estimated < 1000 ? estimated : 1000;
+    uint32_t estimatedVariance = estimated * estimated;
+    uint32_t measuredVariance = measured * measured;
+    uint32_t variance = estimatedVariance + measuredVariance;
+    if (variance == 0)
+    {
+        return;
+    }
+
+    int64_t current = estimate();
+    setLevel(current + ((int64_t)level - current) * estimatedVariance / variance);
+    _baseError = isqrt((uint64_t)estimatedVariance * measuredVariance / variance) * 1000;
+    _throughput = 0;
+    _drift = 0;
+    _corrections++;
+}
+
+uint32_t SocEstimator::estimate()
+{
+    int64_t level = _charge * 5 / ((int64_t)_capacity * 18);
+    return level < 0 ? 0 : (level > 1000000 ? 1000000 : level);
+}
+
+uint32_t SocEstimator::errorPpm()
+{
+    int64_t counted = _throughput * (SOC_CURRENT_ERROR + _capacityError) / 1000 + _drift;
+    int64_t error = _baseError + counted * 5 / ((int64_t)_capacity * 18);
+    return error < 1000000 ? error : 1000000;
+}
+
+void SocEstimator::setLevel(uint32_t level)
+{
+    _charge = (int64_t)level * _capacity * 18 / 5;
+}
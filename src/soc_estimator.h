@@ -0,0 +1,77 @@
+#ifndef soc_estimator_h
+#define soc_estimator_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sensor_snapshot.h"
+
+#define SOC_DEFAULT_CAPACITY 2696 // mAh, if the Roomba reports none
+#define SOC_MAX_GAP 10000         // ms, longer gaps between samples are not integrated
+#define SOC_GAP_ERROR 50          // permille added to the error for a gap
+#define SOC_CURRENT_ERROR 20      // permille of the counted charge added to the error
+#define SOC_CURRENT_OFFSET 10     // mA of possible offset of the current, added to the error over time
+#define SOC_CAPACITY_ERROR 300    // permille error of the capacity before it was measured
+#define SOC_LEARNED_ERROR 50      // permille, the capacity error doesn't get lower than this
+#define SOC_REST_CURRENT 50       // mA, a smaller current starts a rest, twice as much ends it
+#define SOC_REST_TIME 120000      // ms of rest before the voltage is used
+#define SOC_REST_REPEAT 3600000   // ms between corrections during a long rest
+#define SOC_OCV_ERROR 150         // permille error of a state of charge from the rest voltage
+#define SOC_FULL_ERROR 20         // permille error when the charger switches to trickle charging
+#define SOC_INITIAL_ERROR 300     // permille error of the Roomba's own level
+#define SOC_SMOOTHING_TIME 30000  // ms, time constant of the published level
+#define SOC_LEARN_LEVEL 300       // permille, rest levels below this one measure the capacity
+
+// State of charge by counting the current over time (coulomb counting),
+// corrected by the rest voltage and by the end of a charge.
+//
+// Every sample costs the same few integer operations, there is no history.
+// The error grows with the counted charge (errors of the current and of the
+// capacity) and with time (offset of the current) and shrinks with each
+// correction, which is weighted by both errors like a one-dimensional
+// Kalman filter. A correction at rest after a deep discharge from full also
+// measures the capacity, so the estimate stays right when the battery ages
+// and the Roomba's own CHARGE/CAPACITY level doesn't. The published level
+// follows the estimate smoothly, so corrections don't make it jump.
+class SocEstimator
+{
+public:
+    void update(unsigned long ms, const SensorSnapshot &sensors);
+    void reset();
+
+    bool valid();
+    uint16_t level();      // permille, smoothed
+    uint16_t error();      // permille
+    uint16_t confidence(); // permille, 1000 - error
+    uint16_t capacity();   // mAh, measured or as reported
+    unsigned long corrections();
+
+    static uint16_t restLevel(uint16_t voltage); // permille of a 12 cell NiMH pack at rest
+
+private:
+    void correct(uint32_t level, uint32_t error);
+    uint32_t estimate(); // ppm
+    uint32_t errorPpm();
+    void setLevel(uint32_t level);
+
+    bool _valid = false;
+    unsigned long _lastTime = 0;
+    uint16_t _nominal = 0;  // mAh reported by the Roomba
+    uint16_t _capacity = 0; // mAh
+    int64_t _charge = 0;    // mA*ms
+    int64_t _throughput = 0; // mA*ms counted since the last correction
+    int64_t _drift = 0;      // mA*ms of possible offset since the last correction
+    uint16_t _capacityError = SOC_CAPACITY_ERROR; // permille
+    uint32_t _baseError = 0; // ppm at the last correction and for gaps
+    uint32_t _published = 0; // ppm
+
+    unsigned long _restSince = 0; // or the last correction during the rest
+    unsigned long _restWait = 0;  // ms from _restSince to the next correction
+    bool _resting = false;
+    bool _fullCorrected = false;
+    bool _fullSeen = false;
+    int64_t _sinceFull = 0; // mA*ms since the end of the last full charge
+
+    unsigned long _corrections = 0;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "task_runtime.h"
+
+TaskRuntime::TaskRuntime(Clock clock)
+{
+    _clock = clock;
+}
+
+uint8_t TaskRuntime::add(const char *name, Step step, unsigned long budget)
+{
+    if (_count >= RUNTIME_TASKS)
+    {
+        return RUNTIME_NONE;
+    }
+    Task &task = _tasks[_count];
+    task.name = name;
+    task.step = step;
+    task.budget = budget;
+    task.overBudget = 0;
+    task.slices.reset();
+    return _count++;
+}
+
+void TaskRuntime::loop()
+{
+    unsigned long loopStart = _clock();
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        Task &task = _tasks[i];
+        _running = i;
+        _sliceStart = _clock();
+        if (task.step)
+        {
+            task.step();
+        }
+        unsigned long slice = _clock() - _sliceStart;
+        task.slices.record(slice);
+        if (slice > task.budget)
+        {
+            task.overBudget++;
+        }
+    }
+    _running = RUNTIME_NONE;
+    _loops.record(_clock() - loopStart);
+}
+
+bool TaskRuntime::expired()
+{
+    return _running != RUNTIME_NONE && elapsed() >= _tasks[_running].budget;
+}
+
+unsigned long TaskRuntime::elapsed()
+{
+    return _running != RUNTIME_NONE ? _clock() - _sliceStart : 0;
+}
+
+uint8_t TaskRuntime::count()
+{
+    return _count;
+}
+
+const char *TaskRuntime::name(uint8_t task)
+{
+    return task < _count ? _tasks[task].name : "";
+}
+
+unsigned long TaskRuntime::budget(uint8_t task)
+{
+    return task < _count ? _tasks[task].budget : 0;
+}
+
+unsigned long TaskRuntime::overBudget(uint8_t task)
+{
+    return task < _count ? _tasks[task].overBudget : 0;
+}
+
+LatencyHistogram &TaskRuntime::slices(uint8_t task)
+{
+    return _tasks[task < _count ? task : 0].slices;
+}
+
+LatencyHistogram &TaskRuntime::loops()
+{
+    return _loops;
+}
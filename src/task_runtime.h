@@ -0,0 +1,85 @@
+#ifndef task_runtime_h
+#define task_runtime_h
+
+#include <stdint.h>
+#include <functional>
+#include "latency_histogram.h"
+
+#define RUNTIME_TASKS 10   // tasks which can be added
+#define RUNTIME_NONE 0xFF  // no task, e.g. when all are in use
+
+// Resume points of a stackless coroutine: the task function keeps the line
+// to resume at in a static uint16_t. Local variables don't survive a yield,
+// and there can be only one yield per line.
+//
+//   static uint16_t resume = 0;
+//   TASK_BEGIN(resume);
+//   first();
+//   TASK_YIELD_IF(resume, runtime.expired());
+//   second();
+//   TASK_END(resume);
+#define TASK_BEGIN(resume) \
+    switch (resume)        \
+    {                      \
+    case 0:
+#define TASK_YIELD_IF(resume, condition) \
+    do                                   \
+    {                                    \
+        if (condition)                   \
+        {                                \
+            resume = __LINE__;           \
+            return;                      \
+        }                                \
+    case __LINE__:;                      \
+    } while (0)
+#define TASK_END(resume) \
+    }                    \
+    resume = 0
+
+// Cooperative round robin of the subsystems in loop(): every task gets one
+// slice per loop() and returns from it on its own, at the latest when its
+// soft time budget is used up (expired()), to go on in the next slice.
+//
+// The slice times are recorded per task in a LatencyHistogram, so max and
+// p99 show which subsystem holds up the loop, and a slice over the budget
+// is counted. The clock is micros() on the device.
+class TaskRuntime
+{
+public:
+    typedef std::function<void()> Step;
+    typedef unsigned long (*Clock)();
+
+    TaskRuntime(Clock clock);
+
+    uint8_t add(const char *name, Step step, unsigned long budget); // µs, returns RUNTIME_NONE when full
+    void loop();
+
+    bool expired();          // the running task used up its budget and should yield
+    unsigned long elapsed(); // µs of the running slice
+
+    uint8_t count();
+    const char *name(uint8_t task);
+    unsigned long budget(uint8_t task);
+    unsigned long overBudget(uint8_t task); // slices longer than the budget
+    LatencyHistogram &slices(uint8_t task);
+    LatencyHistogram &loops(); // µs of a whole loop()
+
+private:
+    struct Task
+    {
+        const char *name;
+        Step step;
+        unsigned long budget;
+        unsigned long overBudget;
+        LatencyHistogram slices;
+    };
+
+    Clock _clock;
+    Task _tasks[RUNTIME_TASKS];
+    uint8_t _count = 0;
+    uint8_t _running = RUNTIME_NONE;
+    unsigned long _sliceStart = 0;
+    LatencyHistogram _loops;
+};
+
+#endif
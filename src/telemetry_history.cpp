@@ -0,0 +1,272 @@
+#include "telemetry_history.h"
+
+static uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static size_t writeVarint(uint8_t *out, uint32_t value)
+{
+    size_t length = 0;
+    do
+    {
+        uint8_t data = value & 0x7F;
+        value >>= 7;
+        out[length++] = data | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+    return length;
+}
+
+static bool sameValues(const TelemetrySample &a, const TelemetrySample &b)
+{
+    return a.voltage == b.voltage && a.current == b.current && a.temperature == b.temperature && a.charge == b.charge && a.chargingState == b.chargingState;
+}
+
+void TelemetryHistory::append(const TelemetrySample &sample)
+{
+    if (_count > 0 && sample.time == _last.time + 1 && sameValues(sample, _last))
+    {
+        _last = sample;
+        _count++;
+        if (++_run == TELEMETRY_RUN_MAX)
+        {
+            flushRun();
+        }
+        return;
+    }
+
+    flushRun();
+
+    // Typical on the dock: only voltage and current change by a few mV/mA
+    int32_t voltageDelta = (int32_t)sample.voltage - _last.voltage;
+    int32_t currentDelta = (int32_t)sample.current - _last.current;
+    if (sample.time == _last.time + 1 && sample.temperature == _last.temperature && sample.charge == _last.charge && sample.chargingState == _last.chargingState &&
+        zigzag(voltageDelta) < 8 && zigzag(currentDelta) < 8)
+    {
+        uint8_t record = SMALL | (zigzag(voltageDelta) << 3) | zigzag(currentDelta);
+        write(&record, 1);
+        _last = sample;
+        _count++;
+        return;
+    }
+
+    uint8_t record[24];
+    size_t length = 1;
+    uint8_t flags = 0;
+
+    if (sample.time != _last.time + 1)
+    {
+        flags |= TIME;
+        length += writeVarint(record + length, zigzag((int32_t)(sample.time - _last.time)));
+    }
+    if (sample.voltage != _last.voltage)
+    {
+        flags |= VOLTAGE;
+        length += writeVarint(record + length, zigzag(voltageDelta));
+    }
+    if (sample.current != _last.current)
+    {
+        flags |= CURRENT;
+        length += writeVarint(record + length, zigzag(currentDelta));
+    }
+    if (sample.temperature != _last.temperature)
+    {
+        flags |= TEMPERATURE;
+        length += writeVarint(record + length, zigzag((int32_t)sample.temperature - _last.temperature));
+    }
+    if (sample.charge != _last.charge)
+    {
+        flags |= CHARGE;
+        length += writeVarint(record + length, zigzag((int32_t)sample.charge - _last.charge));
+    }
+    if (sample.chargingState != _last.chargingState)
+    {
+        flags |= STATE;
+        record[length++] = sample.chargingState;
+    }
+    record[0] = flags;
+
+    write(record, length);
+    _last = sample;
+    _count++;
+}
+
+void TelemetryHistory::clear()
+{
+    _ring.clear();
+    _base = TelemetrySample();
+    _last = TelemetrySample();
+    _run = 0;
+    _count = 0;
+}
+
+TelemetryHistory::Iterator TelemetryHistory::samples()
+{
+    return Iterator(*this);
+}
+
+unsigned long TelemetryHistory::count()
+{
+    return _count;
+}
+
+// RAM used by the encoded samples
+size_t TelemetryHistory::bytes()
+{
+    return _ring.available();
+}
+
+uint32_t TelemetryHistory::firstTime()
+{
+    TelemetrySample sample;
+    Iterator iterator = samples();
+    return iterator.next(sample) ? sample.time : 0;
+}
+
+uint32_t TelemetryHistory::lastTime()
+{
+    return _count > 0 ? _last.time : 0;
+}
+
+unsigned long TelemetryHistory::droppedSamples()
+{
+    return _droppedSamples;
+}
+
+void TelemetryHistory::write(const uint8_t *data, size_t length)
+{
+    while (TELEMETRY_HISTORY_SIZE - _ring.available() < length)
+    {
+        dropRecord();
+    }
+    _ring.push(data, length);
+}
+
+void TelemetryHistory::flushRun()
+{
+    if (_run > 0)
+    {
+        uint8_t record = RUN | (_run - 1);
+        _run = 0;
+        write(&record, 1);
+    }
+}
+
+// Drop the oldest record, its sample becomes the base
+void TelemetryHistory::dropRecord()
+{
+    uint8_t run;
+    size_t length = decode(0, _base, run);
+    if (run > 0)
+    {
+        _base.time += run;
+    }
+    else
+    {
+        run = 1;
+    }
+    _ring.consume(length);
+    _count -= run;
+    _droppedSamples += run;
+}
+
+// Apply the record at offset to sample, returns the record length. For a run
+// record the sample is unchanged and run is the number of samples.
+size_t TelemetryHistory::decode(size_t offset, TelemetrySample &sample, uint8_t &run)
+{
+    uint8_t flags = _ring.peek(offset);
+    size_t length = 1;
+    run = 0;
+
+    if (flags & RUN)
+    {
+        run = (flags & 0x7F) + 1;
+        return length;
+    }
+
+    if (flags & SMALL)
+    {
+        sample.time++;
+        sample.voltage += unzigzag((flags >> 3) & 7);
+        sample.current += unzigzag(flags & 7);
+        return length;
+    }
+
+    const auto varint = [&]()
+    {
+        uint32_t value = 0;
+        uint8_t data;
+        uint8_t shift = 0;
+        do
+        {
+            data = _ring.peek(offset + length++);
+            value |= (uint32_t)(data & 0x7F) << shift;
+            shift += 7;
+        } while ((data & 0x80) != 0 && shift < 35);
+        return unzigzag(value);
+    };
+
+    sample.time += (flags & TIME) ? varint() : 1;
+    if (flags & VOLTAGE)
+    {
+        sample.voltage += varint();
+    }
+    if (flags & CURRENT)
+    {
+        sample.current += varint();
+    }
+    if (flags & TEMPERATURE)
+    {
+        sample.temperature += varint();
+    }
+    if (flags & CHARGE)
+    {
+        sample.charge += varint();
+    }
+    if (flags & STATE)
+    {
+        sample.chargingState = _ring.peek(offset + length++);
+    }
+    return length;
+}
+
+TelemetryHistory::Iterator::Iterator(TelemetryHistory &history) : _history(history), _sample(history._base), _pendingRun(history._run)
+{
+}
+
+bool TelemetryHistory::Iterator::next(TelemetrySample &sample)
+{
+    while (_run == 0 && _offset < _history._ring.available())
+    {
+        uint8_t run;
+        _offset += _history.decode(_offset, _sample, run);
+        if (run == 0)
+        {
+            sample = _sample;
+            return true;
+        }
+        _run = run;
+    }
+
+    if (_run > 0)
+    {
+        _run--;
+    }
+    else if (_pendingRun > 0)
+    {
+        _pendingRun--;
+    }
+    else
+    {
+        return false;
+    }
+
+    _sample.time++;
+    sample = _sample;
+    return true;
+}
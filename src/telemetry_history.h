@@ -0,0 +1,92 @@
+#ifndef telemetry_history_h
+#define telemetry_history_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "byte_ring.h"
+
+#define TELEMETRY_HISTORY_SIZE 4096 // RAM for samples, the oldest samples are dropped when full
+#define TELEMETRY_RUN_MAX 128       // samples in one run record
+
+struct TelemetrySample
+{
+    uint32_t time = 0;        // s
+    uint16_t voltage = 0;     // mV
+    int16_t current = 0;      // mA
+    int8_t temperature = 0;   // degree Celsius
+    uint16_t charge = 0;      // mAh
+    uint8_t chargingState = 0;
+};
+
+// Per-second samples of the battery values in a byte ring, each sample
+// encoded as the difference to the previous one.
+//
+// Record: flags followed by the fields set in the flags
+//   bit 7 set:   a run of (flags & 0x7F) + 1 samples, each 1s after the
+//                previous one with unchanged values
+//   bit 6 set:   a sample 1s after the previous one, bit 3-5 and bit 0-2 are
+//                the zigzag delta of voltage and current (-4..3), the other
+//                values are unchanged
+//   otherwise
+//   bit 0 TIME:  zigzag varint time delta (otherwise the delta is 1s)
+//   bit 1-4:     zigzag varint delta of voltage, current, temperature, charge
+//   bit 5 STATE: charging state
+// The base sample is the one before the oldest record, it is updated when
+// the oldest record is dropped.
+class TelemetryHistory
+{
+public:
+    // Walks the samples from the oldest to the newest. Invalid after append().
+    class Iterator
+    {
+    public:
+        bool next(TelemetrySample &sample);
+
+    private:
+        friend class TelemetryHistory;
+        Iterator(TelemetryHistory &history);
+
+        TelemetryHistory &_history;
+        TelemetrySample _sample;
+        size_t _offset = 0;
+        uint8_t _run = 0;        // samples left of the current run record
+        uint8_t _pendingRun = 0; // samples left of the run not written yet
+    };
+
+    void append(const TelemetrySample &sample);
+    void clear();
+    Iterator samples();
+
+    unsigned long count();
+    size_t bytes();
+    uint32_t firstTime();
+    uint32_t lastTime();
+    unsigned long droppedSamples();
+
+private:
+    enum Flags : uint8_t
+    {
+        TIME = 0x01,
+        VOLTAGE = 0x02,
+        CURRENT = 0x04,
+        TEMPERATURE = 0x08,
+        CHARGE = 0x10,
+        STATE = 0x20,
+        SMALL = 0x40,
+        RUN = 0x80
+    };
+
+    void write(const uint8_t *data, size_t length);
+    void flushRun();
+    void dropRecord();
+    size_t decode(size_t offset, TelemetrySample &sample, uint8_t &run);
+
+    ByteRing<TELEMETRY_HISTORY_SIZE> _ring;
+    TelemetrySample _base; // sample before the oldest record
+    TelemetrySample _last; // newest sample
+    uint8_t _run = 0;      // samples equal to _last (1s apart) not written yet
+    unsigned long _count = 0;
+    unsigned long _droppedSamples = 0;
+};
+
+#endif
@@ -0,0 +1,506 @@
+#include "telemetry_log.h"
+
+static const uint8_t LOG_MAGIC[] = {'T', 'L', 'O', 'G'};
+static const uint8_t PAGE = LOG_SEGMENTS; // readAt() from the page in RAM
+
+static uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void put32(uint8_t *out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static size_t encodeRecord(uint8_t *out, LogRecordType type, uint32_t time, const uint8_t *data, uint8_t length)
+{
+    out[0] = length;
+    out[1] = type;
+    put32(out + 2, time);
+    memcpy(out + 6, data, length);
+    uint16_t crc = crc16(out + 1, 5 + length);
+    out[6 + length] = crc >> 8;
+    out[7 + length] = crc;
+    return LOG_RECORD_OVERHEAD + length;
+}
+
+TelemetryLog::TelemetryLog(LogStorage &storage) : _storage(storage)
+{
+}
+
+bool TelemetryLog::begin()
+{
+    uint32_t sequences[LOG_SEGMENTS];
+    LogState states[LOG_SEGMENTS];
+
+    // Sort the valid segments by sequence
+    _segments = 0;
+    for (uint8_t segment = 0; segment < LOG_SEGMENTS; segment++)
+    {
+        uint32_t sequence;
+        LogState state;
+        if (!readHeader(segment, sequence, state))
+        {
+            continue;
+        }
+
+        uint8_t position = _segments++;
+        while (position > 0 && sequences[position - 1] > sequence)
+        {
+            _order[position] = _order[position - 1];
+            sequences[position] = sequences[position - 1];
+            states[position] = states[position - 1];
+            position--;
+        }
+        _order[position] = segment;
+        sequences[position] = sequence;
+        states[position] = state;
+    }
+
+    _index = Index();
+    _activeClosed = false;
+    if (_segments == 0)
+    {
+        _sequence = 0;
+        _activeSize = 0;
+        return true;
+    }
+
+    // State of the header and newer state from the records of the active segment
+    uint8_t active = _order[_segments - 1];
+    _sequence = sequences[_segments - 1];
+    _state = states[_segments - 1];
+    _activeSize = _storage.size(active);
+
+    // The index of the active segment is rebuilt from the same records
+    LogRecord record;
+    size_t offset = LOG_HEADER_SIZE;
+    size_t start = offset;
+    ReadResult result;
+    while ((result = readRecord(active, offset, _activeSize, record)) != ReadResult::END)
+    {
+        if (result == ReadResult::RECORD)
+        {
+            if (record.type == LOG_INDEX)
+            {
+                _activeClosed = true;
+            }
+            else
+            {
+                indexRecord(start, record.time);
+                applyState(record);
+            }
+        }
+        start = offset;
+    }
+    return true;
+}
+
+bool TelemetryLog::append(LogRecordType type, uint32_t time, const uint8_t *data, uint8_t length)
+{
+    if (length > LOG_RECORD_MAX)
+    {
+        return false;
+    }
+
+    if (_pageLength + LOG_RECORD_OVERHEAD + length > LOG_PAGE_SIZE)
+    {
+        flush();
+    }
+    if (_pageLength == 0)
+    {
+        _pageSince = millis();
+    }
+
+    _pageLength += encodeRecord(_page + _pageLength, type, time, data, length);
+
+    LogRecord record;
+    record.type = type;
+    record.time = time;
+    record.length = length;
+    memcpy(record.data, data, length);
+    applyState(record);
+    return true;
+}
+
+bool TelemetryLog::event(LogEvent event, uint32_t time, const uint8_t *data, uint8_t length)
+{
+    uint8_t payload[LOG_RECORD_MAX];
+    if (length + 1 > LOG_RECORD_MAX)
+    {
+        return false;
+    }
+    payload[0] = event;
+    if (length > 0)
+    {
+        memcpy(payload + 1, data, length);
+    }
+    return append(LOG_EVENT, time, payload, length + 1);
+}
+
+void TelemetryLog::loop()
+{
+    if (_pageLength > 0 && millis() - _pageSince >= LOG_FLUSH_INTERVAL)
+    {
+        flush();
+    }
+}
+
+// Write the records waiting in RAM, e.g. before a reboot
+bool TelemetryLog::flush()
+{
+    if (_pageLength == 0)
+    {
+        return true;
+    }
+
+    // Room for the index record is kept in every segment
+    if (_segments == 0 || _activeClosed || _activeSize + _pageLength + LOG_INDEX_RECORD_SIZE > LOG_SEGMENT_SIZE)
+    {
+        if (_segments > 0 && !_activeClosed && !closeSegment())
+        {
+            // Readers scan the segment without index
+            _writeErrors++;
+        }
+        if (!openSegment())
+        {
+            _writeErrors++;
+            _pageLength = 0;
+            return false;
+        }
+    }
+
+    bool success = _storage.append(_order[_segments - 1], _page, _pageLength);
+    if (success)
+    {
+        for (size_t offset = 0; offset < _pageLength; offset += LOG_RECORD_OVERHEAD + _page[offset])
+        {
+            indexRecord(_activeSize + offset, get32(_page + offset + 2));
+        }
+        _activeSize += _pageLength;
+        _bytesWritten += _pageLength;
+        _flushes++;
+    }
+    else
+    {
+        _writeErrors++;
+    }
+    _pageLength = 0;
+    return success;
+}
+
+TelemetryLog::Reader TelemetryLog::records(uint32_t from)
+{
+    return Reader(*this, from);
+}
+
+LogState &TelemetryLog::state()
+{
+    return _state;
+}
+
+// Bytes on the flash
+size_t TelemetryLog::size()
+{
+    size_t size = 0;
+    for (uint8_t i = 0; i < _segments; i++)
+    {
+        size += (i == _segments - 1) ? _activeSize : _storage.size(_order[i]);
+    }
+    return size;
+}
+
+unsigned long TelemetryLog::flushes()
+{
+    return _flushes;
+}
+
+unsigned long TelemetryLog::bytesWritten()
+{
+    return _bytesWritten;
+}
+
+unsigned long TelemetryLog::rotations()
+{
+    return _rotations;
+}
+
+unsigned long TelemetryLog::crcErrors()
+{
+    return _crcErrors;
+}
+
+unsigned long TelemetryLog::indexSkips()
+{
+    return _indexSkips;
+}
+
+unsigned long TelemetryLog::writeErrors()
+{
+    return _writeErrors;
+}
+
+// Start a new segment in a free slot or in place of the oldest segment
+bool TelemetryLog::openSegment()
+{
+    uint8_t segment = 0;
+    if (_segments < LOG_SEGMENTS)
+    {
+        bool used;
+        do
+        {
+            used = false;
+            for (uint8_t i = 0; i < _segments; i++)
+            {
+                used = used || _order[i] == segment;
+            }
+        } while (used && ++segment < LOG_SEGMENTS);
+    }
+    else
+    {
+        segment = _order[0];
+        memmove(_order, _order + 1, LOG_SEGMENTS - 1);
+        _segments--;
+        _rotations++;
+    }
+
+    uint8_t header[LOG_HEADER_SIZE];
+    memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header[4] = LOG_VERSION;
+    header[5] = 0;
+    put32(header + 8, _sequence + 1);
+    put32(header + 12, _state.lastClean);
+    uint16_t crc = crc16(header + 8, LOG_HEADER_SIZE - 8);
+    header[6] = crc >> 8;
+    header[7] = crc;
+
+    if (!_storage.erase(segment) || !_storage.append(segment, header, sizeof(header)))
+    {
+        return false;
+    }
+
+    _order[_segments++] = segment;
+    _sequence++;
+    _activeSize = sizeof(header);
+    _activeClosed = false;
+    _index = Index();
+    _bytesWritten += sizeof(header);
+    return true;
+}
+
+bool TelemetryLog::readHeader(uint8_t segment, uint32_t &sequence, LogState &state)
+{
+    uint8_t header[LOG_HEADER_SIZE];
+    if (_storage.read(segment, 0, header, sizeof(header)) != sizeof(header) || memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 ||
+        header[4] != LOG_VERSION || crc16(header + 8, LOG_HEADER_SIZE - 8) != (((uint16_t)header[6] << 8) | header[7]))
+    {
+        return false;
+    }
+    sequence = get32(header + 8);
+    state.lastClean = get32(header + 12);
+    return true;
+}
+
+void TelemetryLog::applyState(const LogRecord &record)
+{
+    if (record.type == LOG_EVENT && record.length > 0 && record.data[0] == LOG_EVENT_CLEAN)
+    {
+        _state.lastClean = record.time;
+    }
+}
+
+// Add an index entry once a step is full
+void TelemetryLog::indexRecord(size_t offset, uint32_t time)
+{
+    if (_index.count < LOG_INDEX_ENTRIES && offset >= (size_t)(_index.count + 1) * LOG_INDEX_STEP)
+    {
+        _index.entries[_index.count++] = {(uint16_t)offset, _index.time};
+    }
+    if (time > _index.time)
+    {
+        _index.time = time;
+    }
+}
+
+// Append the index of the active segment as its last record
+bool TelemetryLog::closeSegment()
+{
+    uint8_t payload[LOG_INDEX_PAYLOAD] = {};
+    payload[0] = _index.count;
+    put32(payload + 1, _index.time);
+    for (uint8_t i = 0; i < _index.count; i++)
+    {
+        uint8_t *out = payload + 5 + i * 6;
+        out[0] = _index.entries[i].offset >> 8;
+        out[1] = _index.entries[i].offset;
+        put32(out + 2, _index.entries[i].time);
+    }
+
+    uint8_t record[LOG_INDEX_RECORD_SIZE];
+    encodeRecord(record, LOG_INDEX, _index.time, payload, sizeof(payload));
+    if (!_storage.append(_order[_segments - 1], record, sizeof(record)))
+    {
+        return false;
+    }
+    _activeSize += sizeof(record);
+    _bytesWritten += sizeof(record);
+    _activeClosed = true;
+    return true;
+}
+
+// The index record of a closed segment, which has a fixed size at its end
+bool TelemetryLog::readIndex(uint8_t segment, size_t size, Index &index)
+{
+    uint8_t data[LOG_INDEX_RECORD_SIZE];
+    if (size < LOG_HEADER_SIZE + sizeof(data) || _storage.read(segment, size - sizeof(data), data, sizeof(data)) != sizeof(data) ||
+        data[0] != LOG_INDEX_PAYLOAD || data[1] != LOG_INDEX ||
+        crc16(data + 1, sizeof(data) - 3) != (((uint16_t)data[sizeof(data) - 2] << 8) | data[sizeof(data) - 1]))
+    {
+        return false;
+    }
+
+    const uint8_t *payload = data + 6;
+    index.count = payload[0] < LOG_INDEX_ENTRIES ? payload[0] : LOG_INDEX_ENTRIES;
+    index.time = get32(payload + 1);
+    for (uint8_t i = 0; i < index.count; i++)
+    {
+        const uint8_t *entry = payload + 5 + i * 6;
+        index.entries[i] = {(uint16_t)((entry[0] << 8) | entry[1]), get32(entry + 2)};
+    }
+    return true;
+}
+
+// Offset of the first record that may be at or after from
+size_t TelemetryLog::seek(const Index &index, uint32_t from)
+{
+    uint8_t low = 0;
+    uint8_t high = index.count;
+    while (low < high)
+    {
+        uint8_t middle = (low + high) / 2;
+        if (index.entries[middle].time < from)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low == 0 ? LOG_HEADER_SIZE : index.entries[low - 1].offset;
+}
+
+size_t TelemetryLog::readAt(uint8_t segment, size_t offset, uint8_t *data, size_t length)
+{
+    if (segment == PAGE)
+    {
+        length = offset < _pageLength ? (length < _pageLength - offset ? length : _pageLength - offset) : 0;
+        memcpy(data, _page + offset, length);
+        return length;
+    }
+    return _storage.read(segment, offset, data, length);
+}
+
+TelemetryLog::ReadResult TelemetryLog::readRecord(uint8_t segment, size_t &offset, size_t end, LogRecord &record)
+{
+    uint8_t data[LOG_RECORD_OVERHEAD + LOG_RECORD_MAX];
+
+    if (offset + LOG_RECORD_OVERHEAD > end || readAt(segment, offset, data, 1) != 1)
+    {
+        return ReadResult::END;
+    }
+
+    // A length beyond the end can't be skipped
+    size_t length = LOG_RECORD_OVERHEAD + data[0];
+    if (data[0] > LOG_RECORD_MAX || offset + length > end || readAt(segment, offset, data, length) != length)
+    {
+        _crcErrors++;
+        return ReadResult::END;
+    }
+    offset += length;
+
+    uint16_t crc = ((uint16_t)data[length - 2] << 8) | data[length - 1];
+    if (crc16(data + 1, length - 3) != crc)
+    {
+        _crcErrors++;
+        return ReadResult::CORRUPT;
+    }
+
+    record.type = (LogRecordType)data[1];
+    record.time = get32(data + 2);
+    record.length = data[0];
+    memcpy(record.data, data + 6, record.length);
+    return ReadResult::RECORD;
+}
+
+TelemetryLog::Reader::Reader(TelemetryLog &log, uint32_t from) : _from(from), _log(log)
+{
+    start(0);
+}
+
+bool TelemetryLog::Reader::next(LogRecord &record)
+{
+    while (_position <= _log._segments)
+    {
+        ReadResult result = _log.readRecord(_segment, _offset, _end, record);
+        if (result == ReadResult::RECORD && record.type != LOG_INDEX)
+        {
+            return true;
+        }
+        if (result == ReadResult::END)
+        {
+            start(_position + 1);
+        }
+    }
+    return false;
+}
+
+void TelemetryLog::Reader::start(uint8_t position)
+{
+    _position = position;
+    if (_position < _log._segments)
+    {
+        bool active = _position == _log._segments - 1;
+        _segment = _log._order[_position];
+        _offset = LOG_HEADER_SIZE;
+        _end = active ? _log._activeSize : _log._storage.size(_segment);
+
+        Index stored;
+        const Index *index = nullptr;
+        if (_from > 0)
+        {
+            index = active ? &_log._index : (_log.readIndex(_segment, _end, stored) ? &stored : nullptr);
+        }
+        if (index)
+        {
+            _offset = index->time < _from ? _end : _log.seek(*index, _from);
+            if (_offset > LOG_HEADER_SIZE)
+            {
+                _log._indexSkips++;
+            }
+        }
+    }
+    else
+    {
+        _segment = PAGE;
+        _offset = 0;
+        _end = _log._pageLength;
+    }
+}
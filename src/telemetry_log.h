@@ -0,0 +1,170 @@
+#ifndef telemetry_log_h
+#define telemetry_log_h
+
+#include <Arduino.h>
+
+#define LOG_SEGMENTS 4            // segment files, the oldest is erased when all are full
+#define LOG_SEGMENT_SIZE 8192     // max. bytes of a segment (header and records)
+#define LOG_PAGE_SIZE 256         // records are written in batches of up to one flash page
+#define LOG_FLUSH_INTERVAL 900000 // ms a record waits in RAM at most
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 16
+#define LOG_RECORD_OVERHEAD 8 // length, type, time, CRC
+#define LOG_RECORD_MAX 64     // max. payload of a record
+#define LOG_INDEX_ENTRIES 9   // sparse time index entries per segment
+#define LOG_INDEX_PAYLOAD (1 + 4 + LOG_INDEX_ENTRIES * 6)
+#define LOG_INDEX_RECORD_SIZE (LOG_RECORD_OVERHEAD + LOG_INDEX_PAYLOAD)
+#define LOG_INDEX_STEP (LOG_SEGMENT_SIZE / (LOG_INDEX_ENTRIES + 1)) // bytes between index entries
+
+// Flash behind the log: segment files which are only appended to or erased
+class LogStorage
+{
+public:
+    virtual ~LogStorage() {}
+    virtual size_t size(uint8_t segment) = 0; // 0 if the segment doesn't exist
+    virtual size_t read(uint8_t segment, size_t offset, uint8_t *data, size_t length) = 0;
+    virtual bool append(uint8_t segment, const uint8_t *data, size_t length) = 0;
+    virtual bool erase(uint8_t segment) = 0;
+};
+
+enum LogRecordType : uint8_t
+{
+    LOG_ROLLUP = 1, // resolution, RollupBucket (see telemetry_rollup.h)
+    LOG_EVENT = 2,  // event code, data
+    LOG_INDEX = 3   // entry count, max. time, entries (offset uint16, max. time before uint32)
+};
+
+enum LogEvent : uint8_t
+{
+    LOG_EVENT_CLEAN = 1 // cleaning started
+};
+
+// State carried from segment to segment in the headers, so it is known after
+// a reboot without reading the old segments
+struct LogState
+{
+    uint32_t lastClean = 0;
+};
+
+struct LogRecord
+{
+    LogRecordType type;
+    uint32_t time;
+    uint8_t length;
+    uint8_t data[LOG_RECORD_MAX];
+};
+
+// Append-only log of telemetry rollups and events in a ring of segment files.
+//
+// Segment: header "TLOG", version, 0, CRC-16 of the rest of the header,
+// sequence (uint32), LogState (uint32 last clean), then records:
+//   payload length, type, time (uint32), payload, CRC-16 of type, time and payload
+// All numbers are big endian. Records are collected in RAM and appended one
+// page at a time; a segment that can't take the page is closed with a
+// LOG_INDEX record of fixed size and the oldest segment is erased for the
+// next one.
+//
+// The index is sparse: an entry every LOG_INDEX_STEP bytes holds the offset
+// of a record and the latest time of the records before it. Rollups are
+// logged when their bucket closes, so times are not sorted, but the latest
+// time so far is, and records before an entry with a time below a query
+// start can be skipped. The index of the active segment is kept in RAM.
+//
+// begin() reads the segment headers to find the newest segment and the
+// state, and only the records of the newest segment for newer state.
+class TelemetryLog
+{
+public:
+    // Walks the records from the oldest to the newest, including the ones
+    // waiting in RAM. Records with a wrong CRC are skipped. Started with a
+    // time, segments and index steps with older records only are skipped;
+    // later records may still be older than that time.
+    class Reader
+    {
+    public:
+        bool next(LogRecord &record);
+
+    private:
+        friend class TelemetryLog;
+        Reader(TelemetryLog &log, uint32_t from);
+        void start(uint8_t position);
+
+        uint32_t _from;
+        TelemetryLog &_log;
+        uint8_t _position; // index in the segment order, _segments = page in RAM
+        uint8_t _segment;
+        size_t _offset;
+        size_t _end;
+    };
+
+    TelemetryLog(LogStorage &storage);
+
+    bool begin();
+    bool append(LogRecordType type, uint32_t time, const uint8_t *data, uint8_t length);
+    bool event(LogEvent event, uint32_t time, const uint8_t *data = nullptr, uint8_t length = 0);
+    void loop();
+    bool flush();
+    Reader records(uint32_t from = 0);
+
+    LogState &state();
+    size_t size();
+    unsigned long flushes();
+    unsigned long bytesWritten();
+    unsigned long rotations();
+    unsigned long crcErrors();
+    unsigned long indexSkips(); // segments or index steps skipped by readers
+    unsigned long writeErrors();
+
+private:
+    enum class ReadResult : uint8_t
+    {
+        RECORD,
+        END,
+        CORRUPT
+    };
+
+    struct IndexEntry
+    {
+        uint16_t offset;
+        uint32_t time; // latest time of the records before offset
+    };
+
+    struct Index
+    {
+        uint8_t count = 0;
+        uint32_t time = 0; // latest time in the segment
+        IndexEntry entries[LOG_INDEX_ENTRIES];
+    };
+
+    bool openSegment();
+    bool readHeader(uint8_t segment, uint32_t &sequence, LogState &state);
+    void applyState(const LogRecord &record);
+    void indexRecord(size_t offset, uint32_t time);
+    bool closeSegment();
+    bool readIndex(uint8_t segment, size_t size, Index &index);
+    size_t seek(const Index &index, uint32_t from);
+    size_t readAt(uint8_t segment, size_t offset, uint8_t *data, size_t length);
+    ReadResult readRecord(uint8_t segment, size_t &offset, size_t end, LogRecord &record);
+
+    LogStorage &_storage;
+    uint8_t _order[LOG_SEGMENTS]; // segments from the oldest to the newest
+    uint8_t _segments = 0;        // segments in _order, the last one is active
+    uint32_t _sequence = 0;       // of the active segment
+    size_t _activeSize = 0;
+    bool _activeClosed = false; // has its index record
+    Index _index;               // of the active segment
+    LogState _state;
+
+    uint8_t _page[LOG_PAGE_SIZE];
+    size_t _pageLength = 0;
+    unsigned long _pageSince = 0;
+
+    unsigned long _flushes = 0;
+    unsigned long _bytesWritten = 0;
+    unsigned long _rotations = 0;
+    unsigned long _crcErrors = 0;
+    unsigned long _indexSkips = 0;
+    unsigned long _writeErrors = 0;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include "telemetry_rollup.h"
+
+static void put16(uint8_t *out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+static int16_t get16(const uint8_t *data)
+{
+    return (int16_t)(((uint16_t)data[0] << 8) | data[1]);
+}
+
+uint8_t rollupEncode(uint8_t resolution, const RollupBucket &bucket, uint8_t *out)
+{
+    out[0] = resolution;
+    put16(out + 1, bucket.samples);
+    uint8_t length = 3;
+    for (const RollupValue &value : bucket.values)
+    {
+        put16(out + length, value.min);
+        put16(out + length + 2, value.max);
+        put16(out + length + 4, value.mean);
+        put16(out + length + 6, value.last);
+        length += 8;
+    }
+    return length;
+}
+
+bool rollupDecode(const uint8_t *data, uint8_t length, uint8_t &resolution, RollupBucket &bucket)
+{
+    if (length < ROLLUP_RECORD_SIZE)
+    {
+        return false;
+    }
+    resolution = data[0];
+    bucket.samples = get16(data + 1);
+    length = 3;
+    for (RollupValue &value : bucket.values)
+    {
+        value = {get16(data + length), get16(data + length + 2), get16(data + length + 4), get16(data + length + 6)};
+        length += 8;
+    }
+    return true;
+}
+
+RollupLevel::RollupLevel(uint32_t resolution, RollupBucket *buckets, uint16_t size) : _resolution(resolution), _buckets(buckets), _size(size)
+{
+}
+
+// Called with every closed bucket that has samples
+void RollupLevel::onClose(CloseCallback callback)
+{
+    _closeCallback = callback;
+}
+
+void RollupLevel::add(const TelemetrySample &sample)
+{
+    uint32_t time = sample.time - sample.time % _resolution;
+
+    if (_openSamples > 0 && time != _openTime)
+    {
+        if (time < _openTime || time - _openTime > ROLLUP_MAX_JUMP)
+        {
+            // Clock set back or jumped, e.g. at the first NTP update
+            clear();
+        }
+        else
+        {
+            close();
+            uint32_t gaps = (time - _openTime) / _resolution - 1;
+            RollupBucket gap = {};
+            for (uint32_t i = 0; i < gaps && i < _size; i++)
+            {
+                push(gap);
+            }
+        }
+    }
+
+    const int16_t values[] = {(int16_t)sample.voltage, sample.current, sample.temperature, (int16_t)sample.charge};
+    if (_openSamples == 0)
+    {
+        _openTime = time;
+        for (uint8_t metric = 0; metric < (uint8_t)RollupMetric::COUNT; metric++)
+        {
+            _open[metric] = {values[metric], values[metric], 0, values[metric]};
+        }
+    }
+
+    for (uint8_t metric = 0; metric < (uint8_t)RollupMetric::COUNT; metric++)
+    {
+        Accumulator &accumulator = _open[metric];
+        int16_t value = values[metric];
+        if (value < accumulator.min)
+        {
+            accumulator.min = value;
+        }
+        if (value > accumulator.max)
+        {
+            accumulator.max = value;
+        }
+        accumulator.sum += value;
+        accumulator.last = value;
+    }
+    _openSamples++;
+}
+
+void RollupLevel::clear()
+{
+    _head = 0;
+    _count = 0;
+    _openSamples = 0;
+}
+
+bool RollupLevel::point(uint16_t age, RollupPoint &point)
+{
+    if (_openSamples == 0 || age > _count)
+    {
+        return false;
+    }
+
+    if (age == 0)
+    {
+        openBucket(point);
+    }
+    else
+    {
+        (RollupBucket &)point = _buckets[(_head + _size - age) % _size];
+    }
+    point.time = _openTime - age * _resolution;
+    return true;
+}
+
+uint16_t RollupLevel::count()
+{
+    return _openSamples > 0 ? _count + 1 : 0;
+}
+
+uint32_t RollupLevel::resolution()
+{
+    return _resolution;
+}
+
+void RollupLevel::close()
+{
+    RollupPoint point;
+    openBucket(point);
+    point.time = _openTime;
+    push(point);
+    _openSamples = 0;
+
+    if (_closeCallback)
+    {
+        _closeCallback(point);
+    }
+}
+
+void RollupLevel::push(const RollupBucket &bucket)
+{
+    if (_size == 0)
+    {
+        return;
+    }
+    _buckets[_head] = bucket;
+    _head = (_head + 1) % _size;
+    if (_count < _size)
+    {
+        _count++;
+    }
+}
+
+void RollupLevel::openBucket(RollupBucket &bucket)
+{
+    bucket.samples = _openSamples;
+    for (uint8_t metric = 0; metric < (uint8_t)RollupMetric::COUNT; metric++)
+    {
+        const Accumulator &accumulator = _open[metric];
+        int32_t half = (accumulator.sum < 0 ? -_openSamples : _openSamples) / 2;
+        bucket.values[metric] = {accumulator.min, accumulator.max, (int16_t)((accumulator.sum + half) / _openSamples), accumulator.last};
+    }
+}
+
+TelemetryRollup::TelemetryRollup() : _levels{RollupLevel(60, _minutes, ROLLUP_MINUTES - 1),
+                                              RollupLevel(900, nullptr, 0),
+                                              RollupLevel(3600, nullptr, 0)}
+{
+}
+
+void TelemetryRollup::add(const TelemetrySample &sample)
+{
+    for (RollupLevel &level : _levels)
+    {
+        level.add(sample);
+    }
+}
+
+void TelemetryRollup::clear()
+{
+    for (RollupLevel &level : _levels)
+    {
+        level.clear();
+    }
+}
+
+uint16_t TelemetryRollup::last(Resolution resolution, uint16_t count, RollupPoint *points)
+{
+    RollupLevel &rollup = level(resolution);
+    uint16_t length = count < rollup.count() ? count : rollup.count();
+    for (uint16_t i = 0; i < length; i++)
+    {
+        rollup.point(length - 1 - i, points[i]);
+    }
+    return length;
+}
+
+RollupLevel &TelemetryRollup::level(Resolution resolution)
+{
+    return _levels[resolution];
+}
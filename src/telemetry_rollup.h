@@ -0,0 +1,121 @@
+#ifndef telemetry_rollup_h
+#define telemetry_rollup_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "telemetry_history.h"
+
+#define ROLLUP_LEVELS 3
+#define ROLLUP_MINUTES 60     // 1 min buckets, 1 hour
+#define ROLLUP_MAX_JUMP 604800 // s, a later sample restarts the levels, e.g. the first NTP update
+#define ROLLUP_RECORD_SIZE 35 // encoded bucket: resolution, samples, min/max/mean/last of each metric
+
+enum class RollupMetric : uint8_t
+{
+    VOLTAGE,     // mV
+    CURRENT,     // mA
+    TEMPERATURE, // degree Celsius
+    CHARGE,      // mAh
+    COUNT
+};
+
+struct RollupValue
+{
+    int16_t min;
+    int16_t max;
+    int16_t mean;
+    int16_t last;
+};
+
+struct RollupBucket
+{
+    uint16_t samples; // 0 = no samples in this bucket
+    RollupValue values[(uint8_t)RollupMetric::COUNT];
+};
+
+struct RollupPoint : RollupBucket
+{
+    uint32_t time; // start of the bucket
+};
+
+// Bucket as big endian bytes, e.g. for the telemetry log
+uint8_t rollupEncode(uint8_t resolution, const RollupBucket &bucket, uint8_t *out);
+bool rollupDecode(const uint8_t *data, uint8_t length, uint8_t &resolution, RollupBucket &bucket);
+
+// Buckets of one resolution in a ring. Samples are added to the open bucket,
+// it is closed (means computed) when the first sample of a later bucket
+// arrives. Buckets without samples are kept as gaps, so the time of a bucket
+// follows from its position. A level without a ring (size 0) only keeps the
+// open bucket, the closed ones go to the close callback.
+class RollupLevel
+{
+public:
+    typedef std::function<void(const RollupPoint &point)> CloseCallback;
+
+    RollupLevel(uint32_t resolution, RollupBucket *buckets, uint16_t size);
+
+    void onClose(CloseCallback callback);
+    void add(const TelemetrySample &sample);
+    void clear();
+
+    // age 0 is the open bucket, 1 the newest closed bucket, ...
+    bool point(uint16_t age, RollupPoint &point);
+    uint16_t count(); // buckets including the open one
+    uint32_t resolution();
+
+private:
+    struct Accumulator
+    {
+        int16_t min;
+        int16_t max;
+        int32_t sum;
+        int16_t last;
+    };
+
+    void close();
+    void push(const RollupBucket &bucket);
+    void openBucket(RollupBucket &bucket);
+
+    CloseCallback _closeCallback;
+    uint32_t _resolution;
+    RollupBucket *_buckets; // closed buckets
+    uint16_t _size;
+    uint16_t _head = 0; // next bucket to write
+    uint16_t _count = 0;
+
+    uint32_t _openTime = 0;
+    uint16_t _openSamples = 0;
+    Accumulator _open[(uint8_t)RollupMetric::COUNT];
+};
+
+// min/max/mean/last of the telemetry samples at 1 min, 15 min and 1 hour.
+// Every sample updates the open bucket of each level, nothing is rescanned.
+// Only the last hour of minutes is kept in RAM, for the 15 min and 1 hour
+// levels just the open bucket: their closed buckets are in the telemetry log.
+class TelemetryRollup
+{
+public:
+    enum Resolution : uint8_t
+    {
+        MINUTE = 0,
+        QUARTER = 1,
+        HOUR = 2
+    };
+
+    TelemetryRollup();
+
+    void add(const TelemetrySample &sample);
+    void clear();
+
+    // The last count points at a resolution, oldest first, including the
+    // open bucket. Returns the number of points written.
+    uint16_t last(Resolution resolution, uint16_t count, RollupPoint *points);
+    RollupLevel &level(Resolution resolution);
+
+private:
+    RollupBucket _minutes[ROLLUP_MINUTES - 1];
+    RollupLevel _levels[ROLLUP_LEVELS];
+};
+
+#endif
@@ -0,0 +1,725 @@
+// Host benchmarks of firmware modules.
+//
+//   bench snapshot [--iterations n]  Sensor values to the web page rows and MQTT
+//                                    JSON fields: decoding and float formatting
+//                                    per output (as before the SensorSnapshot)
+//                                    against one snapshot per frame and the
+//                                    integer formatters.
+//   bench history [--iterations n]   TelemetryHistory against a plain array of
+//                                    samples of the same RAM size: bytes per
+//                                    sample, hours held, append and scan time.
+//                                    The samples are a synthetic day of
+//                                    cleaning runs and charging on the dock.
+//   bench coverage [--iterations n]  CoverageMap: pose updates per second and
+//                                    bytes per square metre for a random
+//                                    walk through a 6 x 4.5 m room at the
+//                                    stream rate, against a byte per cell of
+//                                    the room, and the PBM/PNG encoders (the
+//                                    PBM is decoded again and compared).
+//   bench group100 [--iterations n]  Decoding the 80 bytes of sensor group 100
+//                                    (all packets): the table decoder and the
+//                                    typed decoders with compile time offsets,
+//                                    against finding every packet's row and
+//                                    offset in the table at run time.
+//   bench ring [--iterations n]      Moving a stream frame (71 bytes) from the
+//                                    UART to the parser: bulk readBytes() into
+//                                    a ByteRing span and reading the span in
+//                                    place, against the per-byte
+//                                    available()/read() loop into a buffer.
+//                                    The UART is a FIFO behind virtual calls
+//                                    like the Arduino Stream, the device adds
+//                                    its driver's per-call cost on top.
+//   bench metrics [--iterations n]   MetricsWriter: time and bytes of a /metrics
+//                                    page like the firmware's (30 samples, 18
+//                                    summaries of filled histograms) and the
+//                                    largest chunk passed to the output.
+//
+// The host has an FPU, the ESP8266 emulates float in software. The float
+// paths are therefore much slower on the device than the ratio printed here.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -Isrc tools/bench/bench.cpp src/sensor_snapshot.cpp src/telemetry_history.cpp
+//       src/coverage_map.cpp src/metrics_writer.cpp src/latency_histogram.cpp -o bench
+
+#include "sensor_snapshot.h"
+#include "oi_packets.h"
+#include "telemetry_history.h"
+#include "coverage_map.h"
+#include "metrics_writer.h"
+#include "byte_ring.h"
+
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keeps the compiler from dropping the formatted output
+volatile size_t benchSink = 0;
+
+template <typename F>
+double measure(unsigned long iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        f(i);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+// Group 3 response with a changing current and charge
+void sensorFrame(unsigned long i, uint8_t *data)
+{
+    int16_t current = -1200 + (int16_t)(i % 400);
+    uint16_t charge = 1500 + i % 1000;
+    data[0] = 0;
+    data[1] = 14234 >> 8;
+    data[2] = 14234 & 0xFF;
+    data[3] = (uint16_t)current >> 8;
+    data[4] = (uint16_t)current & 0xFF;
+    data[5] = 27;
+    data[6] = charge >> 8;
+    data[7] = charge & 0xFF;
+    data[8] = 2696 >> 8;
+    data[9] = 2696 & 0xFF;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// SNAPSHOT
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+size_t floatHtml(const uint8_t *data, char *out, size_t size)
+{
+    size_t length = snprintf(out, size, "<td>%.2f V</td>", ((float)oiDecode<3, OI_PACKET_VOLTAGE>(data) / 1000));
+    length += snprintf(out + length, size - length, "<td>%d mA</td>", (int)oiDecode<3, OI_PACKET_CURRENT>(data));
+    length += snprintf(out + length, size - length, "<td>%d&deg;C</td>", (int)oiDecode<3, OI_PACKET_TEMPERATURE>(data));
+    length += snprintf(out + length, size - length, "<td>%.2f%%</td>", (100 / (float)oiDecode<3, OI_PACKET_BATTERY_CAPACITY>(data)) * oiDecode<3, OI_PACKET_BATTERY_CHARGE>(data));
+    length += snprintf(out + length, size - length, "<td>%d/%d mA</td>", (int)oiDecode<3, OI_PACKET_BATTERY_CHARGE>(data), (int)oiDecode<3, OI_PACKET_BATTERY_CAPACITY>(data));
+    return length;
+}
+
+size_t floatJson(const uint8_t *data, char *out, size_t size)
+{
+    return snprintf(out, size, "\"battery_v\":%.2f,\"battery_ma\":%d,\"battery_level\":%.2f",
+                    ((float)oiDecode<3, OI_PACKET_VOLTAGE>(data) / 1000), (int)oiDecode<3, OI_PACKET_CURRENT>(data),
+                    (100 / (float)oiDecode<3, OI_PACKET_BATTERY_CAPACITY>(data)) * oiDecode<3, OI_PACKET_BATTERY_CHARGE>(data));
+}
+
+size_t snapshotHtml(SensorSnapshot &snapshot, char *out, size_t size)
+{
+    char value[24];
+    size_t length = 0;
+    const auto cell = [&](size_t valueLength) {
+        if (length + valueLength + 10 < size)
+        {
+            memcpy(out + length, "<td>", 4);
+            memcpy(out + length + 4, value, valueLength);
+            memcpy(out + length + 4 + valueLength, "</td>", 6);
+            length += valueLength + 9;
+        }
+    };
+    cell(snapshot.formatVoltage(value, sizeof(value)));
+    cell(snapshot.formatCurrent(value, sizeof(value)));
+    cell(snapshot.formatTemperature(value, sizeof(value), "&deg;C"));
+    cell(snapshot.formatLevel(value, sizeof(value)));
+    cell(snapshot.formatCharge(value, sizeof(value)));
+    return length;
+}
+
+size_t snapshotJson(SensorSnapshot &snapshot, char *out, size_t size)
+{
+    char level[8];
+    formatDecimal(level, sizeof(level), snapshot.level, 1);
+    return snprintf(out, size, "\"battery_mv\":%u,\"battery_ma\":%d,\"battery_level\":%s", snapshot.voltage, snapshot.current, level);
+}
+
+int benchSnapshot(unsigned long iterations)
+{
+    uint8_t data[10];
+    char out[256];
+    SensorSnapshot snapshot;
+
+    // One frame per page view and status message, as on the device
+    double floatHtmlTime = measure(iterations, [&](unsigned long i) {
+        sensorFrame(i, data);
+        benchSink += floatHtml(data, out, sizeof(out));
+    });
+    double floatJsonTime = measure(iterations, [&](unsigned long i) {
+        sensorFrame(i, data);
+        benchSink += floatJson(data, out, sizeof(out));
+    });
+    double snapshotTime = measure(iterations, [&](unsigned long i) {
+        sensorFrame(i, data);
+        snapshot = SensorSnapshot::fromGroup3(data);
+        benchSink += snapshot.level;
+    });
+    double snapshotHtmlTime = measure(iterations, [&](unsigned long i) {
+        sensorFrame(i, data);
+        snapshot = SensorSnapshot::fromGroup3(data);
+        benchSink += snapshotHtml(snapshot, out, sizeof(out));
+    });
+    double snapshotJsonTime = measure(iterations, [&](unsigned long i) {
+        sensorFrame(i, data);
+        snapshot = SensorSnapshot::fromGroup3(data);
+        benchSink += snapshotJson(snapshot, out, sizeof(out));
+    });
+
+    printf("%lu iterations, ns per call\n", iterations);
+    printf("  snapshot from frame       %8.1f\n", snapshotTime);
+    printf("  HTML  float  %8.1f  snapshot %8.1f  (%.1fx)\n", floatHtmlTime, snapshotHtmlTime, floatHtmlTime / snapshotHtmlTime);
+    printf("  JSON  float  %8.1f  snapshot %8.1f  (%.1fx)\n", floatJsonTime, snapshotJsonTime, floatJsonTime / snapshotJsonTime);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// HISTORY
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// A day of 1Hz samples: two cleaning runs of 45 minutes, charging and
+// trickle charging on the dock in between. Sensor noise of a few mV/mA.
+std::vector<TelemetrySample> historyDay()
+{
+    std::vector<TelemetrySample> samples;
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> noise(-3, 3);
+    std::bernoulli_distribution noisy(0.3);
+    double charge = 2400;
+
+    for (uint32_t time = 0; time < 86400; time++)
+    {
+        TelemetrySample sample;
+        uint32_t second = time % 43200;
+        sample.time = 1700000000 + time;
+        if (second >= 3600 && second < 3600 + 2700)
+        {
+            sample.current = -1300 + noise(random) * 20;
+            sample.chargingState = 0;
+        }
+        else if (charge < 2600)
+        {
+            sample.current = 1400 + noise(random) * 5;
+            sample.chargingState = 1;
+        }
+        else
+        {
+            sample.current = noisy(random) ? -3 + noise(random) : -3;
+            sample.chargingState = 3;
+        }
+        charge += sample.current / 3600.0;
+        sample.charge = (uint16_t)charge;
+        sample.voltage = 13000 + (uint16_t)(charge * 0.6) + (sample.current > 0 ? 400 : 0) + (noisy(random) ? noise(random) : 0);
+        sample.temperature = sample.current < -100 ? 32 : 26;
+        samples.push_back(sample);
+    }
+    return samples;
+}
+
+// The naive store: a ring of samples of the same RAM size
+struct SampleArray
+{
+    static const size_t COUNT = TELEMETRY_HISTORY_SIZE / sizeof(TelemetrySample);
+    TelemetrySample samples[COUNT];
+    size_t head = 0;
+    size_t count = 0;
+
+    void append(const TelemetrySample &sample)
+    {
+        samples[head] = sample;
+        head = (head + 1) % COUNT;
+        if (count < COUNT)
+        {
+            count++;
+        }
+    }
+};
+
+int benchHistory(unsigned long iterations)
+{
+    std::vector<TelemetrySample> day = historyDay();
+    static TelemetryHistory history;
+    static SampleArray array;
+
+    // Round trip: the history returns the newest samples unchanged
+    for (const TelemetrySample &sample : day)
+    {
+        history.append(sample);
+    }
+    TelemetryHistory::Iterator iterator = history.samples();
+    TelemetrySample sample;
+    size_t index = day.size() - history.count();
+    size_t mismatches = 0;
+    while (iterator.next(sample))
+    {
+        const TelemetrySample &expected = day[index++];
+        if (sample.time != expected.time || sample.voltage != expected.voltage || sample.current != expected.current ||
+            sample.temperature != expected.temperature || sample.charge != expected.charge || sample.chargingState != expected.chargingState)
+        {
+            mismatches++;
+        }
+    }
+    if (mismatches > 0 || index != day.size())
+    {
+        printf("History round trip FAILED: %zu mismatches, %zu of %zu samples\n", mismatches, index, day.size());
+        return 1;
+    }
+
+    double historyAppendTime = measure(iterations, [&](unsigned long i) {
+        history.append(day[i % day.size()]);
+    });
+    double arrayAppendTime = measure(iterations, [&](unsigned long i) {
+        array.append(day[i % day.size()]);
+    });
+
+    unsigned long scans = iterations / history.count() + 1;
+    unsigned long scanned = 0;
+    double historyScanTime = measure(scans, [&](unsigned long i) {
+        TelemetryHistory::Iterator iterator = history.samples();
+        TelemetrySample sample;
+        while (iterator.next(sample))
+        {
+            benchSink += sample.voltage;
+            scanned++;
+        }
+    }) * scans / scanned;
+    scanned = 0;
+    double arrayScanTime = measure(scans, [&](unsigned long i) {
+        for (size_t n = 0; n < array.count; n++)
+        {
+            benchSink += array.samples[(array.head + SampleArray::COUNT - array.count + n) % SampleArray::COUNT].voltage;
+            scanned++;
+        }
+    }) * scans / scanned;
+
+    // Fill level over the day, as it depends on the activity
+    history.clear();
+    unsigned long dropped = history.droppedSamples();
+    unsigned long minCount = 0;
+    for (size_t i = 0; i < day.size(); i++)
+    {
+        history.append(day[i]);
+        if (history.droppedSamples() > dropped && (minCount == 0 || history.count() < minCount))
+        {
+            minCount = history.count();
+        }
+    }
+
+    printf("%u bytes of RAM\n", TELEMETRY_HISTORY_SIZE);
+    printf("  history  %5.2f bytes/sample, %lu samples (%.1fh) at the end of the day, min. %lu (%.1fh)\n",
+           (double)history.bytes() / history.count(), history.count(), history.count() / 3600.0, minCount, minCount / 3600.0);
+    printf("  array    %5zu bytes/sample, %zu samples (%.1fh)\n", sizeof(TelemetrySample), SampleArray::COUNT, SampleArray::COUNT / 3600.0);
+    printf("ns per sample\n");
+    printf("  append   history %6.1f  array %6.1f\n", historyAppendTime, arrayAppendTime);
+    printf("  scan     history %6.1f  array %6.1f\n", historyScanTime, arrayScanTime);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// COVERAGE
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+struct BenchPose
+{
+    int32_t x; // mm
+    int32_t y;
+};
+
+// Straight lines at 250 mm/s, a new random direction at a wall, a pose
+// every 15 ms like the OI stream
+std::vector<BenchPose> coverageWalk(unsigned long count, double width, double height)
+{
+    std::vector<BenchPose> poses;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> direction(0, 2 * M_PI);
+    const double step = 250 * 0.015;
+    const double margin = COVERAGE_FOOTPRINT;
+    double x = 0;
+    double y = 0;
+    double heading = direction(random);
+
+    while (poses.size() < count)
+    {
+        double nextX = x + step * cos(heading);
+        double nextY = y + step * sin(heading);
+        if (fabs(nextX) > width / 2 - margin || fabs(nextY) > height / 2 - margin)
+        {
+            heading = direction(random);
+            continue;
+        }
+        x = nextX;
+        y = nextY;
+        poses.push_back({(int32_t)lround(x), (int32_t)lround(y)});
+    }
+    return poses;
+}
+
+int benchCoverage(unsigned long iterations)
+{
+    const double width = 6000;
+    const double height = 4500;
+    std::vector<BenchPose> poses = coverageWalk(iterations, width, height);
+    static CoverageMap map;
+    map.reset();
+
+    auto start = std::chrono::steady_clock::now();
+    for (const BenchPose &pose : poses)
+    {
+        map.sweep(pose.x, pose.y);
+    }
+    double sweepTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / poses.size();
+
+    std::vector<uint8_t> pbm;
+    std::vector<uint8_t> png;
+    start = std::chrono::steady_clock::now();
+    map.encode(CoverageMap::Format::PBM, CoverageMap::Layer::CLEANED, [&](const uint8_t *data, size_t length)
+               { pbm.insert(pbm.end(), data, data + length); });
+    double pbmTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    map.encode(CoverageMap::Format::PNG, CoverageMap::Layer::CLEANED, [&](const uint8_t *data, size_t length)
+               { png.insert(png.end(), data, data + length); });
+    double pngTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    // Round trip: every pixel of the PBM is the cell of the map
+    int32_t cellX;
+    int32_t cellY;
+    uint16_t mapWidth;
+    uint16_t mapHeight;
+    map.bounds(cellX, cellY, mapWidth, mapHeight);
+    size_t headerEnd = 0;
+    for (int lines = 0; headerEnd < pbm.size() && lines < 3; headerEnd++)
+    {
+        lines += pbm[headerEnd] == '\n';
+    }
+    size_t mismatches = pbm.size() == headerEnd + (size_t)mapWidth / 8 * mapHeight ? 0 : 1;
+    for (uint16_t row = 0; mismatches == 0 && row < mapHeight; row++)
+    {
+        for (uint16_t column = 0; column < mapWidth; column++)
+        {
+            bool pixel = pbm[headerEnd + row * (mapWidth / 8) + column / 8] & (0x80 >> (column % 8));
+            mismatches += pixel != map.get(CoverageMap::Layer::CLEANED, cellX + column, cellY + mapHeight - 1 - row);
+        }
+    }
+    if (mismatches > 0)
+    {
+        printf("Coverage round trip FAILED: %zu mismatches\n", mismatches);
+        return 1;
+    }
+
+    const double cellArea = COVERAGE_CELL * COVERAGE_CELL / 1e6; // m^2
+    double covered = map.cells(CoverageMap::Layer::CLEANED) * cellArea;
+    double room = width * height / 1e6;
+    double tileArea = COVERAGE_TILE * COVERAGE_TILE * cellArea;
+    double grid = (width / COVERAGE_CELL) * (height / COVERAGE_CELL); // a byte per cell of the room
+
+    printf("%zu poses (%.1f min at 15 ms), room %.1f m^2, covered %.1f m^2 (%.0f%%)\n",
+           poses.size(), poses.size() * 0.015 / 60, room, covered, 100 * covered / room);
+    printf("Update  %6.1f ns per pose, %.1f M poses/s, %lu footprints, %lu cells dropped\n",
+           sweepTime, 1e3 / sweepTime, map.sweeps(), map.dropped());
+    printf("RAM     %u tiles, %zu bytes: %.1f bytes/m^2 of tile, %.1f bytes/m^2 covered (byte per cell: %.0f bytes, %.1f bytes/m^2)\n",
+           map.tiles(), map.bytes(), map.bytes() / (map.tiles() * tileArea), map.bytes() / covered, grid, grid / room);
+    printf("Encode  %ux%u cells, PBM %zu bytes in %.0f us, PNG %zu bytes in %.0f us\n",
+           mapWidth, mapHeight, pbm.size(), pbmTime, png.size(), pngTime);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// GROUP 100
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// The row and offset of a packet searched at run time, the cost the
+// constexpr table avoids
+int32_t lookupDecode(uint8_t id, const uint8_t *group100)
+{
+    size_t offset = 0;
+    for (const OIPacketInfo &packet : OI_PACKETS)
+    {
+        if (packet.id == id)
+        {
+            const uint8_t *data = group100 + offset;
+            return packet.size == 1 ? (packet.isSigned ? (int32_t)(int8_t)data[0] : (int32_t)data[0])
+                                    : (packet.isSigned ? (int32_t)(int16_t)((data[0] << 8) | data[1]) : (int32_t)(uint16_t)((data[0] << 8) | data[1]));
+        }
+        offset += packet.size;
+    }
+    return 0;
+}
+
+int benchGroup100(unsigned long iterations)
+{
+    const uint8_t size = oiPacketSize(100);
+    uint8_t data[size];
+    int32_t values[OI_PACKET_COUNT];
+    volatile uint8_t battery[] = {OI_PACKET_CHARGING_STATE, OI_PACKET_VOLTAGE, OI_PACKET_CURRENT,
+                                  OI_PACKET_TEMPERATURE, OI_PACKET_BATTERY_CHARGE, OI_PACKET_BATTERY_CAPACITY};
+
+    double tableTime = measure(iterations, [&](unsigned long i) {
+        data[i % size] = (uint8_t)i;
+        oiDecodeGroup(*oiGroup(100), data, values);
+        benchSink += values[i % OI_PACKET_COUNT];
+    });
+    double lookupTime = measure(iterations, [&](unsigned long i) {
+        data[i % size] = (uint8_t)i;
+        for (uint8_t j = 0; j < OI_PACKET_COUNT; j++)
+        {
+            values[j] = lookupDecode(OI_PACKET_FIRST + j, data);
+        }
+        benchSink += values[i % OI_PACKET_COUNT];
+    });
+    double typedTime = measure(iterations, [&](unsigned long i) {
+        data[i % size] = (uint8_t)i;
+        benchSink += oiDecode<100, OI_PACKET_CHARGING_STATE>(data) + oiDecode<100, OI_PACKET_VOLTAGE>(data) +
+                     oiDecode<100, OI_PACKET_CURRENT>(data) + oiDecode<100, OI_PACKET_TEMPERATURE>(data) +
+                     oiDecode<100, OI_PACKET_BATTERY_CHARGE>(data) + oiDecode<100, OI_PACKET_BATTERY_CAPACITY>(data);
+    });
+    double typedLookupTime = measure(iterations, [&](unsigned long i) {
+        data[i % size] = (uint8_t)i;
+        int32_t sum = 0;
+        for (uint8_t id : battery)
+        {
+            sum += lookupDecode(id, data);
+        }
+        benchSink += sum;
+    });
+
+    printf("%lu iterations, group 100: %u bytes, %u packets, ns per decode\n", iterations, size, OI_PACKET_COUNT);
+    printf("  all packets     table %8.1f  lookup %8.1f  (%.1fx)\n", tableTime, lookupTime, lookupTime / tableTime);
+    printf("  6 battery       typed %8.1f  lookup %8.1f  (%.1fx)\n", typedTime, typedLookupTime, typedLookupTime / typedTime);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// RING
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// RX FIFO of a UART behind virtual calls, like HardwareSerial
+class BenchUart
+{
+public:
+    virtual ~BenchUart() {}
+
+    virtual int available()
+    {
+        return _length - _position;
+    }
+
+    virtual int read()
+    {
+        return _position < _length ? _fifo[_position++] : -1;
+    }
+
+    virtual size_t readBytes(uint8_t *buffer, size_t length)
+    {
+        size_t count = length < (size_t)available() ? length : available();
+        memcpy(buffer, _fifo + _position, count);
+        _position += count;
+        return count;
+    }
+
+    void receive(const uint8_t *data, size_t length)
+    {
+        memcpy(_fifo, data, length);
+        _length = length;
+        _position = 0;
+    }
+
+private:
+    uint8_t _fifo[128];
+    size_t _length = 0;
+    size_t _position = 0;
+};
+
+// Keeps the compiler from resolving the virtual calls
+BenchUart *volatile benchUart = new BenchUart();
+
+int benchRing(unsigned long iterations)
+{
+    const size_t frameLength = 71; // the firmware's stream packet set
+    uint8_t frame[frameLength];
+    for (size_t i = 0; i < frameLength; i++)
+    {
+        frame[i] = (uint8_t)(i * 37);
+    }
+    BenchUart &uart = *benchUart;
+    static ByteRing<256> ring;
+    uint8_t buffer[128];
+
+    double perByteTime = measure(iterations, [&](unsigned long i) {
+        frame[i % frameLength] = (uint8_t)i;
+        uart.receive(frame, frameLength);
+        size_t length = 0;
+        while (uart.available() && length < sizeof(buffer))
+        {
+            buffer[length++] = uart.read();
+        }
+        uint8_t sum = 0;
+        for (size_t j = 0; j < length; j++)
+        {
+            sum += buffer[j];
+        }
+        benchSink += sum;
+    });
+    double ringTime = measure(iterations, [&](unsigned long i) {
+        frame[i % frameLength] = (uint8_t)i;
+        uart.receive(frame, frameLength);
+        for (uint8_t part = 0; part < 2; part++)
+        {
+            size_t available = uart.available();
+            uint8_t *span;
+            size_t free = ring.writeSpan(span);
+            if (available == 0 || free == 0)
+            {
+                break;
+            }
+            ring.commit(uart.readBytes(span, available < free ? available : free));
+        }
+        uint8_t sum = 0;
+        const uint8_t *span;
+        size_t length;
+        while ((length = ring.readSpan(span)) > 0)
+        {
+            for (size_t j = 0; j < length; j++)
+            {
+                sum += span[j];
+            }
+            ring.consume(length);
+        }
+        benchSink += sum;
+    });
+
+    printf("%lu frames of %zu bytes, ns per frame (per byte)\n", iterations, frameLength);
+    printf("  per-byte read()  %8.1f (%.2f)\n", perByteTime, perByteTime / frameLength);
+    printf("  ring span        %8.1f (%.2f)  %.1fx\n", ringTime, ringTime / frameLength, perByteTime / ringTime);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// METRICS
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+int benchMetrics(unsigned long iterations)
+{
+    static LatencyHistogram histograms[18];
+    std::mt19937 random(1);
+    std::exponential_distribution<double> duration(1.0 / 300);
+    for (LatencyHistogram &histogram : histograms)
+    {
+        for (int i = 0; i < 100000; i++)
+        {
+            histogram.record((uint32_t)duration(random));
+        }
+    }
+
+    size_t bytes = 0;
+    size_t chunks = 0;
+    size_t largest = 0;
+    char labels[48];
+    double time = measure(iterations, [&](unsigned long i)
+                          {
+        bytes = 0;
+        chunks = 0;
+        MetricsWriter metrics([&](const char *data, size_t length)
+                              {
+            benchSink += data[length - 1];
+            chunks++;
+            largest = length > largest ? length : largest; });
+        for (int sample = 0; sample < 30; sample++)
+        {
+            snprintf(labels, sizeof(labels), "sample=\"%d\"", sample);
+            metrics.family("roomba_bench_total", "counter", "Samples of the benchmark");
+            metrics.sample("roomba_bench_total", sample % 2 ? labels : nullptr, i * 31 + sample);
+            metrics.decimal("roomba_bench_volts", nullptr, 14230 + sample, 3);
+        }
+        metrics.family("roomba_bench_seconds", "summary", "Summaries of the benchmark");
+        for (int h = 0; h < 18; h++)
+        {
+            snprintf(labels, sizeof(labels), "task=\"task%d\"", h);
+            metrics.summary("roomba_bench_seconds", labels, histograms[h]);
+        }
+        metrics.end();
+        bytes = metrics.bytes(); });
+
+    printf("Scrape  %.1f us, %zu bytes in %zu chunks (largest %zu of %d bytes), %.1f ns per byte\n",
+           time / 1e3, bytes, chunks, largest, METRICS_BUFFER_SIZE, time / bytes);
+    return 0;
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MAIN
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+void usage()
+{
+    fprintf(stderr, "Usage: bench snapshot|history|coverage|group100|ring|metrics [--iterations n]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 1000000;
+
+    if (argc < 2)
+    {
+        usage();
+    }
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+            iterations = strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (iterations == 0)
+    {
+        usage();
+    }
+
+    if (strcmp(argv[1], "snapshot") == 0)
+    {
+        return benchSnapshot(iterations);
+    }
+    if (strcmp(argv[1], "history") == 0)
+    {
+        return benchHistory(iterations);
+    }
+    if (strcmp(argv[1], "coverage") == 0)
+    {
+        return benchCoverage(iterations);
+    }
+    if (strcmp(argv[1], "group100") == 0)
+    {
+        return benchGroup100(iterations);
+    }
+    if (strcmp(argv[1], "ring") == 0)
+    {
+        return benchRing(iterations);
+    }
+    if (strcmp(argv[1], "metrics") == 0)
+    {
+        return benchMetrics(iterations);
+    }
+
+    usage();
+    return 2;
+}
@@ -0,0 +1,411 @@
+// Telemetry log on a file-backed flash emulator.
+//
+//   logsim <directory> [options]   Feed 1Hz telemetry through the rollups into
+//                                  the log (src/telemetry_log.h) at simulated
+//                                  time, reboot now and then and check that the
+//                                  log recovers. The segments are files in the
+//                                  directory, which must exist.
+//
+// Options:
+//   --days <d>        simulated time (default 7)
+//   --reboots <n>     reboots spread over the run (default 10)
+//   --corrupt <n>     flip a bit in n random records before the check
+//   --seed <n>        seed for the telemetry and the faults
+//
+// Flash costs are modelled on the flash of a D1 mini and LittleFS: an append
+// programs every 256 byte page it touches plus one page of metadata, a file
+// growing into a new 4KB block costs a block erase, removing a file costs a
+// metadata page (LittleFS erases blocks when it allocates them). Timing is
+// 0.8ms per page program, 45ms per block erase and 0.05ms per page read.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -Itools/oisim/host -Isrc
+//       tools/logsim/logsim.cpp src/telemetry_log.cpp src/telemetry_rollup.cpp -o logsim
+
+#include <Arduino.h>
+#include "telemetry_log.h"
+#include "telemetry_rollup.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+const size_t FLASH_PAGE = 256;
+const size_t FLASH_BLOCK = 4096;
+const double FLASH_PROGRAM_TIME = 0.8; // ms per page
+const double FLASH_ERASE_TIME = 45;    // ms per block
+const double FLASH_READ_TIME = 0.05;   // ms per page
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// ARDUINO ON THE SIMULATED CLOCK
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+uint64_t simTime = 0; // ms
+
+unsigned long millis()
+{
+    return (unsigned long)simTime;
+}
+
+unsigned long micros()
+{
+    return (unsigned long)(simTime * 1000);
+}
+
+void delay(unsigned long ms)
+{
+    simTime += ms;
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// FLASH EMULATOR
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+class FileFlash : public LogStorage
+{
+public:
+    explicit FileFlash(const std::string &directory) : _directory(directory)
+    {
+    }
+
+    size_t size(uint8_t segment) override
+    {
+        FILE *file = fopen(path(segment).c_str(), "rb");
+        if (file == nullptr)
+        {
+            return 0;
+        }
+        fseek(file, 0, SEEK_END);
+        size_t size = ftell(file);
+        fclose(file);
+        return size;
+    }
+
+    size_t read(uint8_t segment, size_t offset, uint8_t *data, size_t length) override
+    {
+        FILE *file = fopen(path(segment).c_str(), "rb");
+        if (file == nullptr)
+        {
+            return 0;
+        }
+        fseek(file, offset, SEEK_SET);
+        size_t count = fread(data, 1, length, file);
+        fclose(file);
+        bytesRead += count;
+        cost += (count + FLASH_PAGE - 1) / FLASH_PAGE * FLASH_READ_TIME;
+        return count;
+    }
+
+    bool append(uint8_t segment, const uint8_t *data, size_t length) override
+    {
+        size_t offset = size(segment);
+        FILE *file = fopen(path(segment).c_str(), "ab");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        bool success = fwrite(data, 1, length, file) == length;
+        fclose(file);
+
+        size_t pages = (offset % FLASH_PAGE + length + FLASH_PAGE - 1) / FLASH_PAGE + 1;
+        size_t blocks = (offset + length + FLASH_BLOCK - 1) / FLASH_BLOCK - (offset + FLASH_BLOCK - 1) / FLASH_BLOCK;
+        appends++;
+        bytesWritten += length;
+        pagePrograms += pages;
+        blockErases += blocks;
+        cost += pages * FLASH_PROGRAM_TIME + blocks * FLASH_ERASE_TIME;
+        return success;
+    }
+
+    bool erase(uint8_t segment) override
+    {
+        if (remove(path(segment).c_str()) == 0)
+        {
+            pagePrograms++;
+            cost += FLASH_PROGRAM_TIME;
+        }
+        return true;
+    }
+
+    // Flip one bit at a random record position of a random segment
+    bool corrupt(std::mt19937 &random)
+    {
+        uint8_t segment = random() % LOG_SEGMENTS;
+        size_t length = size(segment);
+        if (length <= LOG_HEADER_SIZE)
+        {
+            return false;
+        }
+        size_t offset = LOG_HEADER_SIZE + random() % (length - LOG_HEADER_SIZE);
+        FILE *file = fopen(path(segment).c_str(), "r+b");
+        fseek(file, offset, SEEK_SET);
+        int data = fgetc(file);
+        fseek(file, offset, SEEK_SET);
+        fputc(data ^ (1 << (random() % 8)), file);
+        fclose(file);
+        return true;
+    }
+
+    unsigned long appends = 0;
+    unsigned long bytesWritten = 0;
+    unsigned long bytesRead = 0;
+    unsigned long pagePrograms = 0;
+    unsigned long blockErases = 0;
+    double cost = 0; // ms of modelled flash time
+
+private:
+    std::string path(uint8_t segment)
+    {
+        return _directory + "/tlog" + std::to_string(segment);
+    }
+
+    std::string _directory;
+};
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MAIN
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+void usage()
+{
+    fprintf(stderr, "usage: logsim <directory> [--days d] [--reboots n] [--corrupt n] [--seed n]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double days = 7;
+    unsigned long reboots = 10;
+    unsigned long corruptions = 0;
+    uint32_t seed = 1;
+
+    if (argc < 2)
+    {
+        usage();
+    }
+    for (int i = 2; i < argc; i++)
+    {
+        const char *option = argv[i];
+        const char *value = (i + 1 < argc ? argv[++i] : "0");
+        if (strcmp(option, "--days") == 0)
+        {
+            days = atof(value);
+        }
+        else if (strcmp(option, "--reboots") == 0)
+        {
+            reboots = strtoul(value, nullptr, 10);
+        }
+        else if (strcmp(option, "--corrupt") == 0)
+        {
+            corruptions = strtoul(value, nullptr, 10);
+        }
+        else if (strcmp(option, "--seed") == 0)
+        {
+            seed = strtoul(value, nullptr, 10);
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    FileFlash flash(argv[1]);
+    for (uint8_t segment = 0; segment < LOG_SEGMENTS; segment++)
+    {
+        flash.erase(segment);
+    }
+    flash.pagePrograms = 0;
+    flash.cost = 0;
+
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> noise(-20, 20);
+    TelemetryRollup *rollup = new TelemetryRollup();
+    TelemetryLog *log = new TelemetryLog(flash);
+    log->begin();
+
+    uint64_t seconds = (uint64_t)(days * 86400);
+    uint64_t rebootInterval = reboots > 0 ? seconds / (reboots + 1) : 0;
+    uint32_t startTime = 1700000000;
+    uint32_t lastClean = 0;
+    unsigned long rollups = 0;
+    unsigned long rotations = 0;
+    unsigned long rebootFailures = 0;
+    double worstLoop = 0;      // ms of modelled flash time in one loop()
+    double worstLoopWall = 0;  // ms of host time in one loop()
+    double worstBoot = 0;      // ms of modelled flash time in begin()
+    unsigned long worstBootRead = 0;
+
+    const auto attach = [&]()
+    {
+        for (uint8_t resolution = TelemetryRollup::QUARTER; resolution <= TelemetryRollup::HOUR; resolution++)
+        {
+            rollup->level((TelemetryRollup::Resolution)resolution).onClose([&, resolution](const RollupPoint &point)
+                                                                          {
+                                                                              uint8_t record[ROLLUP_RECORD_SIZE];
+                                                                              log->append(LOG_ROLLUP, point.time, record, rollupEncode(resolution, point, record));
+                                                                              rollups++; });
+        }
+    };
+    attach();
+
+    for (uint64_t second = 0; second < seconds; second++)
+    {
+        simTime = second * 1000;
+        uint32_t time = startTime + (uint32_t)second;
+        uint32_t daySecond = second % 43200;
+        bool cleaning = daySecond >= 3600 && daySecond < 6300;
+
+        double costBefore = flash.cost;
+        auto wallStart = std::chrono::steady_clock::now();
+
+        // loop(): recordTelemetry(), telemetryLog.loop()
+        TelemetrySample sample;
+        sample.time = time;
+        sample.voltage = 14500 + noise(random);
+        sample.current = (cleaning ? -1300 : 300) + noise(random);
+        sample.temperature = cleaning ? 32 : 26;
+        sample.charge = 2000 + daySecond / 100;
+        rollup->add(sample);
+        if (daySecond == 3600)
+        {
+            lastClean = time;
+            log->event(LOG_EVENT_CLEAN, time);
+            log->flush();
+        }
+        log->loop();
+
+        worstLoop = std::max(worstLoop, flash.cost - costBefore);
+        worstLoopWall = std::max(worstLoopWall, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count());
+
+        if (rebootInterval > 0 && second > 0 && second % rebootInterval == 0)
+        {
+            // Reboot from the settings page: flush, then start from the flash
+            log->flush();
+            rotations += log->rotations();
+            delete log;
+            delete rollup;
+            rollup = new TelemetryRollup();
+            log = new TelemetryLog(flash);
+            attach();
+
+            costBefore = flash.cost;
+            unsigned long readBefore = flash.bytesRead;
+            log->begin();
+            worstBoot = std::max(worstBoot, flash.cost - costBefore);
+            worstBootRead = std::max(worstBootRead, flash.bytesRead - readBefore);
+            if (log->state().lastClean != lastClean)
+            {
+                rebootFailures++;
+            }
+        }
+    }
+    log->flush();
+    rotations += log->rotations();
+
+    for (unsigned long i = 0; i < corruptions; i++)
+    {
+        flash.corrupt(random);
+    }
+
+    // Read back what survived the rotation
+    unsigned long records = 0;
+    unsigned long rollupRecords = 0;
+    unsigned long badRollups = 0;
+    uint32_t firstTime = 0;
+    uint32_t lastTime = 0;
+    uint32_t lastRollupTime[ROLLUP_LEVELS] = {};
+    unsigned long outOfOrder = 0;
+    TelemetryLog check(flash);
+    check.begin();
+    TelemetryLog::Reader reader = check.records();
+    LogRecord record;
+    while (reader.next(record))
+    {
+        if (records == 0)
+        {
+            firstTime = record.time;
+        }
+        lastTime = std::max(lastTime, record.time);
+        records++;
+
+        uint8_t resolution;
+        RollupBucket bucket;
+        if (record.type == LOG_ROLLUP)
+        {
+            rollupRecords++;
+            if (!rollupDecode(record.data, record.length, resolution, bucket) || resolution >= ROLLUP_LEVELS || bucket.samples == 0 ||
+                bucket.values[(uint8_t)RollupMetric::VOLTAGE].min < 14480 || bucket.values[(uint8_t)RollupMetric::VOLTAGE].max > 14520)
+            {
+                badRollups++;
+                continue;
+            }
+            // Buckets of one resolution are logged in time order
+            if (record.time <= lastRollupTime[resolution])
+            {
+                outOfOrder++;
+            }
+            lastRollupTime[resolution] = record.time;
+        }
+    }
+
+    // Range queries: the indexed reader must return every record at or after
+    // from that the full scan returns, with fewer bytes read
+    unsigned long queryMismatches = 0;
+    unsigned long fullRead = 0;
+    unsigned long indexedRead = 0;
+    const uint32_t ages[] = {86400, 6 * 3600, 3600};
+    for (uint32_t age : ages)
+    {
+        uint32_t from = lastTime - age;
+        unsigned long counts[2] = {};
+        for (uint8_t indexed = 0; indexed < 2; indexed++)
+        {
+            unsigned long readBefore = flash.bytesRead;
+            TelemetryLog::Reader query = check.records(indexed ? from : 0);
+            while (query.next(record))
+            {
+                counts[indexed] += record.time >= from;
+            }
+            (indexed ? indexedRead : fullRead) += flash.bytesRead - readBefore;
+        }
+        queryMismatches += counts[0] != counts[1];
+    }
+
+    double hours = seconds / 3600.0;
+    printf("Simulated %.1f days, %lu reboots, %lu rollups logged\n", seconds / 86400.0, reboots, rollups);
+    printf("Flash: %lu appends (%.1f/h), %lu bytes (%.0f/h), %lu page programs (%.1f/h), %lu block erases (%.2f/h)\n",
+           flash.appends, flash.appends / hours, flash.bytesWritten, flash.bytesWritten / hours, flash.pagePrograms, flash.pagePrograms / hours,
+           flash.blockErases, flash.blockErases / hours);
+    printf("Footprint: %u bytes (max. %u), %lu rotations\n", (unsigned int)check.size(), LOG_SEGMENTS * LOG_SEGMENT_SIZE, rotations);
+    printf("Worst loop(): %.1fms flash (model), %.3fms host\n", worstLoop, worstLoopWall);
+    printf("Worst boot: %.1fms flash (model), %lu bytes read\n", worstBoot, worstBootRead);
+    printf("Read back: %lu records (%lu rollups) from %.1fh, %lu CRC errors, %lu bad rollups, %lu out of order\n",
+           records, rollupRecords, (lastTime - firstTime) / 3600.0, check.crcErrors(), badRollups, outOfOrder);
+    printf("Range queries (24h, 6h, 1h): %lu bytes read with the index, %lu without, %lu index skips, %lu mismatches\n",
+           indexedRead, fullRead, check.indexSkips(), queryMismatches);
+    printf("Last clean after reboots: %s\n", rebootFailures == 0 ? "restored" : "LOST");
+
+    bool failed = rebootFailures > 0 || queryMismatches > 0 || badRollups > 0 || outOfOrder > 0 || records == 0 || (corruptions == 0 && check.crcErrors() > 0);
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Minimal Arduino API for building the firmware's OI modules (src/roomba_oi.cpp,
+// src/oi_stream.cpp, src/command_queue.cpp) on the host. The functions are
+// implemented by the tool which links them, on top of its simulated clock.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t data) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            write(buffer[i]);
+        }
+        return size;
+    }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    virtual size_t readBytes(char *buffer, size_t length)
+    {
+        size_t count = 0;
+        while (count < length && available() > 0)
+        {
+            buffer[count++] = (char)read();
+        }
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,694 @@
+// Roomba Open Interface simulator for the host.
+//
+//   oisim run [options]   Run the firmware's OI transport, stream parser and
+//                         command queue against the simulated Roomba at
+//                         accelerated time and check the outcome (exit code 1
+//                         on failure).
+//   oisim pty [options]   Expose the simulated Roomba on a pseudo terminal in
+//                         real time, e.g. for a USB-serial test setup. There
+//                         is no BRC line on a pty, so the Roomba starts awake.
+//
+// Options:
+//   --hours <h>       simulated time for "run" (default 2)
+//   --stream          use OI stream mode instead of polling sensor group 3
+//   --latency <us>    response latency (default 1000)
+//   --loss <p>        probability of a lost byte, e.g. 0.001
+//   --corrupt <p>     probability of a corrupted byte
+//   --seed <n>        seed for faults and the cleaning pattern
+//   --trace <file>    write the OI trace of the end of the run (see tools/oitrace)
+//
+// With --stream, "run" also measures the hazard events: every bumper press of
+// the simulated Roomba must become exactly one event, and the report shows
+// the error of the event timestamps and the latency from the press to the
+// published batch. It also compares the odometry pose with the true pose of
+// the simulated Roomba, from the first stream frame to the end of the run.
+//
+// "run" also counts the MQTT status messages of the firmware's change
+// detection (heartbeat and significant changes, without session and SoC).
+// While cleaning, the sensor noise must not publish more than
+// SIM_STATUS_MAX_PER_MINUTE messages per minute.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -Itools/oisim/host -Itools/oisim -Isrc
+//       tools/oisim/oisim.cpp tools/oisim/roomba_sim.cpp
+//       src/roomba_oi.cpp src/oi_stream.cpp src/oi_trace.cpp src/command_queue.cpp
+//       src/hazard_events.cpp src/odometry.cpp src/change_detector.cpp -o oisim
+
+#include <Arduino.h>
+#include "roomba_sim.h"
+#include "roomba_oi.h"
+#include "oi_stream.h"
+#include "oi_packets.h"
+#include "command_queue.h"
+#include "oi_trace.h"
+#include "hazard_events.h"
+#include "odometry.h"
+#include "change_detector.h"
+
+#include <chrono>
+#include <deque>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+const uint8_t SIM_PIN_BRC = 14;
+const uint64_t SIM_LOOP_TIME = 1000; // us of simulated time per firmware loop()
+const uint64_t SIM_YIELD_TIME = 100; // us of simulated time per yield()
+
+// Same settings as the firmware (src/main.cpp)
+const uint8_t SIM_STREAM_PACKETS[] = {7, 8, 9, 10, 11, 12, 13, 14, 15, 19, 20, 21, 22, 23, 24, 25, 26, 34, 35, 43, 44, 45};
+const unsigned long SIM_STATUS_INTERVAL = 60000;
+const unsigned long SIM_CMD_STATUS_DELAY = 2000;
+const unsigned long SIM_CMD_COALESCE_WINDOW = 1000;
+const unsigned long SIM_CMD_CONDITION_TIMEOUT = 10000;
+const unsigned long SIM_STREAM_TIMEOUT = 1000;
+const unsigned long SIM_STREAM_RESTART_INTERVAL = 5000;
+const unsigned long SIM_HEARTBEAT_INTERVAL = 60000;
+const unsigned long SIM_CHANGE_MIN_INTERVAL = 1000;
+const ChangeField SIM_STATUS_FIELDS[] = {
+    {"valid", 0},
+    {"cleaning", 0},
+    {"charging", 0},
+    {"charging_state", 0},
+    {"battery_mv", 50, 10000},
+    {"battery_ma", 100, 10000},
+    {"temperature", 1},
+    {"battery_mah", 20},
+};
+const double SIM_STATUS_MAX_PER_MINUTE = 4; // while cleaning, the charge alone changes by 20 mAh per minute
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// ARDUINO ON THE SIMULATED CLOCK
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+uint64_t simTime = 0; // us
+RoombaSim *simRoomba = nullptr;
+
+unsigned long millis()
+{
+    return (unsigned long)(simTime / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)simTime;
+}
+
+void delay(unsigned long ms)
+{
+    simTime += (uint64_t)ms * 1000;
+}
+
+void yield()
+{
+    simTime += SIM_YIELD_TIME;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin == SIM_PIN_BRC && simRoomba != nullptr)
+    {
+        simRoomba->brc(value == HIGH, simTime);
+    }
+}
+
+// UART of the ESP, connected to the simulated Roomba
+class SimSerial : public Stream
+{
+public:
+    int available() override
+    {
+        simRoomba->advance(simTime);
+        return (int)simRoomba->available(simTime);
+    }
+
+    int read() override
+    {
+        return simRoomba->read(simTime);
+    }
+
+    int peek() override
+    {
+        return -1;
+    }
+
+    size_t write(uint8_t data) override
+    {
+        simRoomba->write(data, simTime);
+        return 1;
+    }
+};
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// FIRMWARE SIDE
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+enum SimCommand : uint8_t
+{
+    SIM_CMD_CLEAN,
+    SIM_CMD_DOCK
+};
+
+SimSerial simSerial;
+RoombaOI oi(simSerial, SIM_PIN_BRC);
+OIStreamParser oiStream;
+OITrace oiTrace;
+CommandQueue commandQueue(SIM_CMD_COALESCE_WINDOW, SIM_CMD_CONDITION_TIMEOUT);
+HazardDetector hazardDetector;
+Odometry odometry;
+ChangeDetector statusChanges(SIM_STATUS_FIELDS, sizeof(SIM_STATUS_FIELDS) / sizeof(*SIM_STATUS_FIELDS));
+
+uint8_t sensorbytes[oiPacketSize(3)];
+bool sensorbytesvalid = false;
+bool sensorStatusPending = false;
+bool streamMode = false;
+const char *tracePath = nullptr;
+unsigned long lastStatusRequest = 0;
+unsigned long lastStreamFrameTime = 0;
+unsigned long lastStreamStartTime = 0;
+
+unsigned long statusRequests = 0;
+unsigned long statusFailed = 0;
+unsigned long statusImplausible = 0;
+unsigned long lastStatusPublish = 0;
+unsigned long statusHeartbeats = 0;
+unsigned long statusOnChange = 0;
+unsigned long statusCleaning = 0; // published while the simulated Roomba cleans
+
+// Bumper presses of the simulated Roomba and the events published for them
+std::deque<uint64_t> bumpPresses; // us, not yet published
+unsigned long bumpsPressed = 0;
+unsigned long bumpsPublished = 0;
+unsigned long bumpsMissed = 0;
+unsigned long bumpsSpurious = 0;
+unsigned long lastBumpEvent = 0;  // ms, both bumpers of a press have the same timestamp
+uint64_t bumpStampError = 0;      // us, sum over the published presses
+uint64_t bumpStampErrorMax = 0;
+uint64_t bumpLatency = 0;         // us from the press to the publish, sum
+uint64_t bumpLatencyMin = UINT64_MAX;
+uint64_t bumpLatencyMax = 0;
+
+bool isChargeStateCharging()
+{
+    uint8_t state = oiDecode<3, OI_PACKET_CHARGING_STATE>(sensorbytes);
+    return state == 1 || state == 2 || state == 3 || state == 5;
+}
+
+// Same rule as isRoombaCleaning() of the firmware
+bool isCleaning()
+{
+    return sensorbytesvalid && !isChargeStateCharging() && oiDecode<3, OI_PACKET_CURRENT>(sensorbytes) < -400;
+}
+
+// Values which can't come from the simulation are corrupted bytes which were not detected
+bool isPlausible(const uint8_t *data)
+{
+    uint16_t voltage = oiDecode<3, OI_PACKET_VOLTAGE>(data);
+    return oiDecode<3, OI_PACKET_CHARGING_STATE>(data) <= 5 && voltage >= 12000 && voltage <= 18000 && oiDecode<3, OI_PACKET_BATTERY_CAPACITY>(data) == RoombaSimConfig().capacity;
+}
+
+// Same fields as updateStatusChanges() of the firmware
+void onSensors()
+{
+    statusChanges.set(0, sensorbytesvalid);
+    statusChanges.set(1, isCleaning());
+    statusChanges.set(2, sensorbytesvalid && isChargeStateCharging());
+    statusChanges.set(3, oiDecode<3, OI_PACKET_CHARGING_STATE>(sensorbytes));
+    statusChanges.set(4, oiDecode<3, OI_PACKET_VOLTAGE>(sensorbytes));
+    statusChanges.set(5, oiDecode<3, OI_PACKET_CURRENT>(sensorbytes));
+    statusChanges.set(6, oiDecode<3, OI_PACKET_TEMPERATURE>(sensorbytes));
+    statusChanges.set(7, oiDecode<3, OI_PACKET_BATTERY_CHARGE>(sensorbytes));
+    statusChanges.sample(millis());
+}
+
+// What MQTTpublishStatus() of the firmware does for the change detection
+void publishStatus(bool change)
+{
+    statusOnChange += change;
+    statusHeartbeats += !change;
+    statusCleaning += simRoomba->activity() == RoombaSim::Activity::CLEANING;
+    statusChanges.published();
+    lastStatusPublish = millis();
+}
+
+void requestStatus()
+{
+    const uint8_t request[] = {142, 3};
+
+    if (sensorStatusPending)
+    {
+        return;
+    }
+
+    sensorStatusPending = true;
+    lastStatusRequest = millis();
+    statusRequests++;
+    oi.query(request, sizeof(request), oiPacketSize(3), [](bool success, const uint8_t *data, uint8_t length)
+             {
+                 sensorStatusPending = false;
+                 if (!success)
+                 {
+                     statusFailed++;
+                     return;
+                 }
+                 if (!isPlausible(data))
+                 {
+                     statusImplausible++;
+                 }
+                 memcpy(sensorbytes, data, sizeof(sensorbytes));
+                 sensorbytesvalid = true;
+                 oi.setCharging(isChargeStateCharging());
+                 onSensors(); },
+             false);
+}
+
+// Match the published bumper events with the presses of the simulated Roomba
+uint8_t onHazardBatch(const HazardEvent *events, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const HazardEvent &event = events[i];
+        if ((event.hazard != HAZARD_BUMP_RIGHT && event.hazard != HAZARD_BUMP_LEFT) || !event.on || event.ms == lastBumpEvent)
+        {
+            continue;
+        }
+        lastBumpEvent = event.ms;
+
+        // The press is the last one before the sample of the event (millis() is truncated)
+        uint64_t sampled = (uint64_t)event.ms * 1000 + 999;
+        while (bumpPresses.size() > 1 && bumpPresses[1] <= sampled)
+        {
+            bumpPresses.pop_front();
+            bumpsMissed++;
+        }
+        if (bumpPresses.empty() || bumpPresses.front() > sampled)
+        {
+            bumpsSpurious++;
+            continue;
+        }
+
+        uint64_t press = bumpPresses.front();
+        bumpPresses.pop_front();
+        uint64_t stampError = (uint64_t)event.ms * 1000 > press ? (uint64_t)event.ms * 1000 - press : 0;
+        uint64_t latency = simTime - press;
+        bumpsPublished++;
+        bumpStampError += stampError;
+        bumpStampErrorMax = stampError > bumpStampErrorMax ? stampError : bumpStampErrorMax;
+        bumpLatency += latency;
+        bumpLatencyMin = latency < bumpLatencyMin ? latency : bumpLatencyMin;
+        bumpLatencyMax = latency > bumpLatencyMax ? latency : bumpLatencyMax;
+    }
+    return count;
+}
+
+void firmwareSetup()
+{
+    oiStream.onPacket([](uint8_t id, const uint8_t *data, uint8_t length)
+                      {
+                          const OIGroupInfo &group = *oiGroup(3);
+                          if (oiGroupContains(group, id))
+                          {
+                              memcpy(sensorbytes + oiGroupOffset(group, id), data, length);
+                          }
+                          else if (id == OI_PACKET_OI_MODE)
+                          {
+                              oi.setMode((OIMode)data[0]);
+                          }
+                          else
+                          {
+                              hazardDetector.setPacket(id, oiPacketValue(id, data));
+                              odometry.setPacket(id, oiPacketValue(id, data));
+                          } });
+    oiStream.expect(SIM_STREAM_PACKETS, sizeof(SIM_STREAM_PACKETS));
+    oiStream.onFrame([]()
+                     {
+                         lastStreamFrameTime = millis();
+                         hazardDetector.update(lastStreamFrameTime);
+                         odometry.update(lastStreamFrameTime);
+                         sensorbytesvalid = true;
+                         oi.setCharging(isChargeStateCharging());
+                         onSensors(); });
+    oi.onStream([](const uint8_t *data, size_t length)
+                { oiStream.feed(data, length); });
+    if (tracePath != nullptr)
+    {
+        oi.setTrace(&oiTrace);
+    }
+
+    hazardDetector.onBatch(onHazardBatch);
+
+    commandQueue.onExecute([](uint8_t command)
+                           { oi.command(command == SIM_CMD_CLEAN ? 135 : 143); });
+    commandQueue.onCondition([](CommandQueue::Condition condition)
+                             { return condition != CommandQueue::Condition::NOT_CLEANING || !isCleaning(); });
+    commandQueue.onStatus([](uint8_t trigger)
+                          { requestStatus(); });
+}
+
+void firmwareLoop()
+{
+    oi.loop();
+    commandQueue.loop();
+    hazardDetector.loop(millis());
+
+    bool streamActive = lastStreamFrameTime != 0 && (millis() - lastStreamFrameTime) < SIM_STREAM_TIMEOUT;
+    if (streamMode && !streamActive && (lastStreamStartTime == 0 || (millis() - lastStreamStartTime) >= SIM_STREAM_RESTART_INTERVAL))
+    {
+        lastStreamStartTime = millis();
+        oiStream.reset();
+        oi.startStream(SIM_STREAM_PACKETS, sizeof(SIM_STREAM_PACKETS));
+    }
+
+    if (!streamActive && (millis() - lastStatusRequest) >= SIM_STATUS_INTERVAL)
+    {
+        requestStatus();
+    }
+
+    if (statusChanges.significant() && (millis() - lastStatusPublish) >= SIM_CHANGE_MIN_INTERVAL)
+    {
+        publishStatus(true);
+    }
+    else if ((millis() - lastStatusPublish) >= SIM_HEARTBEAT_INTERVAL)
+    {
+        publishStatus(false);
+    }
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MODES
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+const char *activityName(RoombaSim::Activity activity)
+{
+    switch (activity)
+    {
+    case RoombaSim::Activity::IDLE:
+        return "idle";
+    case RoombaSim::Activity::CLEANING:
+        return "cleaning";
+    case RoombaSim::Activity::SEEKING_DOCK:
+        return "seeking dock";
+    case RoombaSim::Activity::DOCKED:
+        return "docked";
+    }
+    return "";
+}
+
+// Clean 20 minutes after start, send it home after 50 minutes (stop cleaning, then dock as soon as it stopped)
+int run(RoombaSimConfig config, double hours)
+{
+    RoombaSim roomba(config);
+    simRoomba = &roomba;
+    firmwareSetup();
+
+    const uint64_t end = (uint64_t)(hours * 3600e6);
+    const unsigned long cleanAt = 20 * 60000UL;
+    const unsigned long dockAt = 50 * 60000UL;
+    bool cleanSent = false;
+    bool dockSent = false;
+    bool cleaned = false;
+    bool cleaningSeen = false;
+    bool pressed = false;
+    bool odometryStarted = false;
+    double originX = 0; // true pose at the reset of the odometry
+    double originY = 0;
+    double originHeading = 0;
+    unsigned long loops = 0;
+    uint64_t cleaningTime = 0; // us
+
+    auto wallStart = std::chrono::steady_clock::now();
+    while (simTime < end)
+    {
+        simTime += SIM_LOOP_TIME;
+        roomba.advance(simTime);
+        firmwareLoop();
+        loops++;
+
+        if (!cleanSent && millis() >= cleanAt)
+        {
+            commandQueue.push(SIM_CMD_CLEAN, 0, SIM_CMD_STATUS_DELAY);
+            cleanSent = true;
+        }
+        if (!dockSent && millis() >= dockAt)
+        {
+            if (roomba.activity() == RoombaSim::Activity::CLEANING)
+            {
+                commandQueue.push(SIM_CMD_CLEAN, 0, 0);
+            }
+            commandQueue.push(SIM_CMD_DOCK, 0, SIM_CMD_STATUS_DELAY, CommandQueue::Condition::NOT_CLEANING);
+            dockSent = true;
+        }
+
+        cleaned |= roomba.activity() == RoombaSim::Activity::CLEANING;
+        cleaningTime += roomba.activity() == RoombaSim::Activity::CLEANING ? SIM_LOOP_TIME : 0;
+        cleaningSeen |= isCleaning();
+
+        if (!pressed && roomba.bumps() != 0)
+        {
+            bumpPresses.push_back(roomba.bumpsChanged());
+            bumpsPressed++;
+        }
+        pressed = roomba.bumps() != 0;
+
+        if (!odometryStarted && odometry.valid())
+        {
+            odometry.reset();
+            odometryStarted = true;
+            originX = roomba.x();
+            originY = roomba.y();
+            originHeading = roomba.heading();
+        }
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    if (tracePath != nullptr)
+    {
+        FILE *file = fopen(tracePath, "wb");
+        if (file == nullptr)
+        {
+            perror(tracePath);
+            return 1;
+        }
+        oiTrace.dump([file](const uint8_t *data, size_t length)
+                     { fwrite(data, 1, length, file); });
+        fclose(file);
+    }
+
+    bool ok = cleaned && cleaningSeen && roomba.activity() == RoombaSim::Activity::DOCKED && isChargeStateCharging();
+    bool faults = config.lossRate > 0 || config.corruptRate > 0;
+    // True pose in the frame of the odometry
+    double dx = roomba.x() - originX;
+    double dy = roomba.y() - originY;
+    double trueX = dx * cos(originHeading) + dy * sin(originHeading);
+    double trueY = -dx * sin(originHeading) + dy * cos(originHeading);
+    double trueHeading = remainder(roomba.heading() - originHeading, 2 * M_PI) * 180 / M_PI;
+    Pose pose = odometry.pose();
+    double positionError = hypot(pose.x - trueX, pose.y - trueY);
+    double headingError = fabs(remainder(odometry.headingDecidegrees() / 10.0 - trueHeading, 360));
+    bool odometryOk = !streamMode || (odometryStarted && positionError <= 0.01 * odometry.travel() + 50 && headingError <= 2);
+
+    double cleaningMinutes = cleaningTime / 60e6;
+    bool statusOk = statusCleaning <= SIM_STATUS_MAX_PER_MINUTE * cleaningMinutes;
+
+    bool hazardsOk = !streamMode || (bumpsPublished > 0 && bumpsSpurious == 0 && (faults || (bumpsMissed == 0 && bumpPresses.empty())));
+
+    printf("Simulated %.2fh in %.2fs (%.0fx real time, %lu loops)\n", hours, wall, hours * 3600 / wall, loops);
+    printf("Roomba: %s, charge %u mAh, current %d mA, mode %u, %s\n", activityName(roomba.activity()), roomba.charge(), roomba.current(), roomba.mode(), roomba.awake() ? "awake" : "asleep");
+    printf("Roomba: wakeups %lu, sleeps %lu, bytes in %lu, out %lu, lost %lu, corrupted %lu, ignored %lu, stream frames %lu\n",
+           roomba.wakeups(), roomba.sleeps(), roomba.bytesIn(), roomba.bytesOut(), roomba.bytesLost(), roomba.bytesCorrupted(), roomba.ignoredBytes(), roomba.frames());
+    printf("Transport: requests %lu, timeouts %lu, wakeups %lu, rx ring max. %u/%u, overflows %lu\n",
+           oi.requests(), oi.timeouts(), oi.wakeups(), (unsigned int)oi.rxHighWater(), OI_RX_RING_SIZE, oi.rxOverflows());
+    printf("Status: requests %lu, failed %lu, implausible %lu\n", statusRequests, statusFailed, statusImplausible);
+    printf("MQTT status: %lu heartbeats, %lu on change, %lu of %lu samples suppressed, %lu while cleaning (%.1f per minute)\n",
+           statusHeartbeats, statusOnChange, statusChanges.suppressed(), statusChanges.samples(), statusCleaning,
+           cleaningMinutes > 0 ? statusCleaning / cleaningMinutes : 0);
+    printf("Stream: frames %lu, checksum errors %lu, frame errors %lu, dropped bytes %lu\n",
+           oiStream.frames(), oiStream.checksumErrors(), oiStream.frameErrors(), oiStream.droppedBytes());
+    printf("Commands: executed %lu, coalesced %lu, dropped %lu, max. latency %lums\n",
+           commandQueue.executed(), commandQueue.coalesced(), commandQueue.dropped(), commandQueue.maxLatency());
+    if (streamMode)
+    {
+        printf("Hazards: events %lu in %lu batches, dropped %lu, bounces %lu\n",
+               hazardDetector.events(), hazardDetector.batches(), hazardDetector.dropped(), hazardDetector.bounces());
+        printf("Bumper: presses %lu, published %lu, missed %lu, spurious %lu\n",
+               bumpsPressed, bumpsPublished, bumpsMissed + (unsigned long)bumpPresses.size(), bumpsSpurious);
+        if (bumpsPublished > 0)
+        {
+            printf("Bumper: timestamp error mean %.1fms, max. %.1fms, press to publish min. %.1fms, mean %.1fms, max. %.1fms\n",
+                   bumpStampError / 1000.0 / bumpsPublished, bumpStampErrorMax / 1000.0,
+                   bumpLatencyMin / 1000.0, bumpLatency / 1000.0 / bumpsPublished, bumpLatencyMax / 1000.0);
+        }
+        const OdometryDrift &drift = odometry.drift();
+        printf("Odometry: travel %.1fm, pose %d/%dmm %.1fdeg, true %.0f/%.0fmm %.1fdeg, error %.0fmm %.2fdeg, gaps %lu, rejected %lu\n",
+               odometry.travel() / 1000.0, (int)pose.x, (int)pose.y, odometry.headingDecidegrees() / 10.0, trueX, trueY, trueHeading,
+               positionError, headingError, odometry.gaps(), odometry.rejected());
+        printf("Odometry: vs. packets 19/20 %dmm %.1fdeg, per m distance mean %umm, max. %umm, heading mean %.1fdeg, max. %.1fdeg (%lu windows)\n",
+               (int)odometry.distanceDifference(), odometry.headingDifference() / 10.0, (unsigned int)drift.distanceMean, (unsigned int)drift.distanceMax,
+               drift.headingMean / 10.0, drift.headingMax / 10.0, drift.windows);
+        printf("Path: %lu raw points, %u simplified, tolerance %umm\n", odometry.rawPoints(), odometry.pathCount(), odometry.pathTolerance());
+    }
+    if (!ok)
+    {
+        printf("FAILED: expected a cleaning run seen by the firmware and a charging Roomba on the dock\n");
+    }
+    else if (!statusOk)
+    {
+        printf("FAILED: expected at most %.0f status messages per minute while cleaning\n", SIM_STATUS_MAX_PER_MINUTE);
+    }
+    else if (!hazardsOk)
+    {
+        printf("FAILED: expected one published event for every bumper press\n");
+    }
+    else if (!odometryOk)
+    {
+        printf("FAILED: expected an odometry pose within 1%% of the travel and 2 degrees of the true pose\n");
+    }
+    else
+    {
+        printf("OK\n");
+    }
+
+    return ok && statusOk && hazardsOk && odometryOk ? 0 : 1;
+}
+
+volatile sig_atomic_t ptyStop = 0;
+
+void onSignal(int)
+{
+    ptyStop = 1;
+}
+
+int pty(RoombaSimConfig config)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        perror("pty");
+        return 1;
+    }
+
+    // Raw mode, the OI is binary
+    const char *name = ptsname(master);
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    config.awake = true;
+    RoombaSim roomba(config);
+    printf("Simulated Roomba on %s, Ctrl+C to stop\n", name);
+    fflush(stdout);
+
+    signal(SIGINT, onSignal);
+    auto start = std::chrono::steady_clock::now();
+    while (!ptyStop)
+    {
+        uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        uint8_t buff[256];
+
+        ssize_t length = ::read(master, buff, sizeof(buff));
+        for (ssize_t i = 0; i < length; i++)
+        {
+            roomba.write(buff[i], now);
+        }
+
+        roomba.advance(now);
+        length = 0;
+        int data;
+        while (length < (ssize_t)sizeof(buff) && (data = roomba.read(now)) >= 0)
+        {
+            buff[length++] = (uint8_t)data;
+        }
+        if (length > 0 && ::write(master, buff, length) < 0)
+        {
+            perror("write");
+        }
+
+        usleep(500);
+    }
+
+    printf("\n%s, charge %u mAh, bytes in %lu, out %lu, stream frames %lu\n", activityName(roomba.activity()), roomba.charge(), roomba.bytesIn(), roomba.bytesOut(), roomba.frames());
+    close(slave);
+    close(master);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    RoombaSimConfig config;
+    double hours = 2;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s run|pty [--hours h] [--stream] [--latency us] [--loss p] [--corrupt p] [--seed n] [--trace file]\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = 2; i < argc; i++)
+    {
+        const char *option = argv[i];
+        const char *value = (i + 1 < argc ? argv[i + 1] : "0");
+        if (strcmp(option, "--stream") == 0)
+        {
+            streamMode = true;
+            continue;
+        }
+        else if (strcmp(option, "--hours") == 0)
+        {
+            hours = atof(value);
+        }
+        else if (strcmp(option, "--latency") == 0)
+        {
+            config.latency = strtoul(value, nullptr, 10);
+        }
+        else if (strcmp(option, "--loss") == 0)
+        {
+            config.lossRate = atof(value);
+        }
+        else if (strcmp(option, "--corrupt") == 0)
+        {
+            config.corruptRate = atof(value);
+        }
+        else if (strcmp(option, "--trace") == 0)
+        {
+            tracePath = value;
+        }
+        else if (strcmp(option, "--seed") == 0)
+        {
+            config.seed = strtoul(value, nullptr, 10);
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", option);
+            return 2;
+        }
+        i++;
+    }
+
+    if (strcmp(argv[1], "run") == 0)
+    {
+        return run(config, hours);
+    }
+    if (strcmp(argv[1], "pty") == 0)
+    {
+        return pty(config);
+    }
+
+    fprintf(stderr, "unknown mode %s\n", argv[1]);
+    return 2;
+}
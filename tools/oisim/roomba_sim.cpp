@@ -0,0 +1,691 @@
+#include "roomba_sim.h"
+#include "oi_packets.h"
+#include "oi_stream.h"
+#include <math.h>
+#include <string.h>
+
+#define SIM_OPCODE_RESET 7
+#define SIM_OPCODE_START 128
+#define SIM_OPCODE_CONTROL 130
+#define SIM_OPCODE_SAFE 131
+#define SIM_OPCODE_FULL 132
+#define SIM_OPCODE_POWER 133
+#define SIM_OPCODE_SPOT 134
+#define SIM_OPCODE_CLEAN 135
+#define SIM_OPCODE_MAX 136
+#define SIM_OPCODE_SONG 140
+#define SIM_OPCODE_SENSORS 142
+#define SIM_OPCODE_SEEK_DOCK 143
+#define SIM_OPCODE_STREAM 148
+#define SIM_OPCODE_QUERY_LIST 149
+#define SIM_OPCODE_PAUSE_RESUME_STREAM 150
+#define SIM_OPCODE_STOP 173
+
+#define SIM_LENGTH_UNKNOWN 0xFF
+
+const uint64_t SIM_BYTE_TIME = 87;            // us per byte at 115200 baud (10 bits)
+const uint64_t SIM_STREAM_INTERVAL = 15000;   // us between two stream frames
+const uint64_t SIM_SLEEP_TIMEOUT = 300000000; // us without commands until the Roomba sleeps in Passive mode
+const double SIM_STEP = 0.1;                  // s, max. step of the physics simulation
+
+const double SIM_SPEED = 250;                                  // mm/s while driving straight
+const double SIM_TURN_SPEED = 100;                             // wheel speed in mm/s while turning on the spot
+const double SIM_WHEELBASE = 235;                              // mm
+const double SIM_COUNTS_PER_MM = 508.8 / (72.0 * M_PI);        // encoder counts per mm wheel travel
+
+const char SIM_BOOT_MESSAGE[] = "bl-start\r\nSTR730\r\nbootloader id: #x47186549 82ECCFFF\r\nr3_robot/tags/release-3.5.x-tags/release-3.5.4:6058 CLEAN\r\n";
+
+RoombaSim::RoombaSim(const RoombaSimConfig &config) : _config(config), _random(config.seed)
+{
+    _awake = config.awake;
+    _activity = (config.docked ? Activity::DOCKED : Activity::IDLE);
+    _charge = config.charge;
+}
+
+// BRC pin of the ESP: a falling edge wakes up a sleeping Roomba and keeps an awake one from sleeping
+void RoombaSim::brc(bool level, uint64_t now)
+{
+    if (_brc && !level)
+    {
+        if (!_awake)
+        {
+            _awake = true;
+            _mode = 0;
+            _commandLength = 0;
+            _wakeups++;
+        }
+        _lastCommand = now;
+    }
+    _brc = level;
+}
+
+// Byte from the ESP to the Roomba
+void RoombaSim::write(uint8_t data, uint64_t now)
+{
+    _bytesIn++;
+    advance(now);
+
+    if (!_awake)
+    {
+        _ignoredBytes++;
+        return;
+    }
+
+    _lastCommand = now;
+    _command[_commandLength++] = data;
+
+    uint8_t length = argumentLength(_command, _commandLength);
+    if (length != SIM_LENGTH_UNKNOWN && _commandLength >= length + 1)
+    {
+        execute(now + SIM_BYTE_TIME);
+        _commandLength = 0;
+    }
+    else if (_commandLength >= sizeof(_command))
+    {
+        _ignoredBytes += _commandLength;
+        _commandLength = 0;
+    }
+}
+
+size_t RoombaSim::available(uint64_t now)
+{
+    size_t count = 0;
+    for (const auto &entry : _tx)
+    {
+        if (entry.first > now)
+        {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Byte from the Roomba to the ESP, -1 if nothing arrived until now
+int RoombaSim::read(uint64_t now)
+{
+    if (_tx.empty() || _tx.front().first > now)
+    {
+        return -1;
+    }
+    uint8_t data = _tx.front().second;
+    _tx.pop_front();
+    return data;
+}
+
+void RoombaSim::advance(uint64_t now)
+{
+    if (now <= _lastSimulated)
+    {
+        return;
+    }
+
+    double seconds = (now - _lastSimulated) / 1000000.0;
+    double elapsed = 0;
+    while (seconds > 0)
+    {
+        double step = (seconds < SIM_STEP ? seconds : SIM_STEP);
+        uint8_t bumps = _bumps;
+        simulate(step);
+        seconds -= step;
+        elapsed += step;
+        if (_bumps != bumps)
+        {
+            _bumpsChanged = _lastSimulated + (uint64_t)(elapsed * 1000000.0);
+        }
+    }
+    _lastSimulated = now;
+
+    if (_awake && _streamActive)
+    {
+        while (_nextFrame <= now)
+        {
+            sendStreamFrame(_nextFrame);
+            _nextFrame += SIM_STREAM_INTERVAL;
+        }
+    }
+
+    switch (_activity)
+    {
+    case Activity::CLEANING:
+        if ((now - _activitySince) >= (uint64_t)_config.cleanDuration * 1000000 || _charge < _config.capacity / 10)
+        {
+            startActivity(Activity::SEEKING_DOCK, now);
+        }
+        break;
+    case Activity::SEEKING_DOCK:
+        if ((now - _activitySince) >= (uint64_t)_config.dockDuration * 1000000)
+        {
+            startActivity(Activity::DOCKED, now);
+        }
+        break;
+    case Activity::IDLE:
+        if (_awake && _mode <= 1 && (now - _lastCommand) >= SIM_SLEEP_TIMEOUT)
+        {
+            sleep();
+        }
+        break;
+    case Activity::DOCKED:
+        break;
+    }
+}
+
+// Put the Roomba on the dock or take it off
+void RoombaSim::setDocked(bool docked, uint64_t now)
+{
+    startActivity(docked ? Activity::DOCKED : Activity::IDLE, now);
+}
+
+bool RoombaSim::awake()
+{
+    return _awake;
+}
+
+uint8_t RoombaSim::mode()
+{
+    return _mode;
+}
+
+RoombaSim::Activity RoombaSim::activity()
+{
+    return _activity;
+}
+
+bool RoombaSim::streaming()
+{
+    return _streamActive;
+}
+
+uint16_t RoombaSim::charge()
+{
+    return (uint16_t)lround(_charge);
+}
+
+int16_t RoombaSim::current()
+{
+    return (int16_t)lround(_current);
+}
+
+// 0 = not charging, 2 = full charging, 3 = trickle charging
+uint8_t RoombaSim::chargingState()
+{
+    if (_activity != Activity::DOCKED)
+    {
+        return 0;
+    }
+    return (_charge < _config.capacity - 1 ? 2 : 3);
+}
+
+unsigned long RoombaSim::bytesIn()
+{
+    return _bytesIn;
+}
+
+unsigned long RoombaSim::bytesOut()
+{
+    return _bytesOut;
+}
+
+unsigned long RoombaSim::bytesLost()
+{
+    return _bytesLost;
+}
+
+unsigned long RoombaSim::bytesCorrupted()
+{
+    return _bytesCorrupted;
+}
+
+unsigned long RoombaSim::ignoredBytes()
+{
+    return _ignoredBytes;
+}
+
+uint8_t RoombaSim::bumps()
+{
+    return _bumps;
+}
+
+uint64_t RoombaSim::bumpsChanged()
+{
+    return _bumpsChanged;
+}
+
+double RoombaSim::x()
+{
+    return _x;
+}
+
+double RoombaSim::y()
+{
+    return _y;
+}
+
+double RoombaSim::heading()
+{
+    return _heading;
+}
+
+unsigned long RoombaSim::frames()
+{
+    return _frames;
+}
+
+unsigned long RoombaSim::wakeups()
+{
+    return _wakeups;
+}
+
+unsigned long RoombaSim::sleeps()
+{
+    return _sleeps;
+}
+
+// Data bytes following the opcode, SIM_LENGTH_UNKNOWN while the length byte didn't arrive yet
+uint8_t RoombaSim::argumentLength(const uint8_t *command, uint8_t length)
+{
+    switch (command[0])
+    {
+    case 129: // Baud
+    case 138: // Motors
+    case 141: // Play
+    case 142: // Sensors
+    case 150: // Pause/Resume Stream
+    case 165: // Buttons
+        return 1;
+    case 162: // Scheduling LEDs
+        return 2;
+    case 139: // LEDs
+    case 144: // PWM Motors
+    case 168: // Set Day/Time
+        return 3;
+    case 137: // Drive
+    case 145: // Drive Direct
+    case 146: // Drive PWM
+    case 163: // Digit LEDs Raw
+    case 164: // Digit LEDs ASCII
+        return 4;
+    case 167: // Schedule
+        return 15;
+    case SIM_OPCODE_SONG:
+        return (length < 3 ? SIM_LENGTH_UNKNOWN : 2 + 2 * command[2]);
+    case SIM_OPCODE_STREAM:
+    case SIM_OPCODE_QUERY_LIST:
+        return (length < 2 ? SIM_LENGTH_UNKNOWN : 1 + command[1]);
+    default:
+        return 0;
+    }
+}
+
+void RoombaSim::execute(uint64_t now)
+{
+    uint8_t opcode = _command[0];
+
+    // Off mode only knows Start and Reset
+    if (_mode == 0 && opcode != SIM_OPCODE_START && opcode != SIM_OPCODE_RESET)
+    {
+        _ignoredBytes += _commandLength;
+        return;
+    }
+
+    switch (opcode)
+    {
+    case SIM_OPCODE_RESET:
+        _mode = 0;
+        _streamActive = false;
+        respond((const uint8_t *)SIM_BOOT_MESSAGE, strlen(SIM_BOOT_MESSAGE), now + 500000 + _config.latency);
+        break;
+
+    case SIM_OPCODE_START:
+        _mode = 1;
+        break;
+
+    case SIM_OPCODE_CONTROL:
+    case SIM_OPCODE_SAFE:
+        _mode = 2;
+        if (_activity == Activity::CLEANING || _activity == Activity::SEEKING_DOCK)
+        {
+            startActivity(Activity::IDLE, now);
+        }
+        break;
+
+    case SIM_OPCODE_FULL:
+        _mode = 3;
+        if (_activity == Activity::CLEANING || _activity == Activity::SEEKING_DOCK)
+        {
+            startActivity(Activity::IDLE, now);
+        }
+        break;
+
+    case SIM_OPCODE_POWER:
+        sleep();
+        break;
+
+    case SIM_OPCODE_SPOT:
+    case SIM_OPCODE_CLEAN:
+    case SIM_OPCODE_MAX:
+        // Like the clean button: starts cleaning or stops a running cleaning
+        _mode = 1;
+        startActivity(_activity == Activity::CLEANING ? Activity::IDLE : Activity::CLEANING, now);
+        break;
+
+    case SIM_OPCODE_SEEK_DOCK:
+        _mode = 1;
+        if (_activity != Activity::DOCKED)
+        {
+            startActivity(Activity::SEEKING_DOCK, now);
+        }
+        break;
+
+    case SIM_OPCODE_STOP:
+        _mode = 0;
+        _streamActive = false;
+        break;
+
+    case SIM_OPCODE_SENSORS:
+        respondPacket(_command[1], now);
+        break;
+
+    case SIM_OPCODE_QUERY_LIST:
+    {
+        uint8_t response[256];
+        size_t length = 0;
+        for (uint8_t i = 0; i < _command[1]; i++)
+        {
+            if (oiPacketSize(_command[2 + i]) == 0 || length + oiPacketSize(_command[2 + i]) > sizeof(response))
+            {
+                return; // the Roomba doesn't answer invalid requests
+            }
+            length += encodePacket(_command[2 + i], response + length);
+        }
+        respond(response, length, now + _config.latency);
+        break;
+    }
+
+    case SIM_OPCODE_STREAM:
+        _streamCount = 0;
+        for (uint8_t i = 0; i < _command[1] && i < sizeof(_streamPackets); i++)
+        {
+            if (oiPacketSize(_command[2 + i]) > 0)
+            {
+                _streamPackets[_streamCount++] = _command[2 + i];
+            }
+        }
+        _streamActive = _streamCount > 0;
+        _nextFrame = now + _config.latency;
+        break;
+
+    case SIM_OPCODE_PAUSE_RESUME_STREAM:
+        _streamActive = _command[1] != 0 && _streamCount > 0;
+        _nextFrame = now + _config.latency;
+        break;
+
+    default:
+        break; // accepted, but without effect on the simulation
+    }
+}
+
+// Queue bytes to the ESP starting at the given time, timed at the baud rate
+// and with the configured faults
+void RoombaSim::respond(const uint8_t *data, size_t length, uint64_t start)
+{
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    uint64_t time = start;
+    if (time < _txFree)
+    {
+        time = _txFree;
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        time += SIM_BYTE_TIME;
+        _bytesOut++;
+
+        if (_config.lossRate > 0 && chance(_random) < _config.lossRate)
+        {
+            _bytesLost++;
+            continue;
+        }
+
+        uint8_t value = data[i];
+        if (_config.corruptRate > 0 && chance(_random) < _config.corruptRate)
+        {
+            value ^= (uint8_t)(1 << (_random() % 8));
+            _bytesCorrupted++;
+        }
+        _tx.push_back(std::make_pair(time, value));
+    }
+    _txFree = time;
+}
+
+void RoombaSim::respondPacket(uint8_t id, uint64_t now)
+{
+    uint8_t response[128];
+    size_t length = encodePacket(id, response);
+    if (length > 0)
+    {
+        respond(response, length, now + _config.latency);
+    }
+}
+
+// Packet or packet group in OI byte order, returns the length (0 = unknown packet)
+size_t RoombaSim::encodePacket(uint8_t id, uint8_t *out)
+{
+    if (oiGroup(id) != nullptr)
+    {
+        size_t length = 0;
+        for (uint8_t packet = oiGroup(id)->first; packet <= oiGroup(id)->last; packet++)
+        {
+            length += encodePacket(packet, out + length);
+        }
+        return length;
+    }
+
+    if (!oiIsPacket(id))
+    {
+        return 0;
+    }
+
+    int32_t value = packetValue(id);
+    if (oiPacket(id).size == 1)
+    {
+        out[0] = (uint8_t)value;
+    }
+    else
+    {
+        out[0] = (uint8_t)(value >> 8);
+        out[1] = (uint8_t)value;
+    }
+    return oiPacket(id).size;
+}
+
+int32_t RoombaSim::packetValue(uint8_t id)
+{
+    bool moving = _activity == Activity::CLEANING || _activity == Activity::SEEKING_DOCK;
+    bool docked = _activity == Activity::DOCKED;
+    int32_t value;
+
+    switch (id)
+    {
+    case OI_PACKET_BUMPS_WHEELDROPS:
+        return _bumps;
+    case OI_PACKET_DIRT_DETECT:
+        return (_activity == Activity::CLEANING && _random() % 20 == 0 ? _random() % 200 : 0);
+    case OI_PACKET_IR_OMNI:
+        return (_activity == Activity::SEEKING_DOCK || docked ? 161 : 0); // force field of the home base
+    case 28: // cliff signals, floor below all sensors
+    case 29:
+    case 30:
+    case 31:
+        return 1200;
+    case OI_PACKET_DISTANCE: // since the last request
+        value = lround(_distance);
+        _distance -= value;
+        return value;
+    case OI_PACKET_ANGLE:
+        value = lround(_angle);
+        _angle -= value;
+        return value;
+    case OI_PACKET_CHARGING_STATE:
+        return chargingState();
+    case OI_PACKET_VOLTAGE:
+        return lround(13500 + 3000 * (_charge / _config.capacity) + (_current > 0 ? 500 : _current / 4));
+    case OI_PACKET_CURRENT:
+        return lround(_current);
+    case OI_PACKET_TEMPERATURE:
+        return lround(_temperature);
+    case OI_PACKET_BATTERY_CHARGE:
+        return lround(_charge);
+    case OI_PACKET_BATTERY_CAPACITY:
+        return _config.capacity;
+    case OI_PACKET_CHARGING_SOURCES:
+        return (docked ? 2 : 0);
+    case OI_PACKET_OI_MODE:
+        return _mode;
+    case OI_PACKET_STREAM_PACKETS:
+        return _streamCount;
+    case OI_PACKET_LEFT_ENCODER:
+        return llround(_leftWheel * SIM_COUNTS_PER_MM) & 0xFFFF;
+    case OI_PACKET_RIGHT_ENCODER:
+        return llround(_rightWheel * SIM_COUNTS_PER_MM) & 0xFFFF;
+    case OI_PACKET_LIGHT_BUMPER:
+        return (_bumps != 0 ? 0x0C : 0);
+    case OI_PACKET_LEFT_MOTOR_CURRENT:
+    case OI_PACKET_RIGHT_MOTOR_CURRENT:
+        return (moving ? 120 + _random() % 40 : 0);
+    case OI_PACKET_MAIN_BRUSH_CURRENT:
+        return (_activity == Activity::CLEANING ? 250 + _random() % 50 : 0);
+    case OI_PACKET_SIDE_BRUSH_CURRENT:
+        return (_activity == Activity::CLEANING ? 80 + _random() % 20 : 0);
+    case OI_PACKET_STASIS:
+        return (moving ? 1 : 0);
+    default:
+        return 0;
+    }
+}
+
+// [19][n][id][data]...[id][data][checksum], all bytes including the checksum sum up to 0
+void RoombaSim::sendStreamFrame(uint64_t now)
+{
+    uint8_t frame[256];
+    size_t length = 2;
+
+    for (uint8_t i = 0; i < _streamCount; i++)
+    {
+        frame[length++] = _streamPackets[i];
+        length += encodePacket(_streamPackets[i], frame + length);
+    }
+    frame[0] = OI_STREAM_HEADER;
+    frame[1] = (uint8_t)(length - 2);
+
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        sum += frame[i];
+    }
+    frame[length++] = (uint8_t)(0 - sum);
+
+    respond(frame, length, now);
+    _frames++;
+}
+
+// Battery, temperature and motion for a short time step
+void RoombaSim::simulate(double seconds)
+{
+    std::normal_distribution<double> noise(0.0, 1.0);
+
+    switch (_activity)
+    {
+    case Activity::CLEANING:
+        _current = -1200 + 80 * noise(_random);
+        move(seconds);
+        break;
+    case Activity::SEEKING_DOCK:
+        _current = -800 + 50 * noise(_random);
+        move(seconds);
+        break;
+    case Activity::DOCKED:
+        _current = (chargingState() == 2 ? 1500 : 40) + 20 * noise(_random);
+        break;
+    case Activity::IDLE:
+        _current = (_awake ? -180 : -20) + 5 * noise(_random);
+        break;
+    }
+
+    _charge += _current * seconds / 3600.0;
+    if (_charge < 0)
+    {
+        _charge = 0;
+    }
+    if (_charge > _config.capacity)
+    {
+        _charge = _config.capacity;
+    }
+
+    double target = (_activity == Activity::CLEANING ? 34 : (chargingState() == 2 ? 30 : 24));
+    _temperature += (target - _temperature) * seconds / 600.0;
+}
+
+// Cleaning pattern: drive straight until a bump, turn on the spot, repeat
+void RoombaSim::move(double seconds)
+{
+    std::uniform_real_distribution<double> straight(1.0, 6.0);
+    std::uniform_real_distribution<double> turn(30.0, 180.0);
+
+    while (seconds > 0)
+    {
+        if (_phaseLeft <= 0)
+        {
+            _turning = !_turning;
+            if (_turning)
+            {
+                double angle = turn(_random) * M_PI / 180.0;
+                _turnSpeed = (_random() % 2 == 0 ? SIM_TURN_SPEED : -SIM_TURN_SPEED);
+                _phaseLeft = angle * SIM_WHEELBASE / 2 / SIM_TURN_SPEED;
+                _bumps = 1 + _random() % 3;
+                _bumpLeft = 0.1;
+            }
+            else
+            {
+                _phaseLeft = straight(_random);
+            }
+        }
+
+        double step = (seconds < _phaseLeft ? seconds : _phaseLeft);
+        double left = (_turning ? -_turnSpeed : SIM_SPEED) * step;
+        double right = (_turning ? _turnSpeed : SIM_SPEED) * step;
+
+        _leftWheel += left;
+        _rightWheel += right;
+        _distance += (left + right) / 2;
+        _angle += (right - left) / SIM_WHEELBASE * 180.0 / M_PI;
+        _x += (left + right) / 2 * cos(_heading);
+        _y += (left + right) / 2 * sin(_heading);
+        _heading += (right - left) / SIM_WHEELBASE;
+
+        _phaseLeft -= step;
+        seconds -= step;
+        _bumpLeft -= step;
+        if (_bumpLeft <= 0)
+        {
+            _bumps = 0;
+        }
+    }
+}
+
+void RoombaSim::startActivity(Activity activity, uint64_t now)
+{
+    _activity = activity;
+    _activitySince = now;
+    _turning = false;
+    _phaseLeft = 0;
+}
+
+void RoombaSim::sleep()
+{
+    _awake = false;
+    _mode = 0;
+    _streamActive = false;
+    _commandLength = 0;
+    _sleeps++;
+}
@@ -0,0 +1,138 @@
+#ifndef roomba_sim_h
+#define roomba_sim_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <random>
+
+// Simulated Roomba 600 on the other end of the OI serial link. Time is
+// passed in by the caller (microseconds), so the simulation runs as fast as
+// the host can go.
+//
+// Modelled: BRC wake line and sleep timeout, OI modes, sensor packets and
+// groups (layout from src/oi_packets.h), Sensors/Query List/Stream, battery
+// charge and discharge, cleaning, seeking the dock and charging. Transmitted
+// bytes are timed at 115200 baud and can be delayed, lost or corrupted.
+struct RoombaSimConfig
+{
+    uint32_t latency = 1000;      // us between the end of a request and the first response byte
+    double lossRate = 0.0;        // probability of a lost byte (Roomba -> ESP)
+    double corruptRate = 0.0;     // probability of a bit error (Roomba -> ESP)
+    uint32_t seed = 1;            // seed for faults and the cleaning pattern
+    bool awake = false;           // start awake (e.g. pty mode without BRC line)
+    bool docked = true;           // start on the dock
+    uint16_t capacity = 2696;     // battery capacity in mAh
+    uint16_t charge = 2000;       // battery charge at start in mAh
+    uint32_t cleanDuration = 2700; // s until a cleaning run ends and the Roomba seeks the dock
+    uint32_t dockDuration = 60;   // s from "seek dock" to being docked
+};
+
+class RoombaSim
+{
+public:
+    enum class Activity
+    {
+        IDLE,
+        CLEANING,
+        SEEKING_DOCK,
+        DOCKED
+    };
+
+    explicit RoombaSim(const RoombaSimConfig &config);
+
+    void brc(bool level, uint64_t now);
+    void write(uint8_t data, uint64_t now);
+    size_t available(uint64_t now);
+    int read(uint64_t now);
+    void advance(uint64_t now);
+
+    void setDocked(bool docked, uint64_t now);
+
+    bool awake();
+    uint8_t mode();
+    Activity activity();
+    bool streaming();
+    uint16_t charge();
+    int16_t current();
+    uint8_t chargingState();
+    uint8_t bumps();         // bumper bits of packet 7
+    uint64_t bumpsChanged(); // us of the last change of the bumpers
+    double x();              // true position in mm
+    double y();
+    double heading();        // true heading in rad, counter-clockwise
+
+    unsigned long bytesIn();
+    unsigned long bytesOut();
+    unsigned long bytesLost();
+    unsigned long bytesCorrupted();
+    unsigned long ignoredBytes();
+    unsigned long frames();
+    unsigned long wakeups();
+    unsigned long sleeps();
+
+private:
+    void execute(uint64_t now);
+    uint8_t argumentLength(const uint8_t *command, uint8_t length);
+    void respond(const uint8_t *data, size_t length, uint64_t start);
+    void respondPacket(uint8_t id, uint64_t now);
+    size_t encodePacket(uint8_t id, uint8_t *out);
+    int32_t packetValue(uint8_t id);
+    void sendStreamFrame(uint64_t now);
+    void simulate(double seconds);
+    void move(double seconds);
+    void startActivity(Activity activity, uint64_t now);
+    void sleep();
+
+    RoombaSimConfig _config;
+    std::mt19937 _random;
+
+    bool _awake;
+    bool _brc = true;
+    uint8_t _mode = 0;
+    Activity _activity;
+    uint64_t _activitySince = 0;
+    uint64_t _lastCommand = 0;
+    uint64_t _lastSimulated = 0;
+
+    uint8_t _command[64];
+    uint8_t _commandLength = 0;
+
+    std::deque<std::pair<uint64_t, uint8_t>> _tx; // scheduled bytes to the ESP
+    uint64_t _txFree = 0;                         // time the UART is free again
+
+    uint8_t _streamPackets[32];
+    uint8_t _streamCount = 0;
+    bool _streamActive = false;
+    uint64_t _nextFrame = 0;
+
+    double _charge;
+    double _current = 0;
+    double _temperature = 25;
+
+    // Motion of the cleaning pattern
+    bool _turning = false;
+    double _phaseLeft = 0; // s until the next straight/turn phase
+    double _turnSpeed = 0; // wheel speed while turning, mm/s (> 0 = counter-clockwise)
+    double _leftWheel = 0; // total wheel travel in mm
+    double _rightWheel = 0;
+    double _distance = 0; // since the last request of packet 19/20
+    double _angle = 0;
+    double _x = 0; // true pose
+    double _y = 0;
+    double _heading = 0;
+    uint8_t _bumps = 0;
+    double _bumpLeft = 0;
+    uint64_t _bumpsChanged = 0;
+
+    unsigned long _bytesIn = 0;
+    unsigned long _bytesOut = 0;
+    unsigned long _bytesLost = 0;
+    unsigned long _bytesCorrupted = 0;
+    unsigned long _ignoredBytes = 0;
+    unsigned long _frames = 0;
+    unsigned long _wakeups = 0;
+    unsigned long _sleeps = 0;
+};
+
+#endif
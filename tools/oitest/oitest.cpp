@@ -0,0 +1,1998 @@
+// Host tests of the firmware's modules (exit code 1 on a failed check).
+//
+//   oitest transport   RoombaOI against a mock UART and a mock Roomba on a
+//                      manual clock: wake-up, START, queries with fragmented,
+//                      late and missing responses, a query while streaming and
+//                      a full request queue. Every loop() must return at once:
+//                      no delay(), no yield(), no time passing and no read of
+//                      more bytes than the UART has.
+//   oitest stream [trace.bin]
+//                      OIStreamParser on a recorded stream: the RX bytes of an
+//                      OI trace (see tools/oitrace), or without a trace a
+//                      synthetic recording of the firmware's stream packets.
+//                      The clean recording must give the frames of a reference
+//                      scan in any chunk size. Then the recording is randomly
+//                      corrupted (flipped, dropped and inserted bytes, forged
+//                      frames with a valid checksum): the parser must keep the
+//                      untouched frames, accept almost no corrupted ones and
+//                      none of the forged ones (groups, packets in another
+//                      order) and be back in sync for the clean end. Also the
+//                      length and packet checks of single frames.
+//   oitest packets     The OI_PACKETS table against the sizes and signedness of
+//                      the OI spec: every packet, the size and packet offsets
+//                      of every group, and a decode of group 100 (all packets)
+//                      with values at the spec offsets.
+//   oitest ring        ByteRing with a producer and a consumer thread: millions
+//                      of bytes of a pseudo random sequence through rings of
+//                      16 and 256 bytes, written by span and push(), read by
+//                      span, peek() and read(). Every byte must arrive once and
+//                      in order, the fill level must stay within the ring.
+//   oitest change      ChangeDetector: deadband against the published value,
+//                      no flapping around a threshold, and an averaged field
+//                      with the noise of a cleaning Roomba in the 15ms stream
+//                      (the simulator's -1200 +/- 80 mA): quiet while the
+//                      average holds, a step publishes within a second.
+//   oitest schedule    CleanScheduler: the timer wheel against a brute force
+//                      scan of every minute for random rule sets over 20
+//                      days, cron text parsed and formatted back, catch-up
+//                      after a boot or an NTP jump, and no slot run twice when
+//                      the time goes back.
+//   oitest deadline    DeadlineScheduler from shortly before the millis()
+//                      rollover: a periodic and a one-shot task with now
+//                      wrapping, overruns of a stalled loop, and random tasks
+//                      against a reference on a 64 bit clock.
+//   oitest all         All of the above.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -pthread -Itools/oisim/host -Isrc
+//       tools/oitest/oitest.cpp src/roomba_oi.cpp src/oi_stream.cpp src/oi_trace.cpp
+//       src/change_detector.cpp src/clean_scheduler.cpp src/deadline_scheduler.cpp -o oitest
+
+#include <Arduino.h>
+#include "roomba_oi.h"
+#include "oi_stream.h"
+#include "oi_packets.h"
+#include "oi_trace.h"
+#include "byte_ring.h"
+#include "change_detector.h"
+#include "clean_scheduler.h"
+#include "deadline_scheduler.h"
+
+#include <algorithm>
+#include <deque>
+#include <math.h>
+#include <random>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const uint8_t TEST_PIN_BRC = 14;
+const uint64_t TEST_BYTE_TIME = 87;       // us per byte at 115200 baud
+const uint64_t TEST_STREAM_PERIOD = 15000; // us between stream frames
+
+// Same settings as the firmware (src/main.cpp)
+const uint8_t TEST_STREAM_PACKETS[] = {7, 8, 9, 10, 11, 12, 13, 14, 15, 19, 20, 21, 22, 23, 24, 25, 26, 34, 35, 43, 44, 45};
+const unsigned long TEST_STREAM_FRAMES = 4000; // synthetic recording, 1 minute
+const int TEST_CORRUPT_RUNS = 100;
+const double TEST_CORRUPT_RATE = 0.002;       // per byte, in the first 90% of the recording
+const double TEST_FORGE_RATE = 0.01;          // per frame, a forged frame with a valid checksum before it
+const unsigned long TEST_RING_BYTES = 20000000; // per ring size
+const int TEST_SCHEDULE_RUNS = 300;             // random rule sets
+const uint32_t TEST_SCHEDULE_DAYS = 20;         // per rule set
+const uint32_t TEST_SCHEDULE_DAY = 1789948800;  // 2026-09-21 00:00, a Monday
+const uint32_t TEST_DEADLINE_START = 0xFFFFFFFF - 1000; // ms, 1s before the millis() rollover
+const int TEST_DEADLINE_RUNS = 100;                     // random task sets
+
+unsigned long checks = 0;
+unsigned long failures = 0;
+
+void check(bool condition, const char *test, const char *what)
+{
+    checks++;
+    if (!condition)
+    {
+        failures++;
+        printf("FAILED %s: %s\n", test, what);
+    }
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// ARDUINO ON A MANUAL CLOCK
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+uint64_t testTime = 0; // us, only the test moves it
+unsigned long delayCalls = 0;
+unsigned long yieldCalls = 0;
+
+unsigned long millis()
+{
+    return (unsigned long)(testTime / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)testTime;
+}
+
+// Both would block loop() on the device, here they only count
+void delay(unsigned long ms)
+{
+    delayCalls++;
+    testTime += (uint64_t)ms * 1000;
+}
+
+void yield()
+{
+    yieldCalls++;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+class MockRoomba;
+MockRoomba *mockRoomba = nullptr;
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MOCK ROOMBA AND UART
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// Answers sensor requests and streams frames. Every byte gets the time it
+// arrives at the UART; nothing is there before its time.
+class MockRoomba
+{
+public:
+    bool awake = true;
+    bool mute = false;           // awake, but never answers
+    uint64_t latency = 1000;     // us from the request to the first response byte
+    uint64_t byteTime = TEST_BYTE_TIME;
+    std::vector<uint8_t> opcodes; // received while awake, in order
+
+    void brc(uint8_t level)
+    {
+        if (level == LOW && _brc == HIGH)
+        {
+            awake = true;
+        }
+        _brc = level;
+    }
+
+    void write(uint8_t data)
+    {
+        if (!awake)
+        {
+            return;
+        }
+        _command.push_back(data);
+        if (_command.size() < commandLength())
+        {
+            return;
+        }
+        execute();
+        _command.clear();
+    }
+
+    size_t available()
+    {
+        advance();
+        size_t count = 0;
+        while (count < _rx.size() && _rx[count].time <= testTime)
+        {
+            count++;
+        }
+        return count;
+    }
+
+    int read()
+    {
+        if (available() == 0)
+        {
+            return -1;
+        }
+        uint8_t data = _rx.front().data;
+        _rx.pop_front();
+        return data;
+    }
+
+    // Value of byte i of a packet, packet 35 (OI mode) is Passive
+    static uint8_t packetByte(uint8_t id, uint8_t i)
+    {
+        return id == OI_PACKET_OI_MODE ? 1 : (uint8_t)(id * 7 + i);
+    }
+
+    static void appendPacket(std::vector<uint8_t> &data, uint8_t id)
+    {
+        for (uint8_t i = 0; i < oiPacketSize(id); i++)
+        {
+            data.push_back(packetByte(id, i));
+        }
+    }
+
+private:
+    struct TimedByte
+    {
+        uint64_t time;
+        uint8_t data;
+    };
+
+    size_t commandLength()
+    {
+        switch (_command[0])
+        {
+        case 142: // Sensors
+        case 150: // Pause/Resume Stream
+            return 2;
+        case 148: // Stream
+        case 149: // Query List
+            return _command.size() < 2 ? 2 : 2 + _command[1];
+        default:
+            return 1;
+        }
+    }
+
+    void execute()
+    {
+        opcodes.push_back(_command[0]);
+        std::vector<uint8_t> response;
+        switch (_command[0])
+        {
+        case 142:
+            appendPacket(response, _command[1]);
+            break;
+        case 149:
+            for (size_t i = 2; i < _command.size(); i++)
+            {
+                appendPacket(response, _command[i]);
+            }
+            break;
+        case 148:
+            _streamPackets.assign(_command.begin() + 2, _command.end());
+            _streaming = true;
+            _nextFrame = testTime + latency;
+            break;
+        case 150:
+            _streaming = _command[1] == 1;
+            _nextFrame = testTime + latency;
+            break;
+        }
+        send(response, testTime + latency);
+    }
+
+    void send(const std::vector<uint8_t> &data, uint64_t time)
+    {
+        if (mute)
+        {
+            return;
+        }
+        time = _rx.empty() || _rx.back().time < time ? time : _rx.back().time;
+        for (uint8_t byte : data)
+        {
+            _rx.push_back({time, byte});
+            time += byteTime;
+        }
+    }
+
+    void advance()
+    {
+        while (_streaming && _nextFrame <= testTime)
+        {
+            std::vector<uint8_t> frame = {OI_STREAM_HEADER, 0};
+            for (uint8_t id : _streamPackets)
+            {
+                frame.push_back(id);
+                appendPacket(frame, id);
+            }
+            frame[1] = frame.size() - 2;
+            uint8_t checksum = 0;
+            for (uint8_t byte : frame)
+            {
+                checksum += byte;
+            }
+            frame.push_back(-checksum);
+            send(frame, _nextFrame);
+            _nextFrame += TEST_STREAM_PERIOD;
+        }
+    }
+
+    std::vector<uint8_t> _command;
+    std::deque<TimedByte> _rx;
+    uint8_t _brc = LOW;
+    bool _streaming = false;
+    std::vector<uint8_t> _streamPackets;
+    uint64_t _nextFrame = 0;
+};
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin == TEST_PIN_BRC && mockRoomba != nullptr)
+    {
+        mockRoomba->brc(value);
+    }
+}
+
+// UART of the ESP. readBytes() for more bytes than available() would wait
+// for the serial timeout on the device, so it is counted as blocking.
+class MockSerial : public Stream
+{
+public:
+    unsigned long overreads = 0;
+
+    int available() override
+    {
+        return (int)mockRoomba->available();
+    }
+
+    int read() override
+    {
+        return mockRoomba->read();
+    }
+
+    int peek() override
+    {
+        return -1;
+    }
+
+    size_t readBytes(char *buffer, size_t length) override
+    {
+        if (length > (size_t)available())
+        {
+            overreads++;
+        }
+        return Stream::readBytes(buffer, length);
+    }
+
+    size_t write(uint8_t data) override
+    {
+        mockRoomba->write(data);
+        return 1;
+    }
+};
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// TRANSPORT
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// The transport with its mocks, one per scenario
+struct TransportTest
+{
+    const char *name;
+    MockRoomba roomba;
+    MockSerial serial;
+    RoombaOI oi;
+    unsigned long loops = 0;
+    unsigned long blockedLoops = 0;
+
+    TransportTest(const char *name) : name(name), oi(serial, TEST_PIN_BRC)
+    {
+        mockRoomba = &roomba;
+        testTime = 1000000;
+        delayCalls = 0;
+        yieldCalls = 0;
+    }
+
+    ~TransportTest()
+    {
+        check(blockedLoops == 0, name, "loop() blocked");
+        check(serial.overreads == 0, name, "readBytes() beyond available()");
+        mockRoomba = nullptr;
+    }
+
+    // Call loop() every step us until done() or the time is over
+    template <typename F>
+    bool run(uint64_t duration, uint64_t step, F done)
+    {
+        uint64_t end = testTime + duration;
+        for (; testTime < end; testTime += step)
+        {
+            uint64_t before = testTime;
+            unsigned long delays = delayCalls;
+            unsigned long yields = yieldCalls;
+            oi.loop();
+            loops++;
+            if (testTime != before || delayCalls != delays || yieldCalls != yields)
+            {
+                blockedLoops++;
+                testTime = before;
+            }
+            if (done())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Result of a query callback
+struct QueryResult
+{
+    bool done = false;
+    bool success = false;
+    std::vector<uint8_t> data;
+
+    RoombaOI::Callback callback()
+    {
+        return [this](bool ok, const uint8_t *bytes, uint8_t length)
+        {
+            done = true;
+            success = ok;
+            data.assign(bytes, bytes + length);
+        };
+    }
+};
+
+std::vector<uint8_t> expectedPackets(const uint8_t *packets, uint8_t count)
+{
+    std::vector<uint8_t> data;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        MockRoomba::appendPacket(data, packets[i]);
+    }
+    return data;
+}
+
+// A sleeping Roomba is woken with BRC pulses and started before the query
+void testWakeAndQuery()
+{
+    TransportTest test("transport wake and query");
+    test.roomba.awake = false;
+    const uint8_t packets[] = {21, 22, 23, 25, 26};
+    QueryResult result;
+
+    check(test.oi.queryList(packets, sizeof(packets), result.callback()), test.name, "query not queued");
+    check(test.run(2000000, 1000, [&]
+                   { return result.done; }),
+          test.name, "no result");
+    check(result.success, test.name, "query failed");
+    check(result.data == expectedPackets(packets, sizeof(packets)), test.name, "wrong response");
+    check(test.oi.wakeups() == 1, test.name, "not exactly one wake-up");
+    check(!test.roomba.opcodes.empty() && test.roomba.opcodes.front() == 128, test.name, "START not the first opcode");
+    check(test.oi.mode() == OIMode::PASSIVE, test.name, "mode not Passive");
+}
+
+// The response trickles in over many loop() calls
+void testFragmentedResponse()
+{
+    TransportTest test("transport fragmented response");
+    test.roomba.latency = 20000;
+    test.roomba.byteTime = 3000;
+    const uint8_t request[] = {142, 3};
+    QueryResult result;
+
+    check(test.oi.query(request, sizeof(request), oiPacketSize(3), result.callback()), test.name, "query not queued");
+    check(test.run(2000000, 250, [&]
+                   { return result.done; }),
+          test.name, "no result");
+    check(result.success, test.name, "query failed");
+    std::vector<uint8_t> expected;
+    MockRoomba::appendPacket(expected, 3);
+    check(result.data == expected, test.name, "wrong response");
+    check(test.loops > oiPacketSize(3) * 3000 / 250, test.name, "response not collected across loop() calls");
+}
+
+// No answer: the query fails after the timeouts, without waiting in loop()
+void testMissingResponse()
+{
+    TransportTest test("transport missing response");
+    test.roomba.mute = true;
+    const uint8_t packets[] = {7};
+    QueryResult result;
+
+    check(test.oi.queryList(packets, sizeof(packets), result.callback()), test.name, "query not queued");
+    check(test.run(5000000, 1000, [&]
+                   { return result.done; }),
+          test.name, "no result");
+    check(!result.success, test.name, "query succeeded");
+    check(test.oi.timeouts() > 0, test.name, "timeout not counted");
+    check(test.oi.asleep(), test.name, "Roomba not considered asleep");
+}
+
+// A query pauses the stream, the stream goes on afterwards
+void testQueryWhileStreaming()
+{
+    TransportTest test("transport query while streaming");
+    OIStreamParser parser;
+    test.oi.onStream([&](const uint8_t *data, size_t length)
+                     { parser.feed(data, length); });
+    const uint8_t stream[] = {7, 21};
+    const uint8_t packets[] = {22, 25};
+    QueryResult result;
+
+    check(test.oi.startStream(stream, sizeof(stream)), test.name, "stream not started");
+    test.run(1000000, 1000, []
+             { return false; });
+    unsigned long frames = parser.frames();
+    check(frames >= 10, test.name, "too few stream frames");
+
+    check(test.oi.queryList(packets, sizeof(packets), result.callback()), test.name, "query not queued");
+    check(test.run(2000000, 1000, [&]
+                   { return result.done; }),
+          test.name, "no result");
+    check(result.success && result.data == expectedPackets(packets, sizeof(packets)), test.name, "wrong response");
+
+    test.run(300000, 1000, []
+             { return false; });
+    check(parser.frames() >= frames + 10, test.name, "stream not resumed");
+    check(parser.checksumErrors() == 0 && parser.frameErrors() == 0, test.name, "stream frames broken by the query");
+}
+
+// A full queue refuses requests instead of waiting for space
+void testFullQueue()
+{
+    TransportTest test("transport full queue");
+    for (uint8_t i = 0; i < OI_QUEUE_SIZE; i++)
+    {
+        check(test.oi.command(135), test.name, "command not queued");
+    }
+    check(!test.oi.command(135), test.name, "command queued into a full queue");
+    check(test.run(2000000, 1000, [&]
+                   { return !test.oi.busy(); }),
+          test.name, "queue not processed");
+    check(test.oi.requests() == OI_QUEUE_SIZE, test.name, "not every command sent");
+}
+
+void testTransport()
+{
+    testWakeAndQuery();
+    testFragmentedResponse();
+    testMissingResponse();
+    testQueryWhileStreaming();
+    testFullQueue();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// STREAM PARSER
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+typedef std::vector<uint8_t> Bytes;
+
+// A frame of the recording: where it is and its packets (id, data, ...)
+struct RecordedFrame
+{
+    size_t offset;
+    size_t length;
+    Bytes packets;
+};
+
+bool readFile(const char *path, Bytes &data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    uint8_t buff[4096];
+    size_t length;
+    while ((length = fread(buff, 1, sizeof(buff), file)) > 0)
+    {
+        data.insert(data.end(), buff, buff + length);
+    }
+    fclose(file);
+    return true;
+}
+
+// The received bytes of a trace, in order, and the packets of its last
+// stream request (empty if the trace doesn't contain one)
+bool traceStream(const Bytes &trace, Bytes &stream, Bytes &packets)
+{
+    OITraceReader reader(trace.data(), trace.size());
+    if (!reader.valid())
+    {
+        return false;
+    }
+    OITraceRecord record;
+    while (reader.next(record))
+    {
+        if (record.type == OITrace::RX)
+        {
+            stream.insert(stream.end(), record.data, record.data + record.length);
+        }
+        else if (record.type == OITrace::TX && record.length >= 2 && record.data[0] == 148 && record.length == 2u + record.data[1])
+        {
+            packets.assign(record.data + 2, record.data + record.length);
+        }
+    }
+    return !reader.error();
+}
+
+// Frames of the firmware's packet set with random values, starting in the
+// middle of a frame like a recording does
+Bytes syntheticStream(unsigned long frames, std::mt19937 &random)
+{
+    Bytes stream = {0x42, 0x00, 0x13};
+    for (unsigned long i = 0; i < frames; i++)
+    {
+        Bytes frame = {OI_STREAM_HEADER, 0};
+        for (uint8_t id : TEST_STREAM_PACKETS)
+        {
+            frame.push_back(id);
+            for (uint8_t j = 0; j < oiPacketSize(id); j++)
+            {
+                frame.push_back((uint8_t)random());
+            }
+        }
+        frame[1] = frame.size() - 2;
+        uint8_t checksum = 0;
+        for (uint8_t byte : frame)
+        {
+            checksum += byte;
+        }
+        frame.push_back(-checksum);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    return stream;
+}
+
+// Reference scan, independent of the parser: a frame is a header, a length,
+// single packets in a valid layout (exactly the expected ones, if any) and a
+// zero checksum, everything else is skipped
+std::vector<RecordedFrame> scanFrames(const Bytes &stream, const Bytes &expected)
+{
+    std::vector<RecordedFrame> frames;
+    size_t i = 0;
+    while (i + 2 < stream.size())
+    {
+        size_t length = stream[i + 1] + 3;
+        bool valid = stream[i] == OI_STREAM_HEADER && stream[i + 1] > 0 && length <= OI_STREAM_FRAME_MAX && i + length <= stream.size();
+        uint8_t checksum = 0;
+        for (size_t j = 0; valid && j < length; j++)
+        {
+            checksum += stream[i + j];
+        }
+        size_t j = i + 2;
+        size_t count = 0;
+        while (valid && j < i + length - 1)
+        {
+            uint8_t id = stream[j];
+            valid = oiIsPacket(id) && (expected.empty() || (count < expected.size() && expected[count] == id));
+            uint8_t size = valid ? oiPacketSize(id) : 0;
+            valid = valid && j + 1 + size <= i + length - 1;
+            j += 1 + size;
+            count++;
+        }
+        valid = valid && (expected.empty() || count == expected.size());
+        if (!valid || checksum != 0)
+        {
+            i++;
+            continue;
+        }
+        frames.push_back({i, length, Bytes(stream.begin() + i + 2, stream.begin() + i + length - 1)});
+        i += length;
+    }
+    return frames;
+}
+
+// What the parser delivers for a stream fed in chunks of 1..maxChunk bytes
+struct ParsedStream
+{
+    std::vector<Bytes> frames;
+    unsigned long checksumErrors = 0;
+    unsigned long frameErrors = 0;
+    unsigned long foreignPackets = 0; // groups, unknown or not expected packets passed to the callback
+};
+
+ParsedStream parseStream(const Bytes &stream, const Bytes &expected, size_t maxChunk, std::mt19937 &random)
+{
+    ParsedStream parsed;
+    Bytes packets;
+    OIStreamParser parser;
+    parser.expect(expected.data(), expected.size());
+    parser.onPacket([&](uint8_t id, const uint8_t *data, uint8_t length)
+                    {
+        bool foreign = !oiIsPacket(id) || length != oiPacketSize(id);
+        foreign = foreign || (!expected.empty() && std::find(expected.begin(), expected.end(), id) == expected.end());
+        parsed.foreignPackets += foreign;
+        packets.push_back(id);
+        packets.insert(packets.end(), data, data + length); });
+    parser.onFrame([&]
+                   {
+        parsed.frames.push_back(packets);
+        packets.clear(); });
+
+    size_t i = 0;
+    while (i < stream.size())
+    {
+        size_t chunk = 1 + random() % maxChunk;
+        chunk = chunk < stream.size() - i ? chunk : stream.size() - i;
+        if (chunk == 1)
+        {
+            parser.feed(stream[i]);
+        }
+        else
+        {
+            parser.feed(stream.data() + i, chunk);
+        }
+        i += chunk;
+    }
+    parsed.checksumErrors = parser.checksumErrors();
+    parsed.frameErrors = parser.frameErrors();
+    return parsed;
+}
+
+void testCleanStream(const Bytes &stream, const Bytes &expected, const std::vector<RecordedFrame> &frames)
+{
+    const char *name = "stream clean";
+    std::mt19937 random(2);
+    const size_t chunks[] = {1, 7, 64, 4096};
+    for (size_t maxChunk : chunks)
+    {
+        ParsedStream parsed = parseStream(stream, expected, maxChunk, random);
+        bool same = parsed.frames.size() == frames.size();
+        for (size_t i = 0; same && i < frames.size(); i++)
+        {
+            same = parsed.frames[i] == frames[i].packets;
+        }
+        check(same, name, "frames differ from the reference scan");
+    }
+}
+
+// A frame with a valid checksum which must never pass: a group packet, as a
+// corrupted packet id of the stream may be (e.g. 3 or 100), or the packets
+// of a stream frame in another order
+Bytes forgeFrame(const Bytes &packets, const Bytes &expected, std::mt19937 &random, Bytes &payload)
+{
+    int kind = random() % 3;
+    payload.clear();
+    if (kind == 2 && !expected.empty())
+    {
+        uint8_t first = 1 + oiPacketSize(packets[0]);
+        payload.assign(packets.begin() + first, packets.end());
+        payload.insert(payload.end(), packets.begin(), packets.begin() + first);
+    }
+    else
+    {
+        uint8_t group = kind == 1 ? 100 : 3;
+        payload.push_back(group);
+        for (uint8_t i = 0; i < oiPacketSize(group); i++)
+        {
+            payload.push_back((uint8_t)random());
+        }
+    }
+
+    Bytes frame = {OI_STREAM_HEADER, (uint8_t)payload.size()};
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    uint8_t checksum = 0;
+    for (uint8_t byte : frame)
+    {
+        checksum += byte;
+    }
+    frame.push_back(-checksum);
+    return frame;
+}
+
+// Flips, drops and inserts bytes in the first 90% of the recording and puts
+// forged frames between the recorded ones. The frames hit by a fault are
+// marked.
+Bytes corruptStream(const Bytes &stream, const Bytes &expected, const std::vector<RecordedFrame> &frames, std::vector<bool> &touched,
+                    std::vector<Bytes> &forged, std::mt19937 &random)
+{
+    std::uniform_real_distribution<double> chance(0, 1);
+    Bytes corrupted;
+    size_t frame = 0;
+    size_t end = stream.size() * 9 / 10;
+    touched.assign(frames.size(), false);
+    for (size_t i = 0; i < stream.size(); i++)
+    {
+        while (frame < frames.size() && frames[frame].offset + frames[frame].length <= i)
+        {
+            frame++;
+        }
+        if (i < end && frame < frames.size() && frames[frame].offset == i && chance(random) < TEST_FORGE_RATE)
+        {
+            Bytes payload;
+            Bytes frameBytes = forgeFrame(frames[frame].packets, expected, random, payload);
+            corrupted.insert(corrupted.end(), frameBytes.begin(), frameBytes.end());
+            forged.push_back(payload);
+        }
+        if (i >= end || chance(random) >= TEST_CORRUPT_RATE)
+        {
+            corrupted.push_back(stream[i]);
+            continue;
+        }
+        if (frame < frames.size() && frames[frame].offset <= i)
+        {
+            touched[frame] = true;
+        }
+        switch (random() % 3)
+        {
+        case 0:
+            corrupted.push_back(stream[i] ^ (1 << random() % 8));
+            break;
+        case 1:
+            break; // dropped
+        default:
+            corrupted.push_back((uint8_t)random());
+            corrupted.push_back(stream[i]);
+            break;
+        }
+    }
+    return corrupted;
+}
+
+void testCorruptedStream(const Bytes &stream, const Bytes &expected, const std::vector<RecordedFrame> &frames)
+{
+    const char *name = "stream corrupted";
+    std::mt19937 random(3);
+    unsigned long untouched = 0;
+    unsigned long untouchedLost = 0;
+    unsigned long touched = 0;
+    unsigned long accepted = 0; // corrupted frames which passed
+    unsigned long tailLost = 0;
+    unsigned long errors = 0;
+    unsigned long forgedFrames = 0;
+    unsigned long forgedAccepted = 0;
+    unsigned long foreignPackets = 0;
+    size_t tail = frames.size() - 1;
+    while (tail > 0 && frames[tail - 1].offset >= stream.size() * 9 / 10)
+    {
+        tail--;
+    }
+    tail += 2; // the first frames after the last fault may still be part of a resync
+
+    for (int run = 0; run < TEST_CORRUPT_RUNS; run++)
+    {
+        std::vector<bool> hit;
+        std::vector<Bytes> forged;
+        Bytes corrupted = corruptStream(stream, expected, frames, hit, forged, random);
+        ParsedStream parsed = parseStream(corrupted, expected, 64, random);
+        errors += parsed.checksumErrors + parsed.frameErrors;
+        forgedFrames += forged.size();
+        foreignPackets += parsed.foreignPackets;
+
+        // Match the delivered frames in order, a frame which is no recorded
+        // frame close to the expected position is a corrupted one
+        std::vector<bool> received(frames.size(), false);
+        size_t next = 0;
+        for (const Bytes &packets : parsed.frames)
+        {
+            size_t match = next;
+            while (match < frames.size() && match < next + 8 && frames[match].packets != packets)
+            {
+                match++;
+            }
+            if (match < frames.size() && match < next + 8)
+            {
+                received[match] = true;
+                next = match + 1;
+            }
+            else
+            {
+                accepted++;
+                forgedAccepted += std::find(forged.begin(), forged.end(), packets) != forged.end();
+            }
+        }
+
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            touched += hit[i];
+            untouched += !hit[i];
+            untouchedLost += !hit[i] && !received[i];
+            tailLost += i >= tail && !received[i];
+        }
+    }
+
+    printf("Corrupted stream: %d runs, %lu untouched frames (%lu lost), %lu touched frames (%lu accepted), %lu forged frames (%lu accepted), %lu parser errors\n",
+           TEST_CORRUPT_RUNS, untouched, untouchedLost, touched, accepted - forgedAccepted, forgedFrames, forgedAccepted, errors);
+    check(touched > 0 && errors > 0, name, "no corruption detected");
+    check(untouchedLost * 100 <= untouched, name, "more than 1% of the untouched frames lost");
+    check((accepted - forgedAccepted) * 20 <= touched, name, "more than 5% of the corrupted frames accepted");
+    check(forgedFrames > 0 && forgedAccepted == 0, name, "forged frame accepted");
+    check(foreignPackets == 0, name, "group or unexpected packet passed to the callback");
+    check(tailLost == 0, name, "not in sync after the last fault");
+}
+
+// Single frames around the length checks
+void testFrameLengths()
+{
+    const char *name = "stream frame lengths";
+    OIStreamParser parser;
+    unsigned long packets = 0;
+    parser.onPacket([&](uint8_t id, const uint8_t *data, uint8_t length)
+                    { packets++; });
+
+    const uint8_t empty[] = {OI_STREAM_HEADER, 0, (uint8_t)-OI_STREAM_HEADER};
+    parser.feed(empty, sizeof(empty));
+    check(parser.frameErrors() == 1 && parser.frames() == 0, name, "empty frame accepted");
+
+    const uint8_t tooLong[] = {OI_STREAM_HEADER, OI_STREAM_FRAME_MAX - 2};
+    parser.feed(tooLong, sizeof(tooLong));
+    check(parser.frameErrors() == 2, name, "frame longer than the buffer accepted");
+
+    // Checksum right, but packet 7 needs 1 data byte and has 2
+    const uint8_t layout[] = {OI_STREAM_HEADER, 3, 7, 1, 2, (uint8_t)-(OI_STREAM_HEADER + 3 + 7 + 1 + 2)};
+    parser.feed(layout, sizeof(layout));
+    check(parser.frameErrors() == 3 && packets == 0, name, "wrong packet layout accepted");
+
+    // Unknown packet 200
+    const uint8_t unknown[] = {OI_STREAM_HEADER, 2, 200, 1, (uint8_t)-(OI_STREAM_HEADER + 2 + 200 + 1)};
+    parser.feed(unknown, sizeof(unknown));
+    check(parser.frameErrors() == 4 && packets == 0, name, "unknown packet accepted");
+
+    // Group 3 with its 10 bytes, the callbacks only decode single packets
+    uint8_t group[] = {OI_STREAM_HEADER, 11, 3, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0};
+    for (size_t i = 0; i + 1 < sizeof(group); i++)
+    {
+        group[sizeof(group) - 1] -= group[i];
+    }
+    parser.feed(group, sizeof(group));
+    check(parser.frameErrors() == 5 && packets == 0, name, "group packet accepted");
+
+    // With the packets of the stream request: exactly these, in this order
+    const uint8_t expected[] = {7, 8};
+    check(parser.expect(expected, sizeof(expected)), name, "expected packets not set");
+    const uint8_t valid[] = {OI_STREAM_HEADER, 4, 7, 1, 8, 0, (uint8_t)-(OI_STREAM_HEADER + 4 + 7 + 1 + 8)};
+    parser.feed(valid, sizeof(valid));
+    check(parser.frames() == 1 && packets == 2, name, "expected packets rejected");
+    const uint8_t swapped[] = {OI_STREAM_HEADER, 4, 8, 0, 7, 1, (uint8_t)-(OI_STREAM_HEADER + 4 + 8 + 7 + 1)};
+    parser.feed(swapped, sizeof(swapped));
+    check(parser.frameErrors() == 6 && packets == 2, name, "packets in another order accepted");
+    const uint8_t missing[] = {OI_STREAM_HEADER, 2, 7, 1, (uint8_t)-(OI_STREAM_HEADER + 2 + 7 + 1)};
+    parser.feed(missing, sizeof(missing));
+    check(parser.frameErrors() == 7 && packets == 2, name, "frame with a missing packet accepted");
+    const uint8_t extra[] = {OI_STREAM_HEADER, 6, 7, 1, 8, 0, 9, 0, (uint8_t)-(OI_STREAM_HEADER + 6 + 7 + 1 + 8 + 9)};
+    parser.feed(extra, sizeof(extra));
+    check(parser.frameErrors() == 8 && packets == 2, name, "frame with an extra packet accepted");
+    const uint8_t tooMany[OI_STREAM_PACKETS_MAX + 1] = {};
+    check(!parser.expect(tooMany, sizeof(tooMany)) && parser.frames() == 1, name, "too many expected packets accepted");
+
+    // The largest frame, split at every position
+    Bytes frame = {OI_STREAM_HEADER, 0};
+    while (frame.size() + 3 <= OI_STREAM_FRAME_MAX - 1)
+    {
+        frame.push_back(22); // voltage, 2 bytes
+        frame.push_back(0x3A);
+        frame.push_back(0x98);
+    }
+    frame[1] = frame.size() - 2;
+    uint8_t checksum = 0;
+    for (uint8_t byte : frame)
+    {
+        checksum += byte;
+    }
+    frame.push_back(-checksum);
+    for (size_t split = 0; split <= frame.size(); split++)
+    {
+        OIStreamParser splitParser;
+        splitParser.feed(frame.data(), split);
+        splitParser.feed(frame.data() + split, frame.size() - split);
+        check(splitParser.frames() == 1 && splitParser.droppedBytes() == 0, name, "split frame lost");
+    }
+}
+
+void testStream(const char *tracePath)
+{
+    Bytes stream;
+    Bytes expected(TEST_STREAM_PACKETS, TEST_STREAM_PACKETS + sizeof(TEST_STREAM_PACKETS));
+    if (tracePath != nullptr)
+    {
+        Bytes trace;
+        expected.clear();
+        if (!readFile(tracePath, trace) || !traceStream(trace, stream, expected))
+        {
+            fprintf(stderr, "%s: no valid trace\n", tracePath);
+            exit(2);
+        }
+    }
+    else
+    {
+        std::mt19937 random(1);
+        stream = syntheticStream(TEST_STREAM_FRAMES, random);
+    }
+
+    std::vector<RecordedFrame> frames = scanFrames(stream, expected);
+    printf("Stream: %zu bytes, %zu frames of %zu packets\n", stream.size(), frames.size(), expected.size());
+    check(frames.size() >= 20, "stream", "fewer than 20 frames in the recording");
+    if (frames.size() >= 20)
+    {
+        testCleanStream(stream, expected, frames);
+        testCorruptedStream(stream, expected, frames);
+    }
+    testFrameLengths();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// PACKET TABLE
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// Packets and groups of the Roomba 600 OI spec, independent of OI_PACKETS
+struct SpecPackets
+{
+    uint8_t first;
+    uint8_t last;
+    uint8_t size;
+    bool isSigned;
+};
+
+const SpecPackets SPEC_PACKETS[] = {
+    {7, 18, 1, false},
+    {19, 20, 2, true},
+    {21, 21, 1, false},
+    {22, 22, 2, false},
+    {23, 23, 2, true},
+    {24, 24, 1, true},
+    {25, 31, 2, false},
+    {32, 32, 1, false},
+    {33, 33, 2, false},
+    {34, 38, 1, false},
+    {39, 42, 2, true},
+    {43, 44, 2, false},
+    {45, 45, 1, false},
+    {46, 51, 2, false},
+    {52, 53, 1, false},
+    {54, 57, 2, true},
+    {58, 58, 1, false},
+};
+
+struct SpecGroup
+{
+    uint8_t id;
+    uint8_t size;
+    uint8_t first;
+    uint8_t last;
+};
+
+const SpecGroup SPEC_GROUPS[] = {
+    {0, 26, 7, 26},
+    {1, 10, 7, 16},
+    {2, 6, 17, 20},
+    {3, 10, 21, 26},
+    {4, 14, 27, 34},
+    {5, 12, 35, 42},
+    {6, 52, 7, 42},
+    {100, 80, 7, 58},
+    {101, 28, 43, 58},
+    {106, 12, 46, 51},
+    {107, 9, 54, 58},
+};
+
+const SpecPackets *specPacket(uint8_t id)
+{
+    for (const SpecPackets &packets : SPEC_PACKETS)
+    {
+        if (id >= packets.first && id <= packets.last)
+        {
+            return &packets;
+        }
+    }
+    return nullptr;
+}
+
+// A value which needs every byte and, if signed, is negative
+int32_t specValue(uint8_t id)
+{
+    const SpecPackets *spec = specPacket(id);
+    if (spec->size == 1)
+    {
+        return spec->isSigned ? -(int32_t)id : 200 + id % 50;
+    }
+    return spec->isSigned ? -100 * id - 7 : 0xF000 + id;
+}
+
+void testPacketTable()
+{
+    const char *name = "packets table";
+    for (uint8_t id = OI_PACKET_FIRST; id <= OI_PACKET_LAST; id++)
+    {
+        const SpecPackets *spec = specPacket(id);
+        check(spec != nullptr && oiIsPacket(id), name, "packet missing");
+        check(oiPacket(id).id == id, name, "packet at the wrong row");
+        check(oiPacketSize(id) == spec->size, name, "packet size differs from the spec");
+        check(oiPacket(id).isSigned == spec->isSigned, name, "signedness differs from the spec");
+        check(oiPacket(id).name[0] != '\0', name, "packet without JSON key");
+        for (uint8_t other = OI_PACKET_FIRST; other < id; other++)
+        {
+            check(strcmp(oiPacket(id).name, oiPacket(other).name) != 0, name, "JSON key used twice");
+        }
+    }
+    const uint8_t unknown[] = {59, 60, 99, 102, 105, 108, 255};
+    for (uint8_t id : unknown)
+    {
+        check(oiPacketSize(id) == 0, name, "size of an unknown packet");
+    }
+}
+
+void testGroupLayouts()
+{
+    const char *name = "packets group layout";
+    for (const SpecGroup &spec : SPEC_GROUPS)
+    {
+        const OIGroupInfo *group = oiGroup(spec.id);
+        check(group != nullptr, name, "group missing");
+        if (group == nullptr)
+        {
+            continue;
+        }
+        check(group->first == spec.first && group->last == spec.last, name, "group packets differ from the spec");
+        check(oiPacketSize(spec.id) == spec.size, name, "group size differs from the spec");
+        uint8_t offset = 0;
+        for (uint8_t id = spec.first; id <= spec.last; id++)
+        {
+            check(oiGroupContains(*group, id), name, "packet not in its group");
+            check(oiGroupOffset(*group, id) == offset, name, "packet offset differs from the spec");
+            offset += specPacket(id)->size;
+        }
+        check(offset == spec.size, name, "spec sizes don't add up");
+    }
+}
+
+// Group 100 built from values at the spec offsets, decoded by the table
+void testGroupDecode()
+{
+    const char *name = "packets group 100 decode";
+    uint8_t data[80];
+    uint8_t offset = 0;
+    for (uint8_t id = OI_PACKET_FIRST; id <= OI_PACKET_LAST; id++)
+    {
+        int32_t value = specValue(id);
+        if (specPacket(id)->size == 1)
+        {
+            data[offset++] = (uint8_t)value;
+        }
+        else
+        {
+            data[offset++] = (uint8_t)(value >> 8);
+            data[offset++] = (uint8_t)value;
+        }
+    }
+
+    int32_t values[OI_PACKET_COUNT];
+    check(oiDecodeGroup(*oiGroup(100), data, values) == OI_PACKET_COUNT, name, "not every packet decoded");
+    for (uint8_t id = OI_PACKET_FIRST; id <= OI_PACKET_LAST; id++)
+    {
+        check(values[id - OI_PACKET_FIRST] == specValue(id), name, "decoded value differs");
+        check(oiPacketValue(id, data + oiGroupOffset(*oiGroup(100), id)) == specValue(id), name, "value at the group offset differs");
+    }
+
+    // Typed decoders at compile time offsets
+    check(oiDecode<100, OI_PACKET_VOLTAGE>(data) == specValue(OI_PACKET_VOLTAGE), name, "typed voltage");
+    check(oiDecode<100, OI_PACKET_CURRENT>(data) == specValue(OI_PACKET_CURRENT), name, "typed current");
+    check(oiDecode<100, OI_PACKET_TEMPERATURE>(data) == specValue(OI_PACKET_TEMPERATURE), name, "typed temperature");
+    check(oiDecode<100, OI_PACKET_LEFT_ENCODER>(data) == specValue(OI_PACKET_LEFT_ENCODER), name, "typed encoder");
+    check(oiDecode<100, OI_PACKET_STASIS>(data) == specValue(OI_PACKET_STASIS), name, "typed stasis");
+    check(oiDecode<3, OI_PACKET_VOLTAGE>(data + oiGroupOffset(*oiGroup(100), OI_PACKET_CHARGING_STATE)) == specValue(OI_PACKET_VOLTAGE), name, "typed voltage in group 3");
+}
+
+void testPackets()
+{
+    testPacketTable();
+    testGroupLayouts();
+    testGroupDecode();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// BYTE RING
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// Same pseudo random bytes on both sides, a lost, doubled or reordered byte
+// shifts the sequence
+struct RingSequence
+{
+    uint32_t state = 1;
+
+    uint8_t next()
+    {
+        state = state * 1103515245 + 12345;
+        return state >> 16;
+    }
+};
+
+template <size_t SIZE>
+void testRing(const char *name)
+{
+    static ByteRing<SIZE> ring;
+    unsigned long mismatches = 0;
+    unsigned long received = 0;
+    size_t maxAvailable = 0;
+
+    // Producer, like the UART RX path: in place by span or copied by push()
+    std::thread producer([&]
+                         {
+        RingSequence sequence;
+        std::mt19937 random(4);
+        uint8_t chunk[SIZE];
+        unsigned long sent = 0;
+        while (sent < TEST_RING_BYTES)
+        {
+            size_t length = 1 + random() % SIZE;
+            length = length < TEST_RING_BYTES - sent ? length : TEST_RING_BYTES - sent;
+            if (random() % 2)
+            {
+                uint8_t *span;
+                size_t free = ring.writeSpan(span);
+                length = length < free ? length : free;
+                for (size_t i = 0; i < length; i++)
+                {
+                    span[i] = sequence.next();
+                }
+                ring.commit(length);
+            }
+            else
+            {
+                for (size_t i = 0; i < length; i++)
+                {
+                    chunk[i] = sequence.next();
+                }
+                size_t left = ring.push(chunk, length);
+                while (left > 0)
+                {
+                    std::this_thread::yield();
+                    left = ring.push(chunk + length - left, left);
+                }
+            }
+            if (length == 0)
+            {
+                std::this_thread::yield();
+            }
+            sent += length;
+        } });
+
+    // Consumer, like the OI parsers: in place by span and peek() or copied by read()
+    RingSequence sequence;
+    std::mt19937 random(5);
+    uint8_t chunk[SIZE];
+    while (received < TEST_RING_BYTES)
+    {
+        size_t available = ring.available();
+        maxAvailable = available > maxAvailable ? available : maxAvailable;
+        if (available == 0)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        switch (random() % 3)
+        {
+        case 0:
+        {
+            const uint8_t *span;
+            size_t length = ring.readSpan(span);
+            for (size_t i = 0; i < length; i++)
+            {
+                mismatches += span[i] != sequence.next();
+            }
+            ring.consume(length);
+            received += length;
+            break;
+        }
+        case 1:
+        {
+            size_t length = 1 + random() % available;
+            for (size_t i = 0; i < length; i++)
+            {
+                mismatches += ring.peek(i) != sequence.next();
+            }
+            ring.consume(length);
+            received += length;
+            break;
+        }
+        default:
+        {
+            size_t length = ring.read(chunk, 1 + random() % SIZE);
+            for (size_t i = 0; i < length; i++)
+            {
+                mismatches += chunk[i] != sequence.next();
+            }
+            received += length;
+            break;
+        }
+        }
+    }
+    producer.join();
+
+    printf("Ring %zu: %lu bytes, %lu mismatches, max. fill %zu, high water %zu\n", SIZE, received, mismatches, maxAvailable, ring.highWater());
+    check(mismatches == 0, name, "bytes lost, doubled or out of order");
+    check(received == TEST_RING_BYTES && ring.available() == 0, name, "byte count differs");
+    check(maxAvailable <= SIZE && ring.highWater() <= SIZE, name, "fill level beyond the ring size");
+}
+
+void testRings()
+{
+    testRing<16>("ring 16");
+    testRing<OI_RX_RING_SIZE>("ring OI_RX_RING_SIZE");
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// CHANGE DETECTION
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+void testDeadband()
+{
+    const char *name = "change deadband";
+    const ChangeField fields[] = {{"voltage", 50}, {"cleaning", 0}};
+    ChangeDetector changes(fields, 2);
+
+    changes.set(0, 16000);
+    changes.sample(0);
+    check(changes.significant(), name, "first values not significant");
+    changes.published();
+    check(!changes.significant() && changes.trigger() < 0, name, "published values still significant");
+
+    // A drift adds up against the published value, not the previous sample
+    for (int32_t voltage = 15990; voltage > 15950; voltage -= 10)
+    {
+        changes.set(0, voltage);
+        changes.sample(0);
+        check(!changes.significant(), name, "change inside the deadband significant");
+    }
+    changes.set(0, 15950);
+    check(changes.trigger() == 0, name, "drift to the deadband not significant");
+    changes.published();
+
+    // Hovering around 15925 stays quiet, the reference only moves on a publish
+    for (int i = 0; i < 100; i++)
+    {
+        changes.set(0, 15925 + (i % 2 ? 20 : -20));
+        changes.sample(0);
+        check(!changes.significant(), name, "value around a threshold significant");
+    }
+    check(changes.suppressed() >= 100, name, "suppressed samples not counted");
+
+    // A deadband of 0 triggers on every change
+    changes.set(1, 1);
+    check(changes.trigger() == 1 && strcmp(changes.name(1), "cleaning") == 0, name, "edge of a flag not significant");
+}
+
+void testSmoothing()
+{
+    const char *name = "change smoothing";
+    const ChangeField fields[] = {{"battery_ma", 100, 10000}}; // as the firmware
+    ChangeDetector changes(fields, 1);
+    std::mt19937 random(6);
+    std::normal_distribution<double> noise(0, 80);
+
+    unsigned long ms = 0;
+    unsigned long publishes = 0;
+    unsigned long stepPublish = 0;
+    for (; ms < 10 * 60000UL; ms += 15)
+    {
+        changes.set(0, lround(-1200 + noise(random)));
+        changes.sample(ms);
+        if (changes.significant())
+        {
+            publishes++;
+            changes.published();
+        }
+    }
+    check(publishes == 1, name, "noise of a cleaning Roomba significant");
+
+    // Stops cleaning: -1200 -> -180 mA
+    unsigned long step = ms;
+    for (; ms < step + 5000 && stepPublish == 0; ms += 15)
+    {
+        changes.set(0, lround(-180 + noise(random) / 16));
+        changes.sample(ms);
+        if (changes.significant())
+        {
+            stepPublish = ms;
+        }
+    }
+    printf("Change: %lu publishes in 10 min of noise, step published after %lums\n", publishes, stepPublish - step);
+    check(stepPublish != 0 && stepPublish - step <= 1000, name, "step not significant within 1s");
+
+    // Sparse samples (polling) are nearly the value itself
+    ChangeDetector polled(fields, 1);
+    polled.set(0, -1200);
+    polled.sample(0);
+    polled.published();
+    polled.set(0, -1000);
+    polled.sample(60000);
+    check(polled.trigger() == 0, name, "change after a minute not significant");
+}
+
+void testChanges()
+{
+    testDeadband();
+    testSmoothing();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// CLEAN SCHEDULE
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// Brute force: the rule has a slot in this minute
+bool ruleAt(const ScheduleRule &rule, uint32_t minute)
+{
+    uint32_t day = minute / 1440;
+    bool used = (rule.days & 0x7F) != 0 && rule.action != (uint8_t)CleanScheduler::Action::NONE;
+    return used && (rule.days & (1 << (day + 4) % 7)) && minute % 1440 == (uint32_t)rule.hour * 60 + rule.minute;
+}
+
+// Rules with shared times now and then, so several rules fall into a minute
+ScheduleRule randomRule(std::mt19937 &random)
+{
+    static const uint16_t TIMES[] = {0, 9 * 60, 9 * 60 + 5, 23 * 60 + 59};
+    ScheduleRule rule;
+    rule.days = random() % 8 == 0 ? 0 : (random() % 4 == 0 ? 0x7F : 1 + random() % 127);
+    uint16_t time = random() % 2 ? TIMES[random() % 4] : random() % 1440;
+    rule.hour = time / 60;
+    rule.minute = time % 60;
+    rule.action = random() % 10 == 0 ? (uint8_t)CleanScheduler::Action::NONE : 1 + random() % 2;
+    return rule;
+}
+
+// The wheel must fire exactly the minutes a scan of every minute finds, once
+// per minute also when several rules share it, with the time advancing in
+// steps of up to SCHEDULE_MAX_TICKS minutes. Half of the runs change the
+// rules on the way.
+void testScheduleWheel()
+{
+    const char *name = "schedule wheel";
+    std::mt19937 random(21);
+    unsigned long fires = 0;
+    unsigned long wrongFires = 0;
+    unsigned long wrongNext = 0;
+
+    for (int run = 0; run < TEST_SCHEDULE_RUNS; run++)
+    {
+        ScheduleRule rules[SCHEDULE_RULES] = {};
+        uint8_t count = random() % (SCHEDULE_RULES + 1);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            rules[i] = randomRule(random);
+        }
+
+        CleanScheduler scheduler;
+        scheduler.setCatchUp(0);
+        scheduler.setRules(rules, count);
+        std::vector<uint32_t> fired;
+        scheduler.onFire([&](uint8_t rule, CleanScheduler::Action action, uint32_t slot, bool late)
+                         {
+                             if (late || action != (CleanScheduler::Action)rules[rule].action || !ruleAt(rules[rule], slot / 60))
+                             {
+                                 wrongFires++;
+                             }
+                             fired.push_back(slot / 60); });
+
+        uint32_t epoch = TEST_SCHEDULE_DAY + random() % (7 * 86400);
+        uint32_t end = epoch + TEST_SCHEDULE_DAYS * 86400;
+        uint32_t change = run % 2 ? epoch + random() % (TEST_SCHEDULE_DAYS * 86400) : end;
+        std::vector<uint32_t> expected;
+        scheduler.loop(epoch);
+        while (epoch < end)
+        {
+            uint32_t minute = epoch / 60;
+            epoch += 1 + random() % (SCHEDULE_MAX_TICKS * 60);
+            for (uint32_t m = minute + 1; m <= epoch / 60; m++)
+            {
+                for (uint8_t i = 0; i < count; i++)
+                {
+                    if (ruleAt(rules[i], m))
+                    {
+                        expected.push_back(m);
+                        break;
+                    }
+                }
+            }
+            scheduler.loop(epoch);
+
+            if (epoch >= change)
+            {
+                count = random() % (SCHEDULE_RULES + 1);
+                for (uint8_t i = 0; i < count; i++)
+                {
+                    rules[i] = randomRule(random);
+                }
+                scheduler.setRules(rules, count);
+                change = end;
+            }
+
+            // Next slot of any rule, a day after the other
+            uint32_t next = 0;
+            for (uint32_t m = (epoch / 60 / 1440) * 1440; m <= epoch / 60 + 8 * 1440 && next == 0; m += 1440)
+            {
+                for (uint8_t i = 0; i < count; i++)
+                {
+                    uint32_t slot = m + rules[i].hour * 60 + rules[i].minute;
+                    if (ruleAt(rules[i], slot) && slot > epoch / 60 && (next == 0 || slot < next))
+                    {
+                        next = slot;
+                    }
+                }
+            }
+            if (scheduler.next() != next * 60)
+            {
+                wrongNext++;
+            }
+        }
+        check(fired == expected, name, "fired minutes differ from the scan");
+        check(scheduler.jumps() == 0, name, "steps counted as jumps");
+        fires += fired.size();
+    }
+    printf("Schedule: %lu slots fired in %d runs of %lu days\n", fires, TEST_SCHEDULE_RUNS, (unsigned long)TEST_SCHEDULE_DAYS);
+    check(wrongFires == 0, name, "fired a slot late, with another action or of another rule");
+    check(wrongNext == 0, name, "next() differs from the scan");
+}
+
+void testScheduleText()
+{
+    const char *name = "schedule text";
+    struct Case
+    {
+        const char *text;
+        bool valid;
+        const char *formatted; // nullptr = same as the text
+    };
+    const Case cases[] = {
+        {"0 9 * * 1-5 clean", true, nullptr},
+        {"30 7 * * 0,6 dock", true, nullptr},
+        {"0 0 * * * clean", true, nullptr},
+        {"59 23 * * 0,2,4-6 clean", true, nullptr},
+        {"5 1 * * 7 dock", true, "5 1 * * 0 dock"},
+        {"5 1 * * 0-7 dock", true, "5 1 * * * dock"},
+        {"  15  8 *\t* 3 clean  ", true, "15 8 * * 3 clean"},
+        {"", true, ""},
+        {"60 1 * * * clean", false, nullptr},
+        {"1 24 * * * clean", false, nullptr},
+        {"1 1 1 * * clean", false, nullptr},
+        {"1 1 * * 8 clean", false, nullptr},
+        {"1 1 * * 5-3 clean", false, nullptr},
+        {"1 1 * * 1, clean", false, nullptr},
+        {"1 1 * * 1 vacuum", false, nullptr},
+        {"1 1 * * 1 clean x", false, nullptr},
+        {"1 1 * * 1 none", false, nullptr},
+        {"1 1 * * 1", false, nullptr},
+        {"1 1 * *", false, nullptr},
+        {"001 1 * * 1 clean", true, "1 1 * * 1 clean"},
+    };
+    for (const Case &c : cases)
+    {
+        ScheduleRule rule = {0x7F, 1, 1, 1};
+        char text[SCHEDULE_TEXT_SIZE];
+        bool valid = CleanScheduler::parse(c.text, rule);
+        CleanScheduler::format(rule, text, sizeof(text));
+        if (valid != c.valid || (valid && strcmp(text, c.formatted ? c.formatted : c.text) != 0))
+        {
+            printf("  \"%s\": %s, \"%s\"\n", c.text, valid ? "valid" : "invalid", text);
+            check(false, name, "cron text parsed or formatted wrong");
+        }
+        check(valid || (rule.days == 0x7F && rule.hour == 1 && rule.minute == 1), name, "invalid text changed the rule");
+    }
+
+    // Every rule formats to a text which parses to the same rule
+    unsigned long wrong = 0;
+    for (uint16_t days = 1; days < 0x80; days++)
+    {
+        for (uint8_t action = 1; action <= 2; action++)
+        {
+            ScheduleRule rule = {(uint8_t)days, (uint8_t)(days % 24), (uint8_t)(days % 60), action};
+            ScheduleRule parsed;
+            char text[SCHEDULE_TEXT_SIZE];
+            char again[SCHEDULE_TEXT_SIZE];
+            CleanScheduler::format(rule, text, sizeof(text));
+            bool valid = CleanScheduler::parse(text, parsed);
+            CleanScheduler::format(parsed, again, sizeof(again));
+            if (!valid || memcmp(&rule, &parsed, sizeof(rule)) != 0 || strcmp(text, again) != 0)
+            {
+                wrong++;
+            }
+        }
+    }
+    check(wrong == 0, name, "rule changed by format and parse");
+    char text[SCHEDULE_TEXT_SIZE] = "x";
+    ScheduleRule unused = {};
+    check(CleanScheduler::format(unused, text, sizeof(text)) == 0 && text[0] == '\0', name, "unused rule formatted");
+}
+
+// Daily clean rules at minutes of the day, fires collected
+struct ScheduleRun
+{
+    struct Fire
+    {
+        uint8_t rule;
+        uint32_t slot; // minute of the day
+        bool late;
+    };
+
+    CleanScheduler scheduler;
+    std::vector<Fire> fires;
+
+    ScheduleRun(std::initializer_list<uint16_t> times)
+    {
+        ScheduleRule rules[SCHEDULE_RULES] = {};
+        uint8_t count = 0;
+        for (uint16_t time : times)
+        {
+            rules[count++] = {0x7F, (uint8_t)(time / 60), (uint8_t)(time % 60), (uint8_t)CleanScheduler::Action::CLEAN};
+        }
+        scheduler.setRules(rules, count);
+        scheduler.onFire([this](uint8_t rule, CleanScheduler::Action action, uint32_t slot, bool late)
+                         { fires.push_back({rule, (slot - TEST_SCHEDULE_DAY) / 60, late}); });
+    }
+
+    // Seconds since TEST_SCHEDULE_DAY
+    void at(uint32_t second)
+    {
+        scheduler.loop(TEST_SCHEDULE_DAY + second);
+    }
+
+    // In steps of 30s up to the second
+    void run(uint32_t from, uint32_t to)
+    {
+        for (uint32_t second = from; second <= to; second += 30)
+        {
+            at(second);
+        }
+    }
+};
+
+void testScheduleCatchUp()
+{
+    const char *name = "schedule catch-up";
+    const uint32_t hour = 3600; // s
+    const uint32_t minute = 60;
+
+    ScheduleRun unsynced({9 * 60});
+    unsynced.scheduler.loop(9 * hour + 30 * minute); // 1970, before the first NTP update
+    check(!unsynced.scheduler.running() && unsynced.fires.empty(), name, "ran before the time was synced");
+
+    ScheduleRun boot({9 * 60});
+    boot.at(9 * hour + 30 * minute);
+    check(boot.fires.size() == 1 && boot.fires[0].slot == 9 * 60 && boot.fires[0].late, name, "missed slot not run late after a boot");
+    check(boot.scheduler.jumps() == 0, name, "boot counted as a jump");
+    boot.run(9 * hour + 31 * minute, 23 * hour);
+    check(boot.fires.size() == 1, name, "slot run again after the catch-up");
+
+    ScheduleRun onTime({9 * 60});
+    onTime.at(9 * hour + 30);
+    check(onTime.fires.size() == 1 && !onTime.fires[0].late, name, "boot in the slot's minute marked late");
+
+    ScheduleRun tooLate({9 * 60});
+    tooLate.at(10 * hour + 30 * minute);
+    check(tooLate.fires.empty(), name, "slot outside the catch-up window run");
+
+    ScheduleRun disabled({9 * 60});
+    disabled.scheduler.setCatchUp(0);
+    disabled.at(9 * hour + 1 * minute);
+    check(disabled.fires.empty(), name, "caught up with a catch-up of 0");
+
+    // NTP corrects the running clock forward: only the latest missed slot
+    ScheduleRun jump({9 * 60, 9 * 60 + 10});
+    jump.run(7 * hour, 8 * hour);
+    jump.at(9 * hour + 20 * minute);
+    check(jump.fires.size() == 1 && jump.fires[0].slot == 9 * 60 + 10 && jump.fires[0].late, name, "NTP jump did not run the latest missed slot once");
+    check(jump.scheduler.jumps() == 1, name, "NTP jump not counted");
+    jump.run(9 * hour + 20 * minute, 10 * hour);
+    check(jump.fires.size() == 1, name, "slot run again after the jump");
+
+    // A step of SCHEDULE_MAX_TICKS minutes is ticked through, no jump
+    ScheduleRun step({9 * 60});
+    step.at(8 * hour + 57 * minute);
+    step.at(9 * hour + 2 * minute);
+    check(step.fires.size() == 1 && !step.fires[0].late && step.scheduler.jumps() == 0, name, "slot within a step not run on time");
+}
+
+void testScheduleBackwards()
+{
+    const char *name = "schedule backwards";
+    const uint32_t hour = 3600; // s
+    const uint32_t minute = 60;
+
+    ScheduleRun back({9 * 60});
+    back.run(8 * hour + 55 * minute, 9 * hour + 5 * minute);
+    check(back.fires.size() == 1, name, "slot not run");
+
+    // Back before the slot and through it again
+    back.at(8 * hour + 50 * minute);
+    back.run(8 * hour + 50 * minute, 9 * hour + 10 * minute);
+    check(back.fires.size() == 1, name, "slot run twice after the time went back");
+    check(back.scheduler.jumps() == 1, name, "time going back not counted as a jump");
+
+    // Back into the catch-up window of the slot which ran, or back and
+    // forward again by jumps
+    back.at(9 * hour + 10);
+    check(back.fires.size() == 1, name, "slot caught up twice");
+    back.at(8 * hour);
+    back.at(9 * hour + 20 * minute);
+    check(back.fires.size() == 1, name, "slot caught up twice after a jump back and forward");
+
+    // New rules while running don't run the slot again
+    ScheduleRule rules[] = {{0x7F, 9, 0, (uint8_t)CleanScheduler::Action::CLEAN}};
+    back.scheduler.setRules(rules, 1);
+    back.run(9 * hour + 10 * minute, 9 * hour + 20 * minute);
+    check(back.fires.size() == 1, name, "slot run again after new rules");
+
+    // A day back, the slots up to the latest run stay done
+    back.at(9 * hour + 20 * minute - 86400);
+    back.run(9 * hour + 20 * minute - 86400, 9 * hour + 30 * minute);
+    check(back.fires.size() == 1, name, "earlier slot run after the time went back a day");
+
+    // The next day runs again
+    back.run(9 * hour + 30 * minute, 86400 + 9 * hour + 5 * minute);
+    check(back.fires.size() == 2 && back.fires[1].slot == 1440 + 9 * 60 && !back.fires[1].late, name, "slot of the next day not run");
+}
+
+void testSchedule()
+{
+    testScheduleWheel();
+    testScheduleText();
+    testScheduleCatchUp();
+    testScheduleBackwards();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// DEADLINES
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+// millis() is 32 bit on the ESP: the clock of these tests wraps the same
+// way, the scheduler gets it as unsigned long.
+
+// A periodic and a one-shot task through the rollover, 1 ms steps
+void testDeadlineWrap()
+{
+    const char *name = "deadline wrap";
+    DeadlineScheduler scheduler;
+    std::vector<uint32_t> periodicRuns;
+    std::vector<uint32_t> oneShotRuns;
+    uint32_t now = TEST_DEADLINE_START;
+    uint8_t periodic = scheduler.add("periodic", [&]()
+                                     { periodicRuns.push_back(now - TEST_DEADLINE_START); },
+                                     100);
+    uint8_t oneShot = scheduler.add("one-shot", [&]()
+                                    { oneShotRuns.push_back(now - TEST_DEADLINE_START); });
+    scheduler.after(periodic, 100, now);
+    scheduler.after(oneShot, 1500, now); // due 499 ms after the rollover
+
+    unsigned long wrongWakes = 0;
+    for (uint32_t step = 0; step <= 3000; step++, now++)
+    {
+        scheduler.loop(now);
+        uint32_t nextPeriodic = (step / 100 + 1) * 100;
+        uint32_t next = step < 1500 && nextPeriodic > 1500 ? 1500 : nextPeriodic;
+        if (scheduler.nextWake(now) != next - step)
+        {
+            wrongWakes++;
+        }
+    }
+
+    std::vector<uint32_t> expected;
+    for (uint32_t run = 100; run <= 3000; run += 100)
+    {
+        expected.push_back(run);
+    }
+    check(periodicRuns == expected, name, "periodic task not run every period over the rollover");
+    check(oneShotRuns.size() == 1 && oneShotRuns[0] == 1500, name, "one-shot task not run once at its deadline after the rollover");
+    check(!scheduler.armed(oneShot) && scheduler.armed(periodic), name, "tasks armed wrong after their runs");
+    check(wrongWakes == 0, name, "nextWake() wrong around the rollover");
+    check(scheduler.overruns(periodic) == 0 && scheduler.maxLate(periodic) == 0 && scheduler.maxLate(oneShot) == 0, name, "runs on time counted late");
+
+    // A one-shot task due at the last ms before the rollover and at 0
+    DeadlineScheduler edges;
+    unsigned long edgeRuns = 0;
+    uint8_t last = edges.add("last", [&]()
+                             { edgeRuns++; });
+    uint8_t zero = edges.add("zero", [&]()
+                             { edgeRuns++; });
+    edges.after(last, 9, 0xFFFFFFF6);
+    edges.after(zero, 10, 0xFFFFFFF6);
+    edges.loop(0xFFFFFFFE);
+    check(edgeRuns == 0 && edges.nextWake(0xFFFFFFFE) == 1, name, "task run before its deadline at the rollover");
+    edges.loop(0xFFFFFFFF);
+    check(edgeRuns == 1 && edges.nextWake(0xFFFFFFFF) == 1, name, "task due at 0xFFFFFFFF not run");
+    edges.loop(0);
+    check(edgeRuns == 2 && edges.runs(last) == 1 && edges.runs(zero) == 1 && edges.nextWake(0) == DEADLINE_IDLE, name, "task due at 0 not run");
+}
+
+// A stalled loop skips the missed periods and counts an overrun, a loop
+// late by less than a period keeps the phase
+void testDeadlineOverrun()
+{
+    const char *name = "deadline overrun";
+    DeadlineScheduler scheduler;
+    unsigned long runs = 0;
+    uint8_t task = scheduler.add("periodic", [&]()
+                                 { runs++; },
+                                 100);
+    uint32_t now = 0xFFFFFFFF - 150;
+    scheduler.after(task, 100, now); // due at -50
+
+    now += 400; // stalled over the rollover, 300 ms late
+    scheduler.loop(now);
+    check(runs == 1 && scheduler.overruns(task) == 1 && scheduler.maxLate(task) == 300, name, "stall not run once and counted as an overrun");
+    check(scheduler.nextWake(now) == 100, name, "overrun not rescheduled a period after the run");
+    for (uint32_t i = 0; i < 99; i++)
+    {
+        scheduler.loop(++now);
+    }
+    check(runs == 1, name, "burst of runs after a stall");
+
+    now += 51; // 50 ms late, less than a period
+    scheduler.loop(now);
+    check(runs == 2 && scheduler.overruns(task) == 1 && scheduler.nextWake(now) == 50, name, "late run did not keep the phase");
+
+    now += 150; // exactly a period after the deadline
+    scheduler.loop(now);
+    check(runs == 3 && scheduler.overruns(task) == 2 && scheduler.maxLate(task) == 300, name, "whole period late not an overrun");
+}
+
+// Random periodic and self re-arming one-shot tasks against a reference on
+// a clock which doesn't wrap
+void testDeadlineReference()
+{
+    const char *name = "deadline reference";
+    struct Reference
+    {
+        unsigned long period;
+        uint64_t deadline;
+        bool armed;
+        unsigned long runs;
+        unsigned long overruns;
+        unsigned long maxLate;
+    };
+    std::mt19937 random(22);
+    unsigned long runs = 0;
+    unsigned long differences = 0;
+
+    for (int set = 0; set < TEST_DEADLINE_RUNS; set++)
+    {
+        DeadlineScheduler scheduler;
+        Reference reference[DEADLINE_TASKS];
+        std::vector<uint8_t> order;         // tasks as the scheduler ran them
+        std::vector<uint8_t> expectedOrder; // as the reference ran them
+        uint8_t count = 1 + random() % DEADLINE_TASKS;
+        uint64_t clock = TEST_DEADLINE_START - random() % 60000;
+
+        // A one-shot task arms itself again, a delay from its number of runs
+        const auto rearm = [](uint8_t task, unsigned long runs)
+        { return 1 + (task * 37 + runs * 11) % 500; };
+
+        for (uint8_t task = 0; task < count; task++)
+        {
+            unsigned long period = random() % 3 ? 1 + random() % 1000 : 0;
+            scheduler.add("task", [&, task]()
+                          {
+                              order.push_back(task);
+                              if (scheduler.period(task) == 0)
+                              {
+                                  scheduler.after(task, rearm(task, scheduler.runs(task)), (uint32_t)clock);
+                              } },
+                          period);
+            unsigned long delay = random() % 2000;
+            scheduler.after(task, delay, (uint32_t)clock);
+            reference[task] = {period, clock + delay, true, 0, 0, 0};
+        }
+
+        uint64_t end = clock + 120000;
+        while (clock < end)
+        {
+            clock += random() % 50 == 0 ? 500 + random() % 2000 : random() % 30; // now and then a stalled loop
+            scheduler.loop((uint32_t)clock);
+
+            uint64_t next = UINT64_MAX;
+            for (uint8_t task = 0; task < count; task++)
+            {
+                Reference &r = reference[task];
+                if (r.armed && clock >= r.deadline)
+                {
+                    uint64_t late = clock - r.deadline;
+                    r.maxLate = std::max(r.maxLate, (unsigned long)late);
+                    if (r.period > 0 && late >= r.period)
+                    {
+                        r.overruns++;
+                        r.deadline = clock + r.period;
+                    }
+                    else if (r.period > 0)
+                    {
+                        r.deadline += r.period;
+                    }
+                    r.runs++;
+                    if (r.period == 0)
+                    {
+                        r.deadline = clock + rearm(task, r.runs);
+                    }
+                    expectedOrder.push_back(task);
+                }
+                next = std::min(next, r.deadline);
+            }
+            if (scheduler.nextWake((uint32_t)clock) != next - clock)
+            {
+                differences++;
+            }
+        }
+
+        for (uint8_t task = 0; task < count; task++)
+        {
+            const Reference &r = reference[task];
+            if (scheduler.runs(task) != r.runs || scheduler.overruns(task) != r.overruns || scheduler.maxLate(task) != r.maxLate)
+            {
+                differences++;
+            }
+            runs += r.runs;
+        }
+        check(order == expectedOrder, name, "runs differ from the reference");
+    }
+    printf("Deadlines: %lu runs of %d task sets over the rollover\n", runs, TEST_DEADLINE_RUNS);
+    check(differences == 0, name, "runs, overruns, lateness or nextWake() differ from the reference");
+}
+
+void testDeadlines()
+{
+    testDeadlineWrap();
+    testDeadlineOverrun();
+    testDeadlineReference();
+}
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MAIN
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+void usage()
+{
+    fprintf(stderr, "Usage: oitest transport|stream [trace.bin]|packets|ring|change|schedule|deadline|all\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[1], "stream") != 0))
+    {
+        usage();
+    }
+
+    bool all = strcmp(argv[1], "all") == 0;
+    bool known = all;
+    if (all || strcmp(argv[1], "transport") == 0)
+    {
+        testTransport();
+        known = true;
+    }
+    if (all || strcmp(argv[1], "stream") == 0)
+    {
+        testStream(argc == 3 ? argv[2] : nullptr);
+        known = true;
+    }
+    if (all || strcmp(argv[1], "packets") == 0)
+    {
+        testPackets();
+        known = true;
+    }
+    if (all || strcmp(argv[1], "ring") == 0)
+    {
+        testRings();
+        known = true;
+    }
+    if (all || strcmp(argv[1], "change") == 0)
+    {
+        testChanges();
+        known = true;
+    }
+    if (all || strcmp(argv[1], "schedule") == 0)
+    {
+        testSchedule();
+        known = true;
+    }
+    if (all || strcmp(argv[1], "deadline") == 0)
+    {
+        testDeadlines();
+        known = true;
+    }
+    if (!known)
+    {
+        usage();
+    }
+
+    printf("%lu checks, %lu failed\n", checks, failures);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,469 @@
+// Reads OI traces downloaded from /trace.bin (see src/oi_trace.h).
+//
+//   oitrace dump <trace.bin>                 Print every record.
+//   oitrace replay <trace.bin> [--repeat n]  Replay the trace into the firmware's
+//                                            OI transport and stream parser: the
+//                                            recorded requests are issued again at
+//                                            their recorded time and the recorded
+//                                            bytes arrive at their recorded time.
+//                                            Reports where the replay diverges from
+//                                            the recording and the replay throughput.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -Itools/oisim/host -Isrc
+//       tools/oitrace/oitrace.cpp src/oi_trace.cpp src/roomba_oi.cpp src/oi_stream.cpp -o oitrace
+
+#include <Arduino.h>
+#include "oi_trace.h"
+#include "roomba_oi.h"
+#include "oi_stream.h"
+#include "oi_packets.h"
+
+#include <chrono>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+const uint8_t REPLAY_PIN_BRC = 14;
+const uint64_t REPLAY_LOOP_TIME = 1000; // us between two loop() calls without records
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// ARDUINO ON THE TRACE CLOCK
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+uint64_t replayTime = 0; // us, micros() of the recording device
+
+unsigned long millis()
+{
+    return (unsigned long)(replayTime / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)replayTime;
+}
+
+void delay(unsigned long ms)
+{
+    replayTime += (uint64_t)ms * 1000;
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+// Output of the replay compared with the recording. A record follows the
+// action of the firmware, so both sides are compared in order as they come.
+struct ReplayCompare
+{
+    std::deque<uint8_t> expected;
+    std::deque<uint8_t> replayed;
+    unsigned long mismatches = 0;
+
+    void compare()
+    {
+        while (!expected.empty() && !replayed.empty())
+        {
+            if (expected.front() != replayed.front())
+            {
+                mismatches++;
+            }
+            expected.pop_front();
+            replayed.pop_front();
+        }
+    }
+
+    unsigned long finish()
+    {
+        compare();
+        return mismatches + expected.size() + replayed.size();
+    }
+};
+
+ReplayCompare brcCompare;
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin == REPLAY_PIN_BRC)
+    {
+        brcCompare.replayed.push_back(value == HIGH ? 1 : 0);
+    }
+}
+
+// UART with the recorded received bytes, collects the sent bytes
+class ReplaySerial : public Stream
+{
+public:
+    std::deque<uint8_t> rx;
+    ReplayCompare tx;
+    unsigned long txBytes = 0;
+
+    int available() override
+    {
+        return (int)rx.size();
+    }
+
+    int read() override
+    {
+        if (rx.empty())
+        {
+            return -1;
+        }
+        uint8_t data = rx.front();
+        rx.pop_front();
+        return data;
+    }
+
+    int peek() override
+    {
+        return rx.empty() ? -1 : rx.front();
+    }
+
+    size_t write(uint8_t data) override
+    {
+        txBytes++;
+        tx.replayed.push_back(data);
+        return 1;
+    }
+};
+
+// ++++++++++++++++++++++++++++++++++++++++
+//
+// MODES
+//
+// ++++++++++++++++++++++++++++++++++++++++
+
+bool readFile(const char *path, std::vector<uint8_t> &data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    uint8_t buff[4096];
+    size_t length;
+    while ((length = fread(buff, 1, sizeof(buff), file)) > 0)
+    {
+        data.insert(data.end(), buff, buff + length);
+    }
+    fclose(file);
+    return true;
+}
+
+void printBytes(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        printf(" %u", data[i]);
+    }
+}
+
+int dump(const std::vector<uint8_t> &trace)
+{
+    OITraceReader reader(trace.data(), trace.size());
+    OITraceRecord record;
+
+    if (!reader.valid())
+    {
+        fprintf(stderr, "not an OI trace (version %d)\n", OI_TRACE_VERSION);
+        return 1;
+    }
+
+    printf("start %lu us\n", (unsigned long)reader.startTime());
+    while (reader.next(record))
+    {
+        printf("%10.6f ", record.time / 1e6);
+        switch (record.type)
+        {
+        case OITrace::RX:
+            printf("RX  ");
+            printBytes(record.data, record.length);
+            break;
+        case OITrace::TX:
+            printf("TX  ");
+            printBytes(record.data, record.length);
+            break;
+        case OITrace::BRC:
+            printf("BRC  %s", record.level ? "high" : "low");
+            break;
+        case OITrace::EVENT:
+            if (record.length >= 7 && record.data[0] == OITrace::REQUEST)
+            {
+                printf("REQ  flags %u, response %u, holdoff %lu:", record.data[1], record.data[2],
+                       ((unsigned long)record.data[3] << 24) | ((unsigned long)record.data[4] << 16) | (record.data[5] << 8) | record.data[6]);
+                printBytes(record.data + 7, record.length - 7);
+            }
+            else if (record.length >= 3 && record.data[0] == OITrace::RESULT)
+            {
+                printf("RES  %s, %u bytes", record.data[1] ? "ok" : "failed", record.data[2]);
+            }
+            else if (record.length >= 3 && record.data[0] == OITrace::STATE)
+            {
+                printf("STATE mode %u, flags %u", record.data[1], record.data[2]);
+            }
+            else if (record.length >= 1 && record.data[0] == OITrace::MARK)
+            {
+                printf("MARK %.*s", (int)record.length - 1, (const char *)record.data + 1);
+            }
+            else
+            {
+                printf("EVT ");
+                printBytes(record.data, record.length);
+            }
+            break;
+        }
+        printf("\n");
+    }
+
+    if (reader.error())
+    {
+        printf("truncated record\n");
+        return 1;
+    }
+    return 0;
+}
+
+struct ReplayResult
+{
+    unsigned long requests = 0;
+    unsigned long resultMismatches = 0;
+    unsigned long rxBytes = 0;
+    unsigned long txBytes = 0;
+    unsigned long txMismatches = 0;
+    unsigned long brcMismatches = 0;
+    unsigned long stateMismatches = 0;
+    unsigned long frames = 0;
+    unsigned long streamErrors = 0;
+};
+
+// Issue a recorded request through the public transport API
+void replayRequest(RoombaOI &oi, const uint8_t *data, size_t length, std::deque<std::pair<bool, uint8_t>> &results)
+{
+    uint8_t flags = data[0];
+    uint8_t responseLength = data[1];
+    unsigned long holdoff = ((unsigned long)data[2] << 24) | ((unsigned long)data[3] << 16) | (data[4] << 8) | data[5];
+    const uint8_t *tx = data + 6;
+    uint8_t txLength = length - 6;
+    bool wake = flags & 1;
+    bool start = flags & 2;
+    bool force = flags & 4;
+
+    if (force && wake)
+    {
+        oi.wake();
+    }
+    else if (force && start)
+    {
+        oi.start();
+    }
+    else if (txLength == 0)
+    {
+        oi.pause(holdoff);
+    }
+    else if (tx[0] == 148 && txLength >= 2)
+    {
+        oi.startStream(tx + 2, tx[1]);
+    }
+    else if (tx[0] == 150 && txLength == 2 && tx[1] == 0 && !wake && !start)
+    {
+        oi.stopStream();
+    }
+    else if (responseLength > 0)
+    {
+        oi.query(tx, txLength, responseLength, [&results](bool success, const uint8_t *, uint8_t length)
+                 { results.push_back(std::make_pair(success, length)); },
+                 wake, start);
+    }
+    else
+    {
+        oi.send(tx, txLength, wake, start);
+    }
+}
+
+ReplayResult replay(const std::vector<uint8_t> &trace)
+{
+    ReplayResult result;
+    ReplaySerial serial;
+    RoombaOI oi(serial, REPLAY_PIN_BRC);
+    OIStreamParser parser;
+    OITraceReader reader(trace.data(), trace.size());
+    OITraceRecord record;
+    std::deque<std::pair<bool, uint8_t>> results;
+    std::deque<std::pair<bool, uint8_t>> expectedResults;
+    brcCompare = ReplayCompare();
+
+    oi.onStream([&parser](const uint8_t *data, size_t length)
+                { parser.feed(data, length); });
+    parser.onPacket([&oi](uint8_t id, const uint8_t *data, uint8_t length)
+                    {
+                        if (id == OI_PACKET_OI_MODE)
+                        {
+                            oi.setMode((OIMode)data[0]); // like the firmware
+                        } });
+    bool started = false; // the first request of the trace was issued
+    bool pending = false;
+
+    replayTime = reader.startTime();
+    uint64_t start = replayTime;
+
+    // All records with the same time stem from one loop() of the firmware:
+    // requests and received bytes are the input of that loop(), the others
+    // are compared with its output.
+    while (reader.next(record))
+    {
+        if (pending && start + record.time != replayTime)
+        {
+            oi.loop();
+            pending = false;
+        }
+
+        // Run the loop between the records like the firmware did, an idle transport can skip ahead
+        while (replayTime + REPLAY_LOOP_TIME < start + record.time && oi.busy())
+        {
+            replayTime += REPLAY_LOOP_TIME;
+            oi.loop();
+        }
+        replayTime = start + record.time;
+        pending = true;
+
+        switch (record.type)
+        {
+        case OITrace::RX:
+            serial.rx.insert(serial.rx.end(), record.data, record.data + record.length);
+            result.rxBytes += record.length;
+            break;
+        case OITrace::TX:
+            if (!started)
+            {
+                break; // belongs to a request which was dropped from the trace
+            }
+            serial.tx.expected.insert(serial.tx.expected.end(), record.data, record.data + record.length);
+            serial.tx.compare();
+            break;
+        case OITrace::BRC:
+            if (!started)
+            {
+                break;
+            }
+            brcCompare.expected.push_back(record.level);
+            brcCompare.compare();
+            break;
+        case OITrace::EVENT:
+            if (record.length >= 7 && record.data[0] == OITrace::REQUEST)
+            {
+                replayRequest(oi, record.data + 1, record.length - 1, results);
+                result.requests++;
+                started = true;
+            }
+            else if (record.length >= 3 && record.data[0] == OITrace::RESULT && started)
+            {
+                expectedResults.push_back(std::make_pair(record.data[1] != 0, record.data[2]));
+            }
+            else if (record.length >= 3 && record.data[0] == OITrace::STATE)
+            {
+                OIMode mode = (OIMode)record.data[1];
+                bool streaming = record.data[2] & 2;
+                if (!started)
+                {
+                    // State at the start of the trace
+                    oi.restoreState(mode, record.data[2] & 1, streaming);
+                }
+                else if (oi.mode() != mode || oi.streaming() != streaming)
+                {
+                    result.stateMismatches++;
+                }
+                oi.setCharging(record.data[2] & 4); // set by the firmware, not by the transport
+            }
+            break;
+        }
+    }
+
+    if (pending)
+    {
+        oi.loop();
+    }
+
+    // Let the last request finish
+    for (int i = 0; i < 1000 && oi.busy(); i++)
+    {
+        replayTime += REPLAY_LOOP_TIME;
+        oi.loop();
+    }
+
+    // Responses can only be compared by order, the replay doesn't know which recorded request was answered
+    while (!expectedResults.empty() && !results.empty())
+    {
+        if (expectedResults.front() != results.front())
+        {
+            result.resultMismatches++;
+        }
+        expectedResults.pop_front();
+        results.pop_front();
+    }
+    result.resultMismatches += expectedResults.size() + results.size();
+
+    result.txBytes = serial.txBytes;
+    result.txMismatches = serial.tx.finish();
+    result.brcMismatches = brcCompare.finish();
+    result.frames = parser.frames();
+    result.streamErrors = parser.checksumErrors() + parser.frameErrors();
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint8_t> trace;
+    int repeat = 1;
+
+    if (argc < 3 || !readFile(argv[2], trace))
+    {
+        fprintf(stderr, "usage: %s dump|replay <trace.bin> [--repeat n]\n", argv[0]);
+        return 2;
+    }
+    if (argc >= 5 && strcmp(argv[3], "--repeat") == 0)
+    {
+        repeat = atoi(argv[4]);
+    }
+
+    if (strcmp(argv[1], "dump") == 0)
+    {
+        return dump(trace);
+    }
+
+    if (strcmp(argv[1], "replay") != 0)
+    {
+        fprintf(stderr, "unknown mode %s\n", argv[1]);
+        return 2;
+    }
+
+    if (!OITraceReader(trace.data(), trace.size()).valid())
+    {
+        fprintf(stderr, "not an OI trace (version %d)\n", OI_TRACE_VERSION);
+        return 1;
+    }
+
+    ReplayResult result;
+    auto wallStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+    {
+        result = replay(trace);
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    bool identical = result.txMismatches == 0 && result.brcMismatches == 0 && result.resultMismatches == 0 && result.stateMismatches == 0;
+    printf("Requests: %lu, RX bytes: %lu, TX bytes: %lu\n", result.requests, result.rxBytes, result.txBytes);
+    printf("Stream: frames %lu, errors %lu\n", result.frames, result.streamErrors);
+    printf("Diverged: TX bytes %lu, BRC edges %lu, results %lu, states %lu\n", result.txMismatches, result.brcMismatches, result.resultMismatches, result.stateMismatches);
+    printf("Replay: %d x %zu bytes in %.3fs (%.1f MB/s of trace)\n", repeat, trace.size(), wall, repeat * trace.size() / wall / 1e6);
+    printf("%s\n", identical ? "IDENTICAL" : "DIVERGED");
+    return identical ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+// State of charge estimator against synthetic batteries.
+//
+//   socsim [options]   Run SocEstimator (src/soc_estimator.h) over days of
+//                      cleaning runs, pauses and charges of simulated NiMH
+//                      packs and compare it and the Roomba's own
+//                      CHARGE/CAPACITY level with the true state of charge.
+//
+// Options:
+//   --days <d>     simulated time per battery (default 10)
+//   --seed <n>     seed for the schedule and the sensor noise
+//   --verbose      print a line per cleaning run
+//
+// Batteries: a new pack, an aged pack with 63% of its capacity and a higher
+// resistance, and a pack with a current sensor that is 3% and 40 mA off.
+// A pack has a rest voltage curve (a few mV off the one of the estimator),
+// an internal resistance and a relaxation of the voltage after a load
+// change (60s). The Roomba's own level counts the measured current against
+// the nominal capacity, is set to full at the end of a charge and to a
+// guess from the voltage when a charge starts, like the jumps seen on a
+// real Roomba.
+//
+// Errors are in percent of the full charge, the first hour is skipped. The
+// estimator passes if it is closer than the Roomba on average and its
+// error stays within twice the reported error most of the time.
+//
+// Build from the repository root:
+//   g++ -std=gnu++17 -O2 -Isrc tools/socsim/socsim.cpp src/soc_estimator.cpp src/sensor_snapshot.cpp -o socsim
+
+#include "soc_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const uint16_t NOMINAL_CAPACITY = 2696; // mAh
+const double REST_VOLTAGES[] = {13.80, 14.40, 14.88, 15.12, 15.36, 15.72, 16.32, 16.80};
+const double REST_LEVELS[] = {0, 0.1, 0.2, 0.4, 0.6, 0.8, 0.95, 1.0};
+
+struct BatteryModel
+{
+    const char *name;
+    double capacity;      // mAh
+    double resistance;    // ohm
+    double curveOffset;   // V added to the rest voltage
+    double currentGain;   // measured current = true * gain + offset
+    double currentOffset; // mA
+};
+
+struct Errors
+{
+    double sum = 0;
+    double max = 0;
+    unsigned long count = 0;
+
+    void add(double error)
+    {
+        error = fabs(error);
+        sum += error;
+        max = std::max(max, error);
+        count++;
+    }
+    double mean() { return count > 0 ? sum / count : 0; }
+};
+
+class Battery
+{
+public:
+    Battery(const BatteryModel &model, double level) : _model(model), _charge(model.capacity * level) {}
+
+    // current in mA, > 0 = charging
+    void step(double current, double seconds)
+    {
+        _charge = std::min(_model.capacity, std::max(0.0, _charge + current * seconds / 3600));
+        double polarization = current / 1000 * 0.1; // V, relaxes with 60s
+        _polarization += (polarization - _polarization) * std::min(1.0, seconds / 60);
+        _current = current;
+    }
+
+    double level() { return _charge / _model.capacity; }
+
+    double voltage()
+    {
+        double level = this->level();
+        double rest = REST_VOLTAGES[0];
+        for (size_t i = 1; i < sizeof(REST_LEVELS) / sizeof(*REST_LEVELS); i++)
+        {
+            if (level <= REST_LEVELS[i])
+            {
+                rest = REST_VOLTAGES[i - 1] + (REST_VOLTAGES[i] - REST_VOLTAGES[i - 1]) * (level - REST_LEVELS[i - 1]) / (REST_LEVELS[i] - REST_LEVELS[i - 1]);
+                break;
+            }
+        }
+        return rest + _model.curveOffset + _current / 1000 * _model.resistance + _polarization;
+    }
+
+private:
+    const BatteryModel &_model;
+    double _charge;           // mAh
+    double _current = 0;      // mA
+    double _polarization = 0; // V
+};
+
+struct Result
+{
+    Errors estimator;
+    Errors roomba;
+    unsigned long covered = 0;
+    unsigned long samples = 0;
+    double estimatorJump = 0; // largest change of the level between two samples
+    double roombaJump = 0;
+    unsigned long corrections = 0;
+    uint16_t capacity = 0;
+};
+
+Result simulate(const BatteryModel &model, double days, unsigned long seed, bool verbose)
+{
+    std::mt19937 random(seed);
+    std::normal_distribution<double> currentNoise(0, 15);
+    std::normal_distribution<double> voltageNoise(0, 0.02);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    Battery battery(model, 0.5);
+    SocEstimator estimator;
+    Result result;
+
+    double roombaCharge = NOMINAL_CAPACITY * 0.5; // mAh
+    double lastEstimate = -1;
+    double lastRoomba = -1;
+    unsigned long second = 0;
+    unsigned long end = (unsigned long)(days * 86400);
+
+    // One phase of constant charging state and mean current
+    const auto run = [&](uint8_t chargingState, double current, unsigned long seconds, double stopBelow, double stopAbove)
+    {
+        for (unsigned long i = 0; i < seconds && second < end; i++, second++)
+        {
+            double draw = current < -100 ? current * (0.9 + 0.2 * uniform(random)) : current;
+            battery.step(draw, 1);
+            if (battery.level() < stopBelow || battery.level() > stopAbove)
+            {
+                break;
+            }
+
+            double measured = draw * model.currentGain + model.currentOffset + currentNoise(random);
+            roombaCharge = std::min((double)NOMINAL_CAPACITY, std::max(0.0, roombaCharge + measured / 3600));
+
+            SensorSnapshot sensors;
+            sensors.valid = true;
+            sensors.chargingState = chargingState;
+            sensors.voltage = (uint16_t)lround((battery.voltage() + voltageNoise(random)) * 1000);
+            sensors.current = (int16_t)lround(measured);
+            sensors.charge = (uint16_t)lround(roombaCharge);
+            sensors.capacity = NOMINAL_CAPACITY;
+            sensors.level = (uint16_t)((uint32_t)sensors.charge * 1000 / sensors.capacity);
+            estimator.update(second * 1000, sensors);
+
+            double truth = battery.level() * 100;
+            double estimate = estimator.level() / 10.0;
+            double roomba = sensors.level / 10.0;
+            if (lastEstimate >= 0)
+            {
+                result.estimatorJump = std::max(result.estimatorJump, fabs(estimate - lastEstimate));
+                result.roombaJump = std::max(result.roombaJump, fabs(roomba - lastRoomba));
+            }
+            lastEstimate = estimate;
+            lastRoomba = roomba;
+
+            if (second >= 3600)
+            {
+                result.estimator.add(estimate - truth);
+                result.roomba.add(roomba - truth);
+                result.covered += fabs(estimate - truth) <= 2 * estimator.error() / 10.0;
+                result.samples++;
+            }
+        }
+    };
+
+    while (second < end)
+    {
+        // Cleaning run, sometimes paused, until the time is up or the battery is empty
+        double startLevel = battery.level();
+        unsigned long minutes = 30 + random() % 120;
+        for (unsigned long minute = 0; minute < minutes && battery.level() > 0.03 && second < end; minute += 10)
+        {
+            run(0, -1600, 600, 0.03, 1);
+            if (uniform(random) < 0.05)
+            {
+                run(0, -20, 300 + random() % 900, 0, 1); // paused or stuck
+            }
+        }
+        run(0, 0, random() % 1800, 0, 1); // waiting off the dock
+        if (verbose)
+        {
+            printf("  %6.1fh run %3.0f%% -> %3.0f%%, estimate %5.1f%% (error %4.1f%%), Roomba %5.1f%%, capacity %u mAh\n", second / 3600.0,
+                   startLevel * 100, battery.level() * 100, estimator.level() / 10.0, estimator.error() / 10.0, roombaCharge * 100 / NOMINAL_CAPACITY,
+                   estimator.capacity());
+        }
+
+        // Charge: the Roomba guesses its charge from the voltage when the charge starts
+        roombaCharge = NOMINAL_CAPACITY * std::min(1.0, std::max(0.0, (battery.voltage() - 13.5) / 3.0));
+        run(2, 1500, 5 * 3600, 0, 0.98);
+        roombaCharge = NOMINAL_CAPACITY;
+        run(3, 80, 3600 + random() % 3600, 0, 2);
+        run(4, 0, 3600 + random() % (10 * 3600), 0, 2);
+    }
+
+    result.corrections = estimator.corrections();
+    result.capacity = estimator.capacity();
+    return result;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: socsim [--days d] [--seed n] [--verbose]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double days = 10;
+    unsigned long seed = 1;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--days") == 0 && i + 1 < argc)
+        {
+            days = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--verbose") == 0)
+        {
+            verbose = true;
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    const BatteryModel models[] = {
+        {"new", 2696, 0.15, 0.02, 1.01, 5},
+        {"aged", 1700, 0.30, -0.04, 1.01, 10},
+        {"sensor off", 2600, 0.15, 0.0, 1.03, -40},
+    };
+
+    bool failed = false;
+    printf("%-11s %20s %20s %9s %9s %6s %10s %7s\n", "battery", "estimate mean/max", "Roomba mean/max", "within", "jump", "corr.", "capacity", "");
+    for (const BatteryModel &model : models)
+    {
+        if (verbose)
+        {
+            printf("%s:\n", model.name);
+        }
+        Result result = simulate(model, days, seed, verbose);
+        double coverage = result.samples > 0 ? 100.0 * result.covered / result.samples : 0;
+        bool passed = result.estimator.mean() < result.roomba.mean() && coverage >= 90;
+        failed = failed || !passed;
+        printf("%-11s %9.1f%% %8.1f%% %9.1f%% %8.1f%% %8.1f%% %4.1f/%-4.1f %6lu %5u/%-4.0f %s\n", model.name, result.estimator.mean(),
+               result.estimator.max, result.roomba.mean(), result.roomba.max, coverage, result.estimatorJump, result.roombaJump,
+               result.corrections, result.capacity, model.capacity, passed ? "OK" : "FAILED");
+    }
+    printf("within: samples with an error of at most twice the reported error, jump: largest step of the level (estimate/Roomba)\n");
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}